@@ -35,6 +35,14 @@ struct buffer {
 void deallocate_String(char **s);
 void deallocate_Buffer(struct buffer *b);
 void deallocate_vector(void *d);
+/* The sizes of fields in the encoding of a buffer oarchive, which the
+ * generated sizeof_ functions add up; a NULL string or buffer is encoded as
+ * its length of -1. */
+int32_t sizeof_Bool(const int32_t *v);
+int32_t sizeof_Int(const int32_t *v);
+int32_t sizeof_Long(const int64_t *v);
+int32_t sizeof_Buffer(const struct buffer *b);
+int32_t sizeof_String(char **s);
 struct iarchive {
     int (*start_record)(struct iarchive *ia, const char *tag);
     int (*end_record)(struct iarchive *ia, const char *tag);
@@ -68,6 +76,20 @@ void close_buffer_oarchive(struct oarchive **oa, int free_buffer);
 struct iarchive *create_buffer_iarchive(char *buffer, int len);
 void close_buffer_iarchive(struct iarchive **ia);
 char *get_buffer(struct oarchive *);
+/* Archives over caller provided storage of buffer_archive_size() bytes; the
+ * archive pointer is the start of the storage, which the caller releases
+ * (after freeing the buffer of an oarchive, if it still owns it). */
+size_t buffer_archive_size(void);
+struct oarchive *init_buffer_oarchive(void *storage);
+/* Like init_buffer_oarchive() with a buffer of size bytes, for records
+ * whose size was computed by their sizeof_ function: serializing them
+ * doesn't reallocate the buffer. */
+struct oarchive *init_sized_buffer_oarchive(void *storage, int32_t size);
+struct iarchive *init_buffer_iarchive(void *storage, char *buffer, int len);
+/* Reads a buffer from a buffer iarchive without copying it: b->buff points
+ * into the archive's buffer and must not be freed. */
+int ia_deserialize_buffer_ref(struct iarchive *ia, const char *name,
+        struct buffer *b);
 int get_buffer_len(struct oarchive *);
 
 int64_t zoo_htonll(int64_t v);
@@ -151,6 +151,14 @@ extern ZOOAPI const int ZOO_PERM_ALL;
 
 /* flags for zookeeper_init{,2} */
 #define ZOO_READONLY         1
+#define ZOO_SHARED_REACTOR   2
+#define ZOO_DIRECT_SEND      4
+
+/* default time (ms) resolved server addresses are cached, see zoo_set_resolve_ttl */
+#define ZOO_DEFAULT_RESOLVE_TTL 30000
+
+/* most servers connected to at once, see zoo_set_connect_race */
+#define ZOO_MAX_CONNECT_RACE 8
 
 /** This Id represents anyone. */
 extern ZOOAPI struct Id ZOO_ANYONE_ID_UNSAFE;
@@ -276,6 +284,254 @@ typedef struct {
     char passwd[16];
 } clientid_t;
 
+/**
+ * \brief server address resolution statistics.
+ *
+ * Counters describing how often the client resolved the host string passed
+ * to \ref zookeeper_init and how often the cached addresses were reused
+ * instead. Obtained via \ref zoo_get_resolve_stats.
+ */
+typedef struct zoo_resolve_stats {
+    int64_t resolutions;        /* number of times the host list was resolved */
+    int64_t lookups_avoided;    /* connection attempts served from the cached addresses */
+    int64_t address_changes;    /* resolutions that published a new address list */
+    int64_t failures;           /* resolutions that returned an error */
+    int64_t last_resolve_us;    /* duration of the most recent resolution */
+    int64_t max_resolve_us;     /* longest resolution seen */
+    int64_t total_resolve_us;   /* time spent resolving in total */
+} zoo_resolve_stats_t;
+
+/**
+ * \brief socket I/O statistics.
+ *
+ * Counters describing the system calls the client makes to talk to the
+ * server. Queued requests are written with vectored sends, so
+ * send_calls / buffers_sent is the number of send system calls per request.
+ * Responses are read ahead and split into packets, so
+ * buffers_received / recv_calls is the number of responses per receive
+ * system call. Obtained via \ref zoo_get_io_stats.
+ */
+typedef struct zoo_io_stats {
+    int64_t send_calls;         /* send system calls made to flush the send queue */
+    int64_t buffers_sent;       /* packets completely written to the socket */
+    int64_t bytes_sent;         /* bytes written, including length prefixes */
+    int64_t recv_calls;         /* receive system calls made */
+    int64_t buffers_received;   /* packets completely received */
+    int64_t bytes_received;     /* bytes received, including length prefixes */
+} zoo_io_stats_t;
+
+/**
+ * \brief connection statistics.
+ *
+ * Counters describing how the client (re)connects to the ensemble. The
+ * client tries each server in turn; after a pass over all of them fails it
+ * waits before starting over, see \ref zoo_set_reconnect_backoff. Obtained
+ * via \ref zoo_get_connect_stats.
+ */
+typedef struct zoo_connect_stats {
+    int64_t attempts;           /* connections initiated to a server */
+    int64_t failures;           /* connections lost before the session was established */
+    int64_t handshakes;         /* sessions established or re-established */
+    int64_t backoffs;           /* waits before connecting again */
+    int64_t backoff_ms;         /* time spent in these waits */
+    int64_t disconnected_ms;    /* time without a session, including the current outage */
+    int64_t races_won;          /* connections made to a raced server, see zoo_set_connect_race */
+    int64_t last_connect_ms;    /* time from the first attempt to the session, latest outage */
+    int64_t max_connect_ms;     /* longest time from the first attempt to the session */
+    int32_t last_backoff_ms;    /* the latest wait */
+} zoo_connect_stats_t;
+
+/**
+ * \brief round trip times measured to a server.
+ *
+ * The client times the handshake and the pings of its connections and keeps
+ * a smoothed round trip time per server address, see
+ * \ref zoo_set_latency_preference. Obtained via \ref zoo_get_server_rtts.
+ */
+typedef struct zoo_server_rtt {
+    char server[64];            /* host:port of the server address */
+    int32_t srtt_us;            /* smoothed round trip time, 0 until timed */
+    int32_t last_rtt_us;        /* the latest sample */
+    int32_t min_rtt_us;         /* the lowest sample */
+    int32_t failures;           /* consecutive connections lost before a session */
+    int64_t samples;            /* handshakes and pings timed */
+} zoo_server_rtt_t;
+
+/**
+ * \brief statistics of the watches re-registered after reconnects.
+ *
+ * When it reconnects, the client sends the paths of all its active watches
+ * to the server, split over SetWatches packets small enough for the server
+ * to accept. The time to rewatch runs from the moment the packets are
+ * queued to the response to the last of them. Obtained via
+ * \ref zoo_get_rewatch_stats.
+ */
+typedef struct zoo_rewatch_stats {
+    int64_t rewatches;          /* reconnects that re-registered watches */
+    int64_t packets;            /* SetWatches packets sent */
+    int64_t paths;              /* watched paths sent */
+    int64_t last_rewatch_us;    /* time to rewatch of the latest reconnect */
+    int64_t max_rewatch_us;     /* longest time to rewatch seen */
+    int32_t pending;            /* packets of the latest reconnect not answered yet */
+} zoo_rewatch_stats_t;
+
+/**
+ * @name Object pools
+ * Each handle recycles the fixed-size objects created for every request and
+ * response instead of returning them to the system allocator. Pass one of
+ * these to \ref zoo_get_pool_stats.
+ */
+// @{
+#define ZOO_POOL_COMPLETIONS 0  /* entries tracking outstanding requests */
+#define ZOO_POOL_BUFFERS 1      /* packet descriptors of queued and received packets */
+#define ZOO_POOL_ARCHIVES 2     /* archives used to (de)serialize packets */
+#define ZOO_POOL_WATCHERS 3     /* pending watcher registrations */
+#define ZOO_POOL_COUNT 4
+// @}
+
+/**
+ * The default number of idle objects each pool of a handle retains,
+ * see \ref zoo_set_pool_retention.
+ */
+#define ZOO_DEFAULT_POOL_RETENTION 1024
+
+/**
+ * \brief object pool statistics.
+ *
+ * Counters describing how one of the object pools of a handle is used.
+ * allocations - reuses is the number of times the system allocator was
+ * called. Obtained via \ref zoo_get_pool_stats.
+ */
+typedef struct zoo_pool_stats {
+    int64_t allocations;        /* objects handed out */
+    int64_t reuses;             /* allocations served from the idle objects */
+    int64_t releases;           /* objects freed because the pool was full */
+    int32_t in_use;             /* objects currently handed out */
+    int32_t idle;               /* objects currently kept for reuse */
+    int32_t max_in_use;         /* most objects handed out at once */
+} zoo_pool_stats_t;
+
+/**
+ * \brief statistics of the node cache of a handle.
+ *
+ * Obtained via \ref zoo_get_cache_stats, see \ref zoo_set_cache.
+ */
+typedef struct zoo_cache_stats {
+    int64_t hits;               /* watched reads served from the cache */
+    int64_t misses;             /* watched reads sent to the server */
+    int64_t evictions;          /* entries dropped to stay within max_bytes */
+    int64_t invalidations;      /* data or children dropped by an event */
+    int64_t bytes;              /* memory currently charged to the cache */
+    int64_t max_bytes;          /* the budget set by zoo_set_cache() */
+    int32_t entries;            /* paths currently cached */
+} zoo_cache_stats_t;
+
+/**
+ * @name Request stages
+ * The latencies of a request are measured from the API call that issued it
+ * to the end of each of these stages. Index zoo_op_stats.stages with them.
+ */
+// @{
+#define ZOO_STAGE_QUEUED 0      /* queued for sending, with its xid assigned */
+#define ZOO_STAGE_SENT 1        /* completely written to the socket */
+#define ZOO_STAGE_RESPONSE 2    /* its response was received */
+#define ZOO_STAGE_COMPLETED 3   /* its completion returned */
+#define ZOO_STAGE_COUNT 4
+// @}
+
+/** The number of opcodes, starting at 0, that latencies are kept for. */
+#define ZOO_STATS_MAX_OPS 24
+
+/**
+ * \brief summary of a latency histogram.
+ *
+ * The percentiles are read from a histogram whose buckets are at most 1/8
+ * of their values wide, so they are accurate to about 12%.
+ */
+typedef struct zoo_latency {
+    int64_t count;              /* requests measured */
+    int64_t total_us;           /* sum of their latencies */
+    int64_t min_us;
+    int64_t max_us;
+    int64_t p50_us;
+    int64_t p90_us;
+    int64_t p99_us;
+    int64_t p999_us;
+} zoo_latency_t;
+
+/**
+ * \brief statistics of the requests of one opcode.
+ */
+typedef struct zoo_op_stats {
+    int32_t op;                 /* one of the ZOO_*_OP constants of proto.h */
+    int64_t requests;           /* requests issued */
+    int64_t errors;             /* requests completed with an error */
+    zoo_latency_t stages[ZOO_STAGE_COUNT]; /* indexed by ZOO_STAGE_* */
+} zoo_op_stats_t;
+
+/**
+ * \brief snapshot of the request statistics of a handle.
+ *
+ * Requests are counted per opcode from the first one issued; the queue
+ * depths are sampled when the snapshot is taken. Obtained via
+ * \ref zoo_get_stats.
+ */
+typedef struct zoo_stats {
+    int64_t requests;           /* requests issued through the API */
+    int64_t errors;             /* of these, completed with an error */
+    int64_t watch_events;       /* watcher events received */
+    int64_t timeouts;           /* requests failed by their deadline */
+    int64_t bytes_sent;         /* as in zoo_io_stats_t */
+    int64_t bytes_received;
+    int64_t reconnects;         /* sessions re-established after the first */
+    int32_t send_queue;         /* packets waiting to be written */
+    int32_t outstanding;        /* requests waiting for their response */
+    int32_t completions;        /* completions waiting to run */
+    int32_t op_count;           /* entries of ops in use */
+    zoo_op_stats_t ops[ZOO_STATS_MAX_OPS]; /* the opcodes seen, ascending */
+} zoo_stats_t;
+
+/**
+ * \brief a point in the timeline of a request, see \ref zoo_set_trace_hooks.
+ *
+ * The times are microseconds of the monotonic clock the client uses for its
+ * timeouts.
+ */
+typedef struct zoo_trace {
+    int32_t xid;
+    int32_t op;                 /* one of the ZOO_*_OP constants of proto.h */
+    const char *path;           /* as sent, including the chroot; NULL for multi and reconfig */
+    int32_t rc;                 /* the result, for the received and callback_end hooks */
+    int64_t time_us;            /* when the event happened */
+    int64_t submitted_us;       /* when the API call submitted the request */
+} zoo_trace_t;
+
+/**
+ * \brief signature of a request tracing hook.
+ *
+ * \param zh the zookeeper handle
+ * \param trace the request and the time of the event, valid during the call
+ * \param context the context of the zoo_trace_hooks_t
+ */
+typedef void (*zoo_trace_fn)(zhandle_t *zh, const zoo_trace_t *trace,
+        void *context);
+
+/**
+ * \brief the hooks called along the timeline of each request.
+ *
+ * Any of the hooks may be NULL. The hooks run on the thread that moves the
+ * request along, possibly while internal locks are held, so they must be
+ * cheap and must not call the ZooKeeper API.
+ */
+typedef struct zoo_trace_hooks {
+    zoo_trace_fn queued;        /* the xid was assigned and the request queued for sending */
+    zoo_trace_fn sent;          /* its first byte was written to the socket */
+    zoo_trace_fn received;      /* its response was received */
+    zoo_trace_fn callback_start; /* its completion is about to run */
+    zoo_trace_fn callback_end;  /* its completion returned */
+    void *context;              /* passed to every hook */
+} zoo_trace_hooks_t;
+
 /**
  * \brief zoo_op structure.
  *
@@ -468,7 +724,11 @@ typedef void (*log_callback_fn)(const char *message);
  *   of zhandle_t. Application can access it (for example, in the watcher
  *   callback) using \ref zoo_get_context. The object is not used by zookeeper
  *   internally and can be null.
- * \param flags reserved for future use. Should be set to zero.
+ * \param flags 0 or an OR of ZOO_READONLY, ZOO_SHARED_REACTOR (see
+ *   \ref zoo_reactor_init) and ZOO_DIRECT_SEND. With ZOO_DIRECT_SEND, a
+ *   call that finds the send queue empty writes its request to the socket
+ *   itself instead of waking the I/O thread of the multi-threaded library,
+ *   which lowers the latency of synchronous calls.
  * \return a pointer to the opaque zhandle structure. If it fails to create
  * a new zhandle the function returns NULL and the errno variable
  * indicates the reason.
@@ -504,7 +764,11 @@ ZOOAPI zhandle_t *zookeeper_init(const char *host, watcher_fn fn,
  *   of zhandle_t. Application can access it (for example, in the watcher
  *   callback) using \ref zoo_get_context. The object is not used by zookeeper
  *   internally and can be null.
- * \param flags reserved for future use. Should be set to zero.
+ * \param flags 0 or an OR of ZOO_READONLY, ZOO_SHARED_REACTOR (see
+ *   \ref zoo_reactor_init) and ZOO_DIRECT_SEND. With ZOO_DIRECT_SEND, a
+ *   call that finds the send queue empty writes its request to the socket
+ *   itself instead of waking the I/O thread of the multi-threaded library,
+ *   which lowers the latency of synchronous calls.
  * \param log_callback All log messages will be passed to this callback function.
  *   For more details see \ref zoo_get_log_callback and \ref zoo_set_log_callback.
  * \return a pointer to the opaque zhandle structure. If it fails to create
@@ -572,6 +836,315 @@ ZOOAPI void zoo_cycle_next_server(zhandle_t *zh);
  */
 ZOOAPI const char* zoo_get_current_server(zhandle_t* zh);
 
+/**
+ * \brief get the socket I/O statistics of a handle.
+ *
+ * The counters are cumulative over the lifetime of the handle, including
+ * reconnects.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_io_stats(zhandle_t *zh, zoo_io_stats_t *stats);
+
+/**
+ * \brief get the statistics of the watches re-registered after reconnects.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_rewatch_stats(zhandle_t *zh, zoo_rewatch_stats_t *stats);
+
+/**
+ * \brief set how the client waits before reconnecting.
+ *
+ * By default the client reconnects as soon as the connection is lost and
+ * waits a fixed recv_timeout/60 each time it has failed to connect to every
+ * server of the list. When many clients lose their servers at once, e.g.
+ * during a rolling restart, they then reconnect in lockstep.
+ *
+ * With a spread, the first attempt after losing an established connection
+ * is delayed by a random time in [0, spread_ms). With a base, the fixed wait
+ * after each failed pass over the servers is replaced by an exponential
+ * backoff with full jitter: a random time in [0, min(max_ms, base_ms * 2^n))
+ * after the n-th consecutive failed pass. The backoff is reset once a
+ * session is established.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param spread_ms window of the first attempt after a disconnect, 0 to
+ *   reconnect immediately (the default)
+ * \param base_ms initial backoff, 0 for the fixed wait (the default)
+ * \param max_ms cap of the backoff, at least base_ms
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or the values are
+ *   negative or inconsistent
+ */
+ZOOAPI int zoo_set_reconnect_backoff(zhandle_t *zh, int spread_ms, int base_ms,
+        int max_ms);
+
+/**
+ * \brief connect to several servers at once.
+ *
+ * By default the client connects to one server at a time and only moves on
+ * to the next one once the connection has failed or timed out, which takes
+ * up to 2/3 of the session timeout if the server doesn't respond at all.
+ *
+ * With a width above 1, while a connection is being established the client
+ * also connects to the next servers of the list, starting one more every
+ * stagger_ms until width connections are in flight. The session is
+ * established over the first connection that completes and the others are
+ * closed. The sockets of the additional connections aren't returned by
+ * \ref zookeeper_interest; they are checked on every call, which caps the
+ * timeout it returns while they are in flight.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param width servers connected to at once, 1 (the default) to connect to
+ *   one at a time, at most ZOO_MAX_CONNECT_RACE
+ * \param stagger_ms delay between the starts of the connections
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or the values are
+ *   out of range
+ */
+ZOOAPI int zoo_set_connect_race(zhandle_t *zh, int width, int stagger_ms);
+
+/**
+ * \brief prefer the servers with the lowest round trip time.
+ *
+ * By default the servers are tried in a random order. With the preference
+ * enabled, the remaining servers are ranked by their smoothed round trip
+ * time each time the client has gone through the list: servers not timed
+ * yet come first so they get measured, servers whose last connections
+ * failed come last. Round trip times are compared in units of floor_us, so
+ * servers closer to each other than that keep their random order and the
+ * clients spread over all the nearby servers instead of all picking the
+ * fastest one. The order of the servers picked while rebalancing after
+ * \ref zoo_set_servers is left alone.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param enabled non-zero to rank the servers, 0 for the random order (the
+ *   default)
+ * \param floor_us round trip times within this many microseconds of each
+ *   other are considered equal
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or floor_us is
+ *   negative
+ */
+ZOOAPI int zoo_set_latency_preference(zhandle_t *zh, int enabled, int floor_us);
+
+/**
+ * \brief get the round trip times measured to the servers.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param rtts an array to fill in
+ * \param count the size of rtts on input; set to the number of servers
+ *   timed or failed on output, which may be larger
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_server_rtts(zhandle_t *zh, zoo_server_rtt_t *rtts,
+        int *count);
+
+/**
+ * \brief get the connection statistics.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_connect_stats(zhandle_t *zh, zoo_connect_stats_t *stats);
+
+/**
+ * \brief set how long resolved server addresses are cached.
+ *
+ * The host string given to \ref zookeeper_init is resolved once and the
+ * resulting addresses are reused until the ttl expires. The I/O thread only
+ * resolves the host string again right before it attempts a connection, and
+ * only if the ttl has expired by then; an established connection never waits
+ * for a lookup. \ref zoo_set_servers always resolves, regardless of the ttl.
+ * The resolution is performed outside of the reconfig lock and a new address
+ * list is only published if it differs from the current one.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param ttl_ms time in milliseconds to cache resolved addresses. 0 resolves
+ * before every connection attempt; a negative value never resolves again
+ * after \ref zookeeper_init, except through \ref zoo_set_servers. Defaults to
+ * ZOO_DEFAULT_RESOLVE_TTL.
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL
+ */
+ZOOAPI int zoo_set_resolve_ttl(zhandle_t *zh, int ttl_ms);
+
+/**
+ * \brief get the server address resolution statistics.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_resolve_stats(zhandle_t *zh, zoo_resolve_stats_t *stats);
+
+/**
+ * \brief set how many idle objects each pool of a handle retains.
+ *
+ * Objects released while a pool already holds this many idle objects are
+ * returned to the system allocator. Lowering the limit frees the excess
+ * immediately.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param max_idle idle objects to keep per pool; 0 disables recycling.
+ * Defaults to ZOO_DEFAULT_POOL_RETENTION.
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or max_idle is
+ * negative
+ */
+ZOOAPI int zoo_set_pool_retention(zhandle_t *zh, int max_idle);
+
+/**
+ * \brief get the statistics of one of the object pools of a handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param pool the pool, one of the ZOO_POOL_* constants
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL or pool is
+ * not a valid pool
+ */
+ZOOAPI int zoo_get_pool_stats(zhandle_t *zh, int pool, zoo_pool_stats_t *stats);
+
+/**
+ * \brief cache the data and children of watched nodes.
+ *
+ * While a watch set by \ref zoo_wget or \ref zoo_wget_children2 is armed,
+ * the server notifies the client of any change to the node, so the result
+ * of the read can be reused until then. With a non-zero budget the data
+ * and children returned along with a data or child watch are kept by the
+ * handle. Later calls of the synchronous zoo_get, zoo_wget,
+ * zoo_get_children, zoo_wget_children, zoo_get_children2 and
+ * zoo_wget_children2 functions that set a watch on a cached node are
+ * answered locally: the watcher is registered as if the server had
+ * answered and no request is sent. Asynchronous reads always go to the
+ * server; the responses to \ref zoo_awget and \ref zoo_awget_children2
+ * are cached like those of the synchronous calls. Reads without a watch
+ * always go to the server and neither fill nor refresh the cache.
+ *
+ * An entry is dropped when a watcher event for its node is received, when
+ * its watches are removed and on every session event, so nothing is served
+ * while the client is disconnected. The least recently used entries are
+ * evicted when the cache exceeds the budget.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param max_bytes the memory the cache may use; 0 disables and empties it.
+ * The cache is disabled by default.
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - zh is NULL
+ * ZSYSTEMERROR - out of memory
+ */
+ZOOAPI int zoo_set_cache(zhandle_t *zh, size_t max_bytes);
+
+/**
+ * \brief get the statistics of the node cache of a handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in; all zeros if \ref zoo_set_cache
+ * was never called
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_cache_stats(zhandle_t *zh, zoo_cache_stats_t *stats);
+
+/**
+ * \brief get a snapshot of the request statistics of a handle.
+ *
+ * Every request issued through the API is timed as it goes through the
+ * ZOO_STAGE_* stages, and its latencies are added to histograms kept per
+ * opcode. Internal packets such as pings, SetWatches and authentication
+ * are not counted. Synchronous calls complete with their response.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if zh or stats is NULL
+ */
+ZOOAPI int zoo_get_stats(zhandle_t *zh, zoo_stats_t *stats);
+
+/**
+ * \brief trace the timeline of every request of a handle.
+ *
+ * The hooks are called for each request issued through the API from the
+ * moment it is queued for sending, once its xid is known, to the return of
+ * its completion. Together they tell whether a slow request was held
+ * behind other requests, sat in the send queue, waited on the server or
+ * waited for the completion thread. Synchronous calls have no callback, so
+ * their timeline ends when the response is received. Internal packets such
+ * as pings are not traced.
+ *
+ * The hooks should be set right after \ref zookeeper_init; requests issued
+ * before are not traced. Without hooks and slow request logging requests
+ * aren't tracked at all.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param hooks the hooks, which are copied; NULL removes them
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL
+ */
+ZOOAPI int zoo_set_trace_hooks(zhandle_t *zh, const zoo_trace_hooks_t *hooks);
+
+/**
+ * \brief log the requests that take longer than a threshold.
+ *
+ * A request whose completion returns, or whose synchronous call is
+ * answered, more than threshold_ms after it was submitted is logged as a
+ * warning together with the time it was queued, sent and answered. It
+ * uses the same tracking as \ref zoo_set_trace_hooks.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param threshold_ms the threshold in milliseconds, 0 disables the log
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or threshold_ms is
+ * negative
+ */
+ZOOAPI int zoo_set_slow_request_log(zhandle_t *zh, int threshold_ms);
+
+/**
+ * \brief fail requests that aren't answered within a deadline.
+ *
+ * Sets the deadline of the requests issued through the handle from then
+ * on, synchronous and asynchronous, counted from the API call. A request
+ * still waiting for its response when the deadline passes completes with
+ * ZOPERATIONTIMEOUT, or its synchronous call returns it, while the
+ * connection and the other requests carry on. The request itself isn't
+ * withdrawn: if it was already queued it is still sent, and the server may
+ * still apply it. Its response is discarded when it arrives, but the watch
+ * the request sets or removes takes effect all the same: a watcher passed
+ * to a request that timed out may still be called.
+ *
+ * The deadlines are checked by \ref zookeeper_interest, whose timeout
+ * accounts for them. The deadline of single requests submitted with
+ * \ref zoo_asubmit can be set with \ref zoo_aop_set_timeout.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param timeout_ms the deadline in milliseconds, 0 (the default) lets
+ * requests wait until they are answered or the connection is lost
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or timeout_ms is
+ * negative
+ */
+ZOOAPI int zoo_set_request_timeout(zhandle_t *zh, int timeout_ms);
+
+/**
+ * \brief let small reads go ahead of the writes queued before them.
+ *
+ * The requests of a handle wait in the send queue until the socket takes
+ * them, and a request is only assigned its xid when it is written, so the
+ * server always sees them in xid order. Pings and the other control
+ * packets of the session are written ahead of all the requests waiting,
+ * after at most 64KB of requests already queued and the packet being
+ * written. With priority reads enabled, exists, get, get children and get
+ * acl requests of up to 4KB are also written ahead of the other requests,
+ * so a large set or multi doesn't hold them back; a waiting write is still
+ * let through after every 16 reads.
+ *
+ * This relaxes the ordering guarantee of the client: such a read may be
+ * answered before a write the application issued earlier, and not see it.
+ * The writes keep their order. It is disabled by default.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param enabled non-zero to let reads go ahead, 0 to send the requests in
+ * the order they are issued
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL
+ */
+ZOOAPI int zoo_set_priority_reads(zhandle_t *zh, int enabled);
+
 /**
  * \brief close the zookeeper handle and free up any resources.
  *
@@ -681,6 +1254,134 @@ ZOOAPI int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
 ZOOAPI int zookeeper_process(zhandle_t *zh, int events);
 #endif
 
+#ifdef THREADED
+/**
+ * \brief configure the reactor shared by handles created with ZOO_SHARED_REACTOR.
+ *
+ * By default every handle of the multi-threaded library runs its own I/O
+ * thread and completion thread. Handles created by passing the
+ * ZOO_SHARED_REACTOR flag to \ref zookeeper_init are instead driven by a
+ * process wide pool of I/O threads multiplexing their sockets with epoll,
+ * and their completions and watchers run on a shared pool of completion
+ * threads. Each handle is served by a single I/O thread and its completions
+ * never run concurrently, so the ordering guarantees of a dedicated handle
+ * are preserved.
+ *
+ * The reactor is started with one thread of each kind when the first shared
+ * handle is created. Call this function beforehand to size the pools.
+ * Platforms without epoll ignore ZOO_SHARED_REACTOR.
+ *
+ * \param io_threads the number of I/O threads
+ * \param completion_threads the number of threads running completions
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - a thread count is smaller than 1
+ * ZINVALIDSTATE - the reactor is already running
+ * ZAPIERROR - the shared reactor is not supported on this platform
+ */
+ZOOAPI int zoo_reactor_init(int io_threads, int completion_threads);
+
+/**
+ * \brief stop the threads of the shared reactor.
+ *
+ * All handles created with ZOO_SHARED_REACTOR must have been closed. A later
+ * shared handle starts the reactor again. Must not be called from a
+ * completion or watcher callback.
+ *
+ * \return ZOK on success or ZINVALIDSTATE if shared handles are still open
+ */
+ZOOAPI int zoo_reactor_shutdown(void);
+
+/**
+ * @name Completion ordering
+ * How \ref zoo_set_completion_workers spreads the completions and watcher
+ * events of a handle over its completion threads.
+ */
+// @{
+#define ZOO_COMPLETION_ORDER_STRICT 0 /* one thread, in the order received */
+#define ZOO_COMPLETION_ORDER_PATH 1   /* in order per znode path */
+#define ZOO_COMPLETION_ORDER_KEY 2    /* in order per key of a completion_key_fn */
+// @}
+
+/**
+ * \brief signature of a function picking the ordering key of a completion.
+ *
+ * Completions and watcher events with the same key run one after the other
+ * in the order the server responses were received; those with different
+ * keys may run concurrently. The function is called by the thread issuing
+ * an asynchronous request and by the I/O thread for every watcher event,
+ * so it must be cheap and thread-safe.
+ *
+ * \param path the znode path of the request or event as sent by the server,
+ * including the chroot; "" for session events and NULL for \ref zoo_amulti
+ * \param data the completion data of the request, NULL for watcher events
+ * \return the ordering key
+ */
+typedef int (*completion_key_fn)(const char *path, const void *data);
+
+/**
+ * \brief statistics of a thread running the completions of a handle.
+ *
+ * busy_usec / elapsed_usec is the utilization of the thread. Obtained via
+ * \ref zoo_get_completion_stats.
+ */
+typedef struct zoo_completion_stats {
+    int64_t completions;        /* completions and watcher events run */
+    int64_t busy_usec;          /* time spent running them */
+    int64_t elapsed_usec;       /* time since the thread started */
+    int32_t queued;             /* handed to the thread but not run yet */
+    int32_t max_queued;         /* most handed to the thread at once */
+} zoo_completion_stats_t;
+
+/**
+ * \brief run the completions of a handle on several threads.
+ *
+ * By default a single completion thread runs all completions and watcher
+ * events of a handle in the order the server responses were received, so a
+ * slow callback delays all others. This function starts a pool of worker
+ * threads that run them concurrently. The completion thread then only hands
+ * each completion to the worker picked by its ordering key, so completions
+ * with the same key never run concurrently or out of order.
+ *
+ * The key of a request is computed when the request is issued, so the
+ * workers should be configured right after \ref zookeeper_init with
+ * ZOO_COMPLETION_ORDER_KEY. Synchronous calls are not affected. Handles
+ * driven by the shared reactor run their completions on its threads, see
+ * \ref zoo_reactor_init.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param workers the number of worker threads
+ * \param ordering one of the ZOO_COMPLETION_ORDER_* constants;
+ * ZOO_COMPLETION_ORDER_STRICT keeps the single completion thread
+ * \param key the function picking the key with ZOO_COMPLETION_ORDER_KEY,
+ * ignored otherwise
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - zh is NULL, workers is smaller than 1, ordering is
+ * invalid or key is NULL with ZOO_COMPLETION_ORDER_KEY
+ * ZINVALIDSTATE - the handle already has workers, is being closed or is
+ * driven by the shared reactor
+ * ZSYSTEMERROR - out of memory or a worker thread could not be started
+ */
+ZOOAPI int zoo_set_completion_workers(zhandle_t *zh, int workers,
+        int ordering, completion_key_fn key);
+
+/**
+ * \brief get the statistics of the threads running the completions of a
+ * handle.
+ *
+ * Reports the completion thread itself with ZOO_COMPLETION_ORDER_STRICT and
+ * each worker thread otherwise. The sum of the queued fields is the number
+ * of completions waiting to run.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats an array to fill in
+ * \param count the size of stats on input; set to the number of threads on
+ * output, which is 0 for handles driven by the shared reactor
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_completion_stats(zhandle_t *zh,
+        zoo_completion_stats_t *stats, int *count);
+#endif
+
 /**
  * \brief signature of a completion function for a call that returns void.
  *
@@ -750,6 +1451,39 @@ typedef void (*stat_completion_t)(int rc, const struct Stat *stat,
 typedef void (*data_completion_t)(int rc, const char *value, int value_len,
         const struct Stat *stat, const void *data);
 
+/**
+ * \brief a packet received from the server, lent to a \ref data_ref_completion_t.
+ *
+ * \see zoo_buffer_retain
+ */
+typedef struct zoo_buffer zoo_buffer_t;
+
+/**
+ * \brief signature of a completion function that returns data without
+ * copying it.
+ *
+ * This is the same as \ref data_completion_t, except that value points
+ * directly into the packet received from the server instead of into a copy.
+ * \param rc the error code of the call, as for \ref data_completion_t.
+ * \param value the value of the node. It is only valid until the completion
+ *   returns, unless the completion calls \ref zoo_buffer_retain on buffer.
+ *   If a non zero error code is returned, the content of value is undefined.
+ *   The programmer is NOT responsible for freeing value.
+ * \param value_len the number of bytes in value.
+ * \param stat a pointer to the stat information for the node involved in
+ *   this function. If a non zero error code is returned, the content of
+ *   stat is undefined. The programmer is NOT responsible for freeing stat.
+ * \param buffer the packet value points into, or NULL if a non zero error
+ *   code is returned. It is only valid until the completion returns.
+ * \param data the pointer that was passed by the caller when the function
+ *   that this completion corresponds to was invoked. The programmer
+ *   is responsible for any memory freeing associated with the data
+ *   pointer.
+ */
+typedef void (*data_ref_completion_t)(int rc, const char *value,
+        int value_len, const struct Stat *stat, zoo_buffer_t *buffer,
+        const void *data);
+
 /**
  * \brief signature of a completion function that returns a list of strings.
  *
@@ -1090,6 +1824,78 @@ ZOOAPI int zoo_awget(zhandle_t *zh, const char *path,
         watcher_fn watcher, void* watcherCtx,
         data_completion_t completion, const void *data);
 
+/**
+ * \brief gets the data associated with a node without copying it.
+ *
+ * This function is similar to \ref zoo_aget except the completion is given
+ * the value in the packet received from the server rather than a copy of
+ * it, which avoids an allocation and a copy per call for large values.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ * \param watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ * \param completion the routine to invoke when the request completes, with
+ * the same error codes as for \ref zoo_aget.
+ * \param data the data that will be passed to the completion routine when
+ * the function completes.
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - invalid input parameters
+ * ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ * ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+ZOOAPI int zoo_aget_ref(zhandle_t *zh, const char *path, int watch,
+        data_ref_completion_t completion, const void *data);
+
+/**
+ * \brief gets the data associated with a node without copying it.
+ *
+ * This function is similar to \ref zoo_aget_ref except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ * \param watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ * \param watcherCtx user specific data, will be passed to the watcher callback.
+ * \param completion the routine to invoke when the request completes, with
+ * the same error codes as for \ref zoo_aget.
+ * \param data the data that will be passed to the completion routine when
+ * the function completes.
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - invalid input parameters
+ * ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ * ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+ZOOAPI int zoo_awget_ref(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_ref_completion_t completion, const void *data);
+
+/**
+ * \brief keeps a packet lent to a completion after the completion returns.
+ *
+ * Called from a \ref data_ref_completion_t, this keeps the value passed
+ * to the completion valid until the reference is released. It may also be
+ * called on a reference it returned earlier, from any thread.
+ *
+ * \param buffer the buffer passed to the completion, or a reference
+ * \return a reference to release with \ref zoo_buffer_release, or NULL if
+ * buffer is NULL or out of memory
+ */
+ZOOAPI zoo_buffer_t *zoo_buffer_retain(zoo_buffer_t *buffer);
+
+/**
+ * \brief releases a reference obtained from \ref zoo_buffer_retain.
+ *
+ * The packet is freed when its last reference is released. This may be
+ * called after the handle the packet was received on is closed.
+ *
+ * \param buffer the reference, which must not be used afterwards
+ */
+ZOOAPI void zoo_buffer_release(zoo_buffer_t *buffer);
+
 /**
  * \brief gets the last committed configuration of the ZooKeeper cluster as it is known to
  * the server to which the client is connected.
@@ -1403,6 +2209,169 @@ ZOOAPI int zoo_aset_acl(zhandle_t *zh, const char *path, int version,
 ZOOAPI int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
         zoo_op_result_t *results, void_completion_t, const void *data);
 
+/**
+ * \brief signature of a function releasing the data of an op sent in place.
+ *
+ * See \ref zoo_aop_set_buffer_ref.
+ *
+ * \param buffer the data of the op
+ * \param context the context passed to \ref zoo_aop_set_buffer_ref
+ */
+typedef void (*zoo_buffer_release_fn)(const char *buffer, void *context);
+
+/**
+ * \brief an operation submitted as part of a batch via \ref zoo_asubmit.
+ *
+ * Unlike the ops of a multi op these are independent requests, each with its
+ * own completion, which the server applies one by one. This structure should
+ * be treated as opaque and initialized via \ref zoo_aget_op_init,
+ * \ref zoo_aexists_op_init, \ref zoo_aget_children_op_init,
+ * \ref zoo_aset_op_init, \ref zoo_acreate_op_init and
+ * \ref zoo_adelete_op_init.
+ */
+typedef struct zoo_aop {
+    int type;
+    const char *path;
+    const void *data;
+    int timeout;
+    zoo_buffer_release_fn release;
+    void *release_context;
+    union {
+        // GETDATA
+        struct {
+            int watch;
+            data_completion_t completion;
+        } get_op;
+
+        // EXISTS
+        struct {
+            int watch;
+            stat_completion_t completion;
+        } exists_op;
+
+        // GETCHILDREN
+        struct {
+            int watch;
+            strings_completion_t completion;
+        } get_children_op;
+
+        // SETDATA
+        struct {
+            const char *buffer;
+            int buflen;
+            int version;
+            stat_completion_t completion;
+        } set_op;
+
+        // CREATE
+        struct {
+            const char *value;
+            int valuelen;
+            const struct ACL_vector *acl;
+            int flags;
+            string_completion_t completion;
+        } create_op;
+
+        // DELETE
+        struct {
+            int version;
+            void_completion_t completion;
+        } delete_op;
+    };
+} zoo_aop_t;
+
+/**
+ * \brief initializes a zoo_aop_t to get the data of a node, like \ref zoo_aget.
+ */
+ZOOAPI void zoo_aget_op_init(zoo_aop_t *op, const char *path, int watch,
+        data_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_aop_t to check if a node exists, like
+ * \ref zoo_aexists.
+ */
+ZOOAPI void zoo_aexists_op_init(zoo_aop_t *op, const char *path, int watch,
+        stat_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_aop_t to list the children of a node, like
+ * \ref zoo_aget_children.
+ */
+ZOOAPI void zoo_aget_children_op_init(zoo_aop_t *op, const char *path,
+        int watch, strings_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_aop_t to set the data of a node, like
+ * \ref zoo_aset.
+ */
+ZOOAPI void zoo_aset_op_init(zoo_aop_t *op, const char *path,
+        const char *buffer, int buflen, int version,
+        stat_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_aop_t to create a node, like \ref zoo_acreate.
+ */
+ZOOAPI void zoo_acreate_op_init(zoo_aop_t *op, const char *path,
+        const char *value, int valuelen, const struct ACL_vector *acl,
+        int flags, string_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_aop_t to delete a node, like \ref zoo_adelete.
+ */
+ZOOAPI void zoo_adelete_op_init(zoo_aop_t *op, const char *path, int version,
+        void_completion_t completion, const void *data);
+
+/**
+ * \brief sets the deadline of an initialized zoo_aop_t.
+ *
+ * The op completes with ZOPERATIONTIMEOUT if it isn't answered within
+ * timeout_ms of the call to \ref zoo_asubmit, as described for
+ * \ref zoo_set_request_timeout. 0 (set by the initializers) uses the
+ * deadline of the handle and a negative value submits the op without one.
+ */
+ZOOAPI void zoo_aop_set_timeout(zoo_aop_t *op, int timeout_ms);
+
+/**
+ * \brief sends the data of an initialized set or create zoo_aop_t in place.
+ *
+ * The data isn't copied into the request by \ref zoo_asubmit, it's written
+ * to the socket straight from the buffer of the op along with the rest of
+ * the request, using scatter/gather I/O. This saves copying large values.
+ * The buffer must stay valid and unchanged until release is called, once
+ * the library no longer reads it: when the request was written or dropped,
+ * which may be before or after the completion of the op. release is called
+ * exactly once whatever zoo_asubmit returns, possibly from the I/O thread
+ * with internal locks held, so it must not call the zookeeper API. On
+ * Windows the data is copied and release is called by zoo_asubmit. The
+ * setting is ignored for the other ops.
+ *
+ * \param op an op initialized by \ref zoo_aset_op_init or
+ * \ref zoo_acreate_op_init
+ * \param release the function to call once the buffer is no longer used
+ * \param context passed to release
+ */
+ZOOAPI void zoo_aop_set_buffer_ref(zoo_aop_t *op, zoo_buffer_release_fn release,
+        void *context);
+
+/**
+ * \brief submits a batch of independent asynchronous operations.
+ *
+ * The operations are queued together, in the order of the array, and the
+ * I/O thread is woken up once for the whole batch rather than once per
+ * operation. Either all of them are queued or none is. Each completion is
+ * triggered with the same result codes as the corresponding zoo_a* call.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param count the number of operations
+ * \param ops an array of operations initialized via the zoo_a*_op_init
+ * functions
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - invalid input parameters, e.g. an invalid path or type
+ * ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ * ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+ZOOAPI int zoo_asubmit(zhandle_t *zh, int count, const zoo_aop_t *ops);
+
 /**
  * \brief return an error string.
  *
@@ -1465,6 +2434,61 @@ ZOOAPI void zoo_set_debug_level(ZooLogLevel logLevel);
  */
 ZOOAPI void zoo_set_log_stream(FILE* logStream);
 
+#ifdef THREADED
+/**
+ * The default size in bytes of the ring each thread logs into, see
+ * \ref zoo_set_log_async.
+ */
+#define ZOO_LOG_RING_SIZE 65536
+
+/**
+ * \brief statistics of the asynchronous logger.
+ *
+ * Obtained via \ref zoo_get_log_stats.
+ */
+typedef struct zoo_log_stats {
+    int64_t records;            /* messages written by the logger thread */
+    int64_t dropped;            /* messages dropped because their ring was full */
+    int64_t writes;             /* batches written to the log stream */
+    int64_t bytes;              /* bytes written to the log stream */
+} zoo_log_stats_t;
+
+/**
+ * \brief write the log stream from a background thread.
+ *
+ * By default the thread logging a message, usually the I/O thread, formats
+ * it, writes it to the log stream and flushes the stream, so a burst of
+ * messages delays the requests behind the writes. Once the asynchronous
+ * logger is enabled each thread formats its messages into a ring of its
+ * own without taking any lock, and a background thread writes the rings to
+ * the log stream in batches. A message that doesn't fit in the ring of its
+ * thread is dropped and counted; the logger thread logs how many were
+ * dropped. Messages passed to a log callback, see
+ * \ref zoo_set_log_callback, are not affected.
+ *
+ * Disabling the logger writes the pending messages and stops the thread.
+ *
+ * \param enabled 1 to start the logger, 0 to stop it
+ * \param ring_size the size in bytes of the rings created from now on,
+ * rounded up to a power of 2; 0 for ZOO_LOG_RING_SIZE
+ * \return ZOK on success or one of the following errcodes on failure:
+ * ZBADARGUMENTS - ring_size is negative
+ * ZSYSTEMERROR - the thread couldn't be started
+ * ZUNIMPLEMENTED - the platform lacks the atomic operations needed
+ */
+ZOOAPI int zoo_set_log_async(int enabled, int ring_size);
+
+/**
+ * \brief get the statistics of the asynchronous logger.
+ *
+ * The counters are cumulative over all the times the logger ran.
+ *
+ * \param stats the structure to fill in
+ * \return ZOK on success or ZBADARGUMENTS if stats is NULL
+ */
+ZOOAPI int zoo_get_log_stats(zoo_log_stats_t *stats);
+#endif
+
 /**
  * \brief gets the callback to be used by this connection for logging.
  *
@@ -29,13 +29,25 @@ extern ZOOAPI ZooLogLevel logLevel;
 #define LOGCALLBACK(_zh) zoo_get_log_callback(_zh)
 #define LOGSTREAM NULL
 
-#define LOG_ERROR(_cb, ...) if(logLevel>=ZOO_LOG_LEVEL_ERROR) \
+/* The least severe level whose log sites are compiled in. Building with
+ * -DZOO_LOG_MIN_LEVEL=ZOO_LOG_LEVEL_INFO, see configure --with-log-level,
+ * turns the LOG_DEBUG sites into dead code the compiler drops while their
+ * arguments still count as used. */
+#ifndef ZOO_LOG_MIN_LEVEL
+#define ZOO_LOG_MIN_LEVEL ZOO_LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_ERROR(_cb, ...) if(ZOO_LOG_MIN_LEVEL>=ZOO_LOG_LEVEL_ERROR && \
+        logLevel>=ZOO_LOG_LEVEL_ERROR) \
     log_message(_cb, ZOO_LOG_LEVEL_ERROR, __LINE__, __func__, __VA_ARGS__)
-#define LOG_WARN(_cb, ...) if(logLevel>=ZOO_LOG_LEVEL_WARN) \
+#define LOG_WARN(_cb, ...) if(ZOO_LOG_MIN_LEVEL>=ZOO_LOG_LEVEL_WARN && \
+        logLevel>=ZOO_LOG_LEVEL_WARN) \
     log_message(_cb, ZOO_LOG_LEVEL_WARN, __LINE__, __func__, __VA_ARGS__)
-#define LOG_INFO(_cb, ...) if(logLevel>=ZOO_LOG_LEVEL_INFO) \
+#define LOG_INFO(_cb, ...) if(ZOO_LOG_MIN_LEVEL>=ZOO_LOG_LEVEL_INFO && \
+        logLevel>=ZOO_LOG_LEVEL_INFO) \
     log_message(_cb, ZOO_LOG_LEVEL_INFO, __LINE__, __func__, __VA_ARGS__)
-#define LOG_DEBUG(_cb, ...) if(logLevel==ZOO_LOG_LEVEL_DEBUG) \
+#define LOG_DEBUG(_cb, ...) if(ZOO_LOG_MIN_LEVEL>=ZOO_LOG_LEVEL_DEBUG && \
+        logLevel==ZOO_LOG_LEVEL_DEBUG) \
     log_message(_cb, ZOO_LOG_LEVEL_DEBUG, __LINE__, __func__, __VA_ARGS__)
 
 ZOOAPI void log_message(log_callback_fn callback, ZooLogLevel curLevel,
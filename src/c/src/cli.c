@@ -175,6 +175,67 @@ void dumpStat(const struct Stat *stat) {
     _LL_CAST_ stat->ephemeralOwner);
 }
 
+static const char *opName(int op) {
+    switch (op) {
+    case ZOO_CREATE_OP: return "create";
+    case ZOO_DELETE_OP: return "delete";
+    case ZOO_EXISTS_OP: return "exists";
+    case ZOO_GETDATA_OP: return "getData";
+    case ZOO_SETDATA_OP: return "setData";
+    case ZOO_GETACL_OP: return "getACL";
+    case ZOO_SETACL_OP: return "setACL";
+    case ZOO_GETCHILDREN_OP: return "getChildren";
+    case ZOO_SYNC_OP: return "sync";
+    case ZOO_GETCHILDREN2_OP: return "getChildren2";
+    case ZOO_CHECK_OP: return "check";
+    case ZOO_MULTI_OP: return "multi";
+    case ZOO_CREATE2_OP: return "create2";
+    case ZOO_RECONFIG_OP: return "reconfig";
+    case ZOO_REMOVE_WATCHES: return "removeWatches";
+    }
+    return "unknown";
+}
+
+void dumpStats(zhandle_t *zh) {
+    static const char *stages[ZOO_STAGE_COUNT] = {
+        "queued", "sent", "response", "completed"
+    };
+    zoo_stats_t stats;
+    int i, j;
+
+    if (zoo_get_stats(zh, &stats) != ZOK) {
+        fprintf(stderr, "stats not available\n");
+        return;
+    }
+    fprintf(stderr, "requests=%lld errors=%lld timeouts=%lld watch_events=%lld "
+            "reconnects=%lld\n"
+            "bytes_sent=%lld bytes_received=%lld\n"
+            "send_queue=%d outstanding=%d completions=%d\n",
+            _LL_CAST_ stats.requests, _LL_CAST_ stats.errors,
+            _LL_CAST_ stats.timeouts, _LL_CAST_ stats.watch_events,
+            _LL_CAST_ stats.reconnects,
+            _LL_CAST_ stats.bytes_sent, _LL_CAST_ stats.bytes_received,
+            stats.send_queue, stats.outstanding, stats.completions);
+    for (i = 0; i < stats.op_count; i++) {
+        zoo_op_stats_t *op = &stats.ops[i];
+        fprintf(stderr, "%s (%d): requests=%lld errors=%lld\n",
+                opName(op->op), op->op, _LL_CAST_ op->requests,
+                _LL_CAST_ op->errors);
+        for (j = 0; j < ZOO_STAGE_COUNT; j++) {
+            zoo_latency_t *l = &op->stages[j];
+            if (l->count == 0) {
+                continue;
+            }
+            fprintf(stderr, "\t%-10s us: count=%lld min=%lld p50=%lld p90=%lld "
+                    "p99=%lld p999=%lld max=%lld\n", stages[j],
+                    _LL_CAST_ l->count, _LL_CAST_ l->min_us,
+                    _LL_CAST_ l->p50_us, _LL_CAST_ l->p90_us,
+                    _LL_CAST_ l->p99_us, _LL_CAST_ l->p999_us,
+                    _LL_CAST_ l->max_us);
+        }
+    }
+}
+
 void my_string_completion(int rc, const char *name, const void *data) {
     fprintf(stderr, "[%s]: rc = %d\n", (char*)(data==0?"null":data), rc);
     if (!rc) {
@@ -337,6 +398,7 @@ void processline(char *line) {
       fprintf(stderr, "    exists <path>\n");
       fprintf(stderr, "    wexists <path>\n");
       fprintf(stderr, "    myid\n");
+      fprintf(stderr, "    stats\n");
       fprintf(stderr, "    verbose\n");
       fprintf(stderr, "    addauth <id> <scheme>\n");
       fprintf(stderr, "    config\n");
@@ -625,6 +687,8 @@ void processline(char *line) {
         }
     } else if (strcmp(line, "myid") == 0) {
         printf("session Id = %llx\n", _LL_CAST_ zoo_client_id(zh)->client_id);
+    } else if (strcmp(line, "stats") == 0) {
+        dumpStats(zh);
     } else if (strcmp(line, "reinit") == 0) {
         zookeeper_close(zh);
         // we can't send myid to the server here -- zookeeper_close() removes
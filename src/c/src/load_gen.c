@@ -28,6 +28,9 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
 
 static zhandle_t *zh;
 
@@ -42,6 +45,12 @@ static pthread_cond_t counterCond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t counterLock=PTHREAD_MUTEX_INITIALIZER;
 static int counter; 
 
+static pthread_cond_t watchCond=PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t watchLock=PTHREAD_MUTEX_INITIALIZER;
+static int watchesPending;
+
+#define WATCH_ROUNDS 10
+
 
 
 void ensureConnected(){
@@ -227,8 +236,118 @@ int recursiveDelete(const char* root){
     return rc;
 }
 
+void watch_fired(zhandle_t *zzh, int type, int state, const char *path,
+        void *ctx) {
+    if (type != ZOO_CHANGED_EVENT)
+        return;
+    pthread_mutex_lock(&watchLock);
+    watchesPending--;
+    pthread_cond_broadcast(&watchCond);
+    pthread_mutex_unlock(&watchLock);
+}
+
+void watch_read_completion(int rc, const char *value, int value_len,
+        const struct Stat *stat, const void *data) {
+    incCounter(-1);
+    if(rc!=ZOK){
+        LOG_ERROR(LOGSTREAM, "Failed to watch a node rc=%d",rc);
+    }
+}
+
+static double now_ms(){
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec*1000.0+tv.tv_usec/1000.0;
+}
+
+// sets a data watch on every child and changes them all, returns the rate
+// at which the watch events were delivered in events/s
+double doWatchCycle(const char* root, int count){
+    char nodeName[1024];
+    double start;
+    int i;
+    counter=0;
+    watchesPending=count;
+    for(i=0; i<count;i++){
+        snprintf(nodeName, sizeof(nodeName),"%s/%d",root,i);
+        incCounter(1);
+        if(zoo_awget(zh, nodeName, watch_fired, 0, watch_read_completion, 0)!=ZOK)
+            return -1;
+    }
+    waitCounter();
+    start=now_ms();
+    if(doWrites(root,count)!=ZOK)
+        return -1;
+    pthread_mutex_lock(&watchLock);
+    while (watchesPending>0) {
+        pthread_cond_wait(&watchCond,&watchLock);
+    }
+    pthread_mutex_unlock(&watchLock);
+    waitCounter();
+    return count*1000.0/(now_ms()-start);
+}
+
+#define MAX_SUBMITTERS 64
+
+struct submitter {
+    pthread_t thread;
+    const char *path;
+    int count;
+    double elapsed;
+};
+
+void contention_completion(int rc, const char *value, int value_len,
+        const struct Stat *stat, const void *data) {
+    incCounter(-1);
+    if(rc!=ZOK){
+        LOG_ERROR(LOGSTREAM, "Failed to read a node rc=%d",rc);
+    }
+}
+
+static void *submitRequests(void *arg){
+    struct submitter *s=arg;
+    double start=now_ms();
+    int i;
+    for(i=0; i<s->count;i++){
+        if(zoo_aget(zh, s->path, 0, contention_completion, 0)!=ZOK){
+            incCounter(-1);
+        }
+    }
+    s->elapsed=now_ms()-start;
+    return 0;
+}
+
+// reads path count times from the given number of threads at once; returns
+// the rate at which the requests were submitted in requests/s and stores the
+// rate at which they completed in completed
+double doContentionRound(const char* path, int threads, int count,
+        double *completed){
+    struct submitter submitters[MAX_SUBMITTERS];
+    double start, elapsed=0;
+    int i;
+    setCounter(count/threads*threads);
+    start=now_ms();
+    for(i=0; i<threads;i++){
+        submitters[i].path=path;
+        submitters[i].count=count/threads;
+        if(pthread_create(&submitters[i].thread,0,submitRequests,
+                    &submitters[i])!=0)
+            return -1;
+    }
+    for(i=0; i<threads;i++){
+        pthread_join(submitters[i].thread,0);
+        if(submitters[i].elapsed>elapsed)
+            elapsed=submitters[i].elapsed;
+    }
+    waitCounter();
+    *completed=count/threads*threads*1000.0/(now_ms()-start);
+    return count/threads*threads*1000.0/elapsed;
+}
+
 void usage(char *argv[]){
     fprintf(stderr, "USAGE:\t%s zookeeper_host_list path #children\nor", argv[0]);
+    fprintf(stderr, "\t%s zookeeper_host_list path #children watches\nor", argv[0]);
+    fprintf(stderr, "\t%s zookeeper_host_list path #requests contention\nor", argv[0]);
     fprintf(stderr, "\t%s zookeeper_host_list path clean\n", argv[0]);
     exit(0);
 }
@@ -263,7 +382,46 @@ int main(int argc, char **argv) {
         exit(1);
     }
     nodeCount=atoi(argv[3]);
+    if(argc>4 && strcmp("contention",argv[4])==0){
+        // measure how fast requests are submitted by 1 to MAX_SUBMITTERS
+        // threads sharing the handle
+        int threads;
+        double submitted, completed;
+        for(threads=1; threads<=MAX_SUBMITTERS; threads*=2){
+            submitted=doContentionRound(argv[2],threads,nodeCount,&completed);
+            if(submitted<0){
+                LOG_ERROR(LOGSTREAM, "Failed to start the submitting threads");
+                exit(1);
+            }
+            fprintf(stdout, "%d threads: %d requests, %.0f submitted/s, "
+                    "%.0f completed/s\n", threads, nodeCount/threads*threads,
+                    submitted, completed);
+        }
+        zookeeper_close(zh);
+        return 0;
+    }
     createRoot(argv[2]);
+    if(argc>4 && strcmp("watches",argv[4])==0){
+        // measure the watch event throughput, then clean up
+        int i;
+        double rate;
+        LOG_INFO(LOGSTREAM, "Creating children for path %s",argv[2]);
+        doCreateNodes(argv[2],nodeCount);
+        waitCounter();
+        for(i=0; i<WATCH_ROUNDS; i++){
+            rate=doWatchCycle(argv[2],nodeCount);
+            if(rate<0){
+                LOG_ERROR(LOGSTREAM, "Failed to run the watch cycle");
+                exit(1);
+            }
+            fprintf(stdout, "round %d: %d watch events, %.0f events/s\n",
+                    i, nodeCount, rate);
+        }
+        doDeletes(argv[2],nodeCount);
+        waitCounter();
+        zookeeper_close(zh);
+        return 0;
+    }
     while(1) {
         ensureConnected();
         LOG_INFO(LOGSTREAM, "Creating children for path %s",argv[2]);
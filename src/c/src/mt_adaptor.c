@@ -36,12 +36,24 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <signal.h>
 #include <poll.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <stdint.h>
+
+/* the single-threaded event loop API, which the shared reactor drives */
+int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
+        struct timeval *tv);
+int zookeeper_process(zhandle_t *zh, int events);
 #endif
 
 void zoo_lock_auth(zhandle_t *zh)
@@ -60,6 +72,14 @@ void unlock_buffer_list(buffer_head_t *l)
 {
     pthread_mutex_unlock(&l->lock);
 }
+void lock_pool(zk_pool_t *p)
+{
+    pthread_mutex_lock(&p->lock);
+}
+void unlock_pool(zk_pool_t *p)
+{
+    pthread_mutex_unlock(&p->lock);
+}
 void lock_completion_list(completion_head_t *l)
 {
     pthread_mutex_lock(&l->lock);
@@ -69,9 +89,33 @@ void unlock_completion_list(completion_head_t *l)
     pthread_cond_broadcast(&l->cond);
     pthread_mutex_unlock(&l->lock);
 }
+/* each thread keeps the sync_completion of its last synchronous call */
+static pthread_key_t cached_sync_completion;
+
+static void destroy_sync_completion(void *p)
+{
+    struct sync_completion *sc = p;
+    pthread_mutex_destroy(&sc->lock);
+    pthread_cond_destroy(&sc->cond);
+    free(sc);
+}
+
+__attribute__((constructor)) static void prepare_sync_completion_key()
+{
+    pthread_key_create(&cached_sync_completion, destroy_sync_completion);
+}
+
 struct sync_completion *alloc_sync_completion(void)
 {
-    struct sync_completion *sc = (struct sync_completion*)calloc(1, sizeof(struct sync_completion));
+    struct sync_completion *sc = pthread_getspecific(cached_sync_completion);
+    if (sc) {
+        pthread_setspecific(cached_sync_completion, 0);
+        sc->rc = 0;
+        memset(&sc->u, 0, sizeof(sc->u));
+        sc->complete = 0;
+        return sc;
+    }
+    sc = (struct sync_completion*)calloc(1, sizeof(struct sync_completion));
     if (sc) {
        pthread_cond_init(&sc->cond, 0);
        pthread_mutex_init(&sc->lock, 0);
@@ -91,9 +135,11 @@ int wait_sync_completion(struct sync_completion *sc)
 void free_sync_completion(struct sync_completion *sc)
 {
     if (sc) {
-        pthread_mutex_destroy(&sc->lock);
-        pthread_cond_destroy(&sc->cond);
-        free(sc);
+        if (pthread_getspecific(cached_sync_completion) == 0 &&
+                pthread_setspecific(cached_sync_completion, sc) == 0) {
+            return;
+        }
+        destroy_sync_completion(sc);
     }
 }
 
@@ -166,6 +212,10 @@ int create_socket_pair(zhandle_t* zh, SOCKET fds[2])
 void *do_io(void *);
 void *do_completion(void *);
 #endif
+static void dispatch_completions(zhandle_t *zh, struct adaptor_threads *adaptor,
+        completion_head_t *batch);
+static void stop_completion_workers(zhandle_t *zh,
+        struct adaptor_threads *adaptor);
 
 
 int wakeup_io_thread(zhandle_t *zh);
@@ -207,6 +257,601 @@ void notify_thread_ready(zhandle_t* zh)
 }
 
 
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * The shared reactor drives ZOO_SHARED_REACTOR handles with a small pool of
+ * I/O threads instead of two threads per handle. Every handle is pinned to
+ * one I/O thread, which runs the same zookeeper_interest() /
+ * zookeeper_process() cycle as do_io() for it, using an epoll set and a
+ * deadline per handle instead of poll(). Completions are run by a pool of
+ * executor threads; a handle is queued to the executor at most once, so its
+ * completions never run concurrently or out of order.
+ */
+
+/* completion_state bits of a shared handle */
+#define COMPLETION_SCHEDULED 1  /* queued to the executor */
+#define COMPLETION_RUNNING   2  /* an executor thread runs its completions */
+#define COMPLETION_RERUN     4  /* completions were queued while running */
+#define COMPLETION_RETIRE    8  /* the handle is being closed */
+#define COMPLETION_WAITER   16  /* adaptor_finish() waits for the executor */
+#define COMPLETION_RETIRED  32  /* the executor released the handle */
+
+#define REACTOR_MAX_EVENTS 64
+
+/* an I/O thread of the shared reactor */
+struct reactor_io {
+    pthread_t thread;
+    int epfd;
+    int wake_pipe[2];
+    pthread_mutex_t lock;       // guards pending and reactor_detached
+    pthread_cond_t cond;        // signalled when a handle is detached
+    zhandle_t *pending;         // attached handles not yet picked up
+    zhandle_t *handles;         // handles driven by the thread, private to it
+    int nhandles;               // handles assigned, guarded by reactor.lock
+    volatile int stop;
+};
+
+static struct {
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t cond;        // signalled when completions are queued
+    pthread_cond_t retired;     // signalled when the executor releases a handle
+    int io_threads;
+    int completion_threads;
+    struct reactor_io *io;
+    pthread_t *completion;
+    zhandle_t *run_head;        // handles with completions to run
+    zhandle_t *run_last;
+    int handles;                // handles using the reactor
+    int started;
+    int stop;
+} reactor = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 1, 1 };
+
+static int reactor_wakeup(struct reactor_io *io)
+{
+    char c=0;
+    if (write(io->wake_pipe[1], &c, 1) == 1 || errno == EAGAIN) {
+        /* a full pipe means a wakeup is pending already */
+        return ZOK;
+    }
+    return ZSYSTEMERROR;
+}
+
+/* must be called with reactor.lock held */
+static void reactor_schedule_locked(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if (adaptor->completion_state & COMPLETION_RUNNING) {
+        adaptor->completion_state |= COMPLETION_RERUN;
+        return;
+    }
+    if (adaptor->completion_state & (COMPLETION_SCHEDULED|COMPLETION_RETIRED)) {
+        return;
+    }
+    adaptor->completion_state |= COMPLETION_SCHEDULED;
+    adaptor->run_next = 0;
+    if (reactor.run_last) {
+        ((struct adaptor_threads*)reactor.run_last->adaptor_priv)->run_next = zh;
+    } else {
+        reactor.run_head = zh;
+    }
+    reactor.run_last = zh;
+    pthread_cond_signal(&reactor.cond);
+}
+
+static int has_completions(zhandle_t *zh)
+{
+    int pending;
+    pthread_mutex_lock(&zh->completions_to_process.lock);
+    pending = zh->completions_to_process.head != 0;
+    pthread_mutex_unlock(&zh->completions_to_process.lock);
+    return pending;
+}
+
+static void reactor_schedule(zhandle_t *zh)
+{
+    if (!has_completions(zh)) {
+        return;
+    }
+    pthread_mutex_lock(&reactor.lock);
+    reactor_schedule_locked(zh);
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+/* must be called with reactor.lock held */
+static void reactor_unschedule_locked(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    zhandle_t *prev = 0;
+    zhandle_t *cur = reactor.run_head;
+
+    while (cur && cur != zh) {
+        prev = cur;
+        cur = ((struct adaptor_threads*)cur->adaptor_priv)->run_next;
+    }
+    if (!cur) {
+        return;
+    }
+    if (prev) {
+        ((struct adaptor_threads*)prev->adaptor_priv)->run_next = adaptor->run_next;
+    } else {
+        reactor.run_head = adaptor->run_next;
+    }
+    if (reactor.run_last == zh) {
+        reactor.run_last = prev;
+    }
+    adaptor->completion_state &= ~COMPLETION_SCHEDULED;
+}
+
+static void *reactor_completion_loop(void *v)
+{
+    pthread_mutex_lock(&reactor.lock);
+    while (!reactor.stop) {
+        zhandle_t *zh = reactor.run_head;
+        struct adaptor_threads *adaptor;
+        if (!zh) {
+            pthread_cond_wait(&reactor.cond, &reactor.lock);
+            continue;
+        }
+        adaptor = zh->adaptor_priv;
+        reactor.run_head = adaptor->run_next;
+        if (!reactor.run_head) {
+            reactor.run_last = 0;
+        }
+        adaptor->completion_state &= ~COMPLETION_SCHEDULED;
+        adaptor->completion_state |= COMPLETION_RUNNING;
+        adaptor->completion_thread = pthread_self();
+        pthread_mutex_unlock(&reactor.lock);
+
+        process_completions(zh);
+
+        pthread_mutex_lock(&reactor.lock);
+        adaptor->completion_state &= ~COMPLETION_RUNNING;
+        if (adaptor->completion_state & COMPLETION_RETIRE) {
+            int waiter = adaptor->completion_state & COMPLETION_WAITER;
+            pthread_mutex_unlock(&reactor.lock);
+            /* run what zookeeper_close() queued while the completions ran */
+            process_completions(zh);
+            /* without a waiter this was the last reference and zh is gone */
+            api_epilog(zh, 0);
+            pthread_mutex_lock(&reactor.lock);
+            if (waiter) {
+                adaptor->completion_state |= COMPLETION_RETIRED;
+                pthread_cond_broadcast(&reactor.retired);
+            }
+            continue;
+        }
+        if ((adaptor->completion_state & COMPLETION_RERUN) ||
+                has_completions(zh)) {
+            adaptor->completion_state &= ~COMPLETION_RERUN;
+            reactor_schedule_locked(zh);
+        }
+    }
+    pthread_mutex_unlock(&reactor.lock);
+    return 0;
+}
+
+/* events on the read/write server probe of a handle are reported with the
+ * lowest bit of the handle pointer set */
+#define REACTOR_PROBE_TAG ((uintptr_t)1)
+
+/* (re)register fd, which replaces the descriptor *registered */
+static void reactor_register(struct reactor_io *io, int fd, int *registered,
+        int interest, void *ptr)
+{
+    struct epoll_event ev;
+
+    if (fd != *registered) {
+        /* the previous socket was closed, which removed it from the set */
+        *registered = -1;
+    }
+    if (fd == -1) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (interest&ZOOKEEPER_READ) ? EPOLLIN : 0;
+    ev.events |= (interest&ZOOKEEPER_WRITE) ? EPOLLOUT : 0;
+    ev.data.ptr = ptr;
+    /* the descriptor may have been closed and reused for a new
+     * connection in between, in which case it has to be added again */
+    if (*registered == -1 ||
+            epoll_ctl(io->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    *registered = fd;
+}
+
+/* register the sockets zookeeper_interest() wants polled and compute the
+ * handle's next deadline */
+static void reactor_interest(struct reactor_io *io, zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct timeval tv;
+    int fd;
+    int interest;
+
+    zookeeper_interest(zh, &fd, &interest, &tv);
+    reactor_register(io, fd, &adaptor->reactor_fd, interest, zh);
+    rw_probe_interest(zh, &fd, &interest);
+    reactor_register(io, fd, &adaptor->reactor_probe_fd, interest,
+            (void*)((uintptr_t)zh | REACTOR_PROBE_TAG));
+
+    get_system_time(&adaptor->reactor_deadline);
+    adaptor->reactor_deadline.tv_sec += tv.tv_sec;
+    adaptor->reactor_deadline.tv_usec += tv.tv_usec;
+    if (adaptor->reactor_deadline.tv_usec >= 1000000) {
+        adaptor->reactor_deadline.tv_sec++;
+        adaptor->reactor_deadline.tv_usec -= 1000000;
+    }
+}
+
+/* called by the I/O thread once it no longer drives the handle */
+static void reactor_detach(struct reactor_io *io, zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if (adaptor->reactor_fd != -1 && adaptor->reactor_fd == zh->fd) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, zh->fd, 0);
+    }
+    if (adaptor->reactor_probe_fd != -1 &&
+            adaptor->reactor_probe_fd == zh->rw_probe.fd) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, zh->rw_probe.fd, 0);
+    }
+    adaptor->reactor_fd = -1;
+    adaptor->reactor_probe_fd = -1;
+    /* the completion side still holds a reference, so zh stays valid */
+    api_epilog(zh, 0);
+    pthread_mutex_lock(&io->lock);
+    adaptor->reactor_detached = 1;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+static void *reactor_io_loop(void *v)
+{
+    struct reactor_io *io = v;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    zhandle_t **pzh;
+    zhandle_t *zh;
+
+    while (!io->stop) {
+        struct timeval now;
+        int64_t timeout = -1;
+        int nevents;
+        int i;
+
+        pthread_mutex_lock(&io->lock);
+        while ((zh = io->pending) != 0) {
+            struct adaptor_threads *adaptor = zh->adaptor_priv;
+            io->pending = adaptor->reactor_next;
+            adaptor->reactor_next = io->handles;
+            io->handles = zh;
+        }
+        pthread_mutex_unlock(&io->lock);
+
+        get_system_time(&now);
+        pzh = &io->handles;
+        while ((zh = *pzh) != 0) {
+            struct adaptor_threads *adaptor = zh->adaptor_priv;
+            int64_t left;
+
+            if (zh->close_requested) {
+                *pzh = adaptor->reactor_next;
+                reactor_detach(io, zh);
+                continue;
+            }
+            left = ((int64_t)(adaptor->reactor_deadline.tv_sec - now.tv_sec)) * 1000000 +
+                (adaptor->reactor_deadline.tv_usec - now.tv_usec);
+            if (adaptor->reactor_revents || left <= 0 ||
+                    __sync_lock_test_and_set(&adaptor->reactor_wakeup, 0)) {
+                int interest = adaptor->reactor_revents;
+                adaptor->reactor_revents = 0;
+                zh->io_count++;
+                zookeeper_process(zh, interest);
+                reactor_schedule(zh);
+                // stop driving the handle if it is_unrecoverable()
+                if (is_unrecoverable(zh)) {
+                    *pzh = adaptor->reactor_next;
+                    reactor_detach(io, zh);
+                    continue;
+                }
+                reactor_interest(io, zh);
+                reactor_schedule(zh);
+                get_system_time(&now);
+                left = ((int64_t)(adaptor->reactor_deadline.tv_sec - now.tv_sec)) * 1000000 +
+                    (adaptor->reactor_deadline.tv_usec - now.tv_usec);
+            }
+            left = left < 0 ? 0 : (left + 999) / 1000;
+            if (timeout == -1 || left < timeout) {
+                timeout = left;
+            }
+            pzh = &adaptor->reactor_next;
+        }
+
+        nevents = epoll_wait(io->epfd, events, REACTOR_MAX_EVENTS, (int)timeout);
+        for (i = 0; i < nevents; i++) {
+            struct adaptor_threads *adaptor;
+            if (events[i].data.ptr == 0) {
+                // flush the pipe
+                char b[128];
+                while(read(io->wake_pipe[0],b,sizeof(b))==sizeof(b)){}
+                continue;
+            }
+            if ((uintptr_t)events[i].data.ptr & REACTOR_PROBE_TAG) {
+                zh = (zhandle_t*)((uintptr_t)events[i].data.ptr & ~REACTOR_PROBE_TAG);
+                adaptor = zh->adaptor_priv;
+                adaptor->reactor_wakeup = 1;
+                continue;
+            }
+            zh = events[i].data.ptr;
+            adaptor = zh->adaptor_priv;
+            // an error is reported to zookeeper_process() by both the read
+            // and the write, whichever gets to the socket first
+            adaptor->reactor_revents =
+                (events[i].events&(EPOLLIN|EPOLLERR)) ? ZOOKEEPER_READ : 0;
+            adaptor->reactor_revents |=
+                (events[i].events&(EPOLLOUT|EPOLLHUP|EPOLLERR)) ?
+                ZOOKEEPER_WRITE : 0;
+        }
+    }
+    return 0;
+}
+
+/* must be called with reactor.lock held, which is released while a failed
+ * start joins the threads it has created */
+static int reactor_start(zhandle_t *zh)
+{
+    struct epoll_event ev;
+    int io_threads = reactor.io_threads;
+    int completion_threads = reactor.completion_threads;
+    int io_started = 0;
+    int completion_started = 0;
+    int i;
+
+    reactor.io = calloc(io_threads, sizeof(*reactor.io));
+    reactor.completion = calloc(completion_threads, sizeof(pthread_t));
+    if (!reactor.io || !reactor.completion) {
+        LOG_ERROR(LOGCALLBACK(zh), "Out of memory");
+        goto fail;
+    }
+    for (i = 0; i < io_threads; i++) {
+        reactor.io[i].epfd = -1;
+        reactor.io[i].wake_pipe[0] = reactor.io[i].wake_pipe[1] = -1;
+    }
+    for (i = 0; i < io_threads; i++) {
+        struct reactor_io *io = &reactor.io[i];
+        io->epfd = epoll_create(REACTOR_MAX_EVENTS);
+        if (io->epfd == -1 || pipe(io->wake_pipe) == -1) {
+            LOG_ERROR(LOGCALLBACK(zh), "Can't set up the reactor %d", errno);
+            goto fail;
+        }
+        set_nonblock(io->wake_pipe[0]);
+        set_nonblock(io->wake_pipe[1]);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = 0;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wake_pipe[0], &ev) == -1) {
+            LOG_ERROR(LOGCALLBACK(zh), "Can't set up the reactor %d", errno);
+            goto fail;
+        }
+    }
+    for (; io_started < io_threads; io_started++) {
+        struct reactor_io *io = &reactor.io[io_started];
+        pthread_mutex_init(&io->lock, 0);
+        pthread_cond_init(&io->cond, 0);
+        if (pthread_create(&io->thread, 0, reactor_io_loop, io) != 0) {
+            LOG_ERROR(LOGCALLBACK(zh), "pthread_create() failed for a reactor IO thread");
+            pthread_mutex_destroy(&io->lock);
+            pthread_cond_destroy(&io->cond);
+            goto fail;
+        }
+    }
+    for (; completion_started < completion_threads; completion_started++) {
+        if (pthread_create(&reactor.completion[completion_started], 0,
+                    reactor_completion_loop, 0) != 0) {
+            LOG_ERROR(LOGCALLBACK(zh), "pthread_create() failed for a reactor completion thread");
+            goto fail;
+        }
+    }
+    reactor.started = 1;
+    LOG_DEBUG(LOGCALLBACK(zh), "started the shared reactor with %d IO and %d completion threads",
+            reactor.io_threads, reactor.completion_threads);
+    return 0;
+fail:
+    if (completion_started > 0) {
+        // the completion threads wait for reactor.lock before they see stop;
+        // reactor_reserve() won't start the reactor again meanwhile
+        reactor.stop = 1;
+        pthread_mutex_unlock(&reactor.lock);
+        for (i = 0; i < completion_started; i++) {
+            pthread_join(reactor.completion[i], 0);
+        }
+        pthread_mutex_lock(&reactor.lock);
+        reactor.stop = 0;
+    }
+    for (i = 0; i < io_started; i++) {
+        struct reactor_io *io = &reactor.io[i];
+        io->stop = 1;
+        reactor_wakeup(io);
+        pthread_join(io->thread, 0);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->cond);
+    }
+    for (i = 0; reactor.io && i < io_threads; i++) {
+        if (reactor.io[i].epfd != -1) close(reactor.io[i].epfd);
+        if (reactor.io[i].wake_pipe[0] != -1) close(reactor.io[i].wake_pipe[0]);
+        if (reactor.io[i].wake_pipe[1] != -1) close(reactor.io[i].wake_pipe[1]);
+    }
+    free(reactor.io);
+    free(reactor.completion);
+    reactor.io = 0;
+    reactor.completion = 0;
+    return -1;
+}
+
+/* assign the handle to the least loaded I/O thread, starting the reactor if
+ * needed; the handle isn't driven until reactor_attach() */
+static int reactor_reserve(zhandle_t *zh, struct adaptor_threads *adaptor)
+{
+    struct reactor_io *io;
+    int i;
+
+    pthread_mutex_lock(&reactor.lock);
+    if (!reactor.started && (reactor.stop || reactor_start(zh) != 0)) {
+        pthread_mutex_unlock(&reactor.lock);
+        return -1;
+    }
+    io = &reactor.io[0];
+    for (i = 1; i < reactor.io_threads; i++) {
+        if (reactor.io[i].nhandles < io->nhandles) {
+            io = &reactor.io[i];
+        }
+    }
+    io->nhandles++;
+    reactor.handles++;
+    adaptor->reactor = io;
+    pthread_mutex_unlock(&reactor.lock);
+    return 0;
+}
+
+static void reactor_attach(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct reactor_io *io = adaptor->reactor;
+
+    // one reference for the I/O side and one for the completion side, like
+    // the two threads of a dedicated handle
+    api_prolog(zh);
+    api_prolog(zh);
+    pthread_mutex_lock(&io->lock);
+    adaptor->reactor_next = io->pending;
+    io->pending = zh;
+    pthread_mutex_unlock(&io->lock);
+    reactor_wakeup(io);
+}
+
+/* wait until neither the I/O thread nor the executor use the handle anymore;
+ * the counterpart of joining the threads of a dedicated handle */
+static void reactor_finish(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct reactor_io *io = adaptor->reactor;
+
+    pthread_mutex_lock(&io->lock);
+    if (!adaptor->reactor_detached) {
+        reactor_wakeup(io);
+        while (!adaptor->reactor_detached &&
+                !pthread_equal(io->thread, pthread_self())) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    pthread_mutex_lock(&reactor.lock);
+    if (adaptor->completion_state & COMPLETION_RETIRED) {
+        pthread_mutex_unlock(&reactor.lock);
+        return;
+    }
+    if (adaptor->completion_state & COMPLETION_RUNNING) {
+        if (pthread_equal(adaptor->completion_thread, pthread_self())) {
+            /* closed from one of its own completions: the executor releases
+             * the handle once the completion returns */
+            adaptor->completion_state |= COMPLETION_RETIRE;
+        } else {
+            adaptor->completion_state |= COMPLETION_RETIRE|COMPLETION_WAITER;
+            while (!(adaptor->completion_state & COMPLETION_RETIRED)) {
+                pthread_cond_wait(&reactor.retired, &reactor.lock);
+            }
+        }
+        pthread_mutex_unlock(&reactor.lock);
+        return;
+    }
+    /* not running anywhere: run the remaining completions on this thread
+     * rather than wait for an executor that may be the caller itself */
+    reactor_unschedule_locked(zh);
+    adaptor->completion_state |= COMPLETION_RETIRED;
+    pthread_mutex_unlock(&reactor.lock);
+    process_completions(zh);
+    api_epilog(zh, 0);
+}
+
+static void reactor_release(struct adaptor_threads *adaptor)
+{
+    pthread_mutex_lock(&reactor.lock);
+    adaptor->reactor->nhandles--;
+    reactor.handles--;
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+int zoo_reactor_init(int io_threads, int completion_threads)
+{
+    int rc = ZOK;
+    if (io_threads < 1 || completion_threads < 1) {
+        return ZBADARGUMENTS;
+    }
+    pthread_mutex_lock(&reactor.lock);
+    if (reactor.started) {
+        rc = ZINVALIDSTATE;
+    } else {
+        reactor.io_threads = io_threads;
+        reactor.completion_threads = completion_threads;
+    }
+    pthread_mutex_unlock(&reactor.lock);
+    return rc;
+}
+
+int zoo_reactor_shutdown(void)
+{
+    int i;
+    pthread_mutex_lock(&reactor.lock);
+    if (reactor.handles > 0) {
+        pthread_mutex_unlock(&reactor.lock);
+        return ZINVALIDSTATE;
+    }
+    if (!reactor.started) {
+        pthread_mutex_unlock(&reactor.lock);
+        return ZOK;
+    }
+    reactor.stop = 1;
+    pthread_cond_broadcast(&reactor.cond);
+    pthread_mutex_unlock(&reactor.lock);
+
+    for (i = 0; i < reactor.completion_threads; i++) {
+        pthread_join(reactor.completion[i], 0);
+    }
+    for (i = 0; i < reactor.io_threads; i++) {
+        struct reactor_io *io = &reactor.io[i];
+        io->stop = 1;
+        reactor_wakeup(io);
+        pthread_join(io->thread, 0);
+        close(io->epfd);
+        close(io->wake_pipe[0]);
+        close(io->wake_pipe[1]);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->cond);
+    }
+
+    pthread_mutex_lock(&reactor.lock);
+    free(reactor.io);
+    free(reactor.completion);
+    reactor.io = 0;
+    reactor.completion = 0;
+    reactor.started = 0;
+    reactor.stop = 0;
+    pthread_mutex_unlock(&reactor.lock);
+    return ZOK;
+}
+#else
+int zoo_reactor_init(int io_threads, int completion_threads)
+{
+    return ZAPIERROR;
+}
+
+int zoo_reactor_shutdown(void)
+{
+    return ZOK;
+}
+#endif
+
 void start_threads(zhandle_t* zh)
 {
     int rc = 0;
@@ -230,25 +875,43 @@ void start_threads(zhandle_t* zh)
 int adaptor_init(zhandle_t *zh)
 {
     pthread_mutexattr_t recursive_mx_attr;
+    int shared = 0;
+    int i;
     struct adaptor_threads *adaptor_threads = calloc(1, sizeof(*adaptor_threads));
     if (!adaptor_threads) {
         LOG_ERROR(LOGCALLBACK(zh), "Out of memory");
         return -1;
     }
+    adaptor_threads->self_pipe[0] = -1;
+    adaptor_threads->self_pipe[1] = -1;
+    adaptor_threads->reactor_fd = -1;
+    adaptor_threads->reactor_probe_fd = -1;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (zh->shared_reactor) {
+        shared = reactor_reserve(zh, adaptor_threads) == 0;
+        if (!shared) {
+            LOG_WARN(LOGCALLBACK(zh), "Can't start the shared reactor, "
+                    "using dedicated threads");
+        }
+    }
+#endif
 
     /* We use a pipe for interrupting select() in unix/sol and socketpair in windows. */
 #ifdef WIN32   
     if (create_socket_pair(zh, adaptor_threads->self_pipe) == -1){
        LOG_ERROR(LOGCALLBACK(zh), "Can't make a socket.");
 #else
-    if(pipe(adaptor_threads->self_pipe)==-1) {
+    if(!shared && pipe(adaptor_threads->self_pipe)==-1) {
         LOG_ERROR(LOGCALLBACK(zh), "Can't make a pipe %d",errno);
 #endif
         free(adaptor_threads);
         return -1;
     }
-    set_nonblock(adaptor_threads->self_pipe[1]);
-    set_nonblock(adaptor_threads->self_pipe[0]);
+    if (!shared) {
+        set_nonblock(adaptor_threads->self_pipe[1]);
+        set_nonblock(adaptor_threads->self_pipe[0]);
+    }
 
     pthread_mutex_init(&zh->auth_h.lock,0);
 
@@ -256,6 +919,9 @@ int adaptor_init(zhandle_t *zh)
     pthread_mutex_init(&zh->to_process.lock,0);
     pthread_mutex_init(&adaptor_threads->zh_lock,0);
     pthread_mutex_init(&adaptor_threads->reconfig_lock,0);
+    pthread_mutex_init(&adaptor_threads->watchers_lock,0);
+    pthread_mutex_init(&adaptor_threads->stats_lock,0);
+    pthread_mutex_init(&adaptor_threads->trace_lock,0);
     // to_send must be recursive mutex    
     pthread_mutexattr_init(&recursive_mx_attr);
     pthread_mutexattr_settype(&recursive_mx_attr, PTHREAD_MUTEX_RECURSIVE);
@@ -266,6 +932,15 @@ int adaptor_init(zhandle_t *zh)
     pthread_cond_init(&zh->sent_requests.cond,0);
     pthread_mutex_init(&zh->completions_to_process.lock,0);
     pthread_cond_init(&zh->completions_to_process.cond,0);
+    for (i = 0; i < ZOO_POOL_COUNT; i++) {
+        pthread_mutex_init(&zh->pools[i].lock,0);
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (shared) {
+        reactor_attach(zh);
+        return 0;
+    }
+#endif
     start_threads(zh);
     return 0;
 }
@@ -280,6 +955,13 @@ void adaptor_finish(zhandle_t *zh)
         api_epilog(zh,0);
         return;
     }
+#ifdef HAVE_SYS_EPOLL_H
+    if (adaptor_threads->reactor) {
+        reactor_finish(zh);
+        api_epilog(zh,0);
+        return;
+    }
+#endif
 
     if(!pthread_equal(adaptor_threads->io,pthread_self())){
         wakeup_io_thread(zh);
@@ -294,6 +976,7 @@ void adaptor_finish(zhandle_t *zh)
         pthread_join(adaptor_threads->completion, 0);
     }else
         pthread_detach(adaptor_threads->completion);
+    stop_completion_workers(zh, adaptor_threads);
     
     api_epilog(zh,0);
 }
@@ -301,6 +984,7 @@ void adaptor_finish(zhandle_t *zh)
 void adaptor_destroy(zhandle_t *zh)
 {
     struct adaptor_threads *adaptor = zh->adaptor_priv;
+    int i;
     if(adaptor==0) return;
     
     pthread_cond_destroy(&adaptor->cond);
@@ -312,11 +996,29 @@ void adaptor_destroy(zhandle_t *zh)
     pthread_mutex_destroy(&zh->completions_to_process.lock);
     pthread_cond_destroy(&zh->completions_to_process.cond);
     pthread_mutex_destroy(&adaptor->zh_lock);
+    pthread_mutex_destroy(&adaptor->watchers_lock);
+    pthread_mutex_destroy(&adaptor->stats_lock);
+    pthread_mutex_destroy(&adaptor->trace_lock);
+    for (i = 0; i < ZOO_POOL_COUNT; i++) {
+        pthread_mutex_destroy(&zh->pools[i].lock);
+    }
+    for (i = 0; i < adaptor->nworkers; i++) {
+        pthread_mutex_destroy(&adaptor->workers[i].queue.lock);
+        pthread_cond_destroy(&adaptor->workers[i].queue.cond);
+    }
+    free(adaptor->workers);
 
     pthread_mutex_destroy(&zh->auth_h.lock);
 
-    close(adaptor->self_pipe[0]);
-    close(adaptor->self_pipe[1]);
+#ifdef HAVE_SYS_EPOLL_H
+    if (adaptor->reactor) {
+        reactor_release(adaptor);
+    } else
+#endif
+    {
+        close(adaptor->self_pipe[0]);
+        close(adaptor->self_pipe[1]);
+    }
     free(adaptor);
     zh->adaptor_priv=0;
 }
@@ -325,6 +1027,12 @@ int wakeup_io_thread(zhandle_t *zh)
 {
     struct adaptor_threads *adaptor_threads = zh->adaptor_priv;
     char c=0;
+#ifdef HAVE_SYS_EPOLL_H
+    if (adaptor_threads->reactor) {
+        __sync_lock_test_and_set(&adaptor_threads->reactor_wakeup, 1);
+        return reactor_wakeup(adaptor_threads->reactor);
+    }
+#endif
 #ifndef WIN32
     return write(adaptor_threads->self_pipe[1],&c,1)==1? ZOK: ZSYSTEMERROR;    
 #else
@@ -334,8 +1042,11 @@ int wakeup_io_thread(zhandle_t *zh)
 
 int adaptor_send_queue(zhandle_t *zh, int timeout)
 {
-    if(!zh->close_requested)
+    if(!zh->close_requested) {
+        if (zh->direct_send && send_queue_directly(zh))
+            return ZOK;
         return wakeup_io_thread(zh);
+    }
     // don't rely on the IO thread to send the messages if the app has
     // requested to close 
     return flush_send_queue(zh, timeout);
@@ -360,7 +1071,7 @@ void *do_io(void *v)
 {
     zhandle_t *zh = (zhandle_t*)v;
 #ifndef WIN32
-    struct pollfd fds[2];
+    struct pollfd fds[3];
     struct adaptor_threads *adaptor_threads = zh->adaptor_priv;
 
     api_prolog(zh);
@@ -376,6 +1087,8 @@ void *do_io(void *v)
         int timeout;
         int maxfd=1;
         int rc;
+        int probe_fd;
+        int probe_interest;
         
         zookeeper_interest(zh, &fd, &interest, &tv);
         if (fd != -1) {
@@ -384,6 +1097,12 @@ void *do_io(void *v)
             fds[1].events|=(interest&ZOOKEEPER_WRITE)?POLLOUT:0;
             maxfd=2;
         }
+        // wake up as soon as the read/write server probe can make progress
+        if (rw_probe_interest(zh, &probe_fd, &probe_interest)) {
+            fds[maxfd].fd=probe_fd;
+            fds[maxfd].events=(probe_interest&ZOOKEEPER_READ)?POLLIN:POLLOUT;
+            maxfd++;
+        }
         timeout=tv.tv_sec * 1000 + (tv.tv_usec/1000);
         
         poll(fds,maxfd,timeout);
@@ -467,7 +1186,10 @@ void *do_completion(void *v)
 #endif
 {
     zhandle_t *zh = v;
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    completion_head_t batch;
     api_prolog(zh);
+    get_system_time(&adaptor->strict.started);
     notify_thread_ready(zh);
     LOG_DEBUG(LOGCALLBACK(zh), "started completion thread");
     while(!zh->close_requested) {
@@ -475,14 +1197,244 @@ void *do_completion(void *v)
         while(!zh->completions_to_process.head && !zh->close_requested) {
             pthread_cond_wait(&zh->completions_to_process.cond, &zh->completions_to_process.lock);
         }
+        batch.head = zh->completions_to_process.head;
+        batch.last = zh->completions_to_process.last;
+        zh->completions_to_process.head = 0;
+        zh->completions_to_process.last = 0;
         pthread_mutex_unlock(&zh->completions_to_process.lock);
-        process_completions(zh);
+        dispatch_completions(zh, adaptor, &batch);
     }
     api_epilog(zh, 0);    
     LOG_DEBUG(LOGCALLBACK(zh), "completion thread terminated");
     return 0;
 }
 
+int completion_key(zhandle_t *zh, const char *path, const void *data)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    unsigned int hash = 5381;
+    if (adaptor && adaptor->completion_key) {
+        return adaptor->completion_key(path, data);
+    }
+    // djb2, like the watcher tables
+    while (path && *path) {
+        hash = ((hash << 5) + hash) + (unsigned char)*path++;
+    }
+    return (int)hash;
+}
+
+static void run_completions(zhandle_t *zh, struct completion_worker *w,
+        completion_head_t *batch)
+{
+    struct _completion_list *cptr;
+    struct timeval start;
+    struct timeval end;
+
+    get_system_time(&start);
+    while ((cptr = dequeue_completion_nolock(batch)) != 0) {
+        process_completion(zh, cptr);
+        fetch_and_add(&w->stats.queued, -1);
+        w->stats.completions++;
+    }
+    get_system_time(&end);
+    w->stats.busy_usec += ((int64_t)(end.tv_sec - start.tv_sec)) * 1000000 +
+        (end.tv_usec - start.tv_usec);
+}
+
+/* runs the batch on the completion thread, or hands every completion to the
+ * worker picked by its key so that completions with the same key keep their
+ * order */
+static void dispatch_completions(zhandle_t *zh, struct adaptor_threads *adaptor,
+        completion_head_t *batch)
+{
+    int nworkers = adaptor->nworkers;
+    struct completion_worker *w = &adaptor->strict;
+    struct _completion_list *cptr;
+    int i;
+
+    while ((cptr = dequeue_completion_nolock(batch)) != 0) {
+        if (nworkers) {
+            w = &adaptor->workers[(unsigned int)get_completion_key(cptr) % nworkers];
+        }
+        queue_completion_nolock(&w->pending, cptr, 0);
+        w->dispatched++;
+    }
+    for (i = 0; i < (nworkers ? nworkers : 1); i++) {
+        int32_t queued;
+        w = nworkers ? &adaptor->workers[i] : &adaptor->strict;
+        if (!w->dispatched) {
+            continue;
+        }
+        queued = fetch_and_add(&w->stats.queued, w->dispatched) + w->dispatched;
+        if (queued > w->stats.max_queued) {
+            w->stats.max_queued = queued;
+        }
+        w->dispatched = 0;
+        if (nworkers) {
+            queue_completion_batch(&w->queue, &w->pending);
+        } else {
+            run_completions(zh, w, &w->pending);
+        }
+    }
+}
+
+static void *completion_worker(void *v)
+{
+    struct completion_worker *w = v;
+    zhandle_t *zh = w->zh;
+    completion_head_t batch;
+    int stop = 0;
+
+    while (!stop) {
+        pthread_mutex_lock(&w->queue.lock);
+        while (!w->queue.head && !w->stop) {
+            pthread_cond_wait(&w->queue.cond, &w->queue.lock);
+        }
+        batch.head = w->queue.head;
+        batch.last = w->queue.last;
+        w->queue.head = 0;
+        w->queue.last = 0;
+        // run what was handed over before the handle was closed
+        stop = w->stop && !batch.head;
+        pthread_mutex_unlock(&w->queue.lock);
+        if (batch.head) {
+            run_completions(zh, w, &batch);
+        }
+    }
+    // the last reference may destroy the handle, and w with it
+    api_epilog(zh, 0);
+    return 0;
+}
+
+/* lets the workers run what they were handed and waits for them to exit */
+static void stop_workers(struct completion_worker *workers, int nworkers)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        struct completion_worker *w = &workers[i];
+        lock_completion_list(&w->queue);
+        w->stop = 1;
+        unlock_completion_list(&w->queue);
+    }
+    for (i = 0; i < nworkers; i++) {
+        struct completion_worker *w = &workers[i];
+        if (!pthread_equal(w->thread, pthread_self())) {
+            pthread_join(w->thread, 0);
+        } else {
+            pthread_detach(w->thread);
+        }
+    }
+}
+
+int zoo_set_completion_workers(zhandle_t *zh, int workers, int ordering,
+        completion_key_fn key)
+{
+    struct adaptor_threads *adaptor;
+    struct completion_worker *w;
+    int i;
+
+    if (zh == 0 || workers < 1 || ordering < ZOO_COMPLETION_ORDER_STRICT ||
+            ordering > ZOO_COMPLETION_ORDER_KEY ||
+            (ordering == ZOO_COMPLETION_ORDER_KEY && key == 0)) {
+        return ZBADARGUMENTS;
+    }
+    adaptor = zh->adaptor_priv;
+    if (adaptor->reactor) {
+        return ZINVALIDSTATE;
+    }
+    pthread_mutex_lock(&adaptor->lock);
+    if (adaptor->workers || zh->close_requested) {
+        pthread_mutex_unlock(&adaptor->lock);
+        return ZINVALIDSTATE;
+    }
+    if (ordering == ZOO_COMPLETION_ORDER_STRICT) {
+        pthread_mutex_unlock(&adaptor->lock);
+        return ZOK;
+    }
+    w = calloc(workers, sizeof(*w));
+    if (!w) {
+        pthread_mutex_unlock(&adaptor->lock);
+        LOG_ERROR(LOGCALLBACK(zh), "Out of memory");
+        return ZSYSTEMERROR;
+    }
+    adaptor->completion_key = ordering == ZOO_COMPLETION_ORDER_KEY ? key : 0;
+    for (i = 0; i < workers; i++) {
+        w[i].zh = zh;
+        pthread_mutex_init(&w[i].queue.lock, 0);
+        pthread_cond_init(&w[i].queue.cond, 0);
+        get_system_time(&w[i].started);
+        // released by the worker when it terminates
+        api_prolog(zh);
+        if (pthread_create(&w[i].thread, 0, completion_worker, &w[i]) != 0) {
+            LOG_ERROR(LOGCALLBACK(zh), "pthread_create() failed for a completion worker");
+            api_epilog(zh, 0);
+            pthread_mutex_destroy(&w[i].queue.lock);
+            pthread_cond_destroy(&w[i].queue.cond);
+            break;
+        }
+    }
+    if (i < workers) {
+        adaptor->completion_key = 0;
+        pthread_mutex_unlock(&adaptor->lock);
+        // nothing else knows about these workers, stop them unlocked
+        stop_workers(w, i);
+        while (i-- > 0) {
+            pthread_mutex_destroy(&w[i].queue.lock);
+            pthread_cond_destroy(&w[i].queue.cond);
+        }
+        free(w);
+        return ZSYSTEMERROR;
+    }
+    adaptor->workers = w;
+    // the completion thread starts dispatching once it sees nworkers
+    __sync_synchronize();
+    adaptor->nworkers = workers;
+    pthread_mutex_unlock(&adaptor->lock);
+    LOG_DEBUG(LOGCALLBACK(zh), "started %d completion workers", workers);
+    return ZOK;
+}
+
+static void stop_completion_workers(zhandle_t *zh,
+        struct adaptor_threads *adaptor)
+{
+    int nworkers;
+
+    pthread_mutex_lock(&adaptor->lock);
+    nworkers = adaptor->nworkers;
+    pthread_mutex_unlock(&adaptor->lock);
+    stop_workers(adaptor->workers, nworkers);
+}
+
+int zoo_get_completion_stats(zhandle_t *zh, zoo_completion_stats_t *stats,
+        int *count)
+{
+    struct adaptor_threads *adaptor;
+    struct timeval now;
+    int nworkers;
+    int i;
+
+    if (zh == 0 || stats == 0 || count == 0) {
+        return ZBADARGUMENTS;
+    }
+    adaptor = zh->adaptor_priv;
+    if (adaptor == 0 || adaptor->reactor) {
+        *count = 0;
+        return ZOK;
+    }
+    get_system_time(&now);
+    nworkers = adaptor->nworkers;
+    for (i = 0; i < (nworkers ? nworkers : 1) && i < *count; i++) {
+        struct completion_worker *w =
+            nworkers ? &adaptor->workers[i] : &adaptor->strict;
+        stats[i] = w->stats;
+        stats[i].elapsed_usec = ((int64_t)(now.tv_sec - w->started.tv_sec)) * 1000000 +
+            (now.tv_usec - w->started.tv_usec);
+    }
+    *count = nworkers ? nworkers : 1;
+    return ZOK;
+}
+
 int32_t inc_ref_counter(zhandle_t* zh,int i)
 {
     int incr=(i<0?-1:(i>0?1:0));
@@ -502,6 +1454,15 @@ int32_t fetch_and_add(volatile int32_t* operand, int incr)
 #endif
 }
 
+void *compare_and_swap_ptr(void *volatile *operand, void *expected, void *value)
+{
+#ifndef WIN32
+    return __sync_val_compare_and_swap(operand, expected, value);
+#else
+    return InterlockedCompareExchangePointer(operand, value, expected);
+#endif
+}
+
 // make sure the static xid is initialized before any threads started
 __attribute__((constructor)) int32_t get_xid()
 {
@@ -525,6 +1486,45 @@ void unlock_reconfig(struct _zhandle *zh)
         pthread_mutex_unlock(&adaptor->reconfig_lock);
 }
 
+void lock_watchers(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_lock(&adaptor->watchers_lock);
+}
+void unlock_watchers(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_unlock(&adaptor->watchers_lock);
+}
+
+void lock_stats(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_lock(&adaptor->stats_lock);
+}
+void unlock_stats(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_unlock(&adaptor->stats_lock);
+}
+
+void lock_trace(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_lock(&adaptor->trace_lock);
+}
+void unlock_trace(struct _zhandle *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if(adaptor)
+        pthread_mutex_unlock(&adaptor->trace_lock);
+}
+
 void enter_critical(zhandle_t* zh)
 {
     struct adaptor_threads *adaptor = zh->adaptor_priv;
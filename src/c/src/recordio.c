@@ -39,6 +39,31 @@ void deallocate_Buffer(struct buffer *b)
     b->buff = 0;
 }
 
+int32_t sizeof_Bool(const int32_t *v)
+{
+    return 1;
+}
+
+int32_t sizeof_Int(const int32_t *v)
+{
+    return sizeof(*v);
+}
+
+int32_t sizeof_Long(const int64_t *v)
+{
+    return sizeof(*v);
+}
+
+int32_t sizeof_Buffer(const struct buffer *b)
+{
+    return sizeof(b->len) + (b->len > 0 ? b->len : 0);
+}
+
+int32_t sizeof_String(char **s)
+{
+    return sizeof(int32_t) + (*s ? strlen(*s) : 0);
+}
+
 struct buff_struct {
     int32_t len;
     int32_t off;
@@ -255,6 +280,24 @@ int ia_deserialize_buffer(struct iarchive *ia, const char *name,
     priv->off += b->len;
     return 0;
 }
+int ia_deserialize_buffer_ref(struct iarchive *ia, const char *name,
+        struct buffer *b)
+{
+    struct buff_struct *priv = ia->priv;
+    int rc = ia_deserialize_int(ia, "len", &b->len);
+    if (rc < 0)
+        return rc;
+    if (b->len == -1) {
+       b->buff = NULL;
+       return rc;
+    }
+    if (b->len < 0 || (priv->len - priv->off) < b->len) {
+        return -E2BIG;
+    }
+    b->buff = priv->buffer+priv->off;
+    priv->off += b->len;
+    return 0;
+}
 int ia_deserialize_string(struct iarchive *ia, const char *name, char **s)
 {
     struct buff_struct *priv = ia->priv;
@@ -300,43 +343,75 @@ static struct oarchive oa_default = {
         oa_serialize_buffer,
         oa_serialize_string};
 
-struct iarchive *create_buffer_iarchive(char *buffer, int len)
+/* an archive and the state of its buffer, allocated together */
+struct buff_archive {
+    union {
+        struct iarchive ia;
+        struct oarchive oa;
+    } a;
+    struct buff_struct buff;
+};
+
+size_t buffer_archive_size(void)
+{
+    return sizeof(struct buff_archive);
+}
+
+struct iarchive *init_buffer_iarchive(void *storage, char *buffer, int len)
 {
-    struct iarchive *ia = malloc(sizeof(*ia));
-    struct buff_struct *buff = malloc(sizeof(struct buff_struct));
-    if (!ia) return 0;
-    if (!buff) {
-        free(ia);
+    struct buff_archive *ba = storage;
+    ba->a.ia = ia_default;
+    ba->buff.off = 0;
+    ba->buff.buffer = buffer;
+    ba->buff.len = len;
+    ba->a.ia.priv = &ba->buff;
+    return &ba->a.ia;
+}
+
+struct oarchive *init_sized_buffer_oarchive(void *storage, int32_t size)
+{
+    struct buff_archive *ba = storage;
+    if (size <= 0) {
+        /* resize_buffer() only grows a buffer by doubling it */
+        size = 128;
+    }
+    ba->buff.buffer = malloc(size);
+    if (!ba->buff.buffer) {
         return 0;
     }
-    *ia = ia_default;
-    buff->off = 0;
-    buff->buffer = buffer;
-    buff->len = len;
-    ia->priv = buff;
-    return ia;
+    ba->a.oa = oa_default;
+    ba->buff.off = 0;
+    ba->buff.len = size;
+    ba->a.oa.priv = &ba->buff;
+    return &ba->a.oa;
+}
+
+struct oarchive *init_buffer_oarchive(void *storage)
+{
+    return init_sized_buffer_oarchive(storage, 128);
+}
+
+struct iarchive *create_buffer_iarchive(char *buffer, int len)
+{
+    struct buff_archive *ba = malloc(sizeof(*ba));
+    if (!ba) return 0;
+    return init_buffer_iarchive(ba, buffer, len);
 }
 
 struct oarchive *create_buffer_oarchive()
 {
-    struct oarchive *oa = malloc(sizeof(*oa));
-    struct buff_struct *buff = malloc(sizeof(struct buff_struct));
-    if (!oa) return 0;
-    if (!buff) {
-        free(oa);
-        return 0;
+    struct buff_archive *ba = malloc(sizeof(*ba));
+    struct oarchive *oa;
+    if (!ba) return 0;
+    oa = init_buffer_oarchive(ba);
+    if (!oa) {
+        free(ba);
     }
-    *oa = oa_default;
-    buff->off = 0;
-    buff->buffer = malloc(128);
-    buff->len = 128;
-    oa->priv = buff;
     return oa;
 }
 
 void close_buffer_iarchive(struct iarchive **ia)
 {
-    free((*ia)->priv);
     free(*ia);
     *ia = 0;
 }
@@ -349,7 +424,6 @@ void close_buffer_oarchive(struct oarchive **oa, int free_buffer)
             free(buff->buffer);
         }
     }
-    free((*oa)->priv);
     free(*oa);
     *oa = 0;
 }
@@ -0,0 +1,186 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark of request serialization: serializes a multi request of 200
+ * creates and sets and a create of 1MB of data into buffer oarchives, first
+ * into ones that start at the default size and grow, then into ones sized by
+ * the sizeof_ functions. Reports the time and, with glibc, the allocations
+ * per request. No server is needed.
+ *
+ * usage: serialize_bench [requests]   (10000 by default)
+ */
+
+#include <zookeeper.h>
+#include <proto.h>
+#include "zookeeper.jute.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MULTI_OPS 200
+#define LARGE_DATA (1024 * 1024)
+
+static long allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static char data[LARGE_DATA];
+static char paths[MULTI_OPS][64];
+
+/* serializes a request into oa and returns its length, or only returns the
+ * length it will have if oa is 0 */
+typedef int32_t (*serializer_t)(struct oarchive *oa);
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void multi_op(int i, struct MultiHeader *mh, struct CreateRequest *create,
+        struct SetDataRequest *set)
+{
+    mh->type = i % 2 ? ZOO_SETDATA_OP : ZOO_CREATE_OP;
+    mh->done = 0;
+    mh->err = -1;
+    create->path = paths[i];
+    create->data.buff = data;
+    create->data.len = 100 + i;
+    create->acl = ZOO_OPEN_ACL_UNSAFE;
+    create->flags = 0;
+    set->path = paths[i];
+    set->data.buff = data;
+    set->data.len = 100 + i;
+    set->version = -1;
+}
+
+static int32_t multi_request(struct oarchive *oa)
+{
+    struct RequestHeader h = {1, ZOO_MULTI_OP};
+    struct MultiHeader mh, end = {-1, 1, -1};
+    struct CreateRequest create;
+    struct SetDataRequest set;
+    int32_t size = 0;
+    int i;
+
+    if (!oa) {
+        size = sizeof_RequestHeader(&h) + sizeof_MultiHeader(&end);
+        for (i = 0; i < MULTI_OPS; i++) {
+            multi_op(i, &mh, &create, &set);
+            size += sizeof_MultiHeader(&mh) + (mh.type == ZOO_CREATE_OP ?
+                    sizeof_CreateRequest(&create) : sizeof_SetDataRequest(&set));
+        }
+        return size;
+    }
+    serialize_RequestHeader(oa, "header", &h);
+    for (i = 0; i < MULTI_OPS; i++) {
+        multi_op(i, &mh, &create, &set);
+        serialize_MultiHeader(oa, "multiheader", &mh);
+        if (mh.type == ZOO_CREATE_OP) {
+            serialize_CreateRequest(oa, "req", &create);
+        } else {
+            serialize_SetDataRequest(oa, "req", &set);
+        }
+    }
+    serialize_MultiHeader(oa, "multiheader", &end);
+    return get_buffer_len(oa);
+}
+
+static int32_t large_request(struct oarchive *oa)
+{
+    struct RequestHeader h = {1, ZOO_CREATE_OP};
+    struct CreateRequest req;
+
+    req.path = paths[0];
+    req.data.buff = data;
+    req.data.len = LARGE_DATA;
+    req.acl = ZOO_OPEN_ACL_UNSAFE;
+    req.flags = 0;
+    if (!oa) {
+        return sizeof_RequestHeader(&h) + sizeof_CreateRequest(&req);
+    }
+    serialize_RequestHeader(oa, "header", &h);
+    serialize_CreateRequest(oa, "req", &req);
+    return get_buffer_len(oa);
+}
+
+static int run(const char *what, serializer_t request, int sized, int n)
+{
+    void *storage = malloc(buffer_archive_size());
+    int32_t size = request(0);
+    long allocated;
+    double start, elapsed;
+    int i;
+
+    allocated = allocations;
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        struct oarchive *oa = sized ?
+            init_sized_buffer_oarchive(storage, size) :
+            init_buffer_oarchive(storage);
+        if (!oa || request(oa) != size) {
+            fprintf(stderr, "%s: serialized size differs from %d\n", what,
+                    size);
+            return 1;
+        }
+        free(get_buffer(oa));
+    }
+    elapsed = now_us() - start;
+    printf("%-14s %8d bytes %10.1f ns/request", what, size,
+            elapsed * 1000.0 / n);
+#ifdef __GLIBC__
+    printf(" %6.1f allocations/request",
+            (double)(allocations - allocated) / n);
+#endif
+    printf("\n");
+    free(storage);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 10000;
+    int i;
+
+    for (i = 0; i < MULTI_OPS; i++) {
+        sprintf(paths[i], "/bench/app/node-%07d", i);
+    }
+    memset(data, 'x', sizeof(data));
+    return run("multi", multi_request, 0, n) ||
+        run("multi sized", multi_request, 1, n) ||
+        run("large", large_request, 0, n / 100 + 1) ||
+        run("large sized", large_request, 1, n / 100 + 1);
+}
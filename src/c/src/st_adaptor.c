@@ -36,6 +36,12 @@ void lock_buffer_list(buffer_head_t *l)
 void unlock_buffer_list(buffer_head_t *l)
 {
 }
+void lock_pool(zk_pool_t *p)
+{
+}
+void unlock_pool(zk_pool_t *p)
+{
+}
 void lock_completion_list(completion_head_t *l)
 {
 }
@@ -65,6 +71,12 @@ int process_async(int outstanding_sync)
     return outstanding_sync == 0;
 }
 
+int completion_key(zhandle_t *zh, const char *path, const void *data)
+{
+    // completions always run on the thread calling zookeeper_process()
+    return 0;
+}
+
 int adaptor_init(zhandle_t *zh)
 {
     return 0;
@@ -87,6 +99,22 @@ int32_t inc_ref_counter(zhandle_t* zh,int i)
     return zh->ref_counter;
 }
 
+int32_t fetch_and_add(volatile int32_t* operand, int incr)
+{
+    int32_t result = *operand;
+    *operand += incr;
+    return result;
+}
+
+void *compare_and_swap_ptr(void *volatile *operand, void *expected, void *value)
+{
+    void *result = *operand;
+    if (result == expected) {
+        *operand = value;
+    }
+    return result;
+}
+
 int32_t get_xid()
 {
     static int32_t xid = -1;
@@ -98,6 +126,12 @@ int32_t get_xid()
 
 void lock_reconfig(struct _zhandle *zh){}
 void unlock_reconfig(struct _zhandle *zh){}
+void lock_watchers(struct _zhandle *zh){}
+void unlock_watchers(struct _zhandle *zh){}
+void lock_stats(struct _zhandle *zh){}
+void unlock_stats(struct _zhandle *zh){}
+void lock_trace(struct _zhandle *zh){}
+void unlock_trace(struct _zhandle *zh){}
 
 void enter_critical(zhandle_t* zh){}
 void leave_critical(zhandle_t* zh){}
@@ -0,0 +1,131 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark of the client watcher tables: registers a watch on each of
+ * N paths, looks them up, walks them the way SetWatches does and fires them.
+ * Runs against the internal library, no server is needed.
+ *
+ * usage: watch_bench [paths]   (1000000 by default)
+ */
+
+#include <zookeeper.h>
+#include "zk_adaptor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define PATH_FORMAT "/bench/app/node-%07d"
+
+static int fired;
+
+static void watcher(zhandle_t *zh, int type, int state, const char *path,
+        void *ctx)
+{
+    fired++;
+}
+
+static int count_path(const char *path, void *ctx)
+{
+    (*(int *)ctx)++;
+    return 0;
+}
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void report(const char *what, double start, int n)
+{
+    double elapsed = now_us() - start;
+    printf("%-10s %10.0f us %8.1f ns/path\n", what, elapsed,
+            elapsed * 1000.0 / n);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    char path[64];
+    watcher_registration_t reg;
+    zhandle_t *zh;
+    long rss;
+    double start;
+    int i, found = 0, walked = 0;
+
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    /* never connects, only its watcher tables are used */
+    zh = zookeeper_init("127.0.0.1:1", 0, 30000, 0, 0, 0);
+    if (!zh) {
+        fprintf(stderr, "zookeeper_init failed\n");
+        return 1;
+    }
+    reg.watcher = watcher;
+    reg.context = 0;
+    reg.checker = data_result_checker;
+    reg.path = path;
+
+    rss = max_rss_kb();
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        sprintf(path, PATH_FORMAT, i);
+        activateWatcher(zh, &reg, ZOK);
+    }
+    report("insert", start, n);
+    printf("%-10s %10.1f bytes/path\n", "memory",
+            (max_rss_kb() - rss) * 1024.0 / n);
+
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        sprintf(path, PATH_FORMAT, i);
+        found += pathHasWatcher(zh, path, ZWATCHERTYPE_DATA, watcher, 0);
+    }
+    report("lookup", start, n);
+
+    start = now_us();
+    for_each_watched_path(zh->active_node_watchers, count_path, &walked);
+    report("iterate", start, n);
+
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        watcher_object_list_t *list;
+        sprintf(path, PATH_FORMAT, i);
+        list = collectWatchers(zh, ZOO_CHANGED_EVENT, path);
+        deliverWatchers(zh, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, path,
+                &list);
+    }
+    report("fire", start, n);
+
+    zookeeper_close(zh);
+    if (found != n || walked != n || fired != n) {
+        fprintf(stderr, "found %d, walked %d, fired %d of %d watches\n",
+                found, walked, fired, n);
+        return 1;
+    }
+    return 0;
+}
@@ -28,6 +28,9 @@
 #endif
 #include "zookeeper.h"
 #include "zk_hashtable.h"
+#include "zk_cache.h"
+#include "zk_stats.h"
+#include "zk_timer.h"
 #include "addrvec.h"
 
 /* predefined xid's values recognized as special by the server */
@@ -35,6 +38,8 @@
 #define PING_XID -2
 #define AUTH_XID -4
 #define SET_WATCHES_XID -8
+/* placeholder of requests submitted by API calls, see submit_request() */
+#define UNASSIGNED_XID 0
 
 /* zookeeper state constants */
 #define EXPIRED_SESSION_STATE_DEF -112
@@ -77,8 +82,35 @@ typedef struct _completion_head {
 #endif
 } completion_head_t;
 
+/* the lanes in which submitted requests wait for to_send, highest priority
+ * first; control packets (pings, auth, set watches and close) are queued on
+ * to_send directly, ahead of both */
+#define LANE_INTERACTIVE 0
+#define LANE_BULK 1
+#define LANE_COUNT 2
+
+/* the requests waiting in a lane, oldest first */
+typedef struct _request_lane {
+    struct _completion_list *head;
+    struct _completion_list *last;
+    int count;
+} request_lane_t;
+
+/* a free list of fixed-size objects owned by a handle */
+typedef struct _zk_pool {
+    struct _pool_object *free;          // idle objects, most recently released first
+    size_t size;                        // size of the objects handed out
+    int max_idle;                       // idle objects kept before freeing to the system
+    zoo_pool_stats_t stats;
+#ifdef THREADED
+    pthread_mutex_t lock;
+#endif
+} zk_pool_t;
+
 void lock_buffer_list(buffer_head_t *l);
 void unlock_buffer_list(buffer_head_t *l);
+void lock_pool(zk_pool_t *p);
+void unlock_pool(zk_pool_t *p);
 void lock_completion_list(completion_head_t *l);
 void unlock_completion_list(completion_head_t *l);
 
@@ -128,6 +160,15 @@ typedef struct _buffer_list {
     char *buffer;
     int len; /* This represents the length of sizeof(header) + length of buffer */
     int curr_offset; /* This is the offset into the header followed by offset into the buffer */
+    int64_t submitted; /* us when the API call queued the request, 0 for other packets */
+    struct _completion_list *traced; /* the request whose packet this is, if traced */
+    /* data sent in place of payload_len bytes at payload_off of the packet,
+     * which buffer lacks; see zoo_aop_set_buffer_ref() */
+    const char *payload;
+    int payload_off;
+    int payload_len;
+    zoo_buffer_release_fn release;
+    void *release_context;
     struct _buffer_list *next;
 } buffer_list_t;
 
@@ -156,6 +197,20 @@ struct prime_struct {
 }; 
 
 #ifdef THREADED
+struct reactor_io;
+
+/* a thread running completions of a handle, see zoo_set_completion_workers() */
+struct completion_worker {
+     pthread_t thread;
+     struct _zhandle *zh;
+     completion_head_t queue;       // completions handed to the thread
+     completion_head_t pending;     // completions being dispatched to it
+     int dispatched;                // entries in pending
+     int stop;                      // guarded by queue.lock
+     struct timeval started;        // when the thread started
+     zoo_completion_stats_t stats;
+};
+
 /* this is used by mt_adaptor internally for thread management */
 struct adaptor_threads {
      pthread_t io;
@@ -165,11 +220,31 @@ struct adaptor_threads {
      pthread_mutex_t lock;          // ... and a lock
      pthread_mutex_t zh_lock;       // critical section lock
      pthread_mutex_t reconfig_lock; // lock for reconfiguring cluster's ensemble
+     pthread_mutex_t watchers_lock; // guards the watcher tables and the cache
+     pthread_mutex_t stats_lock;    // guards the request statistics
+     pthread_mutex_t trace_lock;    // guards the trace hooks
 #ifdef WIN32
      SOCKET self_pipe[2];
 #else
      int self_pipe[2];
 #endif
+     /* used instead of the threads above by ZOO_SHARED_REACTOR handles */
+     struct reactor_io *reactor;    // shared I/O thread driving the handle
+     int reactor_fd;                // socket registered with the I/O thread
+     int reactor_probe_fd;          // r/w server probe registered with it
+     int reactor_revents;           // ZOOKEEPER_READ/WRITE events to process
+     volatile int reactor_wakeup;   // set by wakeup_io_thread()
+     int reactor_detached;          // the I/O thread has released the handle
+     struct timeval reactor_deadline; // when zookeeper_interest() is due
+     int completion_state;          // COMPLETION_* bits, see mt_adaptor.c
+     pthread_t completion_thread;   // shared thread running the completions
+     struct _zhandle *reactor_next; // next handle of the same I/O thread
+     struct _zhandle *run_next;     // next handle with completions to run
+     /* completions run by the completion thread or handed to workers */
+     struct completion_worker strict; // the completion thread itself
+     struct completion_worker *workers; // started by zoo_set_completion_workers()
+     volatile int nworkers;         // set once the workers are running
+     completion_key_fn completion_key; // with ZOO_COMPLETION_ORDER_KEY
 };
 #endif
 
@@ -181,6 +256,57 @@ typedef struct _auth_list_head {
 #endif
 } auth_list_head_t;
 
+/* server responses received ahead of being split into packets */
+typedef struct _recv_ahead {
+    char *buffer;
+    int len;                            // allocated size of buffer
+    int start;                          // offset of the first unconsumed byte
+    int end;                            // offset past the last received byte
+} recv_ahead_t;
+
+/* states of the probe looking for a read/write server in read-only mode */
+#define RW_PROBE_IDLE 0
+#define RW_PROBE_CONNECTING 1
+#define RW_PROBE_SENDING 2
+#define RW_PROBE_RECEIVING 3
+
+/* the round trip times measured to a server address */
+typedef struct _server_rtt {
+    struct sockaddr_storage addr;
+    zoo_server_rtt_t rtt;               // the server field is filled on output
+} server_rtt_t;
+
+/* connections to the next servers racing the one being established */
+typedef struct _connect_race {
+    int active;                         // the race is running
+    int left;                           // connections still to start
+    int count;                          // connections in flight
+    struct timeval next_start;          // when the next connection starts
+    struct {
+#ifdef WIN32
+        SOCKET fd;
+#else
+        int fd;
+#endif
+        struct sockaddr_storage addr;
+    } racers[ZOO_MAX_CONNECT_RACE - 1];
+} connect_race_t;
+
+/* a non-blocking "isro" request to the next server in the list */
+typedef struct _rw_probe {
+#ifdef WIN32
+    SOCKET fd;
+#else
+    int fd;
+#endif
+    int state;
+    int sent;                           // bytes of the request sent so far
+    int received;                       // bytes of the reply received so far
+    char reply[4];
+    struct sockaddr_storage addr;       // the server being probed
+    struct timeval deadline;            // when the probe is given up
+} rw_probe_t;
+
 /**
  * This structure represents the connection to zookeeper.
  */
@@ -202,6 +328,32 @@ struct _zhandle {
     int reconfig;                       // Are we in the process of reconfiguring cluster's ensemble
     double pOld, pNew;                  // Probability for selecting between 'addrs_old' and 'addrs_new'
     int delay;
+    struct timeval reconnect_at;        // no connection attempt before this time
+
+    // Reconnect backoff, guarded by lock_reconfig()
+    int backoff_spread;                 // ms over which the first attempt is spread
+    int backoff_base;                   // ms of the first backoff, 0 disables it
+    int backoff_max;                    // cap of the backoff in ms
+    int backoff_passes;                 // failed passes since the last handshake
+    int race_width;                     // servers connected to at once
+    int race_stagger;                   // ms between the racing connects
+    connect_race_t connect_race;        // the racing connections, if any
+    struct timeval connect_started;     // first attempt of the current outage
+
+    // Round trip times per server, guarded by lock_reconfig()
+    server_rtt_t *rtts;
+    int rtt_count;
+    int rtt_capacity;
+    int prefer_latency;                 // rank the servers by round trip time
+    int latency_floor;                  // us under which rtts are equal
+    struct timeval handshake_sent;      // when the ConnectRequest was sent
+    zoo_connect_stats_t connect_stats;  // connection counters
+    struct timeval disconnected_since;  // start of the current outage, if any
+
+    // Resolved address cache
+    int resolve_ttl;                    // ms to reuse addrs before resolving hostname again
+    struct timeval last_resolve;        // time hostname was last resolved
+    zoo_resolve_stats_t resolve_stats;  // resolution counters
 
     watcher_fn watcher;                 // the registered watcher
 
@@ -214,15 +366,30 @@ struct _zhandle {
 
     // Buffers
     buffer_list_t *input_buffer;        // current buffer being read in
+    recv_ahead_t recv_ahead;            // read-ahead buffer for server responses
     buffer_head_t to_process;           // buffers that have been read and ready to be processed
     buffer_head_t to_send;              // packets queued to send
+    struct _completion_list *volatile submitted; // requests of API calls not queued yet, newest first
+    int32_t xid;                        // next xid, guarded by the to_send lock
+    request_lane_t lanes[LANE_COUNT];   // requests waiting for to_send, guarded by its lock
+    int lane_burst;                     // interactive requests queued while bulk ones wait
+    int priority_reads;                 // set by zoo_set_priority_reads()
     completion_head_t sent_requests;    // outstanding requests
+    zk_timer_wheel_t deadlines;         // of sent_requests, guarded by its lock
+    int request_timeout;                // ms, set by zoo_set_request_timeout(), guarded by lock_reconfig()
     completion_head_t completions_to_process; // completions that are ready to run
     int outstanding_sync;               // number of outstanding synchronous requests
+    zoo_io_stats_t io_stats;            // socket I/O counters
+    zk_stats_t stats;                   // request latencies, guarded by lock_stats()
+    zoo_trace_hooks_t trace_hooks;      // set by zoo_set_trace_hooks(), guarded by lock_trace()
+    int slow_request_ms;                // set by zoo_set_slow_request_log(), guarded by lock_trace()
+    int tracing;                        // requests are tracked for either
+    zk_pool_t pools[ZOO_POOL_COUNT];    // recycled completions, buffers, archives and watchers
 
     /* read-only mode specific fields */
     struct timeval last_ping_rw; /* The last time we checked server for being r/w */
     int ping_rw_timeout; /* The time that can go by before checking next server */
+    rw_probe_t rw_probe; /* The probe of the next server, if one is running */
 
     // State info
     volatile int state;                 // Current zookeeper state
@@ -254,12 +421,19 @@ struct _zhandle {
     zk_hashtable* active_node_watchers;   
     zk_hashtable* active_exist_watchers;
     zk_hashtable* active_child_watchers;
+    zk_cache_t *cache;                  // created by zoo_set_cache()
+    zoo_rewatch_stats_t rewatch_stats;  // guarded by lock_watchers()
+    struct timeval rewatch_started;     // when the SetWatches were queued
 
     /** used for chroot path at the client side **/
     char *chroot;
 
     /** Indicates if this client is allowed to go to r/o mode */
     char allow_read_only;
+    /** Indicates if the handle is driven by the shared reactor */
+    char shared_reactor;
+    /** Indicates if API calls may send their requests themselves */
+    char direct_send;
     /** Indicates if we connected to a majority server before */
     char seen_rw_server_before;
 };
@@ -268,6 +442,9 @@ struct _zhandle {
 int adaptor_init(zhandle_t *zh);
 void adaptor_finish(zhandle_t *zh);
 void adaptor_destroy(zhandle_t *zh);
+#ifndef WIN32
+int rw_probe_interest(zhandle_t *zh, int *fd, int *interest);
+#endif
 struct sync_completion *alloc_sync_completion(void);
 int wait_sync_completion(struct sync_completion *sc);
 void free_sync_completion(struct sync_completion *sc);
@@ -275,7 +452,16 @@ void notify_sync_completion(struct sync_completion *sc);
 int adaptor_send_queue(zhandle_t *zh, int timeout);
 int process_async(int outstanding_sync);
 void process_completions(zhandle_t *zh);
+void process_completion(zhandle_t *zh, struct _completion_list *cptr);
+int completion_key(zhandle_t *zh, const char *path, const void *data);
+int get_completion_key(struct _completion_list *cptr);
+struct _completion_list *dequeue_completion_nolock(completion_head_t *list);
+void queue_completion_nolock(completion_head_t *list,
+        struct _completion_list *c, int add_to_front);
+void queue_completion_batch(completion_head_t *list, completion_head_t *batch);
 int flush_send_queue(zhandle_t*zh, int timeout);
+int send_queue_directly(zhandle_t *zh);
+void get_system_time(struct timeval *tv);
 char* sub_string(zhandle_t *zh, const char* server_path);
 void free_duplicate_path(const char* free_path, const char* path);
 void zoo_lock_auth(zhandle_t *zh);
@@ -285,6 +471,19 @@ void zoo_unlock_auth(zhandle_t *zh);
 void lock_reconfig(struct _zhandle *zh);
 void unlock_reconfig(struct _zhandle *zh);
 
+// watcher tables and node cache access guards
+void lock_watchers(struct _zhandle *zh);
+void unlock_watchers(struct _zhandle *zh);
+
+// request statistics access guards
+void lock_stats(struct _zhandle *zh);
+void unlock_stats(struct _zhandle *zh);
+
+// trace hooks and slow request log access guards, taken inside any other
+// lock and never held while a hook runs
+void lock_trace(struct _zhandle *zh);
+void unlock_trace(struct _zhandle *zh);
+
 // critical section guards
 void enter_critical(zhandle_t* zh);
 void leave_critical(zhandle_t* zh);
@@ -297,9 +496,13 @@ int32_t get_xid();
 // returns the new value of the ref counter
 int32_t inc_ref_counter(zhandle_t* zh,int i);
 
-#ifdef THREADED
 // atomic post-increment
 int32_t fetch_and_add(volatile int32_t* operand, int incr);
+
+// atomic compare-and-swap, returns the previous value
+void *compare_and_swap_ptr(void *volatile *operand, void *expected, void *value);
+
+#ifdef THREADED
 // in mt mode process session event asynchronously by the completion thread
 #define PROCESS_SESSION_EVENT(zh,newstate) queue_session_event(zh,newstate)
 #else
@@ -0,0 +1,349 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zk_cache.h"
+#include "hashtable/hashtable.h"
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct _zk_cache_entry {
+    char *path;                 /* the key, freed by the hashtable */
+    int has_data;
+    struct buffer data;
+    struct Stat data_stat;
+    int has_children;
+    struct String_vector children;
+    struct Stat children_stat;
+    size_t bytes;               /* charged against the budget */
+    struct _zk_cache_entry *prev; /* more recently used */
+    struct _zk_cache_entry *next; /* less recently used */
+} zk_cache_entry_t;
+
+struct _zk_cache {
+    struct hashtable *ht;
+    zk_cache_entry_t *head;     /* most recently used */
+    zk_cache_entry_t *tail;     /* evicted first */
+    size_t max_bytes;
+    zoo_cache_stats_t stats;
+};
+
+static unsigned int string_hash_djb2(void *str)
+{
+    unsigned int hash = 5381;
+    int c;
+    const char* cstr = (const char*)str;
+    while ((c = *cstr++))
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+    return hash;
+}
+
+static int string_equal(void *key1,void *key2)
+{
+    return strcmp((const char*)key1,(const char*)key2)==0;
+}
+
+zk_cache_t *create_zk_cache(size_t max_bytes)
+{
+    zk_cache_t *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return 0;
+    }
+    cache->ht = create_hashtable(32, string_hash_djb2, string_equal);
+    if (!cache->ht) {
+        free(cache);
+        return 0;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+static void unlink_entry(zk_cache_t *cache, zk_cache_entry_t *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+    e->prev = e->next = 0;
+}
+
+static void link_entry(zk_cache_t *cache, zk_cache_entry_t *e)
+{
+    e->prev = 0;
+    e->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = e;
+    } else {
+        cache->tail = e;
+    }
+    cache->head = e;
+}
+
+static void drop_data(zk_cache_entry_t *e)
+{
+    if (e->has_data) {
+        free(e->data.buff);
+        e->data.buff = 0;
+        e->has_data = 0;
+    }
+}
+
+static void drop_children(zk_cache_entry_t *e)
+{
+    if (e->has_children) {
+        deallocate_String_vector(&e->children);
+        e->has_children = 0;
+    }
+}
+
+static size_t entry_bytes(const zk_cache_entry_t *e)
+{
+    size_t bytes = sizeof(*e) + strlen(e->path) + 1;
+    int i;
+    if (e->has_data && e->data.len > 0) {
+        bytes += e->data.len;
+    }
+    if (e->has_children) {
+        for (i = 0; i < e->children.count; i++) {
+            bytes += sizeof(char*) + strlen(e->children.data[i]) + 1;
+        }
+    }
+    return bytes;
+}
+
+static void remove_entry(zk_cache_t *cache, zk_cache_entry_t *e)
+{
+    unlink_entry(cache, e);
+    cache->stats.bytes -= e->bytes;
+    cache->stats.entries--;
+    drop_data(e);
+    drop_children(e);
+    /* frees the path as well */
+    hashtable_remove(cache->ht, e->path);
+    free(e);
+}
+
+/* recharges an entry after one of its parts changed */
+static void update_entry(zk_cache_t *cache, zk_cache_entry_t *e)
+{
+    if (!e->has_data && !e->has_children) {
+        remove_entry(cache, e);
+        return;
+    }
+    cache->stats.bytes -= e->bytes;
+    e->bytes = entry_bytes(e);
+    cache->stats.bytes += e->bytes;
+}
+
+static void evict(zk_cache_t *cache, size_t max_bytes)
+{
+    while (cache->tail && (size_t)cache->stats.bytes > max_bytes) {
+        remove_entry(cache, cache->tail);
+        cache->stats.evictions++;
+    }
+}
+
+/* finds or creates the entry of a path and marks it most recently used */
+static zk_cache_entry_t *use_entry(zk_cache_t *cache, const char *path)
+{
+    zk_cache_entry_t *e = hashtable_search(cache->ht, (void*)path);
+    if (e) {
+        unlink_entry(cache, e);
+        link_entry(cache, e);
+        return e;
+    }
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        return 0;
+    }
+    e->path = strdup(path);
+    if (!e->path || !hashtable_insert(cache->ht, e->path, e)) {
+        free(e->path);
+        free(e);
+        return 0;
+    }
+    link_entry(cache, e);
+    cache->stats.entries++;
+    return e;
+}
+
+static void fit_entry(zk_cache_t *cache, zk_cache_entry_t *e)
+{
+    update_entry(cache, e);
+    /* an entry larger than the whole budget would evict everything else */
+    if (e->bytes > cache->max_bytes) {
+        remove_entry(cache, e);
+        cache->stats.evictions++;
+        return;
+    }
+    evict(cache, cache->max_bytes);
+}
+
+void zk_cache_put_data(zk_cache_t *cache, const char *path,
+        struct buffer *data, const struct Stat *stat)
+{
+    zk_cache_entry_t *e = cache->max_bytes ? use_entry(cache, path) : 0;
+    if (!e) {
+        free(data->buff);
+        data->buff = 0;
+        return;
+    }
+    drop_data(e);
+    e->data = *data;
+    e->data_stat = *stat;
+    e->has_data = 1;
+    data->buff = 0;
+    fit_entry(cache, e);
+}
+
+void zk_cache_put_children(zk_cache_t *cache, const char *path,
+        struct String_vector *children, const struct Stat *stat)
+{
+    zk_cache_entry_t *e = cache->max_bytes ? use_entry(cache, path) : 0;
+    if (!e) {
+        deallocate_String_vector(children);
+        return;
+    }
+    drop_children(e);
+    e->children = *children;
+    e->children_stat = *stat;
+    e->has_children = 1;
+    children->count = 0;
+    children->data = 0;
+    fit_entry(cache, e);
+}
+
+int zk_cache_get_data(zk_cache_t *cache, const char *path, char *buffer,
+        int *buffer_len, struct Stat *stat)
+{
+    zk_cache_entry_t *e;
+    int len;
+    if (!cache->max_bytes) {
+        return 0;
+    }
+    e = hashtable_search(cache->ht, (void*)path);
+    if (!e || !e->has_data) {
+        cache->stats.misses++;
+        return 0;
+    }
+    unlink_entry(cache, e);
+    link_entry(cache, e);
+    len = e->data.len < *buffer_len ? e->data.len : *buffer_len;
+    if (len > 0) {
+        memcpy(buffer, e->data.buff, len);
+    }
+    *buffer_len = len;
+    if (stat) {
+        *stat = e->data_stat;
+    }
+    cache->stats.hits++;
+    return 1;
+}
+
+int zk_cache_get_children(zk_cache_t *cache, const char *path,
+        struct String_vector *children, struct Stat *stat)
+{
+    zk_cache_entry_t *e;
+    int i;
+    if (!cache->max_bytes) {
+        return 0;
+    }
+    e = hashtable_search(cache->ht, (void*)path);
+    if (!e || !e->has_children) {
+        cache->stats.misses++;
+        return 0;
+    }
+    if (children) {
+        if (allocate_String_vector(children, e->children.count) < 0 ||
+                (e->children.count && !children->data)) {
+            cache->stats.misses++;
+            return 0;
+        }
+        for (i = 0; i < e->children.count; i++) {
+            children->data[i] = strdup(e->children.data[i]);
+            if (!children->data[i]) {
+                deallocate_String_vector(children);
+                cache->stats.misses++;
+                return 0;
+            }
+        }
+    }
+    unlink_entry(cache, e);
+    link_entry(cache, e);
+    if (stat) {
+        *stat = e->children_stat;
+    }
+    cache->stats.hits++;
+    return 1;
+}
+
+void zk_cache_invalidate(zk_cache_t *cache, const char *path, int what)
+{
+    zk_cache_entry_t *e = hashtable_search(cache->ht, (void*)path);
+    if (!e) {
+        return;
+    }
+    if ((what & ZK_CACHE_DATA) && e->has_data) {
+        drop_data(e);
+        cache->stats.invalidations++;
+    }
+    if ((what & ZK_CACHE_CHILDREN) && e->has_children) {
+        drop_children(e);
+        cache->stats.invalidations++;
+    }
+    update_entry(cache, e);
+}
+
+void zk_cache_clear(zk_cache_t *cache)
+{
+    while (cache->head) {
+        cache->stats.invalidations += cache->head->has_data +
+            cache->head->has_children;
+        remove_entry(cache, cache->head);
+    }
+}
+
+void zk_cache_set_limit(zk_cache_t *cache, size_t max_bytes)
+{
+    cache->max_bytes = max_bytes;
+    evict(cache, max_bytes);
+}
+
+void zk_cache_get_stats(zk_cache_t *cache, zoo_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+    stats->max_bytes = cache->max_bytes;
+}
+
+void destroy_zk_cache(zk_cache_t *cache)
+{
+    if (cache == 0) {
+        return;
+    }
+    while (cache->head) {
+        remove_entry(cache, cache->head);
+    }
+    hashtable_destroy(cache->ht, 0);
+    free(cache);
+}
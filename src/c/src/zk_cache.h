@@ -0,0 +1,77 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_CACHE_H_
+#define ZK_CACHE_H_
+
+#include <zookeeper.h>
+#include <zookeeper.jute.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The node data and children received along with an armed watch, keyed by
+ * the server path. An entry is only valid until the watch fires, so the
+ * cache must be updated together with the watcher tables, under
+ * lock_watchers(). The least recently used entries are evicted to stay
+ * within the byte budget.
+ */
+typedef struct _zk_cache zk_cache_t;
+
+/* what to drop from an entry, see zk_cache_invalidate() */
+#define ZK_CACHE_DATA 1
+#define ZK_CACHE_CHILDREN 2
+
+zk_cache_t *create_zk_cache(size_t max_bytes);
+void destroy_zk_cache(zk_cache_t *cache);
+
+/* evicts entries until the cache fits the new budget; 0 empties it */
+void zk_cache_set_limit(zk_cache_t *cache, size_t max_bytes);
+
+/**
+ * Store the result of a watched GetData or GetChildren2 request. The cache
+ * takes ownership of data.buff and of the children vector.
+ */
+void zk_cache_put_data(zk_cache_t *cache, const char *path,
+        struct buffer *data, const struct Stat *stat);
+void zk_cache_put_children(zk_cache_t *cache, const char *path,
+        struct String_vector *children, const struct Stat *stat);
+
+/**
+ * Copy a cached entry out like the synchronous API does: the data is
+ * truncated to *buffer_len and the children are duplicated. Returns 1 on a
+ * hit and 0 on a miss.
+ */
+int zk_cache_get_data(zk_cache_t *cache, const char *path, char *buffer,
+        int *buffer_len, struct Stat *stat);
+int zk_cache_get_children(zk_cache_t *cache, const char *path,
+        struct String_vector *children, struct Stat *stat);
+
+/* drops the ZK_CACHE_* parts of the entry of a path */
+void zk_cache_invalidate(zk_cache_t *cache, const char *path, int what);
+void zk_cache_clear(zk_cache_t *cache);
+
+void zk_cache_get_stats(zk_cache_t *cache, zoo_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_CACHE_H_*/
@@ -18,10 +18,9 @@
 
 #include "zk_hashtable.h"
 #include "zk_adaptor.h"
-#include "hashtable/hashtable.h"
-#include "hashtable/hashtable_itr.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 
 typedef struct _watcher_object {
@@ -30,29 +29,203 @@ typedef struct _watcher_object {
     struct _watcher_object* next;
 } watcher_object_t;
 
+struct watcher_object_list {
+    watcher_object_t* head;
+};
+
+/*
+ * The watcher tables are open addressing hash tables with linear probing.
+ * Next to the entry pointers a separate array holds a one byte tag per
+ * slot: 0 for an empty slot, otherwise the top bits of the hash of the path
+ * with the high bit set. A probe scans these contiguous tags and only
+ * dereferences the entries whose tag matches. Removal shifts the following
+ * entries of the cluster back instead of leaving tombstones.
+ *
+ * Each watched path is a single allocation holding the path and the head
+ * of its watcher list. The table is never more than 3/4 full, so a probe
+ * always ends on an empty slot.
+ */
+#define INDEX_MIN_CAPACITY 32
+#define INDEX_EMPTY 0
+#define INDEX_TAG(hash) ((uint8_t)(0x80 | ((hash) >> 25)))
+#define INDEX_NO_SLOT ((uint32_t)-1)
+
+typedef struct _watched_path {
+    watcher_object_list_t watchers;
+    uint32_t hash;
+    char path[1];               /* allocated along with the entry */
+} watched_path_t;
 
 struct _zk_hashtable {
-    struct hashtable* ht;
+    uint32_t mask;              /* the capacity, a power of 2, minus 1 */
+    uint32_t count;             /* watched paths */
+    uint8_t *tags;
+    watched_path_t **entries;
 };
 
-struct watcher_object_list {
-    watcher_object_t* head;
-};
+static uint32_t hash_path(const char *path)
+{
+    /* FNV-1a, its low bits are well mixed enough to index the table */
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-/* the following functions are for testing only */
-typedef struct hashtable hashtable_impl;
+static uint32_t index_find_slot(zk_hashtable *ht, const char *path,
+        uint32_t hash)
+{
+    uint8_t tag = INDEX_TAG(hash);
+    uint32_t i = hash & ht->mask;
+
+    while (ht->tags[i] != INDEX_EMPTY) {
+        if (ht->tags[i] == tag && ht->entries[i]->hash == hash &&
+                strcmp(ht->entries[i]->path, path) == 0) {
+            return i;
+        }
+        i = (i + 1) & ht->mask;
+    }
+    return INDEX_NO_SLOT;
+}
+
+static watched_path_t *index_find(zk_hashtable *ht, const char *path)
+{
+    uint32_t i = index_find_slot(ht, path, hash_path(path));
+    return i == INDEX_NO_SLOT ? 0 : ht->entries[i];
+}
+
+static void index_place(zk_hashtable *ht, watched_path_t *wp)
+{
+    uint32_t i = wp->hash & ht->mask;
+    while (ht->tags[i] != INDEX_EMPTY) {
+        i = (i + 1) & ht->mask;
+    }
+    ht->tags[i] = INDEX_TAG(wp->hash);
+    ht->entries[i] = wp;
+}
+
+static int index_resize(zk_hashtable *ht, uint32_t capacity)
+{
+    uint8_t *tags = calloc(capacity, sizeof(*tags));
+    watched_path_t **entries = malloc(capacity * sizeof(*entries));
+    uint8_t *old_tags = ht->tags;
+    watched_path_t **old_entries = ht->entries;
+    uint32_t old_capacity = ht->mask + 1;
+    uint32_t i;
+
+    if (!tags || !entries) {
+        free(tags);
+        free(entries);
+        return -1;
+    }
+    ht->tags = tags;
+    ht->entries = entries;
+    ht->mask = capacity - 1;
+    for (i = 0; old_tags && i < old_capacity; i++) {
+        if (old_tags[i] != INDEX_EMPTY) {
+            index_place(ht, old_entries[i]);
+        }
+    }
+    free(old_tags);
+    free(old_entries);
+    return 0;
+}
+
+/* returns the entry of a path, adding it with no watchers if needed */
+static watched_path_t *index_add(zk_hashtable *ht, const char *path)
+{
+    uint32_t hash = hash_path(path);
+    uint32_t i = index_find_slot(ht, path, hash);
+    size_t len;
+    watched_path_t *wp;
+
+    if (i != INDEX_NO_SLOT) {
+        return ht->entries[i];
+    }
+    if ((ht->count + 1) * 4 > (ht->mask + 1) * 3 &&
+            index_resize(ht, (ht->mask + 1) * 2) != 0) {
+        return 0;
+    }
+    len = strlen(path);
+    wp = malloc(offsetof(watched_path_t, path) + len + 1);
+    if (!wp) {
+        return 0;
+    }
+    wp->watchers.head = 0;
+    wp->hash = hash;
+    memcpy(wp->path, path, len + 1);
+    index_place(ht, wp);
+    ht->count++;
+    return wp;
+}
+
+/* unlinks the entry of a path, the caller frees it */
+static watched_path_t *index_remove(zk_hashtable *ht, const char *path)
+{
+    uint32_t i = index_find_slot(ht, path, hash_path(path));
+    uint32_t j;
+    watched_path_t *wp;
 
-hashtable_impl* getImpl(zk_hashtable* ht){
-    return ht->ht;
+    if (i == INDEX_NO_SLOT) {
+        return 0;
+    }
+    wp = ht->entries[i];
+    /* move back the entries of the cluster that may no longer be reachable */
+    j = i;
+    for (;;) {
+        uint32_t home;
+        j = (j + 1) & ht->mask;
+        if (ht->tags[j] == INDEX_EMPTY) {
+            break;
+        }
+        home = ht->entries[j]->hash & ht->mask;
+        if (((j - home) & ht->mask) >= ((j - i) & ht->mask)) {
+            ht->tags[i] = ht->tags[j];
+            ht->entries[i] = ht->entries[j];
+            i = j;
+        }
+    }
+    ht->tags[i] = INDEX_EMPTY;
+    ht->count--;
+    if (ht->mask + 1 > INDEX_MIN_CAPACITY && ht->count * 8 < ht->mask + 1) {
+        /* keeping the larger table is fine if this fails */
+        index_resize(ht, (ht->mask + 1) / 2);
+    }
+    return wp;
 }
 
+static void destroy_watched_path(watched_path_t *wp)
+{
+    watcher_object_t *e = wp->watchers.head;
+    while (e != 0) {
+        watcher_object_t *this = e;
+        e = e->next;
+        free(this);
+    }
+    free(wp);
+}
+
+/* the following functions are for testing only */
 watcher_object_t* getFirstWatcher(zk_hashtable* ht,const char* path)
 {
-    watcher_object_list_t* wl=hashtable_search(ht->ht,(void*)path);
-    if(wl!=0)
-        return wl->head;
+    watched_path_t* wp=index_find(ht,path);
+    if(wp!=0)
+        return wp->watchers.head;
     return 0;
 }
+
+uint32_t getWatcherTableCapacity(zk_hashtable* ht)
+{
+    return ht->mask+1;
+}
+
+/* the slot a path is placed in when there is no collision */
+uint32_t getWatchedPathHome(zk_hashtable* ht,const char* path)
+{
+    return hash_path(path)&ht->mask;
+}
 /* end of testing functions */
 
 watcher_object_t* clone_watcher_object(watcher_object_t* wo)
@@ -64,22 +237,6 @@ watcher_object_t* clone_watcher_object(watcher_object_t* wo)
     return res;
 }
 
-static unsigned int string_hash_djb2(void *str) 
-{
-    unsigned int hash = 5381;
-    int c;
-    const char* cstr = (const char*)str;
-    while ((c = *cstr++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-
-    return hash;
-}
-
-static int string_equal(void *key1,void *key2)
-{
-    return strcmp((const char*)key1,(const char*)key2)==0;
-}
-
 static watcher_object_t* create_watcher_object(watcher_fn watcher,void* ctx)
 {
     watcher_object_t* wo=calloc(1,sizeof(watcher_object_t));
@@ -115,31 +272,23 @@ static void destroy_watcher_object_list(watcher_object_list_t* list)
 zk_hashtable* create_zk_hashtable()
 {
     struct _zk_hashtable *ht=calloc(1,sizeof(struct _zk_hashtable));
-    assert(ht);
-    ht->ht=create_hashtable(32,string_hash_djb2,string_equal);
+    if(ht!=0 && index_resize(ht,INDEX_MIN_CAPACITY)!=0){
+        free(ht);
+        ht=0;
+    }
     return ht;
 }
 
-static void do_clean_hashtable(zk_hashtable* ht)
-{
-    struct hashtable_itr *it;
-    int hasMore;
-    if(hashtable_count(ht->ht)==0)
-        return;
-    it=hashtable_iterator(ht->ht);
-    do {
-        watcher_object_list_t* w=hashtable_iterator_value(it);
-        destroy_watcher_object_list(w);
-        hasMore=hashtable_iterator_remove(it);
-    } while(hasMore);
-    free(it);
-}
-
 void destroy_zk_hashtable(zk_hashtable* ht)
 {
+    uint32_t i;
     if(ht!=0){
-        do_clean_hashtable(ht);
-        hashtable_destroy(ht->ht,0);
+        for(i=0;i<=ht->mask;i++){
+            if(ht->tags[i]!=INDEX_EMPTY)
+                destroy_watched_path(ht->entries[i]);
+        }
+        free(ht->tags);
+        free(ht->entries);
         free(ht);
     }
 }
@@ -179,42 +328,29 @@ static int add_to_list(watcher_object_list_t **wl, watcher_object_t *wo,
 
 static int do_insert_watcher_object(zk_hashtable *ht, const char *path, watcher_object_t* wo)
 {
-    int res=1;
+    watched_path_t* wp=index_add(ht,path);
     watcher_object_list_t* wl;
-
-    wl=hashtable_search(ht->ht,(void*)path);
-    if(wl==0){
-        int res;
-        /* inserting a new path element */
-        res=hashtable_insert(ht->ht,strdup(path),create_watcher_object_list(wo));
-        assert(res);
-    }else{
-        /*
-         * Path already exists; check if the watcher already exists.
-         * Don't clone the watcher since it's allocated on the heap --- avoids
-         * a memory leak and saves a clone operation (calloc + copy).
-         */
-        res = add_to_list(&wl, wo, 0);
-    }
-    return res;    
+    assert(wp);
+    wl=&wp->watchers;
+    /*
+     * Check if the watcher already exists. Don't clone the watcher since
+     * it's allocated on the heap --- avoids a memory leak and saves a clone
+     * operation (calloc + copy).
+     */
+    return add_to_list(&wl, wo, 0);
 }
 
 
-char **collect_keys(zk_hashtable *ht, int *count)
+int for_each_watched_path(zk_hashtable *ht, watched_path_fn fn, void *ctx)
 {
-    char **list;
-    struct hashtable_itr *it;
-    int i;
+    uint32_t i;
+    int rc = 0;
 
-    *count = hashtable_count(ht->ht);
-    list = calloc(*count, sizeof(char*));
-    it=hashtable_iterator(ht->ht);
-    for(i = 0; i < *count; i++) {
-        list[i] = strdup(hashtable_iterator_key(it));
-        hashtable_iterator_advance(it);
+    for (i = 0; rc == 0 && i <= ht->mask; i++) {
+        if (ht->tags[i] != INDEX_EMPTY)
+            rc = fn(ht->entries[i]->path, ctx);
     }
-    free(it);
-    return list;
+    return rc;
 }
 
 static int insert_watcher_object(zk_hashtable *ht, const char *path,
@@ -236,17 +372,11 @@ static void copy_watchers(watcher_object_list_t *from, watcher_object_list_t *to
 }
 
 static void copy_table(zk_hashtable *from, watcher_object_list_t *to) {
-    struct hashtable_itr *it;
-    int hasMore;
-    if(hashtable_count(from->ht)==0)
-        return;
-    it=hashtable_iterator(from->ht);
-    do {
-        watcher_object_list_t *w = hashtable_iterator_value(it);
-        copy_watchers(w, to, 1);
-        hasMore=hashtable_iterator_advance(it);
-    } while(hasMore);
-    free(it);
+    uint32_t i;
+    for(i=0;i<=from->mask;i++){
+        if(from->tags[i]!=INDEX_EMPTY)
+            copy_watchers(&from->entries[i]->watchers, to, 1);
+    }
 }
 
 static void collect_session_watchers(zhandle_t *zh,
@@ -259,13 +389,12 @@ static void collect_session_watchers(zhandle_t *zh,
 
 static void add_for_event(zk_hashtable *ht, char *path, watcher_object_list_t **list)
 {
-    watcher_object_list_t* wl;
-    wl = (watcher_object_list_t*)hashtable_remove(ht->ht, path);
-    if (wl) {
-        copy_watchers(wl, *list, 0);
+    watched_path_t* wp = index_remove(ht, path);
+    if (wp) {
+        copy_watchers(&wp->watchers, *list, 0);
         // Since we move, not clone the watch_objects, we just need to free the
-        // head pointer
-        free(wl);
+        // entry
+        free(wp);
     }
 }
 
@@ -340,15 +469,17 @@ void activateWatcher(zhandle_t *zh, watcher_registration_t* reg, int rc)
 static int containsWatcher(zk_hashtable *watchers, const char *path,
         watcher_fn watcher, void *watcherCtx)
 {
+    watched_path_t *wp;
     watcher_object_list_t *wl;
     watcher_object_t e;
 
     if (!watcher)
         return 1;
 
-    wl = hashtable_search(watchers->ht, (void *)path);
-    if (!wl)
+    wp = index_find(watchers, path);
+    if (!wp)
         return 0;
+    wl = &wp->watchers;
 
     e.watcher = watcher;
     e.context = watcherCtx;
@@ -391,25 +522,17 @@ static void removeWatcherFromList(watcher_object_list_t *wl, watcher_fn watcher,
 static void removeWatcher(zk_hashtable *watchers, const char *path,
         watcher_fn watcher, void *watcherCtx)
 {
-    watcher_object_list_t *wl = hashtable_search(watchers->ht, (void *)path);
-
-    if (!wl)
-        return;
+    watched_path_t *wp = index_find(watchers, path);
 
-    if (!watcher) {
-        wl = (watcher_object_list_t *) hashtable_remove(watchers->ht,
-                                                        (void *)path);
-        destroy_watcher_object_list(wl);
+    if (!wp)
         return;
-    }
-
-    removeWatcherFromList(wl, watcher, watcherCtx);
 
-    if (!wl->head) {
-        wl = (watcher_object_list_t *) hashtable_remove(watchers->ht,
-                                                        (void *)path);
-        destroy_watcher_object_list(wl);
+    if (watcher) {
+        removeWatcherFromList(&wp->watchers, watcher, watcherCtx);
+        if (wp->watchers.head)
+            return;
     }
+    destroy_watched_path(index_remove(watchers, path));
 }
 
 void deactivateWatcher(zhandle_t *zh, watcher_deregistration_t *dereg, int rc)
@@ -36,6 +36,11 @@ typedef struct _zk_hashtable zk_hashtable;
  */
 typedef zk_hashtable *(*result_checker_fn)(zhandle_t *, int rc);
 
+/* the checkers of zoo_exists(), zoo_get() and zoo_get_children() */
+zk_hashtable *exists_result_checker(zhandle_t *zh, int rc);
+zk_hashtable *data_result_checker(zhandle_t *zh, int rc);
+zk_hashtable *child_result_checker(zhandle_t *zh, int rc);
+
 /**
  * A watcher object gets temporarily stored with the completion entry until 
  * the server response comes back at which moment the watcher object is moved
@@ -63,7 +68,12 @@ typedef struct _watcher_deregistration {
 zk_hashtable* create_zk_hashtable();
 void destroy_zk_hashtable(zk_hashtable* ht);
 
-char **collect_keys(zk_hashtable *ht, int *count);
+/**
+ * Calls fn with every path of the table without copying it. Stops at the
+ * first non-zero value returned by fn and returns it.
+ */
+typedef int (*watched_path_fn)(const char *path, void *ctx);
+int for_each_watched_path(zk_hashtable *ht, watched_path_fn fn, void *ctx);
 
 /**
  * check if the completion has a watcher object associated
@@ -26,20 +26,36 @@
 #endif
 
 #include <stdarg.h>
+#include <string.h>
 #include <time.h>
 
 #define TIME_NOW_BUF_SIZE 1024
 #define FORMAT_LOG_BUF_SIZE 4096
 
+/* the formatted time; the date and time of day are only formatted again
+ * once the second changes */
+typedef struct _time_now_cache {
+    time_t second;
+    size_t len;                 /* of "yyyy-MM-dd HH:mm:ss", 0 if not set */
+    char str[TIME_NOW_BUF_SIZE];
+} time_now_cache_t;
+
 #ifdef THREADED
 #ifndef WIN32
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #else 
 #include "winport.h"
 #endif
 
 static pthread_key_t time_now_buffer;
 static pthread_key_t format_log_msg_buffer;
+#ifndef WIN32
+#define ASYNC_LOG
+static pthread_key_t log_ring_key;
+static void orphan_log_ring(void *p);
+#endif
 
 void freeBuffer(void* p){
     if(p) free(p);
@@ -48,6 +64,9 @@ void freeBuffer(void* p){
 __attribute__((constructor)) void prepareTSDKeys() {
     pthread_key_create (&time_now_buffer, freeBuffer);
     pthread_key_create (&format_log_msg_buffer, freeBuffer);
+#ifdef ASYNC_LOG
+    pthread_key_create (&log_ring_key, orphan_log_ring);
+#endif
 }
 
 char* getTSData(pthread_key_t key,int size){
@@ -63,17 +82,18 @@ char* getTSData(pthread_key_t key,int size){
     return p;
 }
 
-char* get_time_buffer(){
-    return getTSData(time_now_buffer,TIME_NOW_BUF_SIZE);
+time_now_cache_t* get_time_buffer(){
+    return (time_now_cache_t*)getTSData(time_now_buffer,
+            sizeof(time_now_cache_t));
 }
 
 char* get_format_log_buffer(){  
     return getTSData(format_log_msg_buffer,FORMAT_LOG_BUF_SIZE);
 }
 #else
-char* get_time_buffer(){
-    static char buf[TIME_NOW_BUF_SIZE];
-    return buf;    
+time_now_cache_t* get_time_buffer(){
+    static time_now_cache_t buf;
+    return &buf;
 }
 
 char* get_format_log_buffer(){
@@ -96,57 +116,53 @@ void zoo_set_log_stream(FILE* stream){
     logStream=stream;
 }
 
-static const char* time_now(char* now_str){
+static const char* time_now(time_now_cache_t* now){
     struct timeval tv;
-    struct tm lt;
-    time_t now = 0;
-    size_t len = 0;
     
     gettimeofday(&tv,0);
 
-    now = tv.tv_sec;
-    localtime_r(&now, &lt);
+    if (now->len == 0 || now->second != tv.tv_sec) {
+        struct tm lt;
+        time_t sec = tv.tv_sec;
+        localtime_r(&sec, &lt);
 
-    // clone the format used by log4j ISO8601DateFormat
-    // specifically: "yyyy-MM-dd HH:mm:ss,SSS"
+        // clone the format used by log4j ISO8601DateFormat
+        // specifically: "yyyy-MM-dd HH:mm:ss,SSS"
 
-    len = strftime(now_str, TIME_NOW_BUF_SIZE,
-                          "%Y-%m-%d %H:%M:%S",
-                          &lt);
+        now->len = strftime(now->str, TIME_NOW_BUF_SIZE,
+                              "%Y-%m-%d %H:%M:%S",
+                              &lt);
+        now->second = tv.tv_sec;
+    }
 
-    len += snprintf(now_str + len,
-                    TIME_NOW_BUF_SIZE - len,
-                    ",%03d",
-                    (int)(tv.tv_usec/1000));
+    snprintf(now->str + now->len,
+             TIME_NOW_BUF_SIZE - now->len,
+             ",%03d",
+             (int)(tv.tv_usec/1000));
 
-    return now_str;
+    return now->str;
 }
 
-void log_message(log_callback_fn callback, ZooLogLevel curLevel,
-    int line, const char* funcName, const char* format, ...)
+/* formats a log message into buf, which holds FORMAT_LOG_BUF_SIZE bytes */
+static void format_log_line(char *buf, ZooLogLevel curLevel, int line,
+    const char* funcName, const char* format, va_list va)
 {
     static const char* dbgLevelStr[]={"ZOO_INVALID","ZOO_ERROR","ZOO_WARN",
             "ZOO_INFO","ZOO_DEBUG"};
     static pid_t pid=0;
-    va_list va;
     int ofs = 0;
 #ifdef THREADED
     unsigned long int tid = 0;
 #endif
 #ifdef WIN32
-    char timebuf [TIME_NOW_BUF_SIZE];
-    const char* time = time_now(timebuf);
+    time_now_cache_t timebuf;
+    const char* time;
+    timebuf.len = 0;
+    time = time_now(&timebuf);
 #else
     const char* time = time_now(get_time_buffer());
 #endif
 
-    char* buf = get_format_log_buffer();
-    if(!buf)
-    {
-        fprintf(stderr, "log_message: Unable to allocate memory buffer");
-        return;
-    }
-
     if(pid==0)
     {
         pid=getpid();
@@ -173,13 +189,397 @@ void log_message(log_callback_fn callback, ZooLogLevel curLevel,
 #endif
 
     // Now grab the actual message out of the variadic arg list
-    va_start(va, format);
     vsnprintf(buf+ofs, FORMAT_LOG_BUF_SIZE-1-ofs, format, va);
+}
+
+#ifdef ASYNC_LOG
+/* the smallest ring, which holds the longest message */
+#define LOG_RING_MIN_SIZE (2 * FORMAT_LOG_BUF_SIZE)
+/* the most bytes the logger thread writes at once */
+#define LOG_BATCH_SIZE 65536
+/* ms the logger thread sleeps while the rings are empty */
+#define LOG_WRITER_INTERVAL 10
+
+/**
+ * The messages of one thread waiting for the logger thread. Each record is
+ * a 4-byte length followed by the message and its newline. Only the owning
+ * thread moves tail and only the logger thread moves head, so the ring
+ * needs no lock; both run freely and are reduced modulo size.
+ */
+typedef struct _log_ring {
+    char *buffer;
+    uint32_t size;              /* a power of 2 */
+    volatile uint32_t head;     /* the next record to write out */
+    volatile uint32_t tail;     /* where the next record goes */
+    volatile int64_t dropped;   /* records that didn't fit */
+    int64_t reported;           /* drops the logger thread logged */
+    volatile int orphaned;      /* the owning thread exited */
+    struct _log_ring *next;
+} log_ring_t;
+
+/* the messages the logger thread collects before writing them */
+typedef struct _log_batch {
+    char *buffer;
+    int len;
+    zoo_log_stats_t stats;      /* what was written */
+} log_batch_t;
+
+static struct {
+    pthread_mutex_t control;    /* serializes zoo_set_log_async() */
+    pthread_mutex_t lock;       /* guards the fields below */
+    pthread_cond_t cond;        /* wakes the logger thread up to stop */
+    pthread_t writer;
+    volatile int running;       /* also read by logging threads */
+    volatile int appending;     /* logging threads between the check of
+                                 * running and the end of their append */
+    int stop;
+    uint32_t ring_size;         /* of the rings created from now on */
+    log_ring_t *rings;          /* new rings are added to the front */
+    zoo_log_stats_t stats;      /* dropped only counts freed rings */
+} async_log = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER};
+
+static void orphan_log_ring(void *p)
+{
+    ((log_ring_t*)p)->orphaned = 1;
+}
+
+static log_ring_t *get_log_ring(void)
+{
+    log_ring_t *ring = pthread_getspecific(log_ring_key);
+    if (ring) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return 0;
+    }
+    pthread_mutex_lock(&async_log.lock);
+    ring->size = async_log.ring_size;
+    ring->buffer = malloc(ring->size);
+    if (ring->buffer) {
+        ring->next = async_log.rings;
+        async_log.rings = ring;
+    }
+    pthread_mutex_unlock(&async_log.lock);
+    if (!ring->buffer) {
+        free(ring);
+        return 0;
+    }
+    pthread_setspecific(log_ring_key, ring);
+    return ring;
+}
+
+static void ring_copy_in(log_ring_t *ring, uint32_t pos, const void *src,
+        uint32_t n)
+{
+    uint32_t off = pos & (ring->size - 1);
+    uint32_t first = n < ring->size - off ? n : ring->size - off;
+    memcpy(ring->buffer + off, src, first);
+    memcpy(ring->buffer, (const char*)src + first, n - first);
+}
+
+static void ring_copy_out(log_ring_t *ring, uint32_t pos, void *dst,
+        uint32_t n)
+{
+    uint32_t off = pos & (ring->size - 1);
+    uint32_t first = n < ring->size - off ? n : ring->size - off;
+    memcpy(dst, ring->buffer + off, first);
+    memcpy((char*)dst + first, ring->buffer, n - first);
+}
+
+/* appends a message to the ring of the calling thread, or counts it as
+ * dropped if the ring is full. Returns 0 if the thread has no ring or the
+ * logger thread is stopping. */
+static int log_async(const char *message)
+{
+    log_ring_t *ring = get_log_ring();
+    uint32_t len = strlen(message) + 1;
+    uint32_t tail, head;
+    if (!ring) {
+        return 0;
+    }
+    /* announced before running is checked again, so that
+     * zoo_set_log_async() either sees the append and waits for it before
+     * its last drain, or this thread sees that it stopped */
+    __sync_fetch_and_add(&async_log.appending, 1);
+    if (!async_log.running) {
+        __sync_fetch_and_sub(&async_log.appending, 1);
+        return 0;
+    }
+    tail = ring->tail;
+    head = ring->head;
+    /* the logger thread is done with the bytes before head */
+    __sync_synchronize();
+    if (sizeof(len) + len > ring->size - (tail - head)) {
+        ring->dropped++;
+    } else {
+        ring_copy_in(ring, tail, &len, sizeof(len));
+        ring_copy_in(ring, tail + sizeof(len), message, len - 1);
+        ring_copy_in(ring, tail + sizeof(len) + len - 1, "\n", 1);
+        /* the record is complete before it is published */
+        __sync_synchronize();
+        ring->tail = tail + sizeof(len) + len;
+    }
+    __sync_fetch_and_sub(&async_log.appending, 1);
+    return 1;
+}
+
+static void write_log_batch(log_batch_t *batch)
+{
+    if (batch->len == 0) {
+        return;
+    }
+    fwrite(batch->buffer, 1, batch->len, zoo_get_log_stream());
+    fflush(zoo_get_log_stream());
+    batch->stats.writes++;
+    batch->stats.bytes += batch->len;
+    batch->len = 0;
+}
+
+static void batch_log_line(log_batch_t *batch, ZooLogLevel curLevel,
+        int line, const char *funcName, const char *format, ...)
+{
+    char buf[FORMAT_LOG_BUF_SIZE];
+    int len;
+    va_list va;
+    va_start(va, format);
+    format_log_line(buf, curLevel, line, funcName, format, va);
+    va_end(va);
+    len = strlen(buf);
+    if (batch->len + len + 1 > LOG_BATCH_SIZE) {
+        write_log_batch(batch);
+    }
+    memcpy(batch->buffer + batch->len, buf, len);
+    batch->buffer[batch->len + len] = '\n';
+    batch->len += len + 1;
+}
+
+/* moves the records of a ring to the batch and logs the new drops */
+static void drain_log_ring(log_ring_t *ring, log_batch_t *batch)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    int64_t dropped;
+    /* the records before tail are complete */
+    __sync_synchronize();
+    while (head != tail) {
+        uint32_t len;
+        ring_copy_out(ring, head, &len, sizeof(len));
+        if (batch->len + len > LOG_BATCH_SIZE) {
+            write_log_batch(batch);
+        }
+        ring_copy_out(ring, head + sizeof(len), batch->buffer + batch->len,
+                len);
+        batch->len += len;
+        batch->stats.records++;
+        head += sizeof(len) + len;
+    }
+    /* done reading before the space is handed back */
+    __sync_synchronize();
+    ring->head = head;
+
+    dropped = ring->dropped;
+    if (dropped != ring->reported) {
+        batch_log_line(batch, ZOO_LOG_LEVEL_WARN, __LINE__, __func__,
+                "%lld log messages were dropped, the ring of their thread "
+                "was full", (long long)(dropped - ring->reported));
+        ring->reported = dropped;
+    }
+}
+
+/* writes out the rings listed from ring on, returns the records written */
+static int64_t drain_log_rings(log_ring_t *ring, log_batch_t *batch)
+{
+    int64_t records = batch->stats.records;
+    for (; ring; ring = ring->next) {
+        drain_log_ring(ring, batch);
+    }
+    write_log_batch(batch);
+    return batch->stats.records - records;
+}
+
+/* adds the counters of the batch to the stats and frees the rings whose
+ * threads exited once they're empty; called with the lock held */
+static void collect_log_stats(log_batch_t *batch)
+{
+    log_ring_t **prev = &async_log.rings;
+    async_log.stats.records += batch->stats.records;
+    async_log.stats.writes += batch->stats.writes;
+    async_log.stats.bytes += batch->stats.bytes;
+    memset(&batch->stats, 0, sizeof(batch->stats));
+    while (*prev) {
+        log_ring_t *ring = *prev;
+        if (ring->orphaned && ring->head == ring->tail &&
+                ring->dropped == ring->reported) {
+            *prev = ring->next;
+            async_log.stats.dropped += ring->dropped;
+            free(ring->buffer);
+            free(ring);
+        } else {
+            prev = &ring->next;
+        }
+    }
+}
+
+static void *log_writer(void *v)
+{
+    log_batch_t batch;
+    int stop = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.buffer = v;
+    while (!stop) {
+        log_ring_t *rings;
+        int64_t records;
+        pthread_mutex_lock(&async_log.lock);
+        stop = async_log.stop;
+        rings = async_log.rings;
+        pthread_mutex_unlock(&async_log.lock);
+
+        /* the rings added meanwhile are written out on the next pass */
+        records = drain_log_rings(rings, &batch);
+
+        pthread_mutex_lock(&async_log.lock);
+        collect_log_stats(&batch);
+        if (!stop && !async_log.stop && records == 0) {
+            struct timeval now;
+            struct timespec deadline;
+            gettimeofday(&now, 0);
+            now.tv_usec += LOG_WRITER_INTERVAL * 1000;
+            deadline.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+            deadline.tv_nsec = (now.tv_usec % 1000000) * 1000;
+            pthread_cond_timedwait(&async_log.cond, &async_log.lock,
+                    &deadline);
+        }
+        pthread_mutex_unlock(&async_log.lock);
+    }
+    return batch.buffer;
+}
+
+static uint32_t log_ring_size(int size)
+{
+    uint32_t ring_size = LOG_RING_MIN_SIZE;
+    if (size == 0) {
+        size = ZOO_LOG_RING_SIZE;
+    }
+    while (ring_size < (uint32_t)size && ring_size < 0x40000000) {
+        ring_size <<= 1;
+    }
+    return ring_size;
+}
+
+int zoo_set_log_async(int enabled, int ring_size)
+{
+    log_batch_t batch;
+    void *buffer;
+    int rc = ZOK;
+
+    if (ring_size < 0) {
+        return ZBADARGUMENTS;
+    }
+    pthread_mutex_lock(&async_log.control);
+    if (enabled) {
+        pthread_mutex_lock(&async_log.lock);
+        async_log.ring_size = log_ring_size(ring_size);
+        if (!async_log.running) {
+            buffer = malloc(LOG_BATCH_SIZE);
+            async_log.stop = 0;
+            if (buffer && pthread_create(&async_log.writer, 0, log_writer,
+                        buffer) == 0) {
+                async_log.running = 1;
+            } else {
+                free(buffer);
+                rc = ZSYSTEMERROR;
+            }
+        }
+        pthread_mutex_unlock(&async_log.lock);
+        pthread_mutex_unlock(&async_log.control);
+        return rc;
+    }
+
+    pthread_mutex_lock(&async_log.lock);
+    if (!async_log.running) {
+        pthread_mutex_unlock(&async_log.lock);
+        pthread_mutex_unlock(&async_log.control);
+        return ZOK;
+    }
+    async_log.running = 0;
+    async_log.stop = 1;
+    pthread_cond_signal(&async_log.cond);
+    pthread_mutex_unlock(&async_log.lock);
+    pthread_join(async_log.writer, &buffer);
+    /* the threads that saw running set are done appending after this;
+     * the others write their messages themselves */
+    __sync_synchronize();
+    while (async_log.appending) {
+        sched_yield();
+    }
+
+    /* the messages logged while the thread was stopping */
+    memset(&batch, 0, sizeof(batch));
+    batch.buffer = buffer;
+    pthread_mutex_lock(&async_log.lock);
+    drain_log_rings(async_log.rings, &batch);
+    collect_log_stats(&batch);
+    pthread_mutex_unlock(&async_log.lock);
+    free(buffer);
+    pthread_mutex_unlock(&async_log.control);
+    return ZOK;
+}
+
+int zoo_get_log_stats(zoo_log_stats_t *stats)
+{
+    log_ring_t *ring;
+    if (stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    pthread_mutex_lock(&async_log.lock);
+    *stats = async_log.stats;
+    for (ring = async_log.rings; ring; ring = ring->next) {
+        stats->dropped += ring->dropped;
+    }
+    pthread_mutex_unlock(&async_log.lock);
+    return ZOK;
+}
+#elif defined(THREADED)
+int zoo_set_log_async(int enabled, int ring_size)
+{
+    return enabled ? ZUNIMPLEMENTED : ZOK;
+}
+
+int zoo_get_log_stats(zoo_log_stats_t *stats)
+{
+    if (stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    memset(stats, 0, sizeof(*stats));
+    return ZOK;
+}
+#endif
+
+void log_message(log_callback_fn callback, ZooLogLevel curLevel,
+    int line, const char* funcName, const char* format, ...)
+{
+    va_list va;
+    char* buf = get_format_log_buffer();
+    if(!buf)
+    {
+        fprintf(stderr, "log_message: Unable to allocate memory buffer");
+        return;
+    }
+
+    va_start(va, format);
+    format_log_line(buf, curLevel, line, funcName, format, va);
     va_end(va);
 
     if (callback)
     {
         callback(buf);
+#ifdef ASYNC_LOG
+    } else if (async_log.running && log_async(buf)) {
+        // written out by the logger thread
+#endif
     } else {
         fprintf(zoo_get_log_stream(), "%s\n", buf);
         fflush(zoo_get_log_stream());
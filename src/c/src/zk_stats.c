@@ -0,0 +1,168 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zk_stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int latency_bucket(int64_t us)
+{
+    uint32_t v;
+    int msb = 0;
+    if (us < LATENCY_SUB_BUCKETS) {
+        return us < 0 ? 0 : (int)us;
+    }
+    if (us >> 32) {
+        return LATENCY_BUCKETS - 1;
+    }
+    v = (uint32_t)us;
+    if (v >> 16) { v >>= 16; msb += 16; }
+    if (v >> 8) { v >>= 8; msb += 8; }
+    if (v >> 4) { v >>= 4; msb += 4; }
+    if (v >> 2) { v >>= 2; msb += 2; }
+    if (v >> 1) { msb += 1; }
+    /* the top LATENCY_SUB_BITS bits below the most significant one pick the
+     * sub-bucket */
+    msb -= LATENCY_SUB_BITS;
+    return ((msb + 1) << LATENCY_SUB_BITS) +
+        (int)((us >> msb) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the highest value counted in bucket b */
+static int64_t latency_bucket_max(int b)
+{
+    int shift;
+    if (b < LATENCY_SUB_BUCKETS) {
+        return b;
+    }
+    shift = (b >> LATENCY_SUB_BITS) - 1;
+    return ((int64_t)(LATENCY_SUB_BUCKETS + (b & (LATENCY_SUB_BUCKETS - 1)))
+            << shift) + ((int64_t)1 << shift) - 1;
+}
+
+void latency_record(latency_histogram_t *h, int64_t us)
+{
+    if (us < 0) {
+        us = 0;
+    }
+    if (h->count == 0 || us < h->min_us) {
+        h->min_us = us;
+    }
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->count++;
+    h->total_us += us;
+    h->buckets[latency_bucket(us)]++;
+}
+
+/* the latency under which per_mille of the values are */
+static int64_t latency_percentile(const latency_histogram_t *h, int per_mille)
+{
+    int64_t rank = (h->count * per_mille + 999) / 1000;
+    int64_t seen = 0;
+    int b;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            int64_t us = latency_bucket_max(b);
+            return us > h->max_us ? h->max_us : us;
+        }
+    }
+    return h->max_us;
+}
+
+void latency_summary(const latency_histogram_t *h, zoo_latency_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    if (h->count == 0) {
+        return;
+    }
+    summary->count = h->count;
+    summary->total_us = h->total_us;
+    summary->min_us = h->min_us;
+    summary->max_us = h->max_us;
+    summary->p50_us = latency_percentile(h, 500);
+    summary->p90_us = latency_percentile(h, 900);
+    summary->p99_us = latency_percentile(h, 990);
+    summary->p999_us = latency_percentile(h, 999);
+}
+
+void zk_stats_request(zk_stats_t *stats, int op)
+{
+    if (op < 0 || op >= ZOO_STATS_MAX_OPS) {
+        return;
+    }
+    if (!stats->ops[op]) {
+        /* the statistics are best effort, requests aren't failed for them */
+        stats->ops[op] = calloc(1, sizeof(op_stats_t));
+        if (!stats->ops[op]) {
+            return;
+        }
+    }
+    stats->ops[op]->requests++;
+}
+
+void zk_stats_stage(zk_stats_t *stats, int op, int stage, int64_t us)
+{
+    if (op >= 0 && op < ZOO_STATS_MAX_OPS && stats->ops[op]) {
+        latency_record(&stats->ops[op]->stages[stage], us);
+    }
+}
+
+void zk_stats_error(zk_stats_t *stats, int op)
+{
+    if (op >= 0 && op < ZOO_STATS_MAX_OPS && stats->ops[op]) {
+        stats->ops[op]->errors++;
+    }
+}
+
+void zk_stats_snapshot(const zk_stats_t *stats, zoo_stats_t *snapshot)
+{
+    int op, stage;
+    snapshot->requests = 0;
+    snapshot->errors = 0;
+    snapshot->watch_events = stats->watch_events;
+    snapshot->timeouts = stats->timeouts;
+    snapshot->op_count = 0;
+    for (op = 0; op < ZOO_STATS_MAX_OPS; op++) {
+        const op_stats_t *s = stats->ops[op];
+        zoo_op_stats_t *out;
+        if (!s) {
+            continue;
+        }
+        out = &snapshot->ops[snapshot->op_count++];
+        out->op = op;
+        out->requests = s->requests;
+        out->errors = s->errors;
+        for (stage = 0; stage < ZOO_STAGE_COUNT; stage++) {
+            latency_summary(&s->stages[stage], &out->stages[stage]);
+        }
+        snapshot->requests += s->requests;
+        snapshot->errors += s->errors;
+    }
+}
+
+void zk_stats_destroy(zk_stats_t *stats)
+{
+    int op;
+    for (op = 0; op < ZOO_STATS_MAX_OPS; op++) {
+        free(stats->ops[op]);
+        stats->ops[op] = 0;
+    }
+}
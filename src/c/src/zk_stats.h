@@ -0,0 +1,84 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_STATS_H_
+#define ZK_STATS_H_
+
+#include <zookeeper.h>
+#ifndef WIN32
+#include <stdint.h>
+#else
+#include "winstdint.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A log-linear latency histogram in microseconds, in the manner of HDR
+ * histograms: each value below LATENCY_SUB_BUCKETS has a bucket of its own
+ * and every power of two above it is split into LATENCY_SUB_BUCKETS buckets,
+ * so a bucket is at most 1/8 of its values wide. Values from 2^32 us (about
+ * 71 minutes) on share the last bucket.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct _latency_histogram {
+    int64_t count;
+    int64_t total_us;
+    int64_t min_us;
+    int64_t max_us;
+    uint32_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+void latency_record(latency_histogram_t *h, int64_t us);
+void latency_summary(const latency_histogram_t *h, zoo_latency_t *summary);
+
+/* the counters and stage histograms of one opcode */
+typedef struct _op_stats {
+    int64_t requests;
+    int64_t errors;
+    latency_histogram_t stages[ZOO_STAGE_COUNT];
+} op_stats_t;
+
+/**
+ * The request statistics of a handle, guarded by lock_stats(). The stats of
+ * an opcode are allocated when its first request is issued.
+ */
+typedef struct _zk_stats {
+    op_stats_t *ops[ZOO_STATS_MAX_OPS];
+    int64_t watch_events;
+    int64_t timeouts;
+} zk_stats_t;
+
+/* counts a request of op; ops outside of ZOO_STATS_MAX_OPS are ignored */
+void zk_stats_request(zk_stats_t *stats, int op);
+/* adds the latency of a request of op up to the end of stage */
+void zk_stats_stage(zk_stats_t *stats, int op, int stage, int64_t us);
+void zk_stats_error(zk_stats_t *stats, int op);
+void zk_stats_snapshot(const zk_stats_t *stats, zoo_stats_t *snapshot);
+void zk_stats_destroy(zk_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZK_STATS_H_ */
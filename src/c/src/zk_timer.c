@@ -0,0 +1,201 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zk_timer.h"
+#include <string.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+/* the ticks the whole wheel covers */
+#define TIMER_WHEEL_SPAN ((int64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void link_timer(zk_timer_t **slot, zk_timer_t *t)
+{
+    t->next = *slot;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    *slot = t;
+    t->pprev = slot;
+}
+
+static void unlink_timer(zk_timer_t *t)
+{
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = 0;
+    t->pprev = 0;
+}
+
+/* puts t in the slot of its level relative to w->now */
+static void place_timer(zk_timer_wheel_t *w, zk_timer_t *t)
+{
+    int64_t expires = t->expires;
+    int64_t delta = expires - w->now;
+    int level;
+
+    if (delta < 0) {
+        /* the tick has passed, expires on the next call */
+        link_timer(&w->due, t);
+        return;
+    } else if (delta >= TIMER_WHEEL_SPAN) {
+        /* parked in the top level, placed again when it comes around */
+        expires = w->now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (int64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+    link_timer(&w->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) &
+            TIMER_WHEEL_MASK], t);
+}
+
+void zk_timer_add(zk_timer_wheel_t *w, zk_timer_t *t, int64_t now_ms)
+{
+    zk_timer_cancel(w, t);
+    if (w->count == 0) {
+        /* an empty wheel starts over at the current time */
+        w->now = now_ms;
+    }
+    place_timer(w, t);
+    w->count++;
+}
+
+void zk_timer_cancel(zk_timer_wheel_t *w, zk_timer_t *t)
+{
+    if (t->pprev) {
+        unlink_timer(t);
+        w->count--;
+    }
+}
+
+/* moves the timers of a slot to the levels below */
+static void cascade(zk_timer_wheel_t *w, int level, int slot)
+{
+    zk_timer_t *t = w->slots[level][slot];
+    w->slots[level][slot] = 0;
+    while (t) {
+        zk_timer_t *next = t->next;
+        place_timer(w, t);
+        t = next;
+    }
+}
+
+int64_t zk_timer_wheel_next(const zk_timer_wheel_t *w)
+{
+    int64_t best = -1;
+    int64_t tick;
+    int level, i;
+
+    if (w->count == 0) {
+        return -1;
+    }
+    if (w->due) {
+        return w->now - 1;
+    }
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        if (w->slots[0][(w->now + i) & TIMER_WHEEL_MASK]) {
+            best = w->now + i;
+            break;
+        }
+    }
+    /* the slots of the upper levels are due when the wheel passes their
+     * start */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        int64_t unit = (int64_t)1 << shift;
+        tick = (w->now + unit - 1) & ~(unit - 1);
+        for (i = 0; i < TIMER_WHEEL_SLOTS; i++, tick += unit) {
+            if (best >= 0 && tick >= best) {
+                break;
+            }
+            if (w->slots[level][(tick >> shift) & TIMER_WHEEL_MASK]) {
+                best = tick;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+zk_timer_t *zk_timer_wheel_expire(zk_timer_wheel_t *w, int64_t now_ms)
+{
+    zk_timer_t *expired = 0;
+    zk_timer_t *t;
+
+    while ((t = w->due) != 0) {
+        unlink_timer(t);
+        w->count--;
+        t->next = expired;
+        expired = t;
+    }
+    while (w->now <= now_ms) {
+        int64_t next = zk_timer_wheel_next(w);
+        int level;
+
+        if (next < 0 || next > now_ms) {
+            /* nothing is due or moves down a level until then */
+            w->now = now_ms + 1;
+            break;
+        }
+        w->now = next;
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int shift = TIMER_WHEEL_BITS * level;
+            if (w->now & (((int64_t)1 << shift) - 1)) {
+                break;
+            }
+            cascade(w, level, (w->now >> shift) & TIMER_WHEEL_MASK);
+        }
+        while ((t = w->slots[0][w->now & TIMER_WHEEL_MASK]) != 0) {
+            unlink_timer(t);
+            w->count--;
+            t->next = expired;
+            expired = t;
+        }
+        w->now++;
+    }
+    return expired;
+}
+
+/* forgets a list of timers */
+static void disarm_timers(zk_timer_t *t)
+{
+    while (t) {
+        zk_timer_t *next = t->next;
+        t->next = 0;
+        t->pprev = 0;
+        t = next;
+    }
+}
+
+void zk_timer_wheel_clear(zk_timer_wheel_t *w)
+{
+    int64_t now = w->now;
+    int level, slot;
+    disarm_timers(w->due);
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            disarm_timers(w->slots[level][slot]);
+        }
+    }
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
@@ -0,0 +1,78 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ZK_TIMER_H_
+#define ZK_TIMER_H_
+
+#ifndef WIN32
+#include <stdint.h>
+#else
+#include "winstdint.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A hierarchical timer wheel with a tick of 1 ms. Each level has
+ * TIMER_WHEEL_SLOTS slots and every slot of a level spans as many ticks as
+ * the whole level below, so the levels cover about 64 ms, 4 s, 4 min and
+ * 4.6 h ahead. Timers are added and cancelled in constant time; a timer of
+ * a higher level moves down a level whenever the wheel passes the start of
+ * its slot. Timers further ahead than the top level are parked in it and
+ * placed again once it comes around.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* a timer embedded in the object it times out */
+typedef struct _zk_timer {
+    int64_t expires;                    /* ms, 0 if the timer isn't set */
+    struct _zk_timer *next;
+    struct _zk_timer **pprev;           /* 0 while the timer isn't armed */
+} zk_timer_t;
+
+typedef struct _zk_timer_wheel {
+    int64_t now;                        /* the next tick to expire */
+    int count;                          /* armed timers */
+    zk_timer_t *due;                    /* added after their tick passed */
+    zk_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} zk_timer_wheel_t;
+
+/* arms t to expire at t->expires, now_ms being the current time; timers
+ * already due expire on the next call of zk_timer_wheel_expire() */
+void zk_timer_add(zk_timer_wheel_t *w, zk_timer_t *t, int64_t now_ms);
+/* disarms t if it is armed */
+void zk_timer_cancel(zk_timer_wheel_t *w, zk_timer_t *t);
+/* disarms the timers due at now_ms and returns them linked through next */
+zk_timer_t *zk_timer_wheel_expire(zk_timer_wheel_t *w, int64_t now_ms);
+/* the ms at which the wheel has to be expired again, -1 if it is empty.
+ * This may be earlier than the first timer is due, when timers only move
+ * down a level. */
+int64_t zk_timer_wheel_next(const zk_timer_wheel_t *w);
+/* disarms all the timers */
+void zk_timer_wheel_clear(zk_timer_wheel_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZK_TIMER_H_ */
@@ -40,10 +40,12 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <stddef.h>
 
 #ifndef _WIN32
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -155,6 +157,7 @@ struct ACL_vector ZOO_CREATOR_ALL_ACL = { 1, _CREATOR_ALL_ACL_ACL};
 #define COMPLETION_STRING 6
 #define COMPLETION_MULTI 7
 #define COMPLETION_STRING_STAT 8
+#define COMPLETION_DATA_REF 9
 
 typedef struct _auth_completion_list {
     void_completion_t completion;
@@ -168,6 +171,7 @@ typedef struct completion {
         void_completion_t void_result;
         stat_completion_t stat_result;
         data_completion_t data_result;
+        data_ref_completion_t data_ref_result;
         strings_completion_t strings_result;
         strings_stat_completion_t strings_stat_result;
         acl_completion_t acl_result;
@@ -178,16 +182,43 @@ typedef struct completion {
     completion_head_t clist; /* For multi-op */
 } completion_t;
 
+/* a received packet lent to a data_ref_completion_t */
+struct zoo_buffer {
+    volatile int32_t refs;              // references taken by the application
+    char *packet;                       // the packet the value points into
+    struct zoo_buffer *retained;        // the reference counted descriptor
+};
+
 typedef struct _completion_list {
     int xid;
     completion_t c;
     const void *data;
     buffer_list_t *buffer;
+    /* decoded by the I/O thread so the completion doesn't parse them again */
+    struct ReplyHeader hdr;
+    struct WatcherEvent event;  /* for WATCHER_EVENT_XID */
+    struct iarchive *ia;        /* over buffer, positioned at the reply body */
+    int key;                    /* orders the completion, see completion_key() */
+    buffer_list_t *request;     /* the serialized request until it is queued */
+    int op;                     /* opcode of the request, -1 if not counted */
+    int64_t submitted;          /* us when the API call issued the request */
+    /* the timeline of the request if it is traced, see zoo_set_trace_hooks() */
+    int traced;
+    char *trace_path;
+    int64_t queued_us;
+    int64_t sent_us;
+    int64_t received_us;
+    zk_timer_t deadline;        /* see zoo_set_request_timeout() */
+    int expired;                /* timed out, its response is discarded */
     struct _completion_list *next;
     watcher_registration_t* watcher;
     watcher_deregistration_t* watcher_deregistration;
 } completion_list_t;
 
+/* the entry of a deadline taken off the timer wheel */
+#define DEADLINE_ENTRY(t) \
+    ((completion_list_t*)((char*)(t) - offsetof(completion_list_t, deadline)))
+
 const char*err2string(int err);
 static int queue_session_event(zhandle_t *zh, int state);
 static const char* format_endpoint_info(const struct sockaddr_storage* ep);
@@ -197,15 +228,19 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
 static int deserialize_multi(zhandle_t *zh, int xid, completion_list_t *cptr, struct iarchive *ia);
 
 /* completion routine forward declarations */
-static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front,
-        watcher_registration_t* wo, completion_head_t *clist);
-static int add_completion_deregistration(zhandle_t *zh, int xid,
+static int add_completion(zhandle_t *zh, int completion_type,
+        const void *dc, const void *data, const char *path,
+        watcher_registration_t* wo, completion_head_t *clist,
+        struct oarchive *oa);
+static int add_completion_deregistration(zhandle_t *zh,
         int completion_type, const void *dc, const void *data,
-        int add_to_front, watcher_deregistration_t* wo,
-        completion_head_t *clist);
-static int do_add_completion(zhandle_t *zh, const void *dc, completion_list_t *c,
-        int add_to_front);
+        const char *path, watcher_deregistration_t* wo,
+        completion_head_t *clist, struct oarchive *oa);
+static int do_add_completion(zhandle_t *zh, const void *dc, completion_list_t *c);
+static int submit_request(zhandle_t *zh, completion_list_t *c,
+        struct oarchive *oa);
+static void queue_submitted_requests(zhandle_t *zh);
+static void fill_send_queue(zhandle_t *zh, int all);
 
 static completion_list_t* create_completion_entry(zhandle_t *zh, int xid, int completion_type,
         const void *dc, const void *data, watcher_registration_t* wo,
@@ -218,19 +253,26 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh,
         watcher_registration_t* wo, completion_head_t *clist,
         watcher_deregistration_t* wdo);
 static void destroy_completion_entry(completion_list_t* c);
-static void queue_completion_nolock(completion_head_t *list, completion_list_t *c,
-        int add_to_front);
+static void init_pools(zhandle_t *zh);
+static void destroy_pools(zhandle_t *zh);
+static struct iarchive *create_pooled_iarchive(zhandle_t *zh, char *buffer,
+        int len);
+static void close_pooled_iarchive(struct iarchive **ia);
 static void queue_completion(completion_head_t *list, completion_list_t *c,
         int add_to_front);
 static int handle_socket_error_msg(zhandle_t *zh, int line, int rc,
     const char* format,...);
 static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc);
+static void rw_probe_close(zhandle_t *zh);
+static void connect_race_close(zhandle_t *zh);
 
 static int disable_conn_permute=0; // permute enabled by default
 
 static __attribute__((unused)) void print_completion_queue(zhandle_t *zh);
 
 static void *SYNCHRONOUS_MARKER = (void*)&SYNCHRONOUS_MARKER;
+/* the head of zh->submitted once the handle is closing */
+static void *SUBMISSIONS_CLOSED = (void*)&SUBMISSIONS_CLOSED;
 static int isValidPath(const char* path, const int flags);
 
 #ifdef _WIN32
@@ -253,7 +295,6 @@ typedef ssize_t sendsize_t;
 
 static void zookeeper_set_sock_nodelay(zhandle_t *, socket_t);
 static void zookeeper_set_sock_noblock(zhandle_t *, socket_t);
-static void zookeeper_set_sock_timeout(zhandle_t *, socket_t, int);
 static socket_t zookeeper_connect(zhandle_t *, struct sockaddr_storage *, socket_t);
 
 
@@ -327,6 +368,14 @@ void get_system_time(struct timeval *tv)
   }
 }
 
+/* the time of get_system_time() in microseconds, to timestamp requests */
+static int64_t system_time_us(void)
+{
+    struct timeval tv;
+    get_system_time(&tv);
+    return ((int64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
 const void *zoo_get_context(zhandle_t *zh)
 {
     return zh->context;
@@ -489,6 +538,76 @@ zk_hashtable *child_result_checker(zhandle_t *zh, int rc)
     return rc==ZOK ? zh->active_child_watchers : 0;
 }
 
+/* the cached parts of a node a watcher event makes stale */
+static int cache_event_parts(int type)
+{
+    if (type == ZOO_CHANGED_EVENT) {
+        return ZK_CACHE_DATA;
+    } else if (type == ZOO_CHILD_EVENT) {
+        return ZK_CACHE_CHILDREN;
+    }
+    return ZK_CACHE_DATA | ZK_CACHE_CHILDREN;
+}
+
+static int cache_watcher_parts(ZooWatcherType wtype)
+{
+    switch (wtype) {
+    case ZWATCHERTYPE_DATA:
+        return ZK_CACHE_DATA;
+    case ZWATCHERTYPE_CHILDREN:
+        return ZK_CACHE_CHILDREN;
+    default:
+        return ZK_CACHE_DATA | ZK_CACHE_CHILDREN;
+    }
+}
+
+/**
+ * Keeps the result of a read that armed a watch and drops the entries
+ * whose watches were removed. Called by the IO thread under lock_watchers()
+ * so the entry and the watcher table change together.
+ */
+static void cache_response(zhandle_t *zh, completion_list_t *cptr, int rc,
+        buffer_list_t *bptr)
+{
+    struct iarchive *ia = 0;
+    struct ReplyHeader hdr;
+    watcher_registration_t *wo = cptr->watcher;
+    watcher_deregistration_t *wdo = cptr->watcher_deregistration;
+
+    if (wdo) {
+        zk_cache_invalidate(zh->cache, wdo->path, cache_watcher_parts(wdo->type));
+    }
+    if (!wo || rc != ZOK) {
+        return;
+    }
+    if (wo->checker == data_result_checker && (cptr->c.type == COMPLETION_DATA
+            || cptr->c.type == COMPLETION_DATA_REF)) {
+        struct GetDataResponse res;
+        memset(&res, 0, sizeof(res));
+        ia = create_pooled_iarchive(zh, bptr->buffer, bptr->len);
+        if (ia && deserialize_ReplyHeader(ia, "hdr", &hdr) == 0 &&
+                deserialize_GetDataResponse(ia, "reply", &res) == 0) {
+            zk_cache_put_data(zh->cache, wo->path, &res.data, &res.stat);
+        }
+        deallocate_GetDataResponse(&res);
+    } else if (wo->checker == child_result_checker &&
+            cptr->c.type == COMPLETION_STRINGLIST_STAT) {
+        struct GetChildren2Response res;
+        memset(&res, 0, sizeof(res));
+        ia = create_pooled_iarchive(zh, bptr->buffer, bptr->len);
+        if (ia && deserialize_ReplyHeader(ia, "hdr", &hdr) == 0 &&
+                deserialize_GetChildren2Response(ia, "reply", &res) == 0) {
+            zk_cache_put_children(zh->cache, wo->path, &res.children, &res.stat);
+        }
+        deallocate_GetChildren2Response(&res);
+    } else {
+        return;
+    }
+    if (ia) {
+        close_pooled_iarchive(&ia);
+    }
+}
+
 /**
  * Frees and closes everything associated with a handle,
  * including the handle itself.
@@ -510,7 +629,17 @@ static void destroy(zhandle_t *zh)
         memset(&zh->addr_cur, 0, sizeof(zh->addr_cur));
         zh->state = 0;
     }
+    rw_probe_close(zh);
+    connect_race_close(zh);
     addrvec_free(&zh->addrs);
+    free(zh->rtts);
+    zh->rtts = NULL;
+    zh->rtt_count = zh->rtt_capacity = 0;
+
+    if (zh->recv_ahead.buffer != NULL) {
+        free(zh->recv_ahead.buffer);
+        zh->recv_ahead.buffer = NULL;
+    }
 
     if (zh->chroot != NULL) {
         free(zh->chroot);
@@ -521,8 +650,14 @@ static void destroy(zhandle_t *zh)
     destroy_zk_hashtable(zh->active_node_watchers);
     destroy_zk_hashtable(zh->active_exist_watchers);
     destroy_zk_hashtable(zh->active_child_watchers);
+    destroy_zk_cache(zh->cache);
+    zh->cache = NULL;
+    lock_stats(zh);
+    zk_stats_destroy(&zh->stats);
+    unlock_stats(zh);
     addrvec_free(&zh->addrs_old);
     addrvec_free(&zh->addrs_new);
+    destroy_pools(zh);
 }
 
 static void setup_random()
@@ -837,6 +972,8 @@ int update_addrs(zhandle_t *zh)
     uint32_t i = 0;
     int found_current = 0;
     addrvec_t resolved = { 0 };
+    struct timeval start, end;
+    int64_t elapsed;
 
     // Verify we have a valid handle
     if (zh == NULL) {
@@ -849,18 +986,42 @@ int update_addrs(zhandle_t *zh)
         return ZSYSTEMERROR;
     }
 
-    // NOTE: guard access to {hostname, addr_cur, addrs, addrs_old, addrs_new}
-    lock_reconfig(zh);
-
     // Copy zh->hostname for local use
+    lock_reconfig(zh);
     hosts = strdup(zh->hostname);
+    unlock_reconfig(zh);
     if (hosts == NULL) {
-        rc = ZSYSTEMERROR;
-        goto fail;
+        return ZSYSTEMERROR;
     }
 
+    // Resolve without holding the reconfig lock: getaddrinfo may block for a
+    // long time and the lock is taken by every call to zookeeper_interest
+    get_system_time(&start);
     rc = resolve_hosts(zh, hosts, &resolved);
+    get_system_time(&end);
+    elapsed = ((int64_t)(end.tv_sec - start.tv_sec)) * 1000000 +
+        (end.tv_usec - start.tv_usec);
+
+    // NOTE: guard access to {hostname, addr_cur, addrs, addrs_old, addrs_new}
+    lock_reconfig(zh);
+
+    zh->last_resolve = end;
+    zh->resolve_stats.resolutions++;
+    zh->resolve_stats.last_resolve_us = elapsed;
+    zh->resolve_stats.total_resolve_us += elapsed;
+    if (elapsed > zh->resolve_stats.max_resolve_us) {
+        zh->resolve_stats.max_resolve_us = elapsed;
+    }
+
     if (rc != ZOK)
+    {
+        zh->resolve_stats.failures++;
+        goto fail;
+    }
+
+    // zoo_set_servers replaced the host list while we were resolving; the
+    // result is stale and the caller of zoo_set_servers will publish its own
+    if (strcmp(hosts, zh->hostname) != 0)
     {
         goto fail;
     }
@@ -871,6 +1032,8 @@ int update_addrs(zhandle_t *zh)
         goto fail;
     }
 
+    zh->resolve_stats.address_changes++;
+
     // Is the server we're connected to in the new resolved list?
     found_current = addrvec_contains(&resolved, &zh->addr_cur);
 
@@ -944,9 +1107,11 @@ int update_addrs(zhandle_t *zh)
     // new connection
     if (zh->reconfig == 1 && zh->fd != -1)
     {
+        lock_buffer_list(&zh->to_send);
         close(zh->fd);
         zh->fd = -1;
         zh->state = ZOO_NOTCONNECTED_STATE;
+        unlock_buffer_list(&zh->to_send);
     }
 
 fail:
@@ -968,6 +1133,150 @@ fail:
     return rc;
 }
 
+/**
+ * Check whether the cached server addresses have to be resolved again before
+ * a connection attempt: on every attempt with a ttl of 0, once the ttl has
+ * expired otherwise, never with a negative ttl.
+ */
+static int resolve_is_due(zhandle_t *zh, const struct timeval *now)
+{
+    int due;
+    int64_t age;
+
+    lock_reconfig(zh);
+    age = ((int64_t)(now->tv_sec - zh->last_resolve.tv_sec)) * 1000 +
+        (now->tv_usec - zh->last_resolve.tv_usec) / 1000;
+    due = zh->resolve_ttl == 0 ||
+        (zh->resolve_ttl > 0 && age >= zh->resolve_ttl);
+    if (!due) {
+        zh->resolve_stats.lookups_avoided++;
+    }
+    unlock_reconfig(zh);
+
+    return due;
+}
+
+int zoo_get_io_stats(zhandle_t *zh, zoo_io_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_buffer_list(&zh->to_send);
+    *stats = zh->io_stats;
+    unlock_buffer_list(&zh->to_send);
+    return ZOK;
+}
+
+int zoo_get_rewatch_stats(zhandle_t *zh, zoo_rewatch_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_watchers(zh);
+    *stats = zh->rewatch_stats;
+    unlock_watchers(zh);
+    return ZOK;
+}
+
+int zoo_set_resolve_ttl(zhandle_t *zh, int ttl_ms)
+{
+    if (zh == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    zh->resolve_ttl = ttl_ms;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_get_resolve_stats(zhandle_t *zh, zoo_resolve_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    *stats = zh->resolve_stats;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_set_reconnect_backoff(zhandle_t *zh, int spread_ms, int base_ms,
+        int max_ms)
+{
+    if (zh == NULL || spread_ms < 0 || base_ms < 0 ||
+            (base_ms > 0 && max_ms < base_ms)) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    zh->backoff_spread = spread_ms;
+    zh->backoff_base = base_ms;
+    zh->backoff_max = max_ms;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_set_connect_race(zhandle_t *zh, int width, int stagger_ms)
+{
+    if (zh == NULL || width < 1 || width > ZOO_MAX_CONNECT_RACE ||
+            stagger_ms < 0) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    zh->race_width = width;
+    zh->race_stagger = stagger_ms;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_set_latency_preference(zhandle_t *zh, int enabled, int floor_us)
+{
+    if (zh == NULL || floor_us < 0) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    zh->prefer_latency = enabled != 0;
+    zh->latency_floor = floor_us;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_get_server_rtts(zhandle_t *zh, zoo_server_rtt_t *rtts, int *count)
+{
+    int i;
+
+    if (zh == NULL || rtts == NULL || count == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    for (i = 0; i < zh->rtt_count && i < *count; i++) {
+        rtts[i] = zh->rtts[i].rtt;
+        strncpy(rtts[i].server, format_endpoint_info(&zh->rtts[i].addr),
+                sizeof(rtts[i].server) - 1);
+        rtts[i].server[sizeof(rtts[i].server) - 1] = '\0';
+    }
+    *count = zh->rtt_count;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_get_connect_stats(zhandle_t *zh, zoo_connect_stats_t *stats)
+{
+    struct timeval now;
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    get_system_time(&now);
+    lock_reconfig(zh);
+    *stats = zh->connect_stats;
+    if (zh->disconnected_since.tv_sec != 0) {
+        stats->disconnected_ms +=
+            (((int64_t)(now.tv_sec - zh->disconnected_since.tv_sec)) * 1000000 +
+             (now.tv_usec - zh->disconnected_since.tv_usec)) / 1000;
+    }
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
 const clientid_t *zoo_client_id(zhandle_t *zh)
 {
     return &zh->client_id;
@@ -1074,6 +1383,7 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
     if (!zh) {
         return 0;
     }
+    init_pools(zh);
 
     // Set log callback before calling into log_env
     zh->log_callback = log_callback;
@@ -1097,11 +1407,17 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
               flags);
 
     zh->hostname = NULL;
+    zh->xid = get_xid();
     zh->fd = -1;
+    zh->rw_probe.fd = -1;
     zh->state = ZOO_NOTCONNECTED_STATE;
     zh->context = context;
     zh->recv_timeout = recv_timeout;
+    zh->resolve_ttl = ZOO_DEFAULT_RESOLVE_TTL;
+    get_system_time(&zh->disconnected_since);
     zh->allow_read_only = flags & ZOO_READONLY;
+    zh->shared_reactor = (flags & ZOO_SHARED_REACTOR) != 0;
+    zh->direct_send = (flags & ZOO_DIRECT_SEND) != 0;
     // non-zero clientid implies we've seen r/w server already
     zh->seen_rw_server_before = (clientid != 0 && clientid->client_id != 0);
     init_auth_info(&zh->auth_h);
@@ -1163,6 +1479,11 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
     zh->active_node_watchers=create_zk_hashtable();
     zh->active_exist_watchers=create_zk_hashtable();
     zh->active_child_watchers=create_zk_hashtable();
+    if (!zh->active_node_watchers || !zh->active_exist_watchers ||
+            !zh->active_child_watchers) {
+        errno=ENOMEM;
+        goto abort;
+    }
 
     if (adaptor_init(zh) == -1) {
         goto abort;
@@ -1231,9 +1552,11 @@ int zoo_set_servers(zhandle_t *zh, const char *hosts)
  * regardless of pNew or pOld. If we tried all servers we give up and go back to
  * the normal round robin mode
  *
- * When called, must be protected by lock_reconfig(zh).
+ * The server is stored in next. When called, must be protected by
+ * lock_reconfig(zh).
  */
-static int get_next_server_in_reconfig(zhandle_t *zh)
+static int get_next_server_in_reconfig(zhandle_t *zh,
+        struct sockaddr_storage *next)
 {
     int take_new = drand48() <= zh->pNew;
 
@@ -1250,44 +1573,192 @@ static int get_next_server_in_reconfig(zhandle_t *zh)
     if (addrvec_hasnext(&zh->addrs_new)
             && (take_new || !addrvec_hasnext(&zh->addrs_old)))
     {
-        addrvec_next(&zh->addrs_new, &zh->addr_cur);
-        LOG_DEBUG(LOGCALLBACK(zh), "Using next from NEW=%s", format_endpoint_info(&zh->addr_cur));
+        addrvec_next(&zh->addrs_new, next);
+        LOG_DEBUG(LOGCALLBACK(zh), "Using next from NEW=%s", format_endpoint_info(next));
         return 0;
     }
 
     // start taking old servers
     if (addrvec_hasnext(&zh->addrs_old)) {
-        addrvec_next(&zh->addrs_old, &zh->addr_cur);
-        LOG_DEBUG(LOGCALLBACK(zh), "Using next from OLD=%s", format_endpoint_info(&zh->addr_cur));
+        addrvec_next(&zh->addrs_old, next);
+        LOG_DEBUG(LOGCALLBACK(zh), "Using next from OLD=%s", format_endpoint_info(next));
         return 0;
     }
 
     LOG_DEBUG(LOGCALLBACK(zh), "Failed to find either new or old");
-    memset(&zh->addr_cur, 0, sizeof(zh->addr_cur));
+    memset(next, 0, sizeof(*next));
     return 1;
 }
 
+static int sockaddr_equal(const struct sockaddr_storage *a,
+        const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+#if defined(AF_INET6)
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6*)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6*)b;
+        return a6->sin6_port == b6->sin6_port &&
+            memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+#endif
+    return ((const struct sockaddr_in*)a)->sin_port ==
+            ((const struct sockaddr_in*)b)->sin_port &&
+        ((const struct sockaddr_in*)a)->sin_addr.s_addr ==
+            ((const struct sockaddr_in*)b)->sin_addr.s_addr;
+}
+
 /**
- * Cycle through our server list to the correct 'next' server. The 'next' server
- * to connect to depends upon whether we're in a 'reconfig' mode or not. Reconfig
- * mode means we've upated the server list and are now trying to find a server
- * to connect to. Once we get connected, we are no longer in the reconfig mode.
- * Similarly, if we try to connect to all the servers in the new configuration
- * and failed, reconfig mode is set to false.
- *
- * For more algorithm details, see get_next_server_in_reconfig.
+ * Find the round trip times of a server address, adding an entry if create is
+ * set. Entries of addresses no longer in the server list are dropped to make
+ * room. Must be called with lock_reconfig(zh) held.
  */
-void zoo_cycle_next_server(zhandle_t *zh)
+static server_rtt_t *find_server_rtt(zhandle_t *zh,
+        const struct sockaddr_storage *addr, int create)
 {
-    // NOTE: guard access to {hostname, addr_cur, addrs, addrs_old, addrs_new}
+    server_rtt_t *entry;
+    int i;
+
+    for (i = 0; i < zh->rtt_count; i++) {
+        if (sockaddr_equal(&zh->rtts[i].addr, addr)) {
+            return &zh->rtts[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (zh->rtt_count == zh->rtt_capacity) {
+        for (i = 0; i < zh->rtt_count; ) {
+            int j, listed = 0;
+            for (j = 0; j < (int)zh->addrs.count && !listed; j++) {
+                listed = sockaddr_equal(&zh->rtts[i].addr, &zh->addrs.data[j]);
+            }
+            if (listed) {
+                i++;
+            } else {
+                zh->rtts[i] = zh->rtts[--zh->rtt_count];
+            }
+        }
+    }
+    if (zh->rtt_count == zh->rtt_capacity) {
+        int capacity = zh->rtt_capacity ? zh->rtt_capacity * 2 : 8;
+        server_rtt_t *rtts = realloc(zh->rtts, capacity * sizeof(*rtts));
+        if (rtts == NULL) {
+            return NULL;
+        }
+        zh->rtts = rtts;
+        zh->rtt_capacity = capacity;
+    }
+    entry = &zh->rtts[zh->rtt_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->addr = *addr;
+    return entry;
+}
+
+/* account a handshake or ping to a server that took rtt_us */
+static void record_rtt(zhandle_t *zh, const struct sockaddr_storage *addr,
+        int64_t rtt_us)
+{
+    server_rtt_t *entry;
+
+    if (rtt_us < 0) {
+        return;
+    }
+    if (rtt_us > INT_MAX) {
+        rtt_us = INT_MAX;
+    }
+    lock_reconfig(zh);
+    entry = find_server_rtt(zh, addr, 1);
+    if (entry) {
+        zoo_server_rtt_t *rtt = &entry->rtt;
+        /* the same smoothing as TCP, new samples weigh 1/8 */
+        rtt->srtt_us = rtt->samples ?
+            (int32_t)(((int64_t)rtt->srtt_us * 7 + rtt_us) / 8) :
+            (int32_t)rtt_us;
+        if (rtt->samples == 0 || rtt_us < rtt->min_rtt_us) {
+            rtt->min_rtt_us = (int32_t)rtt_us;
+        }
+        rtt->last_rtt_us = (int32_t)rtt_us;
+        rtt->samples++;
+        rtt->failures = 0;
+    }
+    unlock_reconfig(zh);
+}
+
+static void record_connect_failure(zhandle_t *zh,
+        const struct sockaddr_storage *addr)
+{
+    server_rtt_t *entry;
+
+    if (addr->ss_family == 0) {
+        return;
+    }
     lock_reconfig(zh);
+    entry = find_server_rtt(zh, addr, 1);
+    if (entry) {
+        entry->rtt.failures++;
+    }
+    unlock_reconfig(zh);
+}
+
+/* the rank of a server, lower is better */
+static int64_t server_rank(zhandle_t *zh, const struct sockaddr_storage *addr)
+{
+    server_rtt_t *entry = find_server_rtt(zh, addr, 0);
+    int floor = zh->latency_floor > 0 ? zh->latency_floor : 1;
+
+    if (entry == NULL) {
+        return 0;
+    }
+    if (entry->rtt.failures > 0) {
+        return ((int64_t)INT_MAX) + entry->rtt.failures;
+    }
+    return entry->rtt.samples ? entry->rtt.srtt_us / floor : 0;
+}
+
+/**
+ * Order the server list by rank before the next pass over it. The sort is
+ * stable, so servers of the same rank keep their random order. Must be
+ * called with lock_reconfig(zh) held.
+ */
+static void rank_servers(zhandle_t *zh)
+{
+    int count = zh->addrs.count;
+    int64_t *ranks;
+    int i, j;
 
-    memset(&zh->addr_cur, 0, sizeof(zh->addr_cur));
+    if (count < 2 || (ranks = malloc(count * sizeof(*ranks))) == NULL) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        ranks[i] = server_rank(zh, &zh->addrs.data[i]);
+    }
+    for (i = 1; i < count; i++) {
+        struct sockaddr_storage addr = zh->addrs.data[i];
+        int64_t rank = ranks[i];
+        for (j = i; j > 0 && ranks[j - 1] > rank; j--) {
+            zh->addrs.data[j] = zh->addrs.data[j - 1];
+            ranks[j] = ranks[j - 1];
+        }
+        zh->addrs.data[j] = addr;
+        ranks[j] = rank;
+    }
+    free(ranks);
+}
+
+/**
+ * Advance the server list like zoo_cycle_next_server() and store the server
+ * picked in next. Must be called with lock_reconfig(zh) held.
+ */
+static void pick_next_server(zhandle_t *zh, struct sockaddr_storage *next)
+{
+    memset(next, 0, sizeof(*next));
 
     if (zh->reconfig)
     {
-        if (get_next_server_in_reconfig(zh) == 0) {
-            unlock_reconfig(zh);
+        if (get_next_server_in_reconfig(zh, next) == 0) {
             return;
         }
 
@@ -1295,11 +1766,28 @@ void zoo_cycle_next_server(zhandle_t *zh)
         zh->reconfig = 0;
     }
 
-    addrvec_next(&zh->addrs, &zh->addr_cur);
+    if (zh->prefer_latency && addrvec_atend(&zh->addrs)) {
+        rank_servers(zh);
+    }
+    addrvec_next(&zh->addrs, next);
+}
 
+/**
+ * Cycle through our server list to the correct 'next' server. The 'next' server
+ * to connect to depends upon whether we're in a 'reconfig' mode or not. Reconfig
+ * mode means we've upated the server list and are now trying to find a server
+ * to connect to. Once we get connected, we are no longer in the reconfig mode.
+ * Similarly, if we try to connect to all the servers in the new configuration
+ * and failed, reconfig mode is set to false.
+ *
+ * For more algorithm details, see get_next_server_in_reconfig.
+ */
+void zoo_cycle_next_server(zhandle_t *zh)
+{
+    // NOTE: guard access to {hostname, addr_cur, addrs, addrs_old, addrs_new}
+    lock_reconfig(zh);
+    pick_next_server(zh, &zh->addr_cur);
     unlock_reconfig(zh);
-
-    return;
 }
 
 /**
@@ -1369,31 +1857,312 @@ char* sub_string(zhandle_t *zh, const char* server_path) {
     return ret_str;
 }
 
-static buffer_list_t *allocate_buffer(char *buff, int len)
-{
-    buffer_list_t *buffer = calloc(1, sizeof(*buffer));
-    if (buffer == 0)
-        return 0;
-
-    buffer->len = len==0?sizeof(*buffer):len;
-    buffer->curr_offset = 0;
-    buffer->buffer = buff;
-    buffer->next = 0;
-    return buffer;
+/* the header in front of every object handed out by a pool */
+struct _pool_object {
+    union {
+        zk_pool_t *pool;                // the owner, while the object is in use
+        struct _pool_object *next;      // the next idle object
+        int64_t align;
+        double align_double;
+    } u;
+};
+
+static void pool_init(zk_pool_t *p, size_t size)
+{
+    p->free = 0;
+    p->size = size;
+    p->max_idle = ZOO_DEFAULT_POOL_RETENTION;
+    memset(&p->stats, 0, sizeof(p->stats));
+}
+
+static void *pool_alloc(zk_pool_t *p)
+{
+    struct _pool_object *o;
+    lock_pool(p);
+    o = p->free;
+    if (o) {
+        p->free = o->u.next;
+        p->stats.idle--;
+        p->stats.reuses++;
+    }
+    p->stats.allocations++;
+    if (++p->stats.in_use > p->stats.max_in_use) {
+        p->stats.max_in_use = p->stats.in_use;
+    }
+    unlock_pool(p);
+    if (!o) {
+        o = malloc(sizeof(*o) + p->size);
+        if (!o) {
+            lock_pool(p);
+            p->stats.allocations--;
+            p->stats.in_use--;
+            unlock_pool(p);
+            return 0;
+        }
+    }
+    o->u.pool = p;
+    return o + 1;
 }
 
-static void free_buffer(buffer_list_t *b)
+static void pool_free(void *obj)
 {
-    if (!b) {
+    struct _pool_object *o;
+    zk_pool_t *p;
+    if (!obj) {
         return;
     }
-    if (b->buffer) {
-        free(b->buffer);
+    o = (struct _pool_object*)obj - 1;
+    p = o->u.pool;
+    lock_pool(p);
+    p->stats.in_use--;
+    if (p->stats.idle < p->max_idle) {
+        o->u.next = p->free;
+        p->free = o;
+        p->stats.idle++;
+        o = 0;
+    } else {
+        p->stats.releases++;
     }
-    free(b);
+    unlock_pool(p);
+    free(o);
 }
 
-static buffer_list_t *dequeue_buffer(buffer_head_t *list)
+/* detaches the idle objects beyond max_idle; the pool must be locked */
+static struct _pool_object *pool_trim(zk_pool_t *p, int max_idle)
+{
+    struct _pool_object *excess = 0;
+    while (p->stats.idle > max_idle) {
+        struct _pool_object *o = p->free;
+        p->free = o->u.next;
+        o->u.next = excess;
+        excess = o;
+        p->stats.idle--;
+        p->stats.releases++;
+    }
+    return excess;
+}
+
+static void pool_free_list(struct _pool_object *o)
+{
+    while (o) {
+        struct _pool_object *next = o->u.next;
+        free(o);
+        o = next;
+    }
+}
+
+static void init_pools(zhandle_t *zh)
+{
+    pool_init(&zh->pools[ZOO_POOL_COMPLETIONS], sizeof(completion_list_t));
+    pool_init(&zh->pools[ZOO_POOL_BUFFERS], sizeof(buffer_list_t));
+    pool_init(&zh->pools[ZOO_POOL_ARCHIVES], buffer_archive_size());
+    pool_init(&zh->pools[ZOO_POOL_WATCHERS], sizeof(watcher_registration_t));
+}
+
+/* called once nothing can use the handle any more, so without locking */
+static void destroy_pools(zhandle_t *zh)
+{
+    int i;
+    for (i = 0; i < ZOO_POOL_COUNT; i++) {
+        pool_free_list(pool_trim(&zh->pools[i], 0));
+    }
+}
+
+int zoo_set_pool_retention(zhandle_t *zh, int max_idle)
+{
+    int i;
+    if (zh == NULL || max_idle < 0) {
+        return ZBADARGUMENTS;
+    }
+    for (i = 0; i < ZOO_POOL_COUNT; i++) {
+        zk_pool_t *p = &zh->pools[i];
+        struct _pool_object *excess;
+        lock_pool(p);
+        p->max_idle = max_idle;
+        excess = pool_trim(p, max_idle);
+        unlock_pool(p);
+        pool_free_list(excess);
+    }
+    return ZOK;
+}
+
+int zoo_get_pool_stats(zhandle_t *zh, int pool, zoo_pool_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL || pool < 0 || pool >= ZOO_POOL_COUNT) {
+        return ZBADARGUMENTS;
+    }
+    lock_pool(&zh->pools[pool]);
+    *stats = zh->pools[pool].stats;
+    unlock_pool(&zh->pools[pool]);
+    return ZOK;
+}
+
+int zoo_set_cache(zhandle_t *zh, size_t max_bytes)
+{
+    int rc = ZOK;
+    if (zh == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_watchers(zh);
+    /* once created the cache lives as long as the handle, the IO thread
+     * checks for it without the lock */
+    if (zh->cache) {
+        zk_cache_set_limit(zh->cache, max_bytes);
+    } else if (max_bytes) {
+        zh->cache = create_zk_cache(max_bytes);
+        if (!zh->cache) {
+            rc = ZSYSTEMERROR;
+        }
+    }
+    unlock_watchers(zh);
+    return rc;
+}
+
+int zoo_get_cache_stats(zhandle_t *zh, zoo_cache_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_watchers(zh);
+    if (zh->cache) {
+        zk_cache_get_stats(zh->cache, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    unlock_watchers(zh);
+    return ZOK;
+}
+
+/**
+ * Answers a watched read from the cache. The watcher is registered as if
+ * the server had answered, under the same lock the IO thread holds while
+ * it invalidates the entry and collects the watchers of an event, so the
+ * watcher can't miss the event making the returned value stale.
+ */
+static int get_cached_data(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void *watcherCtx, char *buffer, int *buffer_len,
+        struct Stat *stat)
+{
+    watcher_registration_t wo;
+    int hit;
+
+    wo.path = prepend_string(zh, path);
+    if (!wo.path) {
+        return 0;
+    }
+    wo.watcher = watcher;
+    wo.context = watcherCtx;
+    wo.checker = data_result_checker;
+    lock_watchers(zh);
+    hit = zk_cache_get_data(zh->cache, wo.path, buffer, buffer_len, stat);
+    if (hit) {
+        activateWatcher(zh, &wo, ZOK);
+    }
+    unlock_watchers(zh);
+    free_duplicate_path(wo.path, path);
+    return hit;
+}
+
+static int get_cached_children(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void *watcherCtx, struct String_vector *strings,
+        struct Stat *stat)
+{
+    watcher_registration_t wo;
+    int hit;
+
+    wo.path = prepend_string(zh, path);
+    if (!wo.path) {
+        return 0;
+    }
+    wo.watcher = watcher;
+    wo.context = watcherCtx;
+    wo.checker = child_result_checker;
+    lock_watchers(zh);
+    hit = zk_cache_get_children(zh->cache, wo.path, strings, stat);
+    if (hit) {
+        activateWatcher(zh, &wo, ZOK);
+    }
+    unlock_watchers(zh);
+    free_duplicate_path(wo.path, path);
+    return hit;
+}
+
+/* an oarchive whose buffer has room for size bytes, the size of the records
+ * to serialize computed by their sizeof_ functions; 0 leaves the buffer to
+ * grow as they are serialized */
+static struct oarchive *create_pooled_oarchive(zhandle_t *zh, int32_t size)
+{
+    void *storage = pool_alloc(&zh->pools[ZOO_POOL_ARCHIVES]);
+    struct oarchive *oa;
+    if (!storage) {
+        return 0;
+    }
+    oa = init_sized_buffer_oarchive(storage, size);
+    if (!oa) {
+        pool_free(storage);
+    }
+    return oa;
+}
+
+static void close_pooled_oarchive(struct oarchive **oa, int free_buffer)
+{
+    if (free_buffer) {
+        free(get_buffer(*oa));
+    }
+    pool_free(*oa);
+    *oa = 0;
+}
+
+static struct iarchive *create_pooled_iarchive(zhandle_t *zh, char *buffer,
+        int len)
+{
+    void *storage = pool_alloc(&zh->pools[ZOO_POOL_ARCHIVES]);
+    if (!storage) {
+        return 0;
+    }
+    return init_buffer_iarchive(storage, buffer, len);
+}
+
+static void close_pooled_iarchive(struct iarchive **ia)
+{
+    pool_free(*ia);
+    *ia = 0;
+}
+
+static buffer_list_t *allocate_buffer(zhandle_t *zh, char *buff, int len)
+{
+    buffer_list_t *buffer = pool_alloc(&zh->pools[ZOO_POOL_BUFFERS]);
+    if (buffer == 0)
+        return 0;
+
+    buffer->len = len==0?sizeof(*buffer):len;
+    buffer->curr_offset = 0;
+    buffer->submitted = 0;
+    buffer->traced = 0;
+    buffer->payload = 0;
+    buffer->payload_off = 0;
+    buffer->payload_len = 0;
+    buffer->release = 0;
+    buffer->buffer = buff;
+    buffer->next = 0;
+    return buffer;
+}
+
+static void free_buffer(buffer_list_t *b)
+{
+    if (!b) {
+        return;
+    }
+    if (b->buffer) {
+        free(b->buffer);
+    }
+    if (b->release) {
+        b->release(b->payload, b->release_context);
+    }
+    pool_free(b);
+}
+
+static buffer_list_t *dequeue_buffer(buffer_head_t *list)
 {
     buffer_list_t *b;
     lock_buffer_list(list);
@@ -1442,25 +2211,144 @@ static void queue_buffer(buffer_head_t *list, buffer_list_t *b, int add_to_front
     unlock_buffer_list(list);
 }
 
-static int queue_buffer_bytes(buffer_head_t *list, char *buff, int len)
+/* adds the time to the wire of a request whose buffer was sent completely */
+static void record_request_sent(zhandle_t *zh, buffer_list_t *buff)
+{
+    int32_t op;
+    if (!buff->submitted) {
+        return;
+    }
+    memcpy(&op, buff->buffer + sizeof(int32_t), sizeof(op));
+    lock_stats(zh);
+    zk_stats_stage(&zh->stats, ntohl(op), ZOO_STAGE_SENT,
+            system_time_us() - buff->submitted);
+    unlock_stats(zh);
+}
+
+/* adds the latency of request c up to the end of stage, counting it as
+ * failed if err isn't ZOK */
+static void record_request_stage(zhandle_t *zh, completion_list_t *c,
+        int stage, int err)
+{
+    int64_t elapsed;
+    if (c->op < 0) {
+        return;
+    }
+    elapsed = system_time_us() - c->submitted;
+    lock_stats(zh);
+    zk_stats_stage(&zh->stats, c->op, stage, elapsed);
+    if (err != ZOK) {
+        zk_stats_error(&zh->stats, c->op);
+    }
+    unlock_stats(zh);
+}
+
+/* the path of a serialized request of op, which follows the request header
+ * for all requests but multi and reconfig */
+static char *request_path(buffer_list_t *request, int op)
+{
+    int off = 2 * sizeof(int32_t);
+    int32_t len;
+    char *path;
+    if (op == ZOO_MULTI_OP || op == ZOO_RECONFIG_OP ||
+            request->len < off + (int)sizeof(len)) {
+        return 0;
+    }
+    memcpy(&len, request->buffer + off, sizeof(len));
+    len = ntohl(len);
+    off += sizeof(len);
+    if (len < 0 || len > request->len - off) {
+        return 0;
+    }
+    path = malloc(len + 1);
+    if (path) {
+        memcpy(path, request->buffer + off, len);
+        path[len] = '\0';
+    }
+    return path;
+}
+
+/* calls the trace hook at *hookp, a member of zh->trace_hooks, with the
+ * event of traced request c at time now */
+static void trace_request(zhandle_t *zh, zoo_trace_fn *hookp,
+        completion_list_t *c, int64_t now, int rc)
+{
+    zoo_trace_t trace;
+    zoo_trace_fn hook;
+    void *context;
+
+    lock_trace(zh);
+    hook = *hookp;
+    context = zh->trace_hooks.context;
+    unlock_trace(zh);
+    if (!hook) {
+        return;
+    }
+    trace.xid = c->xid;
+    trace.op = c->op;
+    trace.path = c->trace_path;
+    trace.rc = rc;
+    trace.time_us = now;
+    trace.submitted_us = c->submitted;
+    hook(zh, &trace, context);
+}
+
+/* the time from the submission of c to a point of its timeline, -1 if the
+ * request never got there */
+static long long since_submitted(completion_list_t *c, int64_t us)
+{
+    return us ? (long long)(us - c->submitted) : -1;
+}
+
+/* logs traced request c, completed at time now, if it took too long */
+static void log_slow_request(zhandle_t *zh, completion_list_t *c, int64_t now,
+        int rc)
+{
+    int threshold_ms;
+
+    lock_trace(zh);
+    threshold_ms = zh->slow_request_ms;
+    unlock_trace(zh);
+    if (threshold_ms <= 0 || now - c->submitted < (int64_t)threshold_ms * 1000) {
+        return;
+    }
+    LOG_WARN(LOGCALLBACK(zh), "Slow request xid=%#x op=%d path=%s rc=%d "
+            "completed after %lld us: queued after %lld us, sent after %lld us, "
+            "answered after %lld us", c->xid, c->op,
+            c->trace_path ? c->trace_path : "-", rc,
+            since_submitted(c, now), since_submitted(c, c->queued_us),
+            since_submitted(c, c->sent_us), since_submitted(c, c->received_us));
+}
+
+/* notes the first byte of a traced request being written to the socket */
+static void trace_request_sent(zhandle_t *zh, buffer_list_t *buff)
 {
-    buffer_list_t *b  = allocate_buffer(buff,len);
+    completion_list_t *c = buff->traced;
+    c->sent_us = system_time_us();
+    trace_request(zh, &zh->trace_hooks.sent, c, c->sent_us, ZOK);
+}
+
+static int queue_buffer_bytes(zhandle_t *zh, buffer_head_t *list, char *buff,
+        int len)
+{
+    buffer_list_t *b  = allocate_buffer(zh,buff,len);
     if (!b)
         return ZSYSTEMERROR;
     queue_buffer(list, b, 0);
     return ZOK;
 }
 
-static int queue_front_buffer_bytes(buffer_head_t *list, char *buff, int len)
+static int queue_front_buffer_bytes(zhandle_t *zh, buffer_head_t *list,
+        char *buff, int len)
 {
-    buffer_list_t *b  = allocate_buffer(buff,len);
+    buffer_list_t *b  = allocate_buffer(zh,buff,len);
     if (!b)
         return ZSYSTEMERROR;
     queue_buffer(list, b, 1);
     return ZOK;
 }
 
-static __attribute__ ((unused)) int get_queue_len(buffer_head_t *list)
+static int get_queue_len(buffer_head_t *list)
 {
     int i;
     buffer_list_t *ptr;
@@ -1471,12 +2359,110 @@ static __attribute__ ((unused)) int get_queue_len(buffer_head_t *list)
     unlock_buffer_list(list);
     return i;
 }
+
+static int get_completion_queue_len(completion_head_t *list)
+{
+    int i;
+    completion_list_t *ptr;
+    lock_completion_list(list);
+    ptr = list->head;
+    for (i=0; ptr!=0; ptr=ptr->next, i++)
+        ;
+    unlock_completion_list(list);
+    return i;
+}
+
+int zoo_get_stats(zhandle_t *zh, zoo_stats_t *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    memset(stats, 0, sizeof(*stats));
+    lock_stats(zh);
+    zk_stats_snapshot(&zh->stats, stats);
+    unlock_stats(zh);
+
+    lock_buffer_list(&zh->to_send);
+    stats->bytes_sent = zh->io_stats.bytes_sent;
+    stats->bytes_received = zh->io_stats.bytes_received;
+    stats->send_queue = get_queue_len(&zh->to_send) +
+        zh->lanes[LANE_INTERACTIVE].count + zh->lanes[LANE_BULK].count;
+    unlock_buffer_list(&zh->to_send);
+    lock_reconfig(zh);
+    if (zh->connect_stats.handshakes > 1) {
+        stats->reconnects = zh->connect_stats.handshakes - 1;
+    }
+    unlock_reconfig(zh);
+
+    stats->outstanding = get_completion_queue_len(&zh->sent_requests);
+    stats->completions =
+        get_completion_queue_len(&zh->completions_to_process);
+    return ZOK;
+}
+
+/* requests are only tracked while a hook or the slow request log uses them;
+ * must be called with lock_trace() held */
+static void update_tracing(zhandle_t *zh)
+{
+    zoo_trace_hooks_t *hooks = &zh->trace_hooks;
+    zh->tracing = zh->slow_request_ms > 0 || hooks->queued || hooks->sent ||
+        hooks->received || hooks->callback_start || hooks->callback_end;
+}
+
+int zoo_set_trace_hooks(zhandle_t *zh, const zoo_trace_hooks_t *hooks)
+{
+    if (zh == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_trace(zh);
+    if (hooks) {
+        zh->trace_hooks = *hooks;
+    } else {
+        memset(&zh->trace_hooks, 0, sizeof(zh->trace_hooks));
+    }
+    update_tracing(zh);
+    unlock_trace(zh);
+    return ZOK;
+}
+
+int zoo_set_slow_request_log(zhandle_t *zh, int threshold_ms)
+{
+    if (zh == NULL || threshold_ms < 0) {
+        return ZBADARGUMENTS;
+    }
+    lock_trace(zh);
+    zh->slow_request_ms = threshold_ms;
+    update_tracing(zh);
+    unlock_trace(zh);
+    return ZOK;
+}
+
+int zoo_set_request_timeout(zhandle_t *zh, int timeout_ms)
+{
+    if (zh == NULL || timeout_ms < 0) {
+        return ZBADARGUMENTS;
+    }
+    lock_reconfig(zh);
+    zh->request_timeout = timeout_ms;
+    unlock_reconfig(zh);
+    return ZOK;
+}
+
+int zoo_set_priority_reads(zhandle_t *zh, int enabled)
+{
+    if (zh == NULL) {
+        return ZBADARGUMENTS;
+    }
+    zh->priority_reads = enabled != 0;
+    return ZOK;
+}
+#ifdef _WIN32
 /* returns:
  * -1 if send failed,
  * 0 if send would block while sending the buffer (or a send was incomplete),
  * 1 if success
  */
-static int send_buffer(socket_t fd, buffer_list_t *buff)
+static int send_buffer(zhandle_t *zh, buffer_list_t *buff)
 {
     int len = buff->len;
     int off = buff->curr_offset;
@@ -1486,13 +2472,10 @@ static int send_buffer(socket_t fd, buffer_list_t *buff)
         /* we need to send the length at the beginning */
         int nlen = htonl(len);
         char *b = (char*)&nlen;
-        rc = zookeeper_send(fd, b + off, sizeof(nlen) - off);
+        rc = zookeeper_send(zh->fd, b + off, sizeof(nlen) - off);
+        zh->io_stats.send_calls++;
         if (rc == -1) {
-#ifdef _WIN32
             if (WSAGetLastError() != WSAEWOULDBLOCK) {
-#else
-            if (errno != EAGAIN) {
-#endif
                 return -1;
             } else {
                 return 0;
@@ -1505,13 +2488,10 @@ static int send_buffer(socket_t fd, buffer_list_t *buff)
     if (off >= 4) {
         /* want off to now represent the offset into the buffer */
         off -= sizeof(buff->len);
-        rc = zookeeper_send(fd, buff->buffer + off, len - off);
+        rc = zookeeper_send(zh->fd, buff->buffer + off, len - off);
+        zh->io_stats.send_calls++;
         if (rc == -1) {
-#ifdef _WIN32
             if (WSAGetLastError() != WSAEWOULDBLOCK) {
-#else
-            if (errno != EAGAIN) {
-#endif
                 return -1;
             }
         } else {
@@ -1521,6 +2501,131 @@ static int send_buffer(socket_t fd, buffer_list_t *buff)
     return buff->curr_offset == len + sizeof(buff->len);
 }
 
+/* returns:
+ * -1 if send failed,
+ * 0 if send would block,
+ * 1 if some data was sent
+ * the caller must hold the to_send lock
+ */
+static int send_queued_buffers(zhandle_t *zh)
+{
+    buffer_list_t *buff = zh->to_send.head;
+    int before = buff->curr_offset;
+    int rc = send_buffer(zh, buff);
+    int sent = buff->curr_offset - before;
+
+    if (before == 0 && sent > 0 && buff->traced) {
+        trace_request_sent(zh, buff);
+    }
+
+    zh->io_stats.bytes_sent += sent;
+    if (rc > 0) {
+        zh->io_stats.buffers_sent++;
+        record_request_sent(zh, buff);
+        remove_buffer(&zh->to_send);
+    }
+    return rc < 0 ? rc : sent > 0;
+}
+#else
+/* max number of queued buffers coalesced into a single sendmsg() call; each
+ * contributes an iovec for its length prefix and one for its body, or three
+ * if the body refers to a payload sent in place */
+#define SEND_IOV_BUFFERS 64
+
+/* points iov at the body of buff from off on; returns the iovecs used */
+static int body_iov(buffer_list_t *buff, int off, struct iovec *iov)
+{
+    int end = buff->payload_off + buff->payload_len;
+    int n = 0;
+    if (!buff->payload) {
+        iov[0].iov_base = buff->buffer + off;
+        iov[0].iov_len = buff->len - off;
+        return 1;
+    }
+    if (off < buff->payload_off) {
+        iov[n].iov_base = buff->buffer + off;
+        iov[n].iov_len = buff->payload_off - off;
+        n++;
+        off = buff->payload_off;
+    }
+    if (off < end) {
+        iov[n].iov_base = (char*)buff->payload + off - buff->payload_off;
+        iov[n].iov_len = end - off;
+        n++;
+        off = end;
+    }
+    /* the rest of the request follows the payload in buffer */
+    iov[n].iov_base = buff->buffer + off - buff->payload_len;
+    iov[n].iov_len = buff->len - off;
+    return n + 1;
+}
+
+/* Write as many queued buffers as the socket accepts with a single sendmsg()
+ * call. Buffers that were written completely are removed from the queue, a
+ * partially written buffer keeps its offset for the next call.
+ *
+ * returns:
+ * -1 if send failed,
+ * 0 if send would block,
+ * 1 if some data was sent
+ * the caller must hold the to_send lock
+ */
+static int send_queued_buffers(zhandle_t *zh)
+{
+    struct iovec iov[SEND_IOV_BUFFERS * 4];
+    int32_t nlen[SEND_IOV_BUFFERS];
+    struct msghdr msg;
+    buffer_list_t *buff;
+    int niov = 0;
+    int nbuff = 0;
+    ssize_t rc;
+
+    for (buff = zh->to_send.head; buff && nbuff < SEND_IOV_BUFFERS;
+            buff = buff->next, nbuff++) {
+        int off = buff->curr_offset;
+        if (off < 4) {
+            /* the length prefix (or what is left of it) goes first */
+            nlen[nbuff] = htonl(buff->len);
+            iov[niov].iov_base = (char*)&nlen[nbuff] + off;
+            iov[niov].iov_len = sizeof(nlen[nbuff]) - off;
+            niov++;
+            off = sizeof(nlen[nbuff]);
+        }
+        /* want off to now represent the offset into the body */
+        off -= sizeof(buff->len);
+        niov += body_iov(buff, off, iov + niov);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    rc = sendmsg(zh->fd, &msg, SEND_FLAGS);
+    zh->io_stats.send_calls++;
+    if (rc == -1) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    zh->io_stats.bytes_sent += rc;
+
+    while (rc > 0) {
+        size_t left;
+        buff = zh->to_send.head;
+        if (buff->curr_offset == 0 && buff->traced) {
+            trace_request_sent(zh, buff);
+        }
+        left = buff->len + sizeof(buff->len) - buff->curr_offset;
+        if ((size_t)rc < left) {
+            buff->curr_offset += rc;
+            break;
+        }
+        rc -= left;
+        zh->io_stats.buffers_sent++;
+        record_request_sent(zh, buff);
+        remove_buffer(&zh->to_send);
+    }
+    return 1;
+}
+#endif
+
 /* returns:
  * -1 if recv call failed,
  * 0 if recv would block,
@@ -1535,6 +2640,7 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
     if (off < 4) {
         char *buffer = (char*)&(buff->len);
         rc = recv(zh->fd, buffer+off, sizeof(int)-off, 0);
+        zh->io_stats.recv_calls++;
         switch (rc) {
         case 0:
             errno = EHOSTDOWN;
@@ -1549,6 +2655,7 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
             return -1;
         default:
             buff->curr_offset += rc;
+            zh->io_stats.bytes_received += rc;
         }
         off = buff->curr_offset;
         if (buff->curr_offset == sizeof(buff->len)) {
@@ -1561,6 +2668,7 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
         off -= sizeof(buff->len);
 
         rc = recv(zh->fd, buff->buffer+off, buff->len-off, 0);
+        zh->io_stats.recv_calls++;
 
         /* dirty hack to make new client work against old server
          * old server sends 40 bytes to finish connection handshake,
@@ -1581,38 +2689,317 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
             return -1;
         default:
             buff->curr_offset += rc;
+            zh->io_stats.bytes_received += rc;
         }
     }
     return buff->curr_offset == buff->len + sizeof(buff->len);
 }
 
+/* size of the read-ahead buffer responses are received into */
+#define RECV_AHEAD_SIZE (64 * 1024)
+
+/* Receive as much as the socket holds into the read-ahead buffer with a
+ * single recv() call and queue every complete packet found in it to
+ * to_process. An incomplete packet larger than half of the read-ahead buffer
+ * gets a dedicated buffer (zh->input_buffer) the rest of it is received into
+ * directly.
+ *
+ * returns:
+ * -1 if recv call failed,
+ * 0 if recv would block or no packet has been completed,
+ * 1 if at least one packet was queued
+ */
+static int recv_packets(zhandle_t *zh)
+{
+    recv_ahead_t *ra = &zh->recv_ahead;
+    buffer_list_t *head = 0;
+    buffer_list_t *last = 0;
+    int count = 0;
+    int failed = 0;                     /* errno of a failed split */
+    int rc;
+
+    if (zh->input_buffer) {
+        /* a large packet is being received into its own buffer */
+        rc = recv_buffer(zh, zh->input_buffer);
+        if (rc <= 0) {
+            return rc;
+        }
+        zh->io_stats.buffers_received++;
+        queue_buffer(&zh->to_process, zh->input_buffer, 0);
+        zh->input_buffer = 0;
+        return 1;
+    }
+
+    if (ra->buffer == 0) {
+        ra->buffer = malloc(RECV_AHEAD_SIZE);
+        if (ra->buffer == 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ra->len = RECV_AHEAD_SIZE;
+        ra->start = ra->end = 0;
+    }
+    if (ra->start > 0) {
+        /* move the beginning of an incomplete packet to the front */
+        memmove(ra->buffer, ra->buffer + ra->start, ra->end - ra->start);
+        ra->end -= ra->start;
+        ra->start = 0;
+    }
+
+    rc = recv(zh->fd, ra->buffer + ra->end, ra->len - ra->end, 0);
+    zh->io_stats.recv_calls++;
+    switch (rc) {
+    case 0:
+        errno = EHOSTDOWN;
+    case -1:
+#ifdef _WIN32
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+        if (errno == EAGAIN) {
+#endif
+            return 0;
+        }
+        return -1;
+    default:
+        ra->end += rc;
+        zh->io_stats.bytes_received += rc;
+    }
+
+    while (ra->end - ra->start >= (int)sizeof(int32_t)) {
+        int32_t len;
+        int avail = ra->end - ra->start - sizeof(len);
+        buffer_list_t *b;
+        char *data;
+
+        memcpy(&len, ra->buffer + ra->start, sizeof(len));
+        len = ntohl(len);
+        if (len < 0) {
+            failed = EINVAL;
+            break;
+        }
+        if (avail < len && len <= ra->len / 2) {
+            /* wait for the rest of the packet */
+            break;
+        }
+        /* an empty frame still gets a buffer, malloc(0) may return NULL */
+        data = malloc(len ? len : 1);
+        b = data ? allocate_buffer(zh, data, len) : 0;
+        if (b == 0) {
+            free(data);
+            failed = ENOMEM;
+            break;
+        }
+        /* allocate_buffer() reserves a default size for len 0, the
+         * decoder must not read past this frame */
+        b->len = len;
+        if (avail < len) {
+            memcpy(b->buffer, ra->buffer + ra->start + sizeof(len), avail);
+            b->curr_offset = sizeof(len) + avail;
+            ra->start = ra->end = 0;
+            zh->input_buffer = b;
+            break;
+        }
+        memcpy(b->buffer, ra->buffer + ra->start + sizeof(len), len);
+        b->curr_offset = sizeof(len) + len;
+        ra->start += sizeof(len) + len;
+        if (last) {
+            last->next = b;
+        } else {
+            head = b;
+        }
+        last = b;
+        count++;
+    }
+    if (ra->start == ra->end) {
+        ra->start = ra->end = 0;
+    }
+
+    /* the packets split off before a failure are queued all the same, so
+     * that cleanup_bufs() frees them with the rest */
+    if (head) {
+        lock_buffer_list(&zh->to_process);
+        if (zh->to_process.head) {
+            zh->to_process.last->next = head;
+        } else {
+            zh->to_process.head = head;
+        }
+        zh->to_process.last = last;
+        unlock_buffer_list(&zh->to_process);
+        zh->io_stats.buffers_received += count;
+    }
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return count > 0;
+}
+
 void free_buffers(buffer_head_t *list)
 {
     while (remove_buffer(list))
         ;
 }
 
+/* registers or removes the watcher of the request answered by bptr, as the
+ * server did, and caches the response alongside */
+static void apply_watcher_changes(zhandle_t *zh, completion_list_t *cptr,
+        int rc, buffer_list_t *bptr)
+{
+    if (cptr->watcher || cptr->watcher_deregistration) {
+        lock_watchers(zh);
+        activateWatcher(zh, cptr->watcher, rc);
+        deactivateWatcher(zh, cptr->watcher_deregistration, rc);
+        if (zh->cache) {
+            cache_response(zh, cptr, rc, bptr);
+        }
+        unlock_watchers(zh);
+    }
+}
+
+/* destroys the entry left in sent_requests by a request that timed out */
+static void destroy_expired_request(completion_list_t *c)
+{
+    if (c->c.type == COMPLETION_MULTI) {
+        /* the operations of a synchronous multi never complete */
+        completion_list_t *op;
+        while ((op = dequeue_completion_nolock(&c->c.clist)) != 0) {
+            destroy_completion_entry(op);
+        }
+    }
+    destroy_completion_entry(c);
+}
+
+/* Fails a request whose deadline passed with ZOPERATIONTIMEOUT. Its entry
+ * stays in sent_requests, without a caller, so that a late response is
+ * still matched in order; an asynchronous completion is handed a copy of
+ * the entry. The caller must hold the sent_requests lock. */
+static void expire_request(zhandle_t *zh, completion_list_t *c,
+        completion_head_t *ready)
+{
+    int64_t now = system_time_us();
+    /* a request still waiting in its lane keeps its packet and has no xid
+     * yet */
+    int32_t xid = c->request ? UNASSIGNED_XID : c->xid;
+
+    if (xid == UNASSIGNED_XID) {
+        LOG_DEBUG(LOGCALLBACK(zh), "Request timed out after %lld us "
+                "before it was sent", (long long)(now - c->submitted));
+    } else {
+        LOG_DEBUG(LOGCALLBACK(zh), "Request xid=%#x timed out after %lld us",
+                xid, (long long)(now - c->submitted));
+    }
+    if (c->c.void_result == SYNCHRONOUS_MARKER) {
+        struct sync_completion *sc = (struct sync_completion*)c->data;
+        sc->rc = ZOPERATIONTIMEOUT;
+        record_request_stage(zh, c, ZOO_STAGE_COMPLETED, ZOPERATIONTIMEOUT);
+        if (c->traced) {
+            log_slow_request(zh, c, now, ZOPERATIONTIMEOUT);
+        }
+        notify_sync_completion(sc);
+        zh->outstanding_sync--;
+    } else {
+        completion_list_t *timeout = pool_alloc(&zh->pools[ZOO_POOL_COMPLETIONS]);
+        if (!timeout) {
+            /* the request completes when it is answered */
+            LOG_ERROR(LOGCALLBACK(zh), "out of memory");
+            return;
+        }
+        /* the copy takes the callback and the operations of a multi over;
+         * it is completed like a lost request. The watcher changes stay
+         * with the entry, a late response still applies them */
+        *timeout = *c;
+        memset(&timeout->deadline, 0, sizeof(timeout->deadline));
+        timeout->request = 0;
+        timeout->watcher = 0;
+        timeout->watcher_deregistration = 0;
+        timeout->hdr.xid = xid;
+        timeout->hdr.zxid = -1;
+        timeout->hdr.err = ZOPERATIONTIMEOUT;
+        queue_completion_nolock(ready, timeout, 0);
+        c->trace_path = 0;
+        c->c.clist.head = 0;
+        c->c.clist.last = 0;
+    }
+    lock_stats(zh);
+    zh->stats.timeouts++;
+    unlock_stats(zh);
+    c->c.void_result = 0;
+    c->data = 0;
+    c->op = -1;
+    c->expired = 1;
+}
+
+/* Fails the requests whose deadline passed, once they are queued. Returns
+ * the ms until the deadlines have to be checked again, -1 if no request
+ * has one. */
+static int expire_requests(zhandle_t *zh, const struct timeval *now)
+{
+    int64_t now_ms = ((int64_t)now->tv_sec) * 1000 + now->tv_usec / 1000;
+    completion_head_t ready = {0, 0};
+    zk_timer_t *t;
+    int64_t next;
+
+    if (zh->fd == -1) {
+        /* zookeeper_interest() only queues the submitted requests while it
+         * has a socket, so their deadlines wouldn't start. Queued here, they
+         * move on to to_send up to its limits like any others; the rest
+         * wait in their lanes */
+        lock_buffer_list(&zh->to_send);
+        queue_submitted_requests(zh);
+        unlock_buffer_list(&zh->to_send);
+    }
+    lock_completion_list(&zh->sent_requests);
+    t = zk_timer_wheel_expire(&zh->deadlines, now_ms);
+    while (t) {
+        completion_list_t *c = DEADLINE_ENTRY(t);
+        t = t->next;
+        expire_request(zh, c, &ready);
+    }
+    next = zk_timer_wheel_next(&zh->deadlines);
+    unlock_completion_list(&zh->sent_requests);
+    queue_completion_batch(&zh->completions_to_process, &ready);
+
+    if (next < 0) {
+        return -1;
+    }
+    return next <= now_ms ? 0 :
+        (next - now_ms > INT_MAX ? INT_MAX : (int)(next - now_ms));
+}
+
 void free_completions(zhandle_t *zh,int callCompletion,int reason)
 {
     completion_head_t tmp_list;
-    struct oarchive *oa;
-    struct ReplyHeader h;
     void_completion_t auth_completion = NULL;
     auth_completion_list_t a_list, *a_tmp;
+    buffer_list_t *b;
 
+    /* the packets still queued no longer refer to the requests, which may
+     * have been traced even if tracing is off by now */
+    lock_buffer_list(&zh->to_send);
+    for (b = zh->to_send.head; b; b = b->next) {
+        b->traced = 0;
+    }
+    unlock_buffer_list(&zh->to_send);
     lock_completion_list(&zh->sent_requests);
     tmp_list = zh->sent_requests;
     zh->sent_requests.head = 0;
     zh->sent_requests.last = 0;
+    zk_timer_wheel_clear(&zh->deadlines);
     unlock_completion_list(&zh->sent_requests);
     while (tmp_list.head) {
         completion_list_t *cptr = tmp_list.head;
 
         tmp_list.head = cptr->next;
-        if (cptr->c.data_result == SYNCHRONOUS_MARKER) {
+        if (cptr->expired) {
+            destroy_expired_request(cptr);
+        } else if (cptr->c.data_result == SYNCHRONOUS_MARKER) {
             struct sync_completion
                         *sc = (struct sync_completion*)cptr->data;
             sc->rc = reason;
+            record_request_stage(zh, cptr, ZOO_STAGE_COMPLETED, reason);
+            if (cptr->traced) {
+                log_slow_request(zh, cptr, system_time_us(), reason);
+            }
             notify_sync_completion(sc);
             zh->outstanding_sync--;
             destroy_completion_entry(cptr);
@@ -1621,19 +3008,10 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
                 // Nothing to do with a ping response
                 destroy_completion_entry(cptr);
             } else {
-                // Fake the response
-                buffer_list_t *bptr;
-                h.xid = cptr->xid;
-                h.zxid = -1;
-                h.err = reason;
-                oa = create_buffer_oarchive();
-                serialize_ReplyHeader(oa, "header", &h);
-                bptr = calloc(sizeof(*bptr), 1);
-                assert(bptr);
-                bptr->len = get_buffer_len(oa);
-                bptr->buffer = get_buffer(oa);
-                close_buffer_oarchive(&oa, 0);
-                cptr->buffer = bptr;
+                // Fake the response, which has no body
+                cptr->hdr.xid = cptr->xid;
+                cptr->hdr.zxid = -1;
+                cptr->hdr.err = reason;
                 queue_completion(&zh->completions_to_process, cptr, 0);
             }
         }
@@ -1658,7 +3036,12 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
 static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc)
 {
     enter_critical(zh);
+    lock_buffer_list(&zh->to_send);
+    queue_submitted_requests(zh);
+    /* the requests waiting in the lanes fail with the ones sent */
+    fill_send_queue(zh, 1);
     free_buffers(&zh->to_send);
+    unlock_buffer_list(&zh->to_send);
     free_buffers(&zh->to_process);
     free_completions(zh,callCompletion,rc);
     leave_critical(zh);
@@ -1666,6 +3049,7 @@ static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc)
         free_buffer(zh->input_buffer);
         zh->input_buffer = 0;
     }
+    zh->recv_ahead.start = zh->recv_ahead.end = 0;
 }
 
 /* return 1 if zh's state is ZOO_CONNECTED_STATE or ZOO_READONLY_STATE,
@@ -1675,9 +3059,69 @@ static int is_connected(zhandle_t* zh)
     return (zh->state==ZOO_CONNECTED_STATE || zh->state==ZOO_READONLY_STATE);
 }
 
+/**
+ * Decide when to connect again after a connection failed or was lost. The
+ * fixed delay after a failed pass over the servers (zh->delay) is replaced
+ * by a jittered exponential backoff if one is configured.
+ */
+static void schedule_reconnect(zhandle_t *zh, int rc, int was_connected)
+{
+    struct timeval now;
+    int wait = 0;
+
+    get_system_time(&now);
+    lock_reconfig(zh);
+    if (was_connected) {
+        zh->disconnected_since = now;
+        zh->backoff_passes = 0;
+        /* a r/w server was found, there is no outage to spread */
+        if (zh->backoff_spread > 0 && rc != ZRWSERVERFOUND) {
+            wait = (int)(drand48() * zh->backoff_spread);
+        }
+    } else {
+        zh->connect_stats.failures++;
+        if (zh->backoff_base > 0 && zh->delay) {
+            int limit = zh->backoff_base;
+            int i;
+            /* doubling past backoff_max / 2 could overflow, clamp instead */
+            for (i = 0; i < zh->backoff_passes && limit < zh->backoff_max; i++) {
+                limit = limit > zh->backoff_max / 2 ? zh->backoff_max : limit * 2;
+            }
+            zh->backoff_passes++;
+            wait = (int)(drand48() * limit);
+        }
+    }
+    if (zh->backoff_base > 0) {
+        zh->delay = 0;
+    }
+    if (wait > 0) {
+        zh->connect_stats.backoffs++;
+        zh->connect_stats.backoff_ms += wait;
+        zh->connect_stats.last_backoff_ms = wait;
+        zh->reconnect_at.tv_sec = now.tv_sec + wait / 1000;
+        zh->reconnect_at.tv_usec = now.tv_usec + (wait % 1000) * 1000;
+        if (zh->reconnect_at.tv_usec >= 1000000) {
+            zh->reconnect_at.tv_sec++;
+            zh->reconnect_at.tv_usec -= 1000000;
+        }
+        LOG_INFO(LOGCALLBACK(zh), "Waiting %dms before reconnecting to [%s]",
+                 wait, zh->hostname);
+    }
+    unlock_reconfig(zh);
+}
+
 static void handle_error(zhandle_t *zh,int rc)
 {
+    int was_connected = is_connected(zh);
+
+    /* callers sending directly check the socket under the to_send lock */
+    lock_buffer_list(&zh->to_send);
     close(zh->fd);
+    zh->fd = -1;
+    unlock_buffer_list(&zh->to_send);
+    /* the probe peeks at the next address, which is about to change */
+    rw_probe_close(zh);
+    connect_race_close(zh);
     if (is_unrecoverable(zh)) {
         LOG_DEBUG(LOGCALLBACK(zh), "Calling a watcher for a ZOO_SESSION_EVENT and the state=%s",
                 state2String(zh->state));
@@ -1687,15 +3131,20 @@ static void handle_error(zhandle_t *zh,int rc)
         PROCESS_SESSION_EVENT(zh, ZOO_CONNECTING_STATE);
     }
     cleanup_bufs(zh,1,rc);
-    zh->fd = -1;
 
     LOG_DEBUG(LOGCALLBACK(zh), "Previous connection=[%s] delay=%d", zoo_get_current_server(zh), zh->delay);
+    if (!was_connected && !is_unrecoverable(zh)) {
+        record_connect_failure(zh, &zh->addr_cur);
+    }
 
     // NOTE: If we're at the end of the list of addresses to connect to, then
     // we want to delay the next connection attempt to avoid spinning.
     // Then increment what host we'll connect to since we failed to connect to current
     zh->delay = addrvec_atend(&zh->addrs);
     addrvec_next(&zh->addrs, &zh->addr_cur);
+    if (!is_unrecoverable(zh)) {
+        schedule_reconnect(zh, rc, was_connected);
+    }
 
     if (!is_unrecoverable(zh)) {
         zh->state = 0;
@@ -1767,17 +3216,18 @@ static int send_info_packet(zhandle_t *zh, auth_info* auth) {
     struct RequestHeader h = {AUTH_XID, ZOO_SETAUTH_OP};
     struct AuthPacket req;
     int rc;
-    oa = create_buffer_oarchive();
-    rc = serialize_RequestHeader(oa, "header", &h);
     req.type=0;   // ignored by the server
     req.scheme = auth->scheme;
     req.auth = auth->auth;
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_AuthPacket(&req));
+    rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_AuthPacket(oa, "req", &req);
     /* add this buffer to the head of the send queue */
-    rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_front_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
     return rc;
 }
@@ -1819,51 +3269,189 @@ static int send_last_auth_info(zhandle_t *zh)
     return (rc < 0)?ZMARSHALLINGERROR:ZOK;
 }
 
-static void free_key_list(char **list, int count)
+/* SetWatches packets stay well below the server's jute.maxbuffer */
+#define SET_WATCHES_MAX_LENGTH (128 * 1024)
+
+static const char *SET_WATCHES_VECTORS[] = {
+    "dataWatches", "existWatches", "childWatches"
+};
+
+/* serializes SetWatches packets straight from the watcher tables */
+struct set_watches_writer {
+    zhandle_t *zh;
+    struct oarchive *oa;        /* the packet being written */
+    int vector;                 /* index in SET_WATCHES_VECTORS being written */
+    int count_offset;           /* where the count of that vector is stored */
+    int32_t count;              /* paths written to that vector */
+    int packet_paths;           /* paths written to the packet */
+    buffer_list_t *head;        /* the finished packets */
+    buffer_list_t *last;
+    int packets;
+    int paths;
+};
+
+static int start_watches_vector(struct set_watches_writer *w)
 {
-    int i;
+    int32_t count = 0;
+    /* the count is only known at the end, see end_watches_vector() */
+    w->count_offset = get_buffer_len(w->oa);
+    w->count = 0;
+    return w->oa->start_vector(w->oa, SET_WATCHES_VECTORS[w->vector], &count);
+}
+
+static int end_watches_vector(struct set_watches_writer *w)
+{
+    int32_t count = htonl(w->count);
+    memcpy(get_buffer(w->oa) + w->count_offset, &count, sizeof(count));
+    return w->oa->end_vector(w->oa, SET_WATCHES_VECTORS[w->vector]);
+}
 
-    for(i = 0; i < count; i++) {
-        free(list[i]);
+static int write_empty_watches_vectors(struct set_watches_writer *w, int from,
+        int to)
+{
+    int32_t count = 0;
+    int rc = 0;
+    int i;
+    for (i = from; rc >= 0 && i < to; i++) {
+        rc = w->oa->start_vector(w->oa, SET_WATCHES_VECTORS[i], &count);
+        rc = rc < 0 ? rc : w->oa->end_vector(w->oa, SET_WATCHES_VECTORS[i]);
     }
-    free(list);
+    return rc;
 }
 
-static int send_set_watches(zhandle_t *zh)
+static int start_set_watches(struct set_watches_writer *w)
 {
-    struct oarchive *oa;
     struct RequestHeader h = {SET_WATCHES_XID, ZOO_SETWATCHES_OP};
-    struct SetWatches req;
+    int64_t zxid = w->zh->last_zxid;
     int rc;
 
-    req.relativeZxid = zh->last_zxid;
-    req.dataWatches.data = collect_keys(zh->active_node_watchers, (int*)&req.dataWatches.count);
-    req.existWatches.data = collect_keys(zh->active_exist_watchers, (int*)&req.existWatches.count);
-    req.childWatches.data = collect_keys(zh->active_child_watchers, (int*)&req.childWatches.count);
-
-    // return if there are no pending watches
-    if (!req.dataWatches.count && !req.existWatches.count &&
-        !req.childWatches.count) {
-        free_key_list(req.dataWatches.data, req.dataWatches.count);
-        free_key_list(req.existWatches.data, req.existWatches.count);
-        free_key_list(req.childWatches.data, req.childWatches.count);
-        return ZOK;
+    /* the packet grows with the paths written to it */
+    w->oa = create_pooled_oarchive(w->zh, 0);
+    if (!w->oa) {
+        return ZSYSTEMERROR;
     }
+    w->packet_paths = 0;
+    rc = serialize_RequestHeader(w->oa, "header", &h);
+    rc = rc < 0 ? rc : w->oa->start_record(w->oa, "req");
+    rc = rc < 0 ? rc : w->oa->serialize_Long(w->oa, "relativeZxid", &zxid);
+    /* the vectors completed by the previous packets are sent empty */
+    rc = rc < 0 ? rc : write_empty_watches_vectors(w, 0, w->vector);
+    return rc < 0 ? rc : start_watches_vector(w);
+}
 
+static int finish_set_watches(struct set_watches_writer *w)
+{
+    buffer_list_t *b;
+    int rc;
 
-    oa = create_buffer_oarchive();
-    rc = serialize_RequestHeader(oa, "header", &h);
-    rc = rc < 0 ? rc : serialize_SetWatches(oa, "req", &req);
-    /* add this buffer to the head of the send queue */
-    rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
-    free_key_list(req.dataWatches.data, req.dataWatches.count);
-    free_key_list(req.existWatches.data, req.existWatches.count);
-    free_key_list(req.childWatches.data, req.childWatches.count);
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending set watches request to %s",zoo_get_current_server(zh));
-    return (rc < 0)?ZMARSHALLINGERROR:ZOK;
+    rc = end_watches_vector(w);
+    rc = rc < 0 ? rc : write_empty_watches_vectors(w, w->vector + 1,
+            sizeof(SET_WATCHES_VECTORS)/sizeof(SET_WATCHES_VECTORS[0]));
+    rc = rc < 0 ? rc : w->oa->end_record(w->oa, "req");
+    b = rc < 0 ? 0 : allocate_buffer(w->zh, get_buffer(w->oa),
+            get_buffer_len(w->oa));
+    close_pooled_oarchive(&w->oa, b == 0);
+    if (!b) {
+        return rc < 0 ? rc : ZSYSTEMERROR;
+    }
+    if (w->last) {
+        w->last->next = b;
+    } else {
+        w->head = b;
+    }
+    w->last = b;
+    w->packets++;
+    return ZOK;
+}
+
+static int write_watched_path(const char *path, void *ctx)
+{
+    struct set_watches_writer *w = ctx;
+    /* the length of the path and the counts of the vectors still to come */
+    int needed = sizeof(int32_t) * (1 + 2 - w->vector) + strlen(path);
+    int rc;
+
+    if (w->packet_paths > 0 &&
+            get_buffer_len(w->oa) + needed > SET_WATCHES_MAX_LENGTH) {
+        rc = finish_set_watches(w);
+        rc = rc < 0 ? rc : start_set_watches(w);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    rc = w->oa->serialize_String(w->oa, "data", (char**)&path);
+    if (rc < 0) {
+        return rc;
+    }
+    w->count++;
+    w->packet_paths++;
+    w->paths++;
+    return 0;
+}
+
+/**
+ * Re-registers the active watches with the server after a reconnect. The
+ * paths are split over as many SetWatches packets as needed to keep each
+ * of them below SET_WATCHES_MAX_LENGTH; the server handles every packet
+ * on its own. The packets go to the head of the send queue.
+ */
+static int send_set_watches(zhandle_t *zh)
+{
+    zk_hashtable *tables[3];
+    struct set_watches_writer w;
+    buffer_list_t *b;
+    int rc;
+
+    tables[0] = zh->active_node_watchers;
+    tables[1] = zh->active_exist_watchers;
+    tables[2] = zh->active_child_watchers;
+    memset(&w, 0, sizeof(w));
+    w.zh = zh;
+    lock_watchers(zh);
+    rc = start_set_watches(&w);
+    while (rc >= 0) {
+        rc = for_each_watched_path(tables[w.vector], write_watched_path, &w);
+        if (rc < 0 || w.vector == 2) {
+            break;
+        }
+        rc = end_watches_vector(&w);
+        w.vector++;
+        rc = rc < 0 ? rc : start_watches_vector(&w);
+    }
+    if (rc >= 0 && w.packet_paths > 0) {
+        rc = finish_set_watches(&w);
+    } else if (w.oa) {
+        close_pooled_oarchive(&w.oa, 1);
+    }
+    if (rc >= 0 && w.packets > 0) {
+        zh->rewatch_stats.rewatches++;
+        zh->rewatch_stats.packets += w.packets;
+        zh->rewatch_stats.paths += w.paths;
+        zh->rewatch_stats.pending = w.packets;
+        get_system_time(&zh->rewatch_started);
+    }
+    unlock_watchers(zh);
+
+    if (rc < 0) {
+        while ((b = w.head) != 0) {
+            w.head = b->next;
+            free_buffer(b);
+        }
+        return ZMARSHALLINGERROR;
+    }
+    if (w.head) {
+        /* ahead of the requests queued while disconnected */
+        lock_buffer_list(&zh->to_send);
+        w.last->next = zh->to_send.head;
+        if (!zh->to_send.head) {
+            zh->to_send.last = w.last;
+        }
+        zh->to_send.head = w.head;
+        unlock_buffer_list(&zh->to_send);
+        LOG_DEBUG(LOGCALLBACK(zh), "Sending %d set watches requests for %d paths to %s",
+                w.packets, w.paths, zoo_get_current_server(zh));
+    }
+    return ZOK;
 }
 
 static int serialize_prime_connect(struct connect_req *req, char* buffer){
@@ -1956,7 +3544,12 @@ static int prime_connection(zhandle_t *zh)
                 "failed to send a handshake packet: %s", strerror(errno));
     }
     zh->state = ZOO_ASSOCIATING_STATE;
+    get_system_time(&zh->handshake_sent);
 
+    if (zh->input_buffer && zh->input_buffer != &zh->primer_buffer) {
+        free_buffer(zh->input_buffer);
+    }
+    zh->recv_ahead.start = zh->recv_ahead.end = 0;
     zh->input_buffer = &zh->primer_buffer;
     memset(zh->input_buffer->buffer, 0, zh->input_buffer->len);
 
@@ -1985,86 +3578,349 @@ static struct timeval get_timeval(int interval)
     if (interval < 0) {
         interval = 0;
     }
-    tv.tv_sec = interval/1000;
-    tv.tv_usec = (interval%1000)*1000;
-    return tv;
+    tv.tv_sec = interval/1000;
+    tv.tv_usec = (interval%1000)*1000;
+    return tv;
+}
+
+ int send_ping(zhandle_t* zh)
+ {
+    int rc;
+    struct RequestHeader h = {PING_XID, ZOO_PING_OP};
+    struct oarchive *oa = create_pooled_oarchive(zh, sizeof_RequestHeader(&h));
+
+    rc = serialize_RequestHeader(oa, "header", &h);
+    /* the ping skips the submission queue, so its completion and buffer are
+     * queued under the to_send lock to keep them in wire order */
+    lock_buffer_list(&zh->to_send);
+    get_system_time(&zh->last_ping);
+    rc = rc < 0 ? rc : do_add_completion(zh, 0, create_completion_entry(zh,
+                h.xid, COMPLETION_VOID, 0, 0, 0, 0));
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
+            get_buffer_len(oa));
+    unlock_buffer_list(&zh->to_send);
+    close_pooled_oarchive(&oa, 0);
+    return rc<0 ? rc : adaptor_send_queue(zh, 0);
+}
+
+/* upper bound of a timeout for seeking for r/w server when in read-only mode */
+const int MAX_RW_TIMEOUT = 60000;
+const int MIN_RW_TIMEOUT = 200;
+
+/* how long the probe of a server may take, including the connect */
+#define RW_PROBE_TIMEOUT 1000
+/* how often a running probe is advanced when its socket isn't polled */
+#define RW_PROBE_POLL_INTERVAL 50
+
+static void rw_probe_close(zhandle_t *zh)
+{
+    if (zh->rw_probe.state != RW_PROBE_IDLE) {
+        close(zh->rw_probe.fd);
+        zh->rw_probe.fd = -1;
+        zh->rw_probe.state = RW_PROBE_IDLE;
+    }
+}
+
+/* start probing the next server; returns 0 if the probe is running */
+static int rw_probe_start(zhandle_t *zh, struct timeval *now)
+{
+    rw_probe_t *probe = &zh->rw_probe;
+    int rc;
+
+    addrvec_peek(&zh->addrs, &probe->addr);
+
+    probe->fd = socket(probe->addr.ss_family, SOCK_STREAM, 0);
+    if (probe->fd < 0) {
+        probe->fd = -1;
+        return -1;
+    }
+
+    zookeeper_set_sock_nodelay(zh, probe->fd);
+    zookeeper_set_sock_noblock(zh, probe->fd);
+
+    probe->sent = 0;
+    probe->received = 0;
+    probe->state = RW_PROBE_SENDING;
+    probe->deadline = *now;
+    probe->deadline.tv_sec += RW_PROBE_TIMEOUT / 1000;
+    probe->deadline.tv_usec += (RW_PROBE_TIMEOUT % 1000) * 1000;
+    if (probe->deadline.tv_usec >= 1000000) {
+        probe->deadline.tv_sec++;
+        probe->deadline.tv_usec -= 1000000;
+    }
+
+    rc = zookeeper_connect(zh, &probe->addr, probe->fd);
+    if (rc == -1) {
+        if (errno != EWOULDBLOCK && errno != EINPROGRESS) {
+            rw_probe_close(zh);
+            return -1;
+        }
+        probe->state = RW_PROBE_CONNECTING;
+    }
+    return 0;
+}
+
+static int rw_probe_would_block(void)
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN;
+#endif
+}
+
+static int rw_probe_ready(socket_t fd, int events)
+{
+#ifdef _WIN32
+    fd_set fds;
+    struct timeval tv = {0, 0};
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (events & ZOOKEEPER_WRITE) {
+        return select(0, NULL, &fds, NULL, &tv) > 0;
+    }
+    return select(0, &fds, NULL, NULL, &tv) > 0;
+#else
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = (events & ZOOKEEPER_WRITE) ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+/*
+ * Advance the probe as far as possible without blocking. Returns 1 if the
+ * probed server accepts writes, 0 while the probe is still running and -1
+ * if it failed, timed out or found another read-only server. The probe is
+ * closed unless it is still running.
+ */
+static int rw_probe_step(zhandle_t *zh, struct timeval *now)
+{
+    rw_probe_t *probe = &zh->rw_probe;
+    sendsize_t ssize;
+    int rc;
+
+    if (calculate_interval(now, &probe->deadline) <= 0) {
+        LOG_DEBUG(LOGCALLBACK(zh), "r/w probe of %s timed out",
+                format_endpoint_info(&probe->addr));
+        rw_probe_close(zh);
+        return -1;
+    }
+
+    if (probe->state == RW_PROBE_CONNECTING) {
+        int error;
+        socklen_t len = sizeof(error);
+        if (!rw_probe_ready(probe->fd, ZOOKEEPER_WRITE)) {
+            return 0;
+        }
+        rc = getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &len);
+        if (rc < 0 || error) {
+            rw_probe_close(zh);
+            return -1;
+        }
+        probe->state = RW_PROBE_SENDING;
+    }
+
+    if (probe->state == RW_PROBE_SENDING) {
+        ssize = zookeeper_send(probe->fd, "isro" + probe->sent, 4 - probe->sent);
+        if (ssize < 0) {
+            if (rw_probe_would_block()) {
+                return 0;
+            }
+            rw_probe_close(zh);
+            return -1;
+        }
+        probe->sent += ssize;
+        if (probe->sent < 4) {
+            return 0;
+        }
+        probe->state = RW_PROBE_RECEIVING;
+    }
+
+    /* the server replies "rw" or "ro" and closes the connection */
+    while (probe->received < 2) {
+        rc = recv(probe->fd, probe->reply + probe->received,
+                2 - probe->received, 0);
+        if (rc < 0 && rw_probe_would_block()) {
+            return 0;
+        }
+        if (rc <= 0) {
+            break;
+        }
+        probe->received += rc;
+    }
+    rc = probe->received == 2 && memcmp(probe->reply, "rw", 2) == 0;
+    rw_probe_close(zh);
+    return rc ? 1 : -1;
+}
+
+#ifndef WIN32
+/* the socket of a running probe and the events that advance it, for I/O
+ * loops that want to poll it next to the connection itself */
+int rw_probe_interest(zhandle_t *zh, int *fd, int *interest)
+{
+    *fd = zh->rw_probe.state != RW_PROBE_IDLE ? zh->rw_probe.fd : -1;
+    *interest = zh->rw_probe.state == RW_PROBE_RECEIVING ?
+            ZOOKEEPER_READ : ZOOKEEPER_WRITE;
+    return *fd != -1;
+}
+#endif
+
+static inline int min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+/* how often the racing connections are checked, their sockets aren't polled */
+#define CONNECT_RACE_POLL_INTERVAL 10
+
+static void connect_race_close(zhandle_t *zh)
+{
+    connect_race_t *race = &zh->connect_race;
+    while (race->count > 0) {
+        close(race->racers[--race->count].fd);
+    }
+    race->active = 0;
+    race->left = 0;
+}
+
+static void add_interval(struct timeval *tv, int ms)
+{
+    tv->tv_sec += ms / 1000;
+    tv->tv_usec += (ms % 1000) * 1000;
+    if (tv->tv_usec >= 1000000) {
+        tv->tv_sec++;
+        tv->tv_usec -= 1000000;
+    }
 }
 
- static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-     const void *data);
- static int add_string_completion(zhandle_t *zh, int xid,
-     string_completion_t dc, const void *data);
- static int add_string_stat_completion(zhandle_t *zh, int xid,
-     string_stat_completion_t dc, const void *data);
+/* called once the connect to addr_cur is in progress */
+static void connect_race_begin(zhandle_t *zh, struct timeval *now)
+{
+    connect_race_t *race = &zh->connect_race;
+    int width;
 
+    lock_reconfig(zh);
+    width = min(zh->race_width, zh->addrs.count);
+    race->next_start = *now;
+    add_interval(&race->next_start, zh->race_stagger);
+    unlock_reconfig(zh);
+    if (width <= 1) {
+        return;
+    }
+    race->active = 1;
+    race->left = width - 1;
+    race->count = 0;
+}
 
- int send_ping(zhandle_t* zh)
- {
-    int rc;
-    struct oarchive *oa = create_buffer_oarchive();
-    struct RequestHeader h = {PING_XID, ZOO_PING_OP};
+/* replace the connection being established with the i-th racing one */
+static void connect_race_adopt(zhandle_t *zh, int i)
+{
+    connect_race_t *race = &zh->connect_race;
 
-    rc = serialize_RequestHeader(oa, "header", &h);
-    enter_critical(zh);
-    get_system_time(&zh->last_ping);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, 0, 0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
-    close_buffer_oarchive(&oa, 0);
-    return rc<0 ? rc : adaptor_send_queue(zh, 0);
+    /* callers sending directly check the socket under the to_send lock */
+    lock_buffer_list(&zh->to_send);
+    close(zh->fd);
+    zh->fd = race->racers[i].fd;
+    unlock_buffer_list(&zh->to_send);
+    zh->addr_cur = race->racers[i].addr;
+    race->racers[i] = race->racers[--race->count];
+    if (race->count == 0 && race->left == 0) {
+        race->active = 0;
+    }
 }
 
-/* upper bound of a timeout for seeking for r/w server when in read-only mode */
-const int MAX_RW_TIMEOUT = 60000;
-const int MIN_RW_TIMEOUT = 200;
-
-static int ping_rw_server(zhandle_t* zh)
+static void connect_race_start(zhandle_t *zh)
 {
-    char buf[10];
-    socket_t sock;
-    int rc;
-    sendsize_t ssize;
+    connect_race_t *race = &zh->connect_race;
     struct sockaddr_storage addr;
+    socket_t fd;
+    int rc;
 
-    addrvec_peek(&zh->addrs, &addr);
+    /* pick the server like the next attempt would, in or out of reconfig,
+     * without making it the current one */
+    race->left--;
+    lock_reconfig(zh);
+    pick_next_server(zh, &addr);
+    unlock_reconfig(zh);
+    if (addr.ss_family == 0) {
+        return;
+    }
 
-    sock = socket(addr.ss_family, SOCK_STREAM, 0);
-    if (sock < 0) {
-        return 0;
+    fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return;
+    }
+    zookeeper_set_sock_nodelay(zh, fd);
+    zookeeper_set_sock_noblock(zh, fd);
+    rc = zookeeper_connect(zh, &addr, fd);
+    if (rc == -1 && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+        close(fd);
+        return;
     }
+    LOG_DEBUG(LOGCALLBACK(zh), "Racing a connection to server [%s]",
+            format_endpoint_info(&addr));
+    lock_reconfig(zh);
+    zh->connect_stats.attempts++;
+    unlock_reconfig(zh);
+    race->racers[race->count].fd = fd;
+    race->racers[race->count].addr = addr;
+    race->count++;
+}
 
-    zookeeper_set_sock_nodelay(zh, sock);
-    zookeeper_set_sock_timeout(zh, sock, 1);
+/*
+ * Start the racing connections that are due and check the ones in flight
+ * without blocking. Returns 1 if one of them completed and replaced the
+ * connection being established, 0 otherwise.
+ */
+static int connect_race_step(zhandle_t *zh, struct timeval *now)
+{
+    connect_race_t *race = &zh->connect_race;
+    int i = 0;
 
-    rc = zookeeper_connect(zh, &addr, sock);
-    if (rc < 0) {
-        return 0;
+    while (race->left > 0 && calculate_interval(now, &race->next_start) <= 0) {
+        connect_race_start(zh);
+        lock_reconfig(zh);
+        add_interval(&race->next_start, zh->race_stagger);
+        unlock_reconfig(zh);
     }
-
-    ssize = zookeeper_send(sock, "isro", 4);
-    if (ssize < 0) {
-        rc = 0;
-        goto out;
+    while (i < race->count) {
+        int rc, error;
+        socklen_t len = sizeof(error);
+        if (!rw_probe_ready(race->racers[i].fd, ZOOKEEPER_WRITE)) {
+            i++;
+            continue;
+        }
+        rc = getsockopt(race->racers[i].fd, SOL_SOCKET, SO_ERROR,
+                (char*)&error, &len);
+        if (rc < 0 || error) {
+            close(race->racers[i].fd);
+            race->racers[i] = race->racers[--race->count];
+            continue;
+        }
+        connect_race_adopt(zh, i);
+        connect_race_close(zh);
+        lock_reconfig(zh);
+        zh->connect_stats.races_won++;
+        unlock_reconfig(zh);
+        return 1;
     }
-
-    memset(buf, 0, sizeof(buf));
-    rc = recv(sock, buf, sizeof(buf), 0);
-    if (rc < 0) {
-        rc = 0;
-        goto out;
+    if (race->count == 0 && race->left == 0) {
+        race->active = 0;
     }
-
-    rc = strcmp("rw", buf) == 0;
-
-out:
-    close(sock);
-    return rc;
+    return 0;
 }
 
-static inline int min(int a, int b)
+/* how long zookeeper_interest() may wait before checking the race again */
+static int connect_race_timeout(zhandle_t *zh, struct timeval *now)
 {
-    return a < b ? a : b;
+    connect_race_t *race = &zh->connect_race;
+    int timeout = race->count > 0 ? CONNECT_RACE_POLL_INTERVAL : INT_MAX;
+    if (race->left > 0) {
+        timeout = min(timeout, calculate_interval(now, &race->next_start));
+    }
+    return timeout;
 }
 
 static void zookeeper_set_sock_noblock(zhandle_t *zh, socket_t sock)
@@ -2078,15 +3934,6 @@ static void zookeeper_set_sock_noblock(zhandle_t *zh, socket_t sock)
 #endif
 }
 
-static void zookeeper_set_sock_timeout(zhandle_t *zh, socket_t s, int timeout)
-{
-    struct timeval tv;
-
-    tv.tv_sec = timeout;
-    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
-    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
-}
-
 static void zookeeper_set_sock_nodelay(zhandle_t *zh, socket_t sock)
 {
 #ifdef _WIN32
@@ -2149,6 +3996,7 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
      struct timeval *tv)
 {
     int rc = 0;
+    int timeout;
     struct timeval now;
     if(zh==0 || fd==0 ||interest==0 || tv==0)
         return ZBADARGUMENTS;
@@ -2164,11 +4012,6 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
     }
     api_prolog(zh);
 
-    rc = update_addrs(zh);
-    if (rc != ZOK) {
-        return api_epilog(zh, rc);
-    }
-
     *fd = zh->fd;
     *interest = 0;
     tv->tv_sec = 0;
@@ -2183,15 +4026,32 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
          * We always clear the delay setting. If we fail again, we'll set delay
          * again and on the next iteration we'll do the same.
          */
-        if (zh->delay == 1) {
+        int backoff = calculate_interval(&now, &zh->reconnect_at);
+        if (backoff > 0) {
+            *tv = get_timeval(backoff);
+        } else if (zh->delay == 1) {
             *tv = get_timeval(zh->recv_timeout/60);
             zh->delay = 0;
 
             LOG_WARN(LOGCALLBACK(zh), "Delaying connection after exhaustively trying all servers [%s]",
                      zh->hostname);
         } else {
-            // No need to delay -- grab the next server and attempt connection
+            // No need to delay -- grab the next server and attempt connection.
+            // This is the only place the I/O thread resolves the host list,
+            // once per attempt at most
+            if (resolve_is_due(zh, &now)) {
+                rc = update_addrs(zh);
+                if (rc != ZOK) {
+                    return api_epilog(zh, rc);
+                }
+            }
             zoo_cycle_next_server(zh);
+            lock_reconfig(zh);
+            zh->connect_stats.attempts++;
+            if (zh->connect_started.tv_sec == 0) {
+                zh->connect_started = now;
+            }
+            unlock_reconfig(zh);
             zh->fd = socket(zh->addr_cur.ss_family, SOCK_STREAM, 0);
             if (zh->fd < 0) {
               rc = handle_socket_error_msg(zh,
@@ -2212,6 +4072,7 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
                  * in UNIX Network Programming vol 1, 3rd edition */
                 if (errno == EWOULDBLOCK || errno == EINPROGRESS) {
                     zh->state = ZOO_CONNECTING_STATE;
+                    connect_race_begin(zh, &now);
                 } else {
                     rc = handle_socket_error_msg(zh,
                                                  __LINE__,
@@ -2239,6 +4100,21 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
         zh->ping_rw_timeout = MIN_RW_TIMEOUT;
     }
 
+    if (zh->fd != -1 && zh->connect_race.active) {
+        rc = connect_race_step(zh, &now);
+        if (rc > 0) {
+            rc = prime_connection(zh);
+            if (rc != 0) {
+                return api_epilog(zh, rc);
+            }
+            LOG_INFO(LOGCALLBACK(zh),
+                     "Initiated connection to raced server [%s]",
+                     format_endpoint_info(&zh->addr_cur));
+            *fd = zh->fd;
+        }
+        rc = 0;
+    }
+
     if (zh->fd != -1) {
         int idle_recv = calculate_interval(&zh->last_recv, &now);
         int idle_send = calculate_interval(&zh->last_send, &now);
@@ -2278,27 +4154,49 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
             }
         }
 
-        // If we are in read-only mode, seek for read/write server
+        // If we are in read-only mode, seek for read/write server without
+        // blocking: the probe advances a step on every call
         if (zh->state == ZOO_READONLY_STATE) {
             int idle_ping_rw = calculate_interval(&zh->last_ping_rw, &now);
-            if (idle_ping_rw >= zh->ping_rw_timeout) {
+            if (zh->rw_probe.state == RW_PROBE_IDLE &&
+                    idle_ping_rw >= zh->ping_rw_timeout) {
                 zh->last_ping_rw = now;
                 idle_ping_rw = 0;
                 zh->ping_rw_timeout = min(zh->ping_rw_timeout * 2,
                                           MAX_RW_TIMEOUT);
-                if (ping_rw_server(zh)) {
-                    struct sockaddr_storage addr;
-                    addrvec_peek(&zh->addrs, &addr);
+                if (rw_probe_start(zh, &now) != 0) {
+                    addrvec_next(&zh->addrs, NULL);
+                }
+            }
+            if (zh->rw_probe.state != RW_PROBE_IDLE) {
+                rc = rw_probe_step(zh, &now);
+                if (rc > 0) {
                     zh->ping_rw_timeout = MIN_RW_TIMEOUT;
                     LOG_INFO(LOGCALLBACK(zh),
                              "r/w server found at %s",
-                             format_endpoint_info(&addr));
+                             format_endpoint_info(&zh->rw_probe.addr));
                     handle_error(zh, ZRWSERVERFOUND);
-                } else {
+                    /* reconnect to it on the next call */
+                    *fd = -1;
+                    *interest = 0;
+                    *tv = get_timeval(0);
+                    return api_epilog(zh, ZOK);
+                } else if (rc < 0) {
                     addrvec_next(&zh->addrs, NULL);
                 }
             }
-            send_to = min(send_to, zh->ping_rw_timeout - idle_ping_rw);
+            if (zh->rw_probe.state != RW_PROBE_IDLE) {
+                send_to = min(send_to, RW_PROBE_POLL_INTERVAL);
+            } else {
+                send_to = min(send_to, zh->ping_rw_timeout - idle_ping_rw);
+            }
+        } else {
+            rw_probe_close(zh);
+        }
+
+        // come back to check the racing connections
+        if (zh->connect_race.active) {
+            send_to = min(send_to, connect_race_timeout(zh, &now));
         }
 
         // choose the lesser value as the timeout
@@ -2311,6 +4209,9 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
             zh->next_deadline.tv_usec = zh->next_deadline.tv_usec % 1000000;
         }
         *interest = ZOOKEEPER_READ;
+        lock_buffer_list(&zh->to_send);
+        queue_submitted_requests(zh);
+        unlock_buffer_list(&zh->to_send);
         /* we are interested in a write if we are connected and have something
          * to send, or we are waiting for a connect to finish. */
         if ((zh->to_send.head && is_connected(zh))
@@ -2318,9 +4219,43 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
             *interest |= ZOOKEEPER_WRITE;
         }
     }
+
+    // come back when the next request times out
+    timeout = expire_requests(zh, &now);
+    if (timeout >= 0 && timeout < tv->tv_sec * 1000 + tv->tv_usec / 1000) {
+        *tv = get_timeval(timeout);
+    }
     return api_epilog(zh,ZOK);
 }
 
+/* the session is established, the outage and the backoff are over */
+static void connection_established(zhandle_t *zh)
+{
+    struct timeval now;
+    get_system_time(&now);
+    lock_reconfig(zh);
+    zh->connect_stats.handshakes++;
+    if (zh->disconnected_since.tv_sec != 0) {
+        zh->connect_stats.disconnected_ms +=
+            (((int64_t)(now.tv_sec - zh->disconnected_since.tv_sec)) * 1000000 +
+             (now.tv_usec - zh->disconnected_since.tv_usec)) / 1000;
+    }
+    zh->disconnected_since.tv_sec = 0;
+    zh->disconnected_since.tv_usec = 0;
+    if (zh->connect_started.tv_sec != 0) {
+        zh->connect_stats.last_connect_ms =
+            (((int64_t)(now.tv_sec - zh->connect_started.tv_sec)) * 1000000 +
+             (now.tv_usec - zh->connect_started.tv_usec)) / 1000;
+        if (zh->connect_stats.last_connect_ms > zh->connect_stats.max_connect_ms) {
+            zh->connect_stats.max_connect_ms = zh->connect_stats.last_connect_ms;
+        }
+        zh->connect_started.tv_sec = 0;
+        zh->connect_started.tv_usec = 0;
+    }
+    zh->backoff_passes = 0;
+    unlock_reconfig(zh);
+}
+
 static int check_events(zhandle_t *zh, int events)
 {
     if (zh->fd == -1)
@@ -2335,17 +4270,25 @@ static int check_events(zhandle_t *zh, int events)
         if (rc < 0 || error) {
             if (rc == 0)
                 errno = error;
+            if (zh->connect_race.count > 0) {
+                /* carry on with a connection still racing */
+                LOG_DEBUG(LOGCALLBACK(zh), "connect to %s failed: %s",
+                        format_endpoint_info(&zh->addr_cur), strerror(errno));
+                connect_race_adopt(zh, 0);
+                return ZOK;
+            }
             return handle_socket_error_msg(zh, __LINE__,ZCONNECTIONLOSS,
                 "server refused to accept the client");
         }
 
+        connect_race_close(zh);
         if((rc=prime_connection(zh))!=0)
             return rc;
 
         LOG_INFO(LOGCALLBACK(zh), "initiated connection to server [%s]", format_endpoint_info(&zh->addr_cur));
         return ZOK;
     }
-    if (zh->to_send.head && (events&ZOOKEEPER_WRITE)) {
+    if ((zh->to_send.head || zh->submitted) && (events&ZOOKEEPER_WRITE)) {
         /* make the flush call non-blocking by specifying a 0 timeout */
         int rc=flush_send_queue(zh,0);
         if (rc < 0)
@@ -2354,20 +4297,20 @@ static int check_events(zhandle_t *zh, int events)
     }
     if (events&ZOOKEEPER_READ) {
         int rc;
-        if (zh->input_buffer == 0) {
-            zh->input_buffer = allocate_buffer(0,0);
+        /* the handshake response is received on its own, everything after
+         * it goes through the read-ahead buffer */
+        if (zh->input_buffer == &zh->primer_buffer) {
+            rc = recv_buffer(zh, zh->input_buffer);
+        } else {
+            rc = recv_packets(zh);
         }
-
-        rc = recv_buffer(zh, zh->input_buffer);
         if (rc < 0) {
             return handle_socket_error_msg(zh, __LINE__,ZCONNECTIONLOSS,
                 "failed while receiving a server response");
         }
         if (rc > 0) {
             get_system_time(&zh->last_recv);
-            if (zh->input_buffer != &zh->primer_buffer) {
-                queue_buffer(&zh->to_process, zh->input_buffer, 0);
-            } else  {
+            if (zh->input_buffer == &zh->primer_buffer) {
                 int64_t oldid, newid;
                 //deserialize
                 deserialize_prime_response(&zh->primer_storage, zh->primer_buffer.buffer);
@@ -2390,6 +4333,10 @@ static int check_events(zhandle_t *zh, int events)
                     zh->state = zh->primer_storage.readOnly ?
                       ZOO_READONLY_STATE : ZOO_CONNECTED_STATE;
                     zh->reconfig = 0;
+                    connection_established(zh);
+                    record_rtt(zh, &zh->addr_cur,
+                            ((int64_t)(zh->last_recv.tv_sec - zh->handshake_sent.tv_sec)) * 1000000 +
+                            (zh->last_recv.tv_usec - zh->handshake_sent.tv_usec));
                     LOG_INFO(LOGCALLBACK(zh),
                              "session establishment complete on server [%s], sessionId=%#llx, negotiated timeout=%d %s",
                              format_endpoint_info(&zh->addr_cur),
@@ -2404,8 +4351,8 @@ static int check_events(zhandle_t *zh, int events)
                     zh->input_buffer = 0; // just in case the watcher calls zookeeper_process() again
                     PROCESS_SESSION_EVENT(zh, zh->state);
                 }
+                zh->input_buffer = 0;
             }
-            zh->input_buffer = 0;
         } else {
             // zookeeper_process was called but there was nothing to read
             // from the socket
@@ -2451,33 +4398,31 @@ static __attribute__((unused)) void print_completion_queue(zhandle_t *zh)
 // IO thread queues session events to be processed by the completion thread
 static int queue_session_event(zhandle_t *zh, int state)
 {
-    int rc;
-    struct WatcherEvent evt = { ZOO_SESSION_EVENT, state, "" };
-    struct ReplyHeader hdr = { WATCHER_EVENT_XID, 0, 0 };
-    struct oarchive *oa;
     completion_list_t *cptr;
+    char *path = strdup("");
 
-    if ((oa=create_buffer_oarchive())==NULL) {
+    if (!path) {
         LOG_ERROR(LOGCALLBACK(zh), "out of memory");
         goto error;
     }
-    rc = serialize_ReplyHeader(oa, "hdr", &hdr);
-    rc = rc<0?rc: serialize_WatcherEvent(oa, "event", &evt);
-    if(rc<0){
-        close_buffer_oarchive(&oa, 1);
-        goto error;
-    }
     cptr = create_completion_entry(zh, WATCHER_EVENT_XID,-1,0,0,0,0);
-    cptr->buffer = allocate_buffer(get_buffer(oa), get_buffer_len(oa));
-    cptr->buffer->curr_offset = get_buffer_len(oa);
-    if (!cptr->buffer) {
-        free(cptr);
-        close_buffer_oarchive(&oa, 1);
+    if (!cptr) {
+        free(path);
         goto error;
     }
-    /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    /* the event is handed over decoded, there is nothing to serialize */
+    cptr->hdr.xid = WATCHER_EVENT_XID;
+    cptr->event.type = ZOO_SESSION_EVENT;
+    cptr->event.state = state;
+    cptr->event.path = path;
+    /* the watches may have been lost along with the connection */
+    lock_watchers(zh);
+    if (zh->cache) {
+        zk_cache_clear(zh->cache);
+    }
     cptr->c.watcher_result = collectWatchers(zh, ZOO_SESSION_EVENT, "");
+    unlock_watchers(zh);
+    cptr->key = completion_key(zh, path, 0);
     queue_completion(&zh->completions_to_process, cptr, 0);
     if (process_async(zh->outstanding_sync)) {
         process_completions(zh);
@@ -2489,11 +4434,10 @@ error:
 }
 //#endif
 
-completion_list_t *dequeue_completion(completion_head_t *list)
+/* for lists that aren't shared with other threads */
+completion_list_t *dequeue_completion_nolock(completion_head_t *list)
 {
-    completion_list_t *cptr;
-    lock_completion_list(list);
-    cptr = list->head;
+    completion_list_t *cptr = list->head;
     if (cptr) {
         list->head = cptr->next;
         if (!list->head) {
@@ -2501,10 +4445,23 @@ completion_list_t *dequeue_completion(completion_head_t *list)
             list->last = 0;
         }
     }
+    return cptr;
+}
+
+completion_list_t *dequeue_completion(completion_head_t *list)
+{
+    completion_list_t *cptr;
+    lock_completion_list(list);
+    cptr = dequeue_completion_nolock(list);
     unlock_completion_list(list);
     return cptr;
 }
 
+int get_completion_key(completion_list_t *cptr)
+{
+    return cptr->key;
+}
+
 static void process_sync_completion(zhandle_t *zh,
         completion_list_t *cptr,
         struct sync_completion *sc,
@@ -2518,7 +4475,14 @@ static void process_sync_completion(zhandle_t *zh,
         if (sc->rc==0) {
             struct GetDataResponse res;
             int len;
-            deserialize_GetDataResponse(ia, "reply", &res);
+            /* copy the value straight from the packet into the caller's buffer */
+            ia->start_record(ia, "reply");
+            if (ia_deserialize_buffer_ref(ia, "data", &res.data) < 0 ||
+                    deserialize_Stat(ia, "stat", &res.stat) < 0) {
+                sc->rc = ZMARSHALLINGERROR;
+                break;
+            }
+            ia->end_record(ia, "reply");
             if (res.data.len <= sc->u.data.buff_len) {
                 len = res.data.len;
             } else {
@@ -2533,7 +4497,6 @@ static void process_sync_completion(zhandle_t *zh,
                 memcpy(sc->u.data.buffer, res.data.buff, len);
             }
             sc->u.data.stat = res.stat;
-            deallocate_GetDataResponse(&res);
         }
         break;
     case COMPLETION_STAT:
@@ -2670,6 +4633,32 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
             deallocate_GetDataResponse(&res);
         }
         break;
+    case COMPLETION_DATA_REF:
+        LOG_DEBUG(LOGCALLBACK(zh), "Calling COMPLETION_DATA_REF for xid=%#x failed=%d rc=%d",
+                    cptr->xid, failed, rc);
+        if (failed) {
+            cptr->c.data_ref_result(rc, 0, 0, 0, 0, cptr->data);
+        } else {
+            struct buffer value;
+            struct Stat stat;
+            struct zoo_buffer lent = {0, 0, 0};
+            ia->start_record(ia, "reply");
+            if (ia_deserialize_buffer_ref(ia, "data", &value) < 0 ||
+                    deserialize_Stat(ia, "stat", &stat) < 0) {
+                cptr->c.data_ref_result(ZMARSHALLINGERROR, 0, 0, 0, 0,
+                        cptr->data);
+                break;
+            }
+            ia->end_record(ia, "reply");
+            lent.packet = cptr->buffer->buffer;
+            cptr->c.data_ref_result(rc, value.buff, value.len, &stat, &lent,
+                    cptr->data);
+            if (lent.retained) {
+                /* the application owns the packet now */
+                cptr->buffer->buffer = 0;
+            }
+        }
+        break;
     case COMPLETION_STAT:
         LOG_DEBUG(LOGCALLBACK(zh), "Calling COMPLETION_STAT for xid=%#x failed=%d rc=%d",
                     cptr->xid, failed, rc);
@@ -2765,35 +4754,45 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
 }
 
 
+/* runs and destroys a completion taken off completions_to_process */
+void process_completion(zhandle_t *zh, completion_list_t *cptr)
+{
+    /* the header and events were decoded when the response was read */
+    if (cptr->hdr.xid == WATCHER_EVENT_XID) {
+        struct WatcherEvent *evt = &cptr->event;
+        /* This is a notification so there aren't any pending requests */
+        LOG_DEBUG(LOGCALLBACK(zh), "Calling a watcher for node [%s], type = %d event=%s",
+                   (evt->path==NULL?"NULL":evt->path), cptr->c.type,
+                   watcherEvent2String(evt->type));
+        deliverWatchers(zh,evt->type,evt->state,evt->path, &cptr->c.watcher_result);
+    } else {
+        if (!cptr->ia) {
+            /* a failure generated locally has no body */
+            cptr->ia = create_pooled_iarchive(zh, NULL, 0);
+        }
+        if (cptr->traced) {
+            trace_request(zh, &zh->trace_hooks.callback_start, cptr,
+                    system_time_us(), ZOK);
+        }
+        deserialize_response(zh, cptr->c.type, cptr->hdr.xid,
+                cptr->hdr.err != 0, cptr->hdr.err, cptr, cptr->ia);
+        record_request_stage(zh, cptr, ZOO_STAGE_COMPLETED, cptr->hdr.err);
+        if (cptr->traced) {
+            int64_t now = system_time_us();
+            trace_request(zh, &zh->trace_hooks.callback_end, cptr, now,
+                    cptr->hdr.err);
+            log_slow_request(zh, cptr, now, cptr->hdr.err);
+        }
+    }
+    destroy_completion_entry(cptr);
+}
+
 /* handles async completion (both single- and multithreaded) */
 void process_completions(zhandle_t *zh)
 {
     completion_list_t *cptr;
     while ((cptr = dequeue_completion(&zh->completions_to_process)) != 0) {
-        struct ReplyHeader hdr;
-        buffer_list_t *bptr = cptr->buffer;
-        struct iarchive *ia = create_buffer_iarchive(bptr->buffer,
-                bptr->len);
-        deserialize_ReplyHeader(ia, "hdr", &hdr);
-
-        if (hdr.xid == WATCHER_EVENT_XID) {
-            int type, state;
-            struct WatcherEvent evt;
-            deserialize_WatcherEvent(ia, "event", &evt);
-            /* We are doing a notification, so there is no pending request */
-            type = evt.type;
-            state = evt.state;
-            /* This is a notification so there aren't any pending requests */
-            LOG_DEBUG(LOGCALLBACK(zh), "Calling a watcher for node [%s], type = %d event=%s",
-                       (evt.path==NULL?"NULL":evt.path), cptr->c.type,
-                       watcherEvent2String(type));
-            deliverWatchers(zh,type,state,evt.path, &cptr->c.watcher_result);
-            deallocate_WatcherEvent(&evt);
-        } else {
-            deserialize_response(zh, cptr->c.type, hdr.xid, hdr.err != 0, hdr.err, cptr, ia);
-        }
-        destroy_completion_entry(cptr);
-        close_buffer_iarchive(&ia);
+        process_completion(zh, cptr);
     }
 }
 
@@ -2841,6 +4840,9 @@ static void checkResponseLatency(zhandle_t* zh)
 int zookeeper_process(zhandle_t *zh, int events)
 {
     buffer_list_t *bptr;
+    /* completions are handed to the completion thread once per call rather
+     * than once per response, which saves a wakeup for each response */
+    completion_head_t ready = {0, 0};
     int rc;
 
     if (zh==NULL)
@@ -2850,15 +4852,21 @@ int zookeeper_process(zhandle_t *zh, int events)
     api_prolog(zh);
     IF_DEBUG(checkResponseLatency(zh));
     rc = check_events(zh, events);
-    if (rc!=ZOK)
+    if (rc!=ZOK) {
+        /* zookeeper_interest() fails the requests that time out, whether
+         * there is anything to read or not */
+        if (process_async(zh->outstanding_sync)) {
+            process_completions(zh);
+        }
         return api_epilog(zh, rc);
+    }
 
     IF_DEBUG(isSocketReadable(zh));
 
     while (rc >= 0 && (bptr=dequeue_buffer(&zh->to_process))) {
         struct ReplyHeader hdr;
-        struct iarchive *ia = create_buffer_iarchive(
-                                    bptr->buffer, bptr->curr_offset);
+        struct iarchive *ia = create_pooled_iarchive(zh, 
+                                    bptr->buffer, bptr->len);
         deserialize_ReplyHeader(ia, "hdr", &hdr);
 
         if (hdr.xid == WATCHER_EVENT_XID) {
@@ -2874,14 +4882,39 @@ int zookeeper_process(zhandle_t *zh, int events)
             path = evt.path;
             /* We are doing a notification, so there is no pending request */
             c = create_completion_entry(zh, WATCHER_EVENT_XID,-1,0,0,0,0);
-            c->buffer = bptr;
+            lock_watchers(zh);
+            if (zh->cache) {
+                zk_cache_invalidate(zh->cache, path, cache_event_parts(type));
+            }
             c->c.watcher_result = collectWatchers(zh, type, path);
-
-            // We cannot free until now, otherwise path will become invalid
-            deallocate_WatcherEvent(&evt);
-            queue_completion(&zh->completions_to_process, c, 0);
+            unlock_watchers(zh);
+            c->key = completion_key(zh, path, 0);
+            lock_stats(zh);
+            zh->stats.watch_events++;
+            unlock_stats(zh);
+
+            /* the completion owns the decoded event, the raw buffer isn't
+             * needed anymore */
+            c->hdr = hdr;
+            c->event = evt;
+            free_buffer(bptr);
+            queue_completion_nolock(&ready, c, 0);
         } else if (hdr.xid == SET_WATCHES_XID) {
             LOG_DEBUG(LOGCALLBACK(zh), "Processing SET_WATCHES");
+            lock_watchers(zh);
+            if (zh->rewatch_stats.pending > 0 &&
+                    --zh->rewatch_stats.pending == 0) {
+                struct timeval now;
+                int64_t elapsed;
+                get_system_time(&now);
+                elapsed = ((int64_t)(now.tv_sec - zh->rewatch_started.tv_sec)) * 1000000 +
+                    (now.tv_usec - zh->rewatch_started.tv_usec);
+                zh->rewatch_stats.last_rewatch_us = elapsed;
+                if (elapsed > zh->rewatch_stats.max_rewatch_us) {
+                    zh->rewatch_stats.max_rewatch_us = elapsed;
+                }
+            }
+            unlock_watchers(zh);
             free_buffer(bptr);
         } else if (hdr.xid == AUTH_XID){
             LOG_DEBUG(LOGCALLBACK(zh), "Processing AUTH_XID");
@@ -2893,19 +4926,27 @@ int zookeeper_process(zhandle_t *zh, int events)
             /* authentication completion may change the connection state to
              * unrecoverable */
             if(is_unrecoverable(zh)){
+                queue_completion_batch(&zh->completions_to_process, &ready);
                 handle_error(zh, ZAUTHFAILED);
-                close_buffer_iarchive(&ia);
+                close_pooled_iarchive(&ia);
                 return api_epilog(zh, ZAUTHFAILED);
             }
         } else {
             int rc = hdr.err;
             /* Find the request corresponding to the response */
-            completion_list_t *cptr = dequeue_completion(&zh->sent_requests);
+            completion_list_t *cptr;
+            lock_completion_list(&zh->sent_requests);
+            cptr = dequeue_completion_nolock(&zh->sent_requests);
+            if (cptr) {
+                zk_timer_cancel(&zh->deadlines, &cptr->deadline);
+            }
+            unlock_completion_list(&zh->sent_requests);
 
             /* [ZOOKEEPER-804] Don't assert if zookeeper_close has been called. */
             if (zh->close_requested == 1 && cptr == NULL) {
                 LOG_DEBUG(LOGCALLBACK(zh), "Completion queue has been cleared by zookeeper_close()");
-                close_buffer_iarchive(&ia);
+                queue_completion_batch(&zh->completions_to_process, &ready);
+                close_pooled_iarchive(&ia);
                 free_buffer(bptr);
                 return api_epilog(zh,ZINVALIDSTATE);
             }
@@ -2915,11 +4956,12 @@ int zookeeper_process(zhandle_t *zh, int events)
                 LOG_DEBUG(LOGCALLBACK(zh), "Processing unexpected or out-of-order response!");
 
                 // received unexpected (or out-of-order) response
-                close_buffer_iarchive(&ia);
+                close_pooled_iarchive(&ia);
                 free_buffer(bptr);
                 // put the completion back on the queue (so it gets properly
                 // signaled and deallocated) and disconnect from the server
                 queue_completion(&zh->sent_requests,cptr,1);
+                queue_completion_batch(&zh->completions_to_process, &ready);
                 return handle_socket_error_msg(zh, __LINE__,ZRUNTIMEINCONSISTENCY,
                         "unexpected server response: expected %#x, but received %#x",
                         hdr.xid,cptr->xid);
@@ -2929,8 +4971,23 @@ int zookeeper_process(zhandle_t *zh, int events)
                 // Update last_zxid only when it is a request response
                 zh->last_zxid = hdr.zxid;
             }
-            activateWatcher(zh, cptr->watcher, rc);
-            deactivateWatcher(zh, cptr->watcher_deregistration, rc);
+            if (cptr->expired) {
+                /* the server did register or remove the watch */
+                LOG_DEBUG(LOGCALLBACK(zh), "Discarding the response to "
+                        "timed out request xid=%#x", cptr->xid);
+                apply_watcher_changes(zh, cptr, rc, bptr);
+                destroy_expired_request(cptr);
+                close_pooled_iarchive(&ia);
+                free_buffer(bptr);
+                continue;
+            }
+            record_request_stage(zh, cptr, ZOO_STAGE_RESPONSE, ZOK);
+            if (cptr->traced) {
+                cptr->received_us = system_time_us();
+                trace_request(zh, &zh->trace_hooks.received, cptr,
+                        cptr->received_us, rc);
+            }
+            apply_watcher_changes(zh, cptr, rc, bptr);
 
             if (cptr->c.void_result != SYNCHRONOUS_MARKER) {
                 if(hdr.xid == PING_XID){
@@ -2939,6 +4996,9 @@ int zookeeper_process(zhandle_t *zh, int events)
                     get_system_time(&now);
                     elapsed = calculate_interval(&zh->last_ping, &now);
                     LOG_DEBUG(LOGCALLBACK(zh), "Got ping response in %d ms", elapsed);
+                    record_rtt(zh, &zh->addr_cur,
+                            ((int64_t)(now.tv_sec - zh->last_ping.tv_sec)) * 1000000 +
+                            (now.tv_usec - zh->last_ping.tv_usec));
 
                     // Nothing to do with a ping response
                     free_buffer(bptr);
@@ -2946,8 +5006,12 @@ int zookeeper_process(zhandle_t *zh, int events)
                 } else {
                     LOG_DEBUG(LOGCALLBACK(zh), "Queueing asynchronous response");
 
+                    /* hand the archive over, positioned after the header */
                     cptr->buffer = bptr;
-                    queue_completion(&zh->completions_to_process, cptr, 0);
+                    cptr->hdr = hdr;
+                    cptr->ia = ia;
+                    ia = 0;
+                    queue_completion_nolock(&ready, cptr, 0);
                 }
             } else {
                 struct sync_completion
@@ -2955,6 +5019,10 @@ int zookeeper_process(zhandle_t *zh, int events)
                 sc->rc = rc;
 
                 process_sync_completion(zh, cptr, sc, ia);
+                record_request_stage(zh, cptr, ZOO_STAGE_COMPLETED, rc);
+                if (cptr->traced) {
+                    log_slow_request(zh, cptr, cptr->received_us, rc);
+                }
 
                 notify_sync_completion(sc);
                 free_buffer(bptr);
@@ -2963,9 +5031,12 @@ int zookeeper_process(zhandle_t *zh, int events)
             }
         }
 
-        close_buffer_iarchive(&ia);
+        if (ia) {
+            close_pooled_iarchive(&ia);
+        }
 
     }
+    queue_completion_batch(&zh->completions_to_process, &ready);
     if (process_async(zh->outstanding_sync)) {
         process_completions(zh);
     }
@@ -2980,12 +5051,14 @@ int zoo_state(zhandle_t *zh)
     return 0;
 }
 
-static watcher_registration_t* create_watcher_registration(const char* path,
-        result_checker_fn checker,watcher_fn watcher,void* ctx){
+static watcher_registration_t* create_watcher_registration(zhandle_t *zh,
+        const char* path,result_checker_fn checker,watcher_fn watcher,void* ctx){
     watcher_registration_t* wo;
     if(watcher==0)
         return 0;
-    wo=calloc(1,sizeof(watcher_registration_t));
+    wo=pool_alloc(&zh->pools[ZOO_POOL_WATCHERS]);
+    if(wo==0)
+        return 0;
     wo->path=strdup(path);
     wo->watcher=watcher;
     wo->context=ctx;
@@ -3011,7 +5084,7 @@ static watcher_deregistration_t* create_watcher_deregistration(const char* path,
 static void destroy_watcher_registration(watcher_registration_t* wo){
     if(wo!=0){
         free((void*)wo->path);
-        free(wo);
+        pool_free(wo);
     }
 }
 
@@ -3042,11 +5115,13 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh, int xid,
         watcher_registration_t* wo, completion_head_t *clist,
         watcher_deregistration_t* wdo)
 {
-    completion_list_t *c = calloc(1, sizeof(completion_list_t));
+    completion_list_t *c = pool_alloc(&zh->pools[ZOO_POOL_COMPLETIONS]);
     if (!c) {
         LOG_ERROR(LOGCALLBACK(zh), "out of memory");
         return 0;
     }
+    memset(c, 0, sizeof(*c));
+    c->op = -1;
     c->c.type = completion_type;
     c->data = data;
     switch(c->c.type) {
@@ -3059,6 +5134,9 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh, int xid,
     case COMPLETION_DATA:
         c->c.data_result = (data_completion_t)dc;
         break;
+    case COMPLETION_DATA_REF:
+        c->c.data_ref_result = (data_ref_completion_t)dc;
+        break;
     case COMPLETION_STAT:
         c->c.stat_result = (stat_completion_t)dc;
         break;
@@ -3090,15 +5168,22 @@ static void destroy_completion_entry(completion_list_t* c){
     if(c!=0){
         destroy_watcher_registration(c->watcher);
         destroy_watcher_deregistration(c->watcher_deregistration);
+        if(c->ia!=0)
+            close_pooled_iarchive(&c->ia);
         if(c->buffer!=0)
             free_buffer(c->buffer);
-        free(c);
+        if(c->request!=0)
+            free_buffer(c->request);
+        if(c->hdr.xid==WATCHER_EVENT_XID)
+            deallocate_WatcherEvent(&c->event);
+        free(c->trace_path);
+        pool_free(c);
     }
 }
 
-static void queue_completion_nolock(completion_head_t *list,
-                                    completion_list_t *c,
-                                    int add_to_front)
+void queue_completion_nolock(completion_head_t *list,
+                             completion_list_t *c,
+                             int add_to_front)
 {
     c->next = 0;
     /* appending a new entry to the back of the list */
@@ -3129,97 +5214,373 @@ static void queue_completion(completion_head_t *list, completion_list_t *c,
     unlock_completion_list(list);
 }
 
-static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front,
-        watcher_registration_t* wo, completion_head_t *clist)
+/* move the entries of a local batch to the back of list in one go */
+void queue_completion_batch(completion_head_t *list,
+        completion_head_t *batch)
 {
-    completion_list_t *c =create_completion_entry(zh, xid, completion_type, dc,
-            data, wo, clist);
-    return do_add_completion(zh, dc, c, add_to_front);
+    if (batch->head == 0) {
+        return;
+    }
+    lock_completion_list(list);
+    if (list->last) {
+        list->last->next = batch->head;
+    } else {
+        list->head = batch->head;
+    }
+    list->last = batch->last;
+    unlock_completion_list(list);
+    batch->head = 0;
+    batch->last = 0;
 }
 
-static int add_completion_deregistration(zhandle_t *zh, int xid,
-        int completion_type, const void *dc, const void *data, int add_to_front,
-        watcher_deregistration_t* wdo, completion_head_t *clist)
+static int add_completion(zhandle_t *zh, int completion_type,
+        const void *dc, const void *data, const char *path,
+        watcher_registration_t* wo, completion_head_t *clist,
+        struct oarchive *oa)
+{
+    completion_list_t *c =create_completion_entry(zh, UNASSIGNED_XID,
+            completion_type, dc, data, wo, clist);
+    if (c && dc && dc != SYNCHRONOUS_MARKER) {
+        c->key = completion_key(zh, path, data);
+    }
+    return submit_request(zh, c, oa);
+}
+
+static int add_completion_deregistration(zhandle_t *zh,
+        int completion_type, const void *dc, const void *data,
+        const char *path, watcher_deregistration_t* wdo,
+        completion_head_t *clist, struct oarchive *oa)
 {
-    completion_list_t *c = create_completion_entry_deregistration(zh, xid,
-           completion_type, dc, data, wdo, clist);
-    return do_add_completion(zh, dc, c, add_to_front);
+    completion_list_t *c = create_completion_entry_deregistration(zh,
+           UNASSIGNED_XID, completion_type, dc, data, wdo, clist);
+    if (c && dc && dc != SYNCHRONOUS_MARKER) {
+        c->key = completion_key(zh, path, data);
+    }
+    return submit_request(zh, c, oa);
 }
 
+/* queues a completion whose request the caller appends to to_send; the
+ * caller must hold the to_send lock so both lists stay in wire order */
 static int do_add_completion(zhandle_t *zh, const void *dc,
-        completion_list_t *c, int add_to_front)
+        completion_list_t *c)
 {
     int rc = 0;
     if (!c)
         return ZSYSTEMERROR;
     lock_completion_list(&zh->sent_requests);
     if (zh->close_requested != 1) {
-        queue_completion_nolock(&zh->sent_requests, c, add_to_front);
+        queue_completion_nolock(&zh->sent_requests, c, 0);
         if (dc == SYNCHRONOUS_MARKER) {
             zh->outstanding_sync++;
         }
         rc = ZOK;
     } else {
-        free(c);
+        destroy_completion_entry(c);
         rc = ZINVALIDSTATE;
     }
     unlock_completion_list(&zh->sent_requests);
-    return rc;
+    return rc;
+}
+
+/* attaches the request serialized in oa to its completion entry, which owns
+ * the buffer of oa from then on */
+static int attach_request(zhandle_t *zh, completion_list_t *c,
+        struct oarchive *oa)
+{
+    int timeout;
+
+    if (!c)
+        return ZSYSTEMERROR;
+    c->request = allocate_buffer(zh, get_buffer(oa), get_buffer_len(oa));
+    if (!c->request) {
+        destroy_completion_entry(c);
+        return ZSYSTEMERROR;
+    }
+    c->submitted = system_time_us();
+    lock_reconfig(zh);
+    timeout = zh->request_timeout;
+    unlock_reconfig(zh);
+    if (timeout > 0) {
+        c->deadline.expires = c->submitted / 1000 + timeout;
+    }
+    return ZOK;
+}
+
+/* Hands a chain of entries, linked from the newest to the oldest, over to the
+ * I/O thread. The chain is pushed onto zh->submitted without taking any lock;
+ * queue_submitted_requests() later moves the entries to their lanes, from
+ * which fill_send_queue() assigns the xids and links them into sent_requests
+ * and to_send in the order the requests go on the wire. The
+ * entries are destroyed if the handle is closing. */
+static int push_requests(zhandle_t *zh, completion_list_t *newest,
+        completion_list_t *oldest)
+{
+    completion_list_t *head;
+    do {
+        head = zh->submitted;
+        if (head == SUBMISSIONS_CLOSED) {
+            oldest->next = 0;
+            while (newest) {
+                head = newest->next;
+                destroy_completion_entry(newest);
+                newest = head;
+            }
+            return ZINVALIDSTATE;
+        }
+        oldest->next = head;
+    } while (compare_and_swap_ptr((void *volatile *)&zh->submitted, head,
+                newest) != head);
+    return ZOK;
+}
+
+static int submit_request(zhandle_t *zh, completion_list_t *c,
+        struct oarchive *oa)
+{
+    int rc = attach_request(zh, c, oa);
+    return rc != ZOK ? rc : push_requests(zh, c, c);
+}
+
+/* the most packets and bytes queued on to_send by fill_send_queue(); the
+ * requests left wait in their lanes, so a packet queued meanwhile is written
+ * after at most this much data and the packet being written */
+#define SEND_QUEUE_PACKETS 64
+#define SEND_QUEUE_BYTES (64 * 1024)
+/* interactive requests queued in a row before a waiting bulk one */
+#define LANE_BURST 16
+/* the largest read request which may go ahead of the writes */
+#define INTERACTIVE_REQUEST_BYTES 4096
+
+/* the lane of a submitted request of c->op: with zoo_set_priority_reads()
+ * small reads are interactive, everything else is bulk */
+static request_lane_t *request_lane(zhandle_t *zh, completion_list_t *c)
+{
+    if (zh->priority_reads && c->request->len <= INTERACTIVE_REQUEST_BYTES) {
+        switch (c->op) {
+        case ZOO_EXISTS_OP:
+        case ZOO_GETDATA_OP:
+        case ZOO_GETACL_OP:
+        case ZOO_GETCHILDREN_OP:
+        case ZOO_GETCHILDREN2_OP:
+            return &zh->lanes[LANE_INTERACTIVE];
+        }
+    }
+    return &zh->lanes[LANE_BULK];
+}
+
+/* the lane the next request is taken from, 0 if all of them are empty;
+ * interactive requests go first but can't hold the bulk ones back for more
+ * than LANE_BURST requests */
+static request_lane_t *next_lane(zhandle_t *zh)
+{
+    request_lane_t *interactive = &zh->lanes[LANE_INTERACTIVE];
+    request_lane_t *bulk = &zh->lanes[LANE_BULK];
+    if (interactive->head && (!bulk->head || zh->lane_burst < LANE_BURST)) {
+        if (bulk->head) {
+            zh->lane_burst++;
+        }
+        return interactive;
+    }
+    zh->lane_burst = 0;
+    return bulk->head ? bulk : 0;
+}
+
+/* moves the submitted requests to their lanes, oldest first, and refills
+ * to_send from them; once the handle is closing no more requests are
+ * accepted afterwards and all of them are queued. The caller must hold the
+ * to_send lock */
+static void queue_submitted_requests(zhandle_t *zh)
+{
+    void *closed = zh->close_requested == 1 ? SUBMISSIONS_CLOSED : 0;
+    completion_list_t *c, *next, *batch = 0;
+    int32_t op;
+    int64_t now;
+
+    do {
+        c = zh->submitted;
+        if (c == closed || c == SUBMISSIONS_CLOSED) {
+            fill_send_queue(zh, closed != 0);
+            return;
+        }
+    } while (compare_and_swap_ptr((void *volatile *)&zh->submitted, c, closed)
+            != c);
+    /* the stack holds the newest request first */
+    for (; c; c = next) {
+        next = c->next;
+        c->next = batch;
+        batch = c;
+    }
+
+    now = system_time_us();
+    lock_completion_list(&zh->sent_requests);
+    lock_stats(zh);
+    for (c = batch; c; c = next) {
+        request_lane_t *lane;
+        next = c->next;
+        /* the opcode follows the xid in the request header */
+        memcpy(&op, c->request->buffer + sizeof(int32_t), sizeof(op));
+        c->op = ntohl(op);
+        zk_stats_request(&zh->stats, c->op);
+        /* the deadline also runs while the request waits in its lane */
+        if (c->deadline.expires) {
+            zk_timer_add(&zh->deadlines, &c->deadline, now / 1000);
+        }
+        if (c->c.void_result == SYNCHRONOUS_MARKER) {
+            zh->outstanding_sync++;
+        }
+        lane = request_lane(zh, c);
+        c->next = 0;
+        if (lane->last) {
+            lane->last->next = c;
+        } else {
+            lane->head = c;
+        }
+        lane->last = c;
+        lane->count++;
+    }
+    unlock_stats(zh);
+    unlock_completion_list(&zh->sent_requests);
+    fill_send_queue(zh, closed != 0);
+}
+
+/* the xid of the next request on the wire, wrapping around to 1 after
+ * INT32_MAX. The caller must hold the to_send lock */
+static int32_t next_xid(zhandle_t *zh)
+{
+    int32_t xid = zh->xid;
+    zh->xid = xid == INT32_MAX ? 1 : xid + 1;
+    return xid;
+}
+
+/* Moves requests from the lanes to sent_requests and to_send until to_send
+ * holds SEND_QUEUE_PACKETS or SEND_QUEUE_BYTES, or all of them if all is
+ * set. The xids are assigned here, so they grow in the order the requests
+ * go on the wire whatever their lanes. Requests which timed out while
+ * waiting are dropped without being sent. The caller must hold the to_send
+ * lock */
+static void fill_send_queue(zhandle_t *zh, int all)
+{
+    completion_list_t *c;
+    request_lane_t *lane;
+    buffer_list_t *b;
+    int packets = 0;
+    int bytes = 0;
+    int32_t xid;
+    int64_t now;
+    int tracing;
+
+    if (!zh->lanes[LANE_INTERACTIVE].head && !zh->lanes[LANE_BULK].head) {
+        return;
+    }
+    lock_trace(zh);
+    tracing = zh->tracing;
+    unlock_trace(zh);
+    for (b = zh->to_send.head; b; b = b->next) {
+        packets++;
+        bytes += b->len + sizeof(b->len) - b->curr_offset;
+    }
+    now = system_time_us();
+    lock_completion_list(&zh->sent_requests);
+    lock_stats(zh);
+    while ((all || (packets < SEND_QUEUE_PACKETS && bytes < SEND_QUEUE_BYTES))
+            && (lane = next_lane(zh)) != 0) {
+        buffer_list_t *request;
+        c = lane->head;
+        lane->head = c->next;
+        if (!lane->head) {
+            lane->last = 0;
+        }
+        lane->count--;
+        if (c->expired) {
+            destroy_expired_request(c);
+            continue;
+        }
+        request = c->request;
+        c->request = 0;
+        c->xid = next_xid(zh);
+        xid = htonl(c->xid);
+        memcpy(request->buffer, &xid, sizeof(xid));
+        zk_stats_stage(&zh->stats, c->op, ZOO_STAGE_QUEUED, now - c->submitted);
+        request->submitted = c->submitted;
+        if (tracing) {
+            c->traced = 1;
+            c->queued_us = now;
+            c->trace_path = request_path(request, c->op);
+            request->traced = c;
+            trace_request(zh, &zh->trace_hooks.queued, c, now, ZOK);
+        }
+        queue_completion_nolock(&zh->sent_requests, c, 0);
+        if (zh->to_send.last) {
+            zh->to_send.last->next = request;
+        } else {
+            zh->to_send.head = request;
+        }
+        zh->to_send.last = request;
+        packets++;
+        bytes += request->len + sizeof(request->len);
+    }
+    unlock_stats(zh);
+    unlock_completion_list(&zh->sent_requests);
 }
 
-static int add_data_completion(zhandle_t *zh, int xid, data_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+static int add_data_completion(zhandle_t *zh, data_completion_t dc,
+        const void *data, const char *path, watcher_registration_t* wo,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_DATA, dc, data, 0, wo, 0);
+    return add_completion(zh, COMPLETION_DATA, dc, data, path, wo, 0, oa);
 }
 
-static int add_stat_completion(zhandle_t *zh, int xid, stat_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+static int add_stat_completion(zhandle_t *zh, stat_completion_t dc,
+        const void *data, const char *path, watcher_registration_t* wo,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, COMPLETION_STAT, dc, data, path, wo, 0, oa);
 }
 
-static int add_strings_completion(zhandle_t *zh, int xid,
-        strings_completion_t dc, const void *data,watcher_registration_t* wo)
+static int add_strings_completion(zhandle_t *zh,
+        strings_completion_t dc, const void *data, const char *path,
+        watcher_registration_t* wo, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST, dc, data, 0, wo, 0);
+    return add_completion(zh, COMPLETION_STRINGLIST, dc, data, path, wo, 0, oa);
 }
 
-static int add_strings_stat_completion(zhandle_t *zh, int xid,
-        strings_stat_completion_t dc, const void *data,watcher_registration_t* wo)
+static int add_strings_stat_completion(zhandle_t *zh,
+        strings_stat_completion_t dc, const void *data, const char *path,
+        watcher_registration_t* wo, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, COMPLETION_STRINGLIST_STAT, dc, data, path, wo, 0,
+            oa);
 }
 
-static int add_acl_completion(zhandle_t *zh, int xid, acl_completion_t dc,
-        const void *data)
+static int add_acl_completion(zhandle_t *zh, acl_completion_t dc,
+        const void *data, const char *path, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_ACLLIST, dc, data, 0, 0, 0);
+    return add_completion(zh, COMPLETION_ACLLIST, dc, data, path, 0, 0, oa);
 }
 
-static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-        const void *data)
+static int add_void_completion(zhandle_t *zh, void_completion_t dc,
+        const void *data, const char *path, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_VOID, dc, data, 0, 0, 0);
+    return add_completion(zh, COMPLETION_VOID, dc, data, path, 0, 0, oa);
 }
 
-static int add_string_completion(zhandle_t *zh, int xid,
-        string_completion_t dc, const void *data)
+static int add_string_completion(zhandle_t *zh,
+        string_completion_t dc, const void *data, const char *path,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRING, dc, data, 0, 0, 0);
+    return add_completion(zh, COMPLETION_STRING, dc, data, path, 0, 0, oa);
 }
 
-static int add_string_stat_completion(zhandle_t *zh, int xid,
-        string_stat_completion_t dc, const void *data)
+static int add_string_stat_completion(zhandle_t *zh,
+        string_stat_completion_t dc, const void *data, const char *path,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRING_STAT, dc, data, 0, 0, 0);
+    return add_completion(zh, COMPLETION_STRING_STAT, dc, data, path, 0, 0, oa);
 }
 
-static int add_multi_completion(zhandle_t *zh, int xid, void_completion_t dc,
-        const void *data, completion_head_t *clist)
+static int add_multi_completion(zhandle_t *zh, void_completion_t dc,
+        const void *data, completion_head_t *clist, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_MULTI, dc, data, 0,0, clist);
+    return add_completion(zh, COMPLETION_MULTI, dc, data, 0, 0, clist, oa);
 }
 
 int zookeeper_close(zhandle_t *zh)
@@ -3236,6 +5597,9 @@ int zookeeper_close(zhandle_t *zh)
 
     /* Signal any syncronous completions before joining the threads */
         enter_critical(zh);
+        lock_buffer_list(&zh->to_send);
+        queue_submitted_requests(zh);
+        unlock_buffer_list(&zh->to_send);
         free_completions(zh,1,ZCLOSING);
         leave_critical(zh);
 
@@ -3249,15 +5613,20 @@ int zookeeper_close(zhandle_t *zh)
      * destroy the handle later. */
     if (is_connected(zh)){
         struct oarchive *oa;
-        struct RequestHeader h = {get_xid(), ZOO_CLOSE_OP};
+        struct RequestHeader h = {UNASSIGNED_XID, ZOO_CLOSE_OP};
         LOG_INFO(LOGCALLBACK(zh), "Closing zookeeper sessionId=%#llx to [%s]\n",
                 zh->client_id.client_id,zoo_get_current_server(zh));
-        oa = create_buffer_oarchive();
+        lock_buffer_list(&zh->to_send);
+        queue_submitted_requests(zh);
+        /* goes on the wire after all the requests queued */
+        h.xid = next_xid(zh);
+        oa = create_pooled_oarchive(zh, sizeof_RequestHeader(&h));
         rc = serialize_RequestHeader(oa, "header", &h);
-        rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+        rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
                 get_buffer_len(oa));
+        unlock_buffer_list(&zh->to_send);
         /* We queued the buffer, so don't free it */
-        close_buffer_oarchive(&oa, 0);
+        close_pooled_oarchive(&oa, 0);
         if (rc < 0) {
             rc = ZMARSHALLINGERROR;
             goto finish;
@@ -3369,13 +5738,13 @@ int zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t dc,
     return zoo_awget(zh,path,watch?zh->watcher:0,zh->context,dc,data);
 }
 
-int zoo_awget(zhandle_t *zh, const char *path,
-        watcher_fn watcher, void* watcherCtx,
-        data_completion_t dc, const void *data)
+static int awget(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx, int completion_type,
+        const void *dc, const void *data)
 {
     struct oarchive *oa;
     char *server_path = prepend_string(zh, path);
-    struct RequestHeader h = {get_xid(), ZOO_GETDATA_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_GETDATA_OP};
     struct GetDataRequest req =  { (char*)server_path, watcher!=0 };
     int rc;
 
@@ -3387,26 +5756,75 @@ int zoo_awget(zhandle_t *zh, const char *path,
         free_duplicate_path(server_path, path);
         return ZINVALIDSTATE;
     }
-    oa=create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_GetDataRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data,
-    create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_completion(zh, completion_type, dc, data, server_path,
+    create_watcher_registration(zh, server_path,data_result_checker,watcher,watcherCtx), 0, oa);
     free_duplicate_path(server_path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
     return (rc < 0)?ZMARSHALLINGERROR:ZOK;
 }
 
+int zoo_awget(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_completion_t dc, const void *data)
+{
+    return awget(zh, path, watcher, watcherCtx, COMPLETION_DATA, dc, data);
+}
+
+int zoo_aget_ref(zhandle_t *zh, const char *path, int watch,
+        data_ref_completion_t dc, const void *data)
+{
+    return zoo_awget_ref(zh,path,watch?zh->watcher:0,zh->context,dc,data);
+}
+
+int zoo_awget_ref(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_ref_completion_t dc, const void *data)
+{
+    return awget(zh, path, watcher, watcherCtx, COMPLETION_DATA_REF, dc, data);
+}
+
+zoo_buffer_t *zoo_buffer_retain(zoo_buffer_t *buffer)
+{
+    if (buffer == NULL) {
+        return NULL;
+    }
+    if (buffer->retained == NULL) {
+        /* the lent descriptor lives on the completion's stack */
+        struct zoo_buffer *r = malloc(sizeof(*r));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->refs = 0;
+        r->packet = buffer->packet;
+        r->retained = r;
+        buffer->retained = r;
+    }
+    fetch_and_add(&buffer->retained->refs, 1);
+    return buffer->retained;
+}
+
+void zoo_buffer_release(zoo_buffer_t *buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    assert(buffer->retained == buffer);
+    if (fetch_and_add(&buffer->refs, -1) == 1) {
+        free(buffer->packet);
+        free(buffer);
+    }
+}
+
 int zoo_agetconfig(zhandle_t *zh, int watch, data_completion_t dc,
         const void *data)
 {
@@ -3419,7 +5837,7 @@ int zoo_awgetconfig(zhandle_t *zh, watcher_fn watcher, void* watcherCtx,
     struct oarchive *oa;
     char *path = ZOO_CONFIG_NODE;
     char *server_path = ZOO_CONFIG_NODE;
-    struct RequestHeader h = { get_xid(), ZOO_GETDATA_OP };
+    struct RequestHeader h = { UNASSIGNED_XID, ZOO_GETDATA_OP };
     struct GetDataRequest req =  { (char*)server_path, watcher!=0 };
     int rc;
 
@@ -3431,20 +5849,18 @@ int zoo_awgetconfig(zhandle_t *zh, watcher_fn watcher, void* watcherCtx,
         free_duplicate_path(server_path, path);
         return ZINVALIDSTATE;
     }
-    oa=create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_GetDataRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data,
-                                           create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-                                          get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_data_completion(zh, dc, data, server_path,
+                                           create_watcher_registration(zh, server_path,data_result_checker,watcher,watcherCtx),
+                                           oa);
     free_duplicate_path(server_path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
                zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3455,7 +5871,7 @@ int zoo_areconfig(zhandle_t *zh, const char *joining, const char *leaving,
        const char *members, int64_t version, data_completion_t dc, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = { get_xid(), ZOO_RECONFIG_OP };
+    struct RequestHeader h = { UNASSIGNED_XID, ZOO_RECONFIG_OP };
     struct ReconfigRequest req;
    int rc = 0;
 
@@ -3466,22 +5882,19 @@ int zoo_areconfig(zhandle_t *zh, const char *joining, const char *leaving,
         return ZINVALIDSTATE;
     }
 
-   oa=create_buffer_oarchive();
    req.joiningServers = (char *)joining;
    req.leavingServers = (char *)leaving;
    req.newMembers = (char *)members;
    req.curConfigId = version;
+   oa = create_pooled_oarchive(zh,
+           sizeof_RequestHeader(&h) + sizeof_ReconfigRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
    rc = rc < 0 ? rc : serialize_ReconfigRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data, NULL);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_data_completion(zh, dc, data, 0, NULL, oa);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending Reconfig request xid=%#x to %s",h.xid, zoo_get_current_server(zh));
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending Reconfig request to %s", zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
 
@@ -3508,25 +5921,22 @@ int zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen,
         int version, stat_completion_t dc, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_SETDATA_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_SETDATA_OP};
     struct SetDataRequest req;
     int rc = SetDataRequest_init(zh, &req, path, buffer, buflen, version);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_SetDataRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, dc, data,0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_stat_completion(zh, dc, data, req.path, 0, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3562,7 +5972,7 @@ int zoo_acreate(zhandle_t *zh, const char *path, const char *value,
         string_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_CREATE_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_CREATE_OP};
     struct CreateRequest req;
 
     int rc = CreateRequest_init(zh, &req, 
@@ -3570,19 +5980,16 @@ int zoo_acreate(zhandle_t *zh, const char *path, const char *value,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_CreateRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_string_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3594,26 +6001,23 @@ int zoo_acreate2(zhandle_t *zh, const char *path, const char *value,
         string_stat_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = { get_xid(), ZOO_CREATE2_OP };
+    struct RequestHeader h = { UNASSIGNED_XID, ZOO_CREATE2_OP };
     struct CreateRequest req;
 
     int rc = CreateRequest_init(zh, &req, path, value, valuelen, acl_entries, flags);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_CreateRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_stat_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_string_stat_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3635,25 +6039,22 @@ int zoo_adelete(zhandle_t *zh, const char *path, int version,
         void_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_DELETE_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_DELETE_OP};
     struct DeleteRequest req;
     int rc = DeleteRequest_init(zh, &req, path, version);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_DeleteRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_void_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3671,28 +6072,25 @@ int zoo_awexists(zhandle_t *zh, const char *path,
         stat_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_EXISTS_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_EXISTS_OP};
     struct ExistsRequest req;
     int rc = Request_path_watch_init(zh, 0, &req.path, path, 
             &req.watch, watcher != NULL);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_ExistsRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_ExistsRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, completion, data,
-        create_watcher_registration(req.path,exists_result_checker,
-                watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_stat_completion(zh, completion, data, req.path,
+        create_watcher_registration(zh, req.path,exists_result_checker,
+                watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3705,27 +6103,24 @@ static int zoo_awget_children_(zhandle_t *zh, const char *path,
          const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_GETCHILDREN_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_GETCHILDREN_OP};
     struct GetChildrenRequest req ;
     int rc = Request_path_watch_init(zh, 0, &req.path, path, 
             &req.watch, watcher != NULL);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_GetChildrenRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildrenRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_strings_completion(zh, h.xid, sc, data,
-            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_strings_completion(zh, sc, data, req.path,
+            create_watcher_registration(zh, req.path,child_result_checker,watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3753,27 +6148,24 @@ static int zoo_awget_children2_(zhandle_t *zh, const char *path,
 {
     /* invariant: (sc == NULL) != (sc == NULL) */
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_GETCHILDREN2_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_GETCHILDREN2_OP};
     struct GetChildren2Request req ;
     int rc = Request_path_watch_init(zh, 0, &req.path, path, 
             &req.watch, watcher != NULL);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_GetChildren2Request(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildren2Request(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_strings_stat_completion(zh, h.xid, ssc, data,
-            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_strings_stat_completion(zh, ssc, data, req.path,
+            create_watcher_registration(zh, req.path,child_result_checker,watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3798,25 +6190,22 @@ int zoo_async(zhandle_t *zh, const char *path,
         string_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_SYNC_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_SYNC_OP};
     struct SyncRequest req;
     int rc = Request_path_init(zh, 0, &req.path, path);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_SyncRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SyncRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_string_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3828,25 +6217,22 @@ int zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion,
         const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_GETACL_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_GETACL_OP};
     struct GetACLRequest req;
     int rc = Request_path_init(zh, 0, &req.path, path) ;
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_GetACLRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetACLRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_acl_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_acl_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3857,27 +6243,24 @@ int zoo_aset_acl(zhandle_t *zh, const char *path, int version,
         struct ACL_vector *acl, void_completion_t completion, const void *data)
 {
     struct oarchive *oa;
-    struct RequestHeader h = {get_xid(), ZOO_SETACL_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_SETACL_OP};
     struct SetACLRequest req;
     int rc = Request_path_init(zh, 0, &req.path, path);
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
     req.acl = *acl;
     req.version = version;
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_SetACLRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetACLRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_void_completion(zh, completion, data, req.path, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",h.xid,path,
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",path,
             zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
@@ -3939,19 +6322,115 @@ static int CheckVersionRequest_init(zhandle_t *zh, struct CheckVersionRequest *r
     return ZOK;
 }
 
+/* the request of a multi or batch op, built once to be sized and then
+ * serialized */
+union op_request {
+    struct CreateRequest create;
+    struct DeleteRequest del;
+    struct SetDataRequest set;
+    struct CheckVersionRequest check;
+    struct GetDataRequest get;
+    struct ExistsRequest exists;
+    struct GetChildrenRequest children;
+};
+
+/* builds the request of op in a multi, with the chroot prepended to its
+ * path, and adds its serialized size and that of its header to size */
+static int multi_request_init(zhandle_t *zh, const zoo_op_t *op,
+        union op_request *req, int32_t *size)
+{
+    struct MultiHeader mh = {op->type, 0, -1};
+    int rc;
+
+    switch(op->type) {
+        case ZOO_CREATE_OP:
+            rc = CreateRequest_init(zh, &req->create, op->create_op.path,
+                    op->create_op.data, op->create_op.datalen,
+                    op->create_op.acl, op->create_op.flags);
+            *size += rc == ZOK ? sizeof_CreateRequest(&req->create) : 0;
+            break;
+        case ZOO_DELETE_OP:
+            rc = DeleteRequest_init(zh, &req->del, op->delete_op.path,
+                    op->delete_op.version);
+            *size += rc == ZOK ? sizeof_DeleteRequest(&req->del) : 0;
+            break;
+        case ZOO_SETDATA_OP:
+            rc = SetDataRequest_init(zh, &req->set, op->set_op.path,
+                    op->set_op.data, op->set_op.datalen, op->set_op.version);
+            *size += rc == ZOK ? sizeof_SetDataRequest(&req->set) : 0;
+            break;
+        case ZOO_CHECK_OP:
+            rc = CheckVersionRequest_init(zh, &req->check,
+                    op->check_op.path, op->check_op.version);
+            *size += rc == ZOK ? sizeof_CheckVersionRequest(&req->check) : 0;
+            break;
+        default:
+            LOG_ERROR(LOGCALLBACK(zh), "Unimplemented sub-op type=%d in multi-op", op->type);
+            return ZUNIMPLEMENTED;
+    }
+    *size += sizeof_MultiHeader(&mh);
+    return rc;
+}
+
+/* frees the path of a request built by multi_request_init() */
+static void multi_request_free(const zoo_op_t *op, union op_request *req)
+{
+    switch(op->type) {
+        case ZOO_CREATE_OP:
+            free_duplicate_path(req->create.path, op->create_op.path);
+            break;
+        case ZOO_DELETE_OP:
+            free_duplicate_path(req->del.path, op->delete_op.path);
+            break;
+        case ZOO_SETDATA_OP:
+            free_duplicate_path(req->set.path, op->set_op.path);
+            break;
+        case ZOO_CHECK_OP:
+            free_duplicate_path(req->check.path, op->check_op.path);
+            break;
+    }
+}
+
 int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
         zoo_op_result_t *results, void_completion_t completion, const void *data)
 {
-    struct RequestHeader h = {get_xid(), ZOO_MULTI_OP};
+    struct RequestHeader h = {UNASSIGNED_XID, ZOO_MULTI_OP};
     struct MultiHeader mh = {-1, 1, -1};
-    struct oarchive *oa = create_buffer_oarchive();
+    struct oarchive *oa;
     completion_head_t clist = { 0 };
+    union op_request *reqs;
+    int32_t size = sizeof_RequestHeader(&h) + sizeof_MultiHeader(&mh);
+    int rc = ZOK;
+    int index = 0;
+    int built;
+
+    /* the requests are built first so that the buffer for the whole multi
+     * is allocated once at its size */
+    reqs = calloc(count > 0 ? count : 1, sizeof(*reqs));
+    if (!reqs) {
+        return ZSYSTEMERROR;
+    }
+    for (built = 0; built < count; built++) {
+        rc = multi_request_init(zh, ops + built, reqs + built, &size);
+        if (rc != ZOK) {
+            break;
+        }
+    }
+    if (rc != ZOK) {
+        /* a request that failed to build holds no path */
+        for (index = 0; index < built; index++) {
+            multi_request_free(ops + index, reqs + index);
+        }
+        free(reqs);
+        return rc == ZUNIMPLEMENTED ? rc : ZMARSHALLINGERROR;
+    }
 
-    int rc = serialize_RequestHeader(oa, "header", &h);
+    oa = create_pooled_oarchive(zh, size);
+    rc = serialize_RequestHeader(oa, "header", &h);
 
-    int index = 0;
     for (index=0; index < count; index++) {
         const zoo_op_t *op = ops+index;
+        union op_request *req = reqs+index;
         zoo_op_result_t *result = results+index;
         completion_list_t *entry = NULL;
 
@@ -3959,86 +6438,49 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
         rc = rc < 0 ? rc : serialize_MultiHeader(oa, "multiheader", &mh);
 
         switch(op->type) {
-            case ZOO_CREATE_OP: {
-                struct CreateRequest req;
-
-                rc = rc < 0 ? rc : CreateRequest_init(zh, &req,
-                                        op->create_op.path, op->create_op.data,
-                                        op->create_op.datalen, op->create_op.acl,
-                                        op->create_op.flags);
-                rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
+            case ZOO_CREATE_OP:
+                rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req->create);
                 result->value = op->create_op.buf;
                 result->valuelen = op->create_op.buflen;
 
-                enter_critical(zh);
-                entry = create_completion_entry(zh, h.xid, COMPLETION_STRING, op_result_string_completion, result, 0, 0);
-                leave_critical(zh);
-                free_duplicate_path(req.path, op->create_op.path);
+                entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_STRING, op_result_string_completion, result, 0, 0);
                 break;
-            }
 
-            case ZOO_DELETE_OP: {
-                struct DeleteRequest req;
-                rc = rc < 0 ? rc : DeleteRequest_init(zh, &req, op->delete_op.path, op->delete_op.version);
-                rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
+            case ZOO_DELETE_OP:
+                rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req->del);
 
-                enter_critical(zh);
-                entry = create_completion_entry(zh, h.xid, COMPLETION_VOID, op_result_void_completion, result, 0, 0);
-                leave_critical(zh);
-                free_duplicate_path(req.path, op->delete_op.path);
+                entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_VOID, op_result_void_completion, result, 0, 0);
                 break;
-            }
 
-            case ZOO_SETDATA_OP: {
-                struct SetDataRequest req;
-                rc = rc < 0 ? rc : SetDataRequest_init(zh, &req,
-                                        op->set_op.path, op->set_op.data,
-                                        op->set_op.datalen, op->set_op.version);
-                rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
+            case ZOO_SETDATA_OP:
+                rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req->set);
                 result->stat = op->set_op.stat;
 
-                enter_critical(zh);
-                entry = create_completion_entry(zh, h.xid, COMPLETION_STAT, op_result_stat_completion, result, 0, 0);
-                leave_critical(zh);
-                free_duplicate_path(req.path, op->set_op.path);
+                entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_STAT, op_result_stat_completion, result, 0, 0);
                 break;
-            }
 
-            case ZOO_CHECK_OP: {
-                struct CheckVersionRequest req;
-                rc = rc < 0 ? rc : CheckVersionRequest_init(zh, &req,
-                                        op->check_op.path, op->check_op.version);
-                rc = rc < 0 ? rc : serialize_CheckVersionRequest(oa, "req", &req);
+            case ZOO_CHECK_OP:
+                rc = rc < 0 ? rc : serialize_CheckVersionRequest(oa, "req", &req->check);
 
-                enter_critical(zh);
-                entry = create_completion_entry(zh, h.xid, COMPLETION_VOID, op_result_void_completion, result, 0, 0);
-                leave_critical(zh);
-                free_duplicate_path(req.path, op->check_op.path);
+                entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_VOID, op_result_void_completion, result, 0, 0);
                 break;
-            }
-
-            default:
-                LOG_ERROR(LOGCALLBACK(zh), "Unimplemented sub-op type=%d in multi-op", op->type);
-                return ZUNIMPLEMENTED;
         }
+        multi_request_free(op, req);
 
         queue_completion(&clist, entry, 0);
     }
+    free(reqs);
 
     rc = rc < 0 ? rc : serialize_MultiHeader(oa, "multiheader", &mh);
 
     /* BEGIN: CRTICIAL SECTION */
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_multi_completion(zh, h.xid, completion, data, &clist);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_multi_completion(zh, completion, data, &clist, oa);
 
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending multi request xid=%#x with %d subrequests to %s",
-            h.xid, index, zoo_get_current_server(zh));
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending multi request with %d subrequests to %s",
+            index, zoo_get_current_server(zh));
     /* make a best (non-blocking) effort to send the requests asap */
     adaptor_send_queue(zh, 0);
 
@@ -4103,6 +6545,380 @@ void zoo_check_op_init(zoo_op_t *op, const char *path, int version)
     op->check_op.version = version;
 }
 
+void zoo_aget_op_init(zoo_aop_t *op, const char *path, int watch,
+        data_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_GETDATA_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->get_op.watch = watch;
+    op->get_op.completion = completion;
+}
+
+void zoo_aexists_op_init(zoo_aop_t *op, const char *path, int watch,
+        stat_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_EXISTS_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->exists_op.watch = watch;
+    op->exists_op.completion = completion;
+}
+
+void zoo_aget_children_op_init(zoo_aop_t *op, const char *path, int watch,
+        strings_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_GETCHILDREN_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->get_children_op.watch = watch;
+    op->get_children_op.completion = completion;
+}
+
+void zoo_aset_op_init(zoo_aop_t *op, const char *path, const char *buffer,
+        int buflen, int version, stat_completion_t completion,
+        const void *data)
+{
+    assert(op);
+    op->type = ZOO_SETDATA_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->set_op.buffer = buffer;
+    op->set_op.buflen = buflen;
+    op->set_op.version = version;
+    op->set_op.completion = completion;
+}
+
+void zoo_acreate_op_init(zoo_aop_t *op, const char *path, const char *value,
+        int valuelen, const struct ACL_vector *acl, int flags,
+        string_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_CREATE_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->create_op.value = value;
+    op->create_op.valuelen = valuelen;
+    op->create_op.acl = acl;
+    op->create_op.flags = flags;
+    op->create_op.completion = completion;
+}
+
+void zoo_adelete_op_init(zoo_aop_t *op, const char *path, int version,
+        void_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_DELETE_OP;
+    op->path = path;
+    op->data = data;
+    op->timeout = 0;
+    op->release = 0;
+    op->delete_op.version = version;
+    op->delete_op.completion = completion;
+}
+
+void zoo_aop_set_timeout(zoo_aop_t *op, int timeout_ms)
+{
+    assert(op);
+    op->timeout = timeout_ms;
+}
+
+void zoo_aop_set_buffer_ref(zoo_aop_t *op, zoo_buffer_release_fn release,
+        void *context)
+{
+    assert(op);
+    op->release = release;
+    op->release_context = context;
+}
+
+/* the data of a set or create op, to which zoo_aop_set_buffer_ref()
+ * applies; returns 0 for the other ops */
+static int op_data(const zoo_aop_t *op, const char **buffer, int *len)
+{
+    switch (op->type) {
+    case ZOO_SETDATA_OP:
+        *buffer = op->set_op.buffer;
+        *len = op->set_op.buflen;
+        return 1;
+    case ZOO_CREATE_OP:
+        *buffer = op->create_op.value;
+        *len = op->create_op.valuelen;
+        return 1;
+    }
+    return 0;
+}
+
+/* hands the data of op back to the caller if it was lent to the library */
+static void release_op_buffer(const zoo_aop_t *op)
+{
+    const char *buffer;
+    int len;
+    if (op->release && op_data(op, &buffer, &len)) {
+        op->release(buffer, op->release_context);
+    }
+}
+
+/* makes request, serialized with empty data whose length ends at off, send
+ * len bytes of payload at off; the buffer of request stays as it is */
+static void refer_payload(buffer_list_t *request, int off,
+        const char *payload, int len, const zoo_aop_t *op)
+{
+    int32_t n = htonl(len);
+    memcpy(request->buffer + off - sizeof(n), &n, sizeof(n));
+    request->payload = payload;
+    request->payload_off = off;
+    request->payload_len = len;
+    request->len += len;
+    request->release = op->release;
+    request->release_context = op->release_context;
+}
+
+/* serializes an operation of a batch into a completion entry holding the
+ * request; returns 0 and sets rc on failure */
+static completion_list_t *create_batch_entry(zhandle_t *zh,
+        const zoo_aop_t *op, int *rc)
+{
+    struct oarchive *oa;
+    struct RequestHeader h = {UNASSIGNED_XID, op->type};
+    union op_request req;
+    int32_t size = sizeof_RequestHeader(&h);
+    completion_list_t *entry = 0;
+    watcher_fn watcher = 0;
+    char *server_path = 0;
+    const char *payload = 0;
+    int payload_len = 0;
+    int payload_off = 0;
+    int referred = 0;
+
+    *rc = Request_path_init(zh, op->type == ZOO_CREATE_OP ?
+            op->create_op.flags : 0, &server_path, op->path);
+    if (*rc != ZOK) {
+        release_op_buffer(op);
+        return 0;
+    }
+
+#ifndef _WIN32
+    /* the data is serialized empty and its length is patched in once the
+     * request is attached */
+    if (!op->release || !op_data(op, &payload, &payload_len) ||
+            payload_len <= 0) {
+        payload = 0;
+    }
+#endif
+    /* the request is built once, to size the buffer and to serialize it */
+    switch (op->type) {
+    case ZOO_GETDATA_OP:
+        watcher = op->get_op.watch ? zh->watcher : 0;
+        req.get.path = server_path;
+        req.get.watch = watcher != 0;
+        size += sizeof_GetDataRequest(&req.get);
+        break;
+    case ZOO_EXISTS_OP:
+        watcher = op->exists_op.watch ? zh->watcher : 0;
+        req.exists.path = server_path;
+        req.exists.watch = watcher != 0;
+        size += sizeof_ExistsRequest(&req.exists);
+        break;
+    case ZOO_GETCHILDREN_OP:
+        watcher = op->get_children_op.watch ? zh->watcher : 0;
+        req.children.path = server_path;
+        req.children.watch = watcher != 0;
+        size += sizeof_GetChildrenRequest(&req.children);
+        break;
+    case ZOO_SETDATA_OP:
+        req.set.path = server_path;
+        req.set.data.buff = (char*)op->set_op.buffer;
+        req.set.data.len = payload ? 0 : op->set_op.buflen;
+        req.set.version = op->set_op.version;
+        size += sizeof_SetDataRequest(&req.set);
+        break;
+    case ZOO_CREATE_OP:
+        req.create.path = server_path;
+        req.create.data.buff = (char*)op->create_op.value;
+        req.create.data.len = payload ? 0 : op->create_op.valuelen;
+        req.create.flags = op->create_op.flags;
+        if (op->create_op.acl == 0) {
+            req.create.acl.count = 0;
+            req.create.acl.data = 0;
+        } else {
+            req.create.acl = *op->create_op.acl;
+        }
+        size += sizeof_CreateRequest(&req.create);
+        break;
+    case ZOO_DELETE_OP:
+        req.del.path = server_path;
+        req.del.version = op->delete_op.version;
+        size += sizeof_DeleteRequest(&req.del);
+        break;
+    default:
+        LOG_ERROR(LOGCALLBACK(zh), "Unsupported op type=%d in a batch", op->type);
+        free_duplicate_path(server_path, op->path);
+        *rc = ZBADARGUMENTS;
+        return 0;
+    }
+
+    oa = create_pooled_oarchive(zh, size);
+    *rc = serialize_RequestHeader(oa, "header", &h);
+    switch (op->type) {
+    case ZOO_GETDATA_OP:
+        *rc = *rc < 0 ? *rc : serialize_GetDataRequest(oa, "req", &req.get);
+        entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_DATA,
+                op->get_op.completion, op->data,
+                create_watcher_registration(zh, server_path,
+                    data_result_checker, watcher, zh->context), 0);
+        break;
+    case ZOO_EXISTS_OP:
+        *rc = *rc < 0 ? *rc : serialize_ExistsRequest(oa, "req", &req.exists);
+        entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_STAT,
+                op->exists_op.completion, op->data,
+                create_watcher_registration(zh, server_path,
+                    exists_result_checker, watcher, zh->context), 0);
+        break;
+    case ZOO_GETCHILDREN_OP:
+        *rc = *rc < 0 ? *rc : serialize_GetChildrenRequest(oa, "req",
+                &req.children);
+        entry = create_completion_entry(zh, UNASSIGNED_XID,
+                COMPLETION_STRINGLIST, op->get_children_op.completion,
+                op->data, create_watcher_registration(zh, server_path,
+                    child_result_checker, watcher, zh->context), 0);
+        break;
+    case ZOO_SETDATA_OP:
+        /* field by field, to note where the data ends */
+        *rc = *rc < 0 ? *rc : oa->start_record(oa, "req");
+        *rc = *rc < 0 ? *rc : oa->serialize_String(oa, "path", &req.set.path);
+        *rc = *rc < 0 ? *rc : oa->serialize_Buffer(oa, "data", &req.set.data);
+        payload_off = get_buffer_len(oa);
+        *rc = *rc < 0 ? *rc : oa->serialize_Int(oa, "version",
+                &req.set.version);
+        *rc = *rc < 0 ? *rc : oa->end_record(oa, "req");
+        entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_STAT,
+                op->set_op.completion, op->data, 0, 0);
+        break;
+    case ZOO_CREATE_OP:
+        /* field by field, to note where the data ends */
+        *rc = *rc < 0 ? *rc : oa->start_record(oa, "req");
+        *rc = *rc < 0 ? *rc : oa->serialize_String(oa, "path",
+                &req.create.path);
+        *rc = *rc < 0 ? *rc : oa->serialize_Buffer(oa, "data",
+                &req.create.data);
+        payload_off = get_buffer_len(oa);
+        *rc = *rc < 0 ? *rc : serialize_ACL_vector(oa, "acl", &req.create.acl);
+        *rc = *rc < 0 ? *rc : oa->serialize_Int(oa, "flags",
+                &req.create.flags);
+        *rc = *rc < 0 ? *rc : oa->end_record(oa, "req");
+        entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_STRING,
+                op->create_op.completion, op->data, 0, 0);
+        break;
+    case ZOO_DELETE_OP:
+        *rc = *rc < 0 ? *rc : serialize_DeleteRequest(oa, "req", &req.del);
+        entry = create_completion_entry(zh, UNASSIGNED_XID, COMPLETION_VOID,
+                op->delete_op.completion, op->data, 0, 0);
+        break;
+    }
+    if (entry) {
+        entry->key = completion_key(zh, server_path, op->data);
+    }
+    if (*rc < 0 || !entry) {
+        destroy_completion_entry(entry);
+        close_pooled_oarchive(&oa, 1);
+        entry = 0;
+        *rc = ZMARSHALLINGERROR;
+    } else if (attach_request(zh, entry, oa) != ZOK) {
+        close_pooled_oarchive(&oa, 1);
+        entry = 0;
+        *rc = ZMARSHALLINGERROR;
+    } else {
+        /* the entry owns the buffer now, so don't free it */
+        close_pooled_oarchive(&oa, 0);
+        if (op->timeout != 0) {
+            entry->deadline.expires = op->timeout < 0 ? 0 :
+                entry->submitted / 1000 + op->timeout;
+        }
+        if (payload) {
+            refer_payload(entry->request, payload_off, payload, payload_len,
+                    op);
+            referred = 1;
+        }
+        *rc = ZOK;
+    }
+    if (!referred) {
+        /* the data was copied, or the op failed */
+        release_op_buffer(op);
+    }
+    free_duplicate_path(server_path, op->path);
+    return entry;
+}
+
+int zoo_asubmit(zhandle_t *zh, int count, const zoo_aop_t *ops)
+{
+    completion_list_t *newest = 0;
+    completion_list_t *oldest = 0;
+    completion_list_t *entry;
+    int rc = ZOK;
+    int i;
+
+    if (count < 0 || (count > 0 && ops == 0)) {
+        return ZBADARGUMENTS;
+    }
+    if (zh == 0 || is_unrecoverable(zh)) {
+        for (i = 0; i < count; i++) {
+            release_op_buffer(ops + i);
+        }
+        return zh == 0 ? ZBADARGUMENTS : ZINVALIDSTATE;
+    }
+    if (count == 0) {
+        return ZOK;
+    }
+    /* link the entries from the newest to the oldest, the order in which
+     * zh->submitted holds them */
+    for (i = 0; i < count; i++) {
+        entry = create_batch_entry(zh, ops + i, &rc);
+        if (!entry) {
+            break;
+        }
+        entry->next = newest;
+        newest = entry;
+        if (!oldest) {
+            oldest = entry;
+        }
+    }
+    if (rc != ZOK) {
+        /* the ops not serialized yet still hold their buffers */
+        for (i++; i < count; i++) {
+            release_op_buffer(ops + i);
+        }
+        while (newest) {
+            entry = newest->next;
+            destroy_completion_entry(newest);
+            newest = entry;
+        }
+        return rc;
+    }
+    rc = push_requests(zh, newest, oldest);
+    if (rc != ZOK) {
+        return rc;
+    }
+
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending a batch of %d requests to %s", count,
+            zoo_get_current_server(zh));
+    /* wake up the I/O thread once for the whole batch */
+    adaptor_send_queue(zh, 0);
+    return ZOK;
+}
+
 int zoo_multi(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results)
 {
     int rc;
@@ -4133,11 +6949,12 @@ int flush_send_queue(zhandle_t*zh, int timeout)
     struct timeval wait;
 #endif
     get_system_time(&started);
-    // we can't use dequeue_buffer() here because if (non-blocking) send_buffer()
-    // returns EWOULDBLOCK we'd have to put the buffer back on the queue.
-    // we use a recursive lock instead and only dequeue the buffer if a send was
-    // successful
+    // we can't use dequeue_buffer() here because if a (non-blocking) send
+    // returns EWOULDBLOCK we'd have to put the buffers back on the queue.
+    // we use a recursive lock instead and send_queued_buffers() only dequeues
+    // the buffers that were sent completely
     lock_buffer_list(&zh->to_send);
+    queue_submitted_requests(zh);
     while (zh->to_send.head != 0 && is_connected(zh)) {
         if(timeout!=0){
 #ifndef _WIN32
@@ -4171,9 +6988,10 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             }
         }
 
-        rc = send_buffer(zh->fd, zh->to_send.head);
+        rc = send_queued_buffers(zh);
+        fill_send_queue(zh, 0);
         if(rc==0 && timeout==0){
-            /* send_buffer would block while sending this buffer */
+            /* the send would block */
             rc = ZOK;
             break;
         }
@@ -4181,9 +6999,6 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             rc = ZCONNECTIONLOSS;
             break;
         }
-        // if the buffer has been sent successfully, remove it from the queue
-        if (rc > 0)
-            remove_buffer(&zh->to_send);
         get_system_time(&zh->last_send);
         rc = ZOK;
     }
@@ -4191,6 +7006,22 @@ int flush_send_queue(zhandle_t*zh, int timeout)
     return rc;
 }
 
+/* Writes the send queue from the calling thread when it only holds the
+ * request just queued, so the I/O thread need not be woken up to send it.
+ * Returns 1 if the queue was emptied. */
+int send_queue_directly(zhandle_t *zh)
+{
+    int sent = 0;
+    lock_buffer_list(&zh->to_send);
+    queue_submitted_requests(zh);
+    if (zh->to_send.head != 0 && zh->to_send.head == zh->to_send.last &&
+            zh->fd != -1 && is_connected(zh)) {
+        sent = flush_send_queue(zh, 0) == ZOK && zh->to_send.head == 0;
+    }
+    unlock_buffer_list(&zh->to_send);
+    return sent;
+}
+
 const char* zerror(int c)
 {
     switch (c){
@@ -4462,6 +7293,9 @@ int zoo_wget(zhandle_t *zh, const char *path,
 
     if(buffer_len==NULL)
         return ZBADARGUMENTS;
+    if(zh && zh->cache && watcher && path &&
+            get_cached_data(zh,path,watcher,watcherCtx,buffer,buffer_len,stat))
+        return ZOK;
     if((sc=alloc_sync_completion())==NULL)
         return ZSYSTEMERROR;
 
@@ -4553,8 +7387,13 @@ static int zoo_wget_children_(zhandle_t *zh, const char *path,
         watcher_fn watcher, void* watcherCtx,
         struct String_vector *strings)
 {
-    struct sync_completion *sc = alloc_sync_completion();
+    struct sync_completion *sc;
     int rc;
+    if (zh && zh->cache && watcher && path &&
+            get_cached_children(zh, path, watcher, watcherCtx, strings, 0)) {
+        return ZOK;
+    }
+    sc = alloc_sync_completion();
     if (!sc) {
         return ZSYSTEMERROR;
     }
@@ -4578,8 +7417,13 @@ static int zoo_wget_children2_(zhandle_t *zh, const char *path,
         watcher_fn watcher, void* watcherCtx,
         struct String_vector *strings, struct Stat *stat)
 {
-    struct sync_completion *sc = alloc_sync_completion();
+    struct sync_completion *sc;
     int rc;
+    if (zh && zh->cache && watcher && path &&
+            get_cached_children(zh, path, watcher, watcherCtx, strings, stat)) {
+        return ZOK;
+    }
+    sc = alloc_sync_completion();
     if (!sc) {
         return ZSYSTEMERROR;
     }
@@ -4702,7 +7546,7 @@ int zoo_aremove_watchers(zhandle_t *zh, const char *path, ZooWatcherType wtype,
     char *server_path = prepend_string(zh, path);
     int rc;
     struct oarchive *oa;
-    struct RequestHeader h = { get_xid(), ZOO_REMOVE_WATCHES };
+    struct RequestHeader h = { UNASSIGNED_XID, ZOO_REMOVE_WATCHES };
     struct RemoveWatchesRequest req =  { (char*)server_path, wtype };
     watcher_deregistration_t *wdo;
 
@@ -4716,19 +7560,27 @@ int zoo_aremove_watchers(zhandle_t *zh, const char *path, ZooWatcherType wtype,
         goto done;
     }
 
+    lock_watchers(zh);
     if (!pathHasWatcher(zh, server_path, wtype, watcher, watcherCtx)) {
+        unlock_watchers(zh);
         rc = ZNOWATCHER;
         goto done;
     }
-
+    /* the server may stop notifying the client before the response arrives */
+    if (zh->cache) {
+        zk_cache_invalidate(zh->cache, server_path, cache_watcher_parts(wtype));
+    }
     if (local) {
         removeWatchers(zh, server_path, wtype, watcher, watcherCtx);
+        unlock_watchers(zh);
         notify_sync_completion((struct sync_completion *)data);
         rc = ZOK;
         goto done;
     }
+    unlock_watchers(zh);
 
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh,
+            sizeof_RequestHeader(&h) + sizeof_RemoveWatchesRequest(&req));
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_RemoveWatchesRequest(oa, "req", &req);
     if (rc < 0) {
@@ -4742,19 +7594,16 @@ int zoo_aremove_watchers(zhandle_t *zh, const char *path, ZooWatcherType wtype,
         goto done;
     }
 
-    enter_critical(zh);
-    rc = add_completion_deregistration(zh, h.xid, COMPLETION_VOID,
-                                       completion, data, 0, wdo, 0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
+    rc = add_completion_deregistration(zh, COMPLETION_VOID,
+                                       completion, data, server_path,
+                                       wdo, 0, oa);
     rc = rc < 0 ? ZMARSHALLINGERROR : ZOK;
-    leave_critical(zh);
 
     /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
+    close_pooled_oarchive(&oa, 0);
 
-    LOG_DEBUG(LOGCALLBACK(zh), "Sending request xid=%#x for path [%s] to %s",
-              h.xid, path, zoo_get_current_server(zh));
+    LOG_DEBUG(LOGCALLBACK(zh), "Sending request for path [%s] to %s",
+              path, zoo_get_current_server(zh));
 
     adaptor_send_queue(zh, 0);
 
@@ -269,6 +269,12 @@ ssize_t send(int s,const void *buf,size_t len,int flags){
     return Mock_socket::mock_->callSend(s,buf,len,flags);    
 }
 
+ssize_t sendmsg(int s,const struct msghdr *msg,int flags){
+    if (!Mock_socket::mock_)
+        return LIBC_SYMBOLS.sendmsg(s,msg,flags);
+    return Mock_socket::mock_->callSendmsg(s,msg,flags);
+}
+
 ssize_t recv(int s,void *buf,size_t len,int flags){
     if (!Mock_socket::mock_)
         return LIBC_SYMBOLS.recv(s,buf,len,flags);
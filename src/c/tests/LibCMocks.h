@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "MocksBase.h"
 #include "LibCSymTable.h"
@@ -212,6 +213,32 @@ public:
         }
         return len;
     }
+    // sendmsg() is used to write whole length-prefixed packets at once; split
+    // the stream back into packets
+    std::string sendStream;
+    virtual ssize_t callSendmsg(int s,const struct msghdr *msg,int flags){
+        if(sendErrno!=0){
+            errno=sendErrno;
+            return -1;
+        }
+        ssize_t total=0;
+        for(size_t i=0;i<msg->msg_iovlen;i++){
+            sendStream.append((const char*)msg->msg_iov[i].iov_base,
+                    msg->msg_iov[i].iov_len);
+            total+=msg->msg_iov[i].iov_len;
+        }
+        while(sendStream.size()>=sizeof(int32_t)){
+            int32_t len;
+            memcpy(&len,sendStream.data(),sizeof(len));
+            len=ntohl(len);
+            if(sendStream.size()<sizeof(len)+len)
+                break;
+            std::string buffer=sendStream.substr(sizeof(len),len);
+            sendStream.erase(0,sizeof(len)+len);
+            notifyBufferSent(buffer);
+        }
+        return total;
+    }
 
     int recvErrno;
     std::string recvReturnBuffer;
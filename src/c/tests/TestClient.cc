@@ -218,6 +218,7 @@ class Zookeeper_simpleSystem : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testGetChildren2);
     CPPUNIT_TEST(testLastZxid);
     CPPUNIT_TEST(testRemoveWatchers);
+    CPPUNIT_TEST(testSharedReactor);
 #endif
     CPPUNIT_TEST_SUITE_END();
 
@@ -746,6 +747,54 @@ public:
         CPPUNIT_ASSERT_EQUAL((int) ZOK, rc);
     }
 
+#ifdef THREADED
+    void testSharedReactor() {
+        const int count = 8;
+        watchctx_t ctx[count];
+        char path[64];
+        struct Stat stat;
+        int rc;
+
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS, zoo_reactor_init(0, 1));
+        for (int i = 0; i < count; i++) {
+            ctx[i].zh = zookeeper_init(hostPorts, watcher, 10000, 0, &ctx[i],
+                    ZOO_SHARED_REACTOR);
+            CPPUNIT_ASSERT(ctx[i].zh);
+        }
+        for (int i = 0; i < count; i++) {
+            CPPUNIT_ASSERT(ctx[i].waitForConnected(ctx[i].zh));
+        }
+        // the reactor is running, so it can't be reconfigured or stopped
+        CPPUNIT_ASSERT_EQUAL((int)ZINVALIDSTATE, zoo_reactor_init(2, 2));
+        CPPUNIT_ASSERT_EQUAL((int)ZINVALIDSTATE, zoo_reactor_shutdown());
+
+        for (int i = 0; i < count; i++) {
+            sprintf(path, "/reactor%d", i);
+            rc = zoo_create(ctx[i].zh, path, "x", 1, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK, rc);
+            rc = zoo_exists(ctx[i].zh, path, 1, &stat);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK, rc);
+        }
+        // every handle sees the change made through its neighbour
+        for (int i = 0; i < count; i++) {
+            sprintf(path, "/reactor%d", i);
+            rc = zoo_set(ctx[(i + 1) % count].zh, path, "y", 1, -1);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK, rc);
+        }
+        for (int i = 0; i < count; i++) {
+            CPPUNIT_ASSERT(waitForEvent(ctx[i].zh, &ctx[i], 5));
+            sprintf(path, "/reactor%d", i);
+            CPPUNIT_ASSERT_EQUAL(string(path), ctx[i].getEvent().path);
+        }
+
+        for (int i = 0; i < count; i++) {
+            zookeeper_close(ctx[i].zh);
+            ctx[i].zh = 0;
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK, zoo_reactor_shutdown());
+    }
+#endif
+
     void testNullData() {
         watchctx_t ctx;
         zhandle_t *zk = createClient(&ctx);
@@ -21,9 +21,25 @@
 
 #include "ZKMocks.h"
 #include <proto.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 
 using namespace std;
 
+// zookeeper_interest() calls it on an idle connection
+extern "C" int send_ping(zhandle_t* zh);
+
+static int slowRequestLogs;
+static void countSlowRequestLogs(const char *message)
+{
+    if (strstr(message, "Slow request") != 0) {
+        slowRequestLogs++;
+    }
+}
+
 class Zookeeper_operations : public CPPUNIT_NS::TestFixture
 {
     CPPUNIT_TEST_SUITE(Zookeeper_operations);
@@ -31,9 +47,32 @@ class Zookeeper_operations : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testPing);
     CPPUNIT_TEST(testTimeoutCausedByWatches1);
     CPPUNIT_TEST(testTimeoutCausedByWatches2);
+    CPPUNIT_TEST(testVectoredSend);
+    CPPUNIT_TEST(testSubmittedRequests);
+    CPPUNIT_TEST(testAsyncSubmit);
+    CPPUNIT_TEST(testObjectPools);
+    CPPUNIT_TEST(testGetDataRef);
+    CPPUNIT_TEST(testReconnectBackoff);
+#ifdef __linux__
+    // relies on a full accept queue dropping the SYNs
+    CPPUNIT_TEST(testConnectRace);
+#endif
+    CPPUNIT_TEST(testServerRtts);
+    CPPUNIT_TEST(testRequestStats);
+    CPPUNIT_TEST(testTraceHooks);
+    CPPUNIT_TEST(testRequestDeadlines);
+    CPPUNIT_TEST(testPriorityReads);
+    CPPUNIT_TEST(testPingAheadOfLanes);
+    CPPUNIT_TEST(testBufferRefs);
+    CPPUNIT_TEST(testRecordSizes);
+    CPPUNIT_TEST(testMultiSizeUnderChroot);
 #else    
     CPPUNIT_TEST(testAsyncWatcher1);
     CPPUNIT_TEST(testAsyncGetOperation);
+    CPPUNIT_TEST(testCompletionWorkers);
+    CPPUNIT_TEST(testWatchCache);
+    CPPUNIT_TEST(testAsyncLog);
+    CPPUNIT_TEST(testSyncDeadline);
 #endif
     CPPUNIT_TEST(testOperationsAndDisconnectConcurrently1);
     CPPUNIT_TEST(testOperationsAndDisconnectConcurrently2);
@@ -215,6 +254,422 @@ public:
         CPPUNIT_ASSERT_EQUAL((int)ZOPERATIONTIMEOUT,res2.rc_);
     }
 
+    // queue several requests without flushing them; verify the whole send
+    // queue is written with a single system call
+    void testVectoredSend()
+    {
+        ZookeeperServer zkServer;
+        AsyncGetOperationCompletion res[3];
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        {
+            // hold the requests in the send queue
+            Mock_flush_send_queue noFlush;
+            for(int i=0;i<3;i++){
+                zkServer.addOperationResponse(new ZooGetResponse("1",1));
+                int rc=zoo_aget(zh,"/x/y/1",0,asyncCompletion,&res[i]);
+                CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            }
+        }
+        zoo_io_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_io_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)0,stats.send_calls);
+
+        zookeeper_process(zh,ZOOKEEPER_WRITE);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_io_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.send_calls);
+        CPPUNIT_ASSERT_EQUAL((int64_t)3,stats.buffers_sent);
+        CPPUNIT_ASSERT(zh->to_send.head==0);
+    }
+
+    // requests wait on the submission queue until the send queue is
+    // serviced; verify they're then queued in order with consecutive xids
+    void testSubmittedRequests()
+    {
+        ZookeeperServer zkServer;
+        AsyncGetOperationCompletion res[3];
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        {
+            Mock_flush_send_queue noFlush;
+            for(int i=0;i<3;i++){
+                zkServer.addOperationResponse(new ZooGetResponse("1",1));
+                int rc=zoo_aget(zh,"/x/y/1",0,asyncCompletion,&res[i]);
+                CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            }
+        }
+        CPPUNIT_ASSERT(zh->to_send.head==0);
+        CPPUNIT_ASSERT(zh->submitted!=0);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        CPPUNIT_ASSERT(zh->submitted==0);
+        CPPUNIT_ASSERT(interest&ZOOKEEPER_WRITE);
+        int32_t first=0;
+        int count=0;
+        for(buffer_list_t* b=zh->to_send.head;b!=0;b=b->next,count++){
+            int32_t xid;
+            memcpy(&xid,b->buffer,sizeof(xid));
+            xid=ntohl(xid);
+            if(count==0)
+                first=xid;
+            CPPUNIT_ASSERT_EQUAL(first+count,xid);
+        }
+        CPPUNIT_ASSERT_EQUAL(3,count);
+    }
+
+    class AsyncStatCompletion: public AsyncCompletion{
+    public:
+        AsyncStatCompletion():called_(false),rc_(ZAPIERROR){}
+        virtual void statCompl(int rc, const Stat *stat){
+            called_=true;
+            rc_=rc;
+        }
+        bool called_;
+        int rc_;
+    };
+    // submit a batch of mixed requests; verify the completions are called
+    // and that a batch with an invalid op queues nothing
+    void testAsyncSubmit()
+    {
+        Mock_gettimeofday timeMock;
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        AsyncGetOperationCompletion res1;
+        AsyncStatCompletion res2;
+        AsyncGetOperationCompletion res3;
+        zoo_aop_t ops[3];
+        zoo_aget_op_init(&ops[0],"/x/y/1",0,asyncCompletion,&res1);
+        zoo_aexists_op_init(&ops[1],"bad path",0,asyncCompletion,&res2);
+        zoo_aget_op_init(&ops[2],"/x/y/3",0,asyncCompletion,&res3);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_asubmit(zh,3,ops));
+        CPPUNIT_ASSERT(zh->submitted==0);
+        CPPUNIT_ASSERT(zh->to_send.head==0);
+
+        zoo_aexists_op_init(&ops[1],"/x/y/2",0,asyncCompletion,&res2);
+        zkServer.addOperationResponse(new ZooGetResponse("1",1));
+        zkServer.addOperationResponse(new ZooStatResponse);
+        zkServer.addOperationResponse(new ZooGetResponse("3",1));
+        int rc=zoo_asubmit(zh,3,ops);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        while((rc=zookeeper_process(zh,interest))==ZOK) {
+            millisleep(100);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZNOTHING,rc);
+
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res1.rc_);
+        CPPUNIT_ASSERT_EQUAL(string("1"),res1.value_);
+        CPPUNIT_ASSERT(res2.called_);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res2.rc_);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res3.rc_);
+        CPPUNIT_ASSERT_EQUAL(string("3"),res3.value_);
+    }
+
+    // run the same request twice; verify the second request reuses the
+    // objects released by the first one
+    void testObjectPools()
+    {
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        for(int i=0;i<2;i++){
+            AsyncGetOperationCompletion res;
+            zkServer.addOperationResponse(new ZooGetResponse("1",1));
+            int rc=zoo_aget(zh,"/x/y/1",0,asyncCompletion,&res);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            for(int j=0;j<10 && !res();j++){
+                rc=zookeeper_interest(zh,&fd,&interest,&tv);
+                CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+                zookeeper_process(zh,interest);
+            }
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,res.rc_);
+        }
+
+        zoo_pool_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                zoo_get_pool_stats(zh,ZOO_POOL_COMPLETIONS,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.allocations);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.reuses);
+        CPPUNIT_ASSERT_EQUAL(0,stats.in_use);
+        CPPUNIT_ASSERT_EQUAL(1,stats.idle);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                zoo_get_pool_stats(zh,ZOO_POOL_ARCHIVES,&stats));
+        CPPUNIT_ASSERT(stats.reuses>0);
+        CPPUNIT_ASSERT_EQUAL(0,stats.in_use);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,
+                zoo_get_pool_stats(zh,ZOO_POOL_COUNT,&stats));
+
+        // nothing is retained without recycling
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_pool_retention(zh,0));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                zoo_get_pool_stats(zh,ZOO_POOL_BUFFERS,&stats));
+        CPPUNIT_ASSERT_EQUAL(0,stats.idle);
+        CPPUNIT_ASSERT(stats.releases>0);
+    }
+
+    struct GetDataRefResult {
+        GetDataRefResult():called_(false),rc_(ZAPIERROR),value_(0),len_(-1),
+            ref_(0){}
+        bool called_;
+        int rc_;
+        const char *value_;
+        int len_;
+        zoo_buffer_t *ref_;
+    };
+    static void dataRefCompletion(int rc, const char *value, int len,
+            const Stat *stat, zoo_buffer_t *buffer, const void *data){
+        GetDataRefResult *res=(GetDataRefResult*)data;
+        res->called_=true;
+        res->rc_=rc;
+        res->value_=value;
+        res->len_=len;
+        res->ref_=zoo_buffer_retain(buffer);
+    }
+
+    // get data without copying it; verify the value stays valid after the
+    // completion returns as long as it holds a reference
+    void testGetDataRef()
+    {
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        GetDataRefResult res;
+        zkServer.addOperationResponse(new ZooGetResponse("value",5));
+        int rc=zoo_aget_ref(zh,"/x/y/1",0,dataRefCompletion,&res);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        for(int j=0;j<10 && !res.called_;j++){
+            rc=zookeeper_interest(zh,&fd,&interest,&tv);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            zookeeper_process(zh,interest);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res.rc_);
+        CPPUNIT_ASSERT(res.ref_!=0);
+        // a second reference keeps the packet after the first is released
+        zoo_buffer_t *ref=zoo_buffer_retain(res.ref_);
+        CPPUNIT_ASSERT(ref==res.ref_);
+        zoo_buffer_release(res.ref_);
+        CPPUNIT_ASSERT_EQUAL(string("value"),string(res.value_,res.len_));
+        zoo_buffer_release(ref);
+    }
+
+    // lose the connection while every server is down: the first attempt
+    // is spread and the passes that follow back off exponentially
+    void testReconnectBackoff()
+    {
+        Mock_gettimeofday timeMock;
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("127.0.0.1:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,
+                zoo_set_reconnect_backoff(zh,0,100,50));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_reconnect_backoff(zh,1000,100,800));
+        forceConnected(zh);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        zoo_connect_stats_t stats;
+        zkServer.setServerDown();
+        zkServer.setConnectionLost();
+        int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        rc=zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL((int)ZCONNECTIONLOSS,rc);
+        zkServer.connectionLost=false;
+
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_connect_stats(zh,&stats));
+        CPPUNIT_ASSERT(stats.last_backoff_ms<1000);
+        int64_t waited=stats.backoff_ms;
+        timeMock.millitick(waited);
+
+        const int limits[]={100,200,400,800,800};
+        for(int i=0;i<5;i++){
+            // connect; the server refuses it
+            rc=zookeeper_interest(zh,&fd,&interest,&tv);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            CPPUNIT_ASSERT(fd!=-1);
+            rc=zookeeper_process(zh,interest);
+            CPPUNIT_ASSERT_EQUAL((int)ZCONNECTIONLOSS,rc);
+
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_connect_stats(zh,&stats));
+            CPPUNIT_ASSERT(stats.last_backoff_ms<limits[i]);
+            int backoff=stats.backoff_ms-waited;
+            if(backoff>0){
+                // no attempt before the backoff is over
+                rc=zookeeper_interest(zh,&fd,&interest,&tv);
+                CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+                CPPUNIT_ASSERT_EQUAL(-1,fd);
+                CPPUNIT_ASSERT_EQUAL(backoff,
+                        (int)(tv.tv_sec*1000+tv.tv_usec/1000));
+                timeMock.millitick(backoff);
+                waited+=backoff;
+            }
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_connect_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)5,stats.attempts);
+        CPPUNIT_ASSERT_EQUAL((int64_t)5,stats.failures);
+        CPPUNIT_ASSERT_EQUAL((int64_t)0,stats.handshakes);
+        // millitick() drops the microseconds of the clock
+        CPPUNIT_ASSERT(stats.disconnected_ms<=waited);
+        CPPUNIT_ASSERT(stats.disconnected_ms>=waited-1);
+    }
+
+    // closes the sockets of a test, also when an assertion fails
+    struct CloseSockets{
+        ~CloseSockets(){
+            for(size_t i=0;i<fds.size();i++)
+                close(fds[i]);
+        }
+        vector<int> fds;
+    };
+
+    static int listenOnLoopback(CloseSockets& sockets, int backlog, int* port){
+        struct sockaddr_in addr;
+        socklen_t len=sizeof(addr);
+        int fd=socket(AF_INET,SOCK_STREAM,0);
+        CPPUNIT_ASSERT(fd!=-1);
+        sockets.fds.push_back(fd);
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family=AF_INET;
+        addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        CPPUNIT_ASSERT(bind(fd,(struct sockaddr*)&addr,sizeof(addr))==0);
+        CPPUNIT_ASSERT(listen(fd,backlog)==0);
+        getsockname(fd,(struct sockaddr*)&addr,&len);
+        *port=ntohs(addr.sin_port);
+        return fd;
+    }
+
+    // the first server doesn't answer the TCP handshake: the session must
+    // be established with the second one without waiting for a timeout
+    void testConnectRace()
+    {
+        CloseSockets sockets;
+        // must call zookeeper_close() while the sockets are open
+        CloseFinally guard(&zh);
+        int deadPort, livePort;
+        listenOnLoopback(sockets,0,&deadPort);
+        int live=listenOnLoopback(sockets,5,&livePort);
+        // once its accept queue is full the dead server drops the SYNs
+        int fillers=0;
+        for(;;){
+            struct sockaddr_in addr;
+            struct pollfd pfd;
+            int fd=socket(AF_INET,SOCK_STREAM,0);
+            memset(&addr,0,sizeof(addr));
+            addr.sin_family=AF_INET;
+            addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+            addr.sin_port=htons(deadPort);
+            fcntl(fd,F_SETFL,O_NONBLOCK);
+            connect(fd,(struct sockaddr*)&addr,sizeof(addr));
+            sockets.fds.push_back(fd);
+            pfd.fd=fd;
+            pfd.events=POLLOUT;
+            if(poll(&pfd,1,200)<=0 || ++fillers>16)
+                break;
+        }
+
+        char hosts[64];
+        sprintf(hosts,"127.0.0.1:%d,127.0.0.1:%d",deadPort,livePort);
+        zoo_deterministic_conn_order(1);
+        zh=zookeeper_init(hosts,watcher,10000,TEST_CLIENT_ID,0,0);
+        zoo_deterministic_conn_order(0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,
+                zoo_set_connect_race(zh,ZOO_MAX_CONNECT_RACE+1,0));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_connect_race(zh,2,50));
+
+        // drive the client until the live server receives the handshake;
+        // without the race it would take 2/3 of the session timeout
+        int client=-1;
+        for(int i=0;i<100 && client==-1;i++){
+            int fd=-1;
+            int interest=0;
+            timeval tv;
+            struct pollfd pfd[2];
+            int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            pfd[0].fd=live;
+            pfd[0].events=POLLIN;
+            pfd[1].fd=fd;
+            pfd[1].events=(interest&ZOOKEEPER_READ)?POLLIN:0;
+            pfd[1].events|=(interest&ZOOKEEPER_WRITE)?POLLOUT:0;
+            pfd[1].revents=0;
+            poll(pfd,fd==-1?1:2,tv.tv_sec*1000+tv.tv_usec/1000);
+            if(pfd[0].revents&POLLIN){
+                client=accept(live,0,0);
+                if(client!=-1)
+                    sockets.fds.push_back(client);
+            }
+            interest=(pfd[1].revents&POLLIN)?ZOOKEEPER_READ:0;
+            interest|=(pfd[1].revents&(POLLOUT|POLLHUP|POLLERR))?ZOOKEEPER_WRITE:0;
+            zookeeper_process(zh,interest);
+        }
+        CPPUNIT_ASSERT(client!=-1);
+        char buf[64];
+        struct pollfd pfd;
+        pfd.fd=client;
+        pfd.events=POLLIN;
+        CPPUNIT_ASSERT(poll(&pfd,1,1000)==1);
+        CPPUNIT_ASSERT(recv(client,buf,sizeof(buf),0)>0);
+
+        zoo_connect_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_connect_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.races_won);
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.attempts);
+        char expected[32];
+        sprintf(expected,"127.0.0.1:%d",livePort);
+        CPPUNIT_ASSERT_EQUAL(string(expected),string(zoo_get_current_server(zh)));
+    }
+
     class PingCountingServer: public ZookeeperServer{
     public:
         PingCountingServer():pingCount_(0){}
@@ -305,6 +760,670 @@ public:
         CPPUNIT_ASSERT_EQUAL(1,zkServer.pingCount_);
     }
 
+    // a slow ping makes the server the last one tried once the client has
+    // gone through the list
+    void testServerRtts()
+    {
+        Mock_gettimeofday timeMock;
+        PingCountingServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zoo_deterministic_conn_order(1);
+        zh=zookeeper_init("127.0.0.1:2121,127.0.0.1:2122,127.0.0.1:2123",
+                watcher,9000,TEST_CLIENT_ID,0,0);
+        zoo_deterministic_conn_order(0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_latency_preference(zh,1,1000));
+        forceConnected(zh);
+        // the handshake ends the initial reconfig mode
+        zh->reconfig=0;
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        // idle until a ping is due, then answer it 10ms later
+        int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        // tick() drops the microseconds of the clock, make up for them
+        timeMock.tick(tv);
+        timeMock.millitick(10);
+        zookeeper_process(zh,interest);
+        rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL(1,zkServer.pingCount_);
+        zkServer.addRecvResponse(new PingResponse);
+        rc=zookeeper_interest(zh,&fd,&interest,&tv);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        timeMock.millitick(10);
+        rc=zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+
+        zoo_server_rtt_t rtts[4];
+        int count=4;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_server_rtts(zh,rtts,&count));
+        CPPUNIT_ASSERT_EQUAL(1,count);
+        CPPUNIT_ASSERT_EQUAL(string("127.0.0.1:2121"),string(rtts[0].server));
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,rtts[0].samples);
+        CPPUNIT_ASSERT_EQUAL(10000,rtts[0].last_rtt_us);
+        CPPUNIT_ASSERT_EQUAL(10000,rtts[0].srtt_us);
+
+        // the servers not timed yet are tried first
+        zh->addrs.next=zh->addrs.count;
+        zoo_cycle_next_server(zh);
+        CPPUNIT_ASSERT_EQUAL(string("127.0.0.1:2122"),
+                string(zoo_get_current_server(zh)));
+        zoo_cycle_next_server(zh);
+        zoo_cycle_next_server(zh);
+        CPPUNIT_ASSERT_EQUAL(string("127.0.0.1:2121"),
+                string(zoo_get_current_server(zh)));
+    }
+
+    // hold two requests for 5ms before sending them and answer one with an
+    // error; verify they're counted per opcode and their latencies add up
+    // stage by stage
+    void testRequestStats()
+    {
+        Mock_gettimeofday timeMock;
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        AsyncGetOperationCompletion res1;
+        AsyncStatCompletion res2;
+        // millitick() drops the microseconds of the clock, do it up front
+        timeMock.millitick(0);
+        {
+            // hold the requests in the submission queue
+            Mock_flush_send_queue noFlush;
+            zkServer.addOperationResponse(new ZooGetResponse("1",1));
+            zkServer.addOperationResponse(new ZooStatResponse(0,ZNONODE));
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zoo_aget(zh,"/x/y/1",0,asyncCompletion,&res1));
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zoo_aexists(zh,"/x/y/2",0,asyncCompletion,&res2));
+        }
+        zkServer.addRecvResponse(new ZNodeEvent(ZOO_CHANGED_EVENT,"/x/y/z"));
+        timeMock.millitick(5);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        for(int j=0;j<10 && !res2.called_;j++){
+            int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            zookeeper_process(zh,interest);
+            timeMock.millitick(5);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res1.rc_);
+        CPPUNIT_ASSERT_EQUAL((int)ZNONODE,res2.rc_);
+
+        zoo_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.requests);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.errors);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.watch_events);
+        CPPUNIT_ASSERT(stats.bytes_sent>0);
+        CPPUNIT_ASSERT_EQUAL(0,stats.send_queue);
+        CPPUNIT_ASSERT_EQUAL(0,stats.outstanding);
+        CPPUNIT_ASSERT_EQUAL(2,stats.op_count);
+        CPPUNIT_ASSERT_EQUAL(ZOO_EXISTS_OP,stats.ops[0].op);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.ops[0].errors);
+        CPPUNIT_ASSERT_EQUAL(ZOO_GETDATA_OP,stats.ops[1].op);
+        CPPUNIT_ASSERT_EQUAL((int64_t)0,stats.ops[1].errors);
+        for(int j=0;j<stats.op_count;j++){
+            zoo_op_stats_t *op=&stats.ops[j];
+            CPPUNIT_ASSERT_EQUAL((int64_t)1,op->requests);
+            CPPUNIT_ASSERT(op->stages[ZOO_STAGE_QUEUED].min_us>=5000);
+            for(int i=0;i<ZOO_STAGE_COUNT;i++){
+                zoo_latency_t *l=&op->stages[i];
+                CPPUNIT_ASSERT_EQUAL((int64_t)1,l->count);
+                CPPUNIT_ASSERT(l->min_us<=l->p50_us);
+                CPPUNIT_ASSERT(l->p50_us<=l->p999_us);
+                CPPUNIT_ASSERT(l->p999_us<=l->max_us);
+                if(i>0){
+                    CPPUNIT_ASSERT(l->min_us>=op->stages[i-1].min_us);
+                }
+            }
+        }
+    }
+
+    // a server that holds its responses back and records the xids
+    class HoldingServer: public ZookeeperServer{
+    public:
+        vector<int32_t> xids;
+        vector<int32_t> types;
+        // the types of all the packets, pings included
+        vector<int32_t> wire;
+        bool blocked;
+        HoldingServer():blocked(false){}
+        virtual ssize_t callSendmsg(int s,const struct msghdr *msg,int flags){
+            if(blocked){
+                errno=EAGAIN;
+                return -1;
+            }
+            return ZookeeperServer::callSendmsg(s,msg,flags);
+        }
+        virtual void onMessageReceived(const RequestHeader& rh, iarchive*){
+            wire.push_back(rh.type);
+            if(rh.xid>0){
+                xids.push_back(rh.xid);
+                types.push_back(rh.type);
+            }
+        }
+        void respond(int i, Response *resp){
+            Element e(resp,0);
+            resp->setXID(xids[i]);
+            addRecvResponse(e);
+        }
+    };
+
+    // requests past their deadline fail while the connection and the
+    // requests behind them carry on; the late responses are dropped, but
+    // still set the watches of their requests
+    void testRequestDeadlines()
+    {
+        Mock_gettimeofday timeMock;
+        HoldingServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+        timeMock.millitick(0);
+
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_set_request_timeout(zh,-1));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_request_timeout(zh,100));
+        AsyncGetOperationCompletion res1;
+        AsyncStatCompletion res2;
+        AsyncStatCompletion res3;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                zoo_awget(zh,"/x/y/1",watcher,&res1,asyncCompletion,&res1));
+        zoo_aop_t ops[2];
+        zoo_aexists_op_init(&ops[0],"/x/y/2",0,asyncCompletion,&res2);
+        zoo_aop_set_timeout(&ops[0],-1);
+        zoo_aexists_op_init(&ops[1],"/x/y/3",0,asyncCompletion,&res3);
+        zoo_aop_set_timeout(&ops[1],50);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_asubmit(zh,2,ops));
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zookeeper_interest(zh,&fd,&interest,&tv));
+        // the poll wakes up for the first deadline, or earlier
+        CPPUNIT_ASSERT_EQUAL(0,(int)tv.tv_sec);
+        CPPUNIT_ASSERT(tv.tv_usec<=50000);
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL(3,(int)zkServer.xids.size());
+
+        timeMock.millitick(60);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zookeeper_interest(zh,&fd,&interest,&tv));
+        CPPUNIT_ASSERT_EQUAL(0,(int)tv.tv_sec);
+        CPPUNIT_ASSERT(tv.tv_usec<=40000);
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT(!res1.called_);
+        CPPUNIT_ASSERT(!res2.called_);
+        CPPUNIT_ASSERT_EQUAL((int)ZOPERATIONTIMEOUT,res3.rc_);
+
+        timeMock.millitick(40);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zookeeper_interest(zh,&fd,&interest,&tv));
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL((int)ZOPERATIONTIMEOUT,res1.rc_);
+        CPPUNIT_ASSERT(!res2.called_);
+        CPPUNIT_ASSERT(!pathHasWatcher(zh,"/x/y/1",ZWATCHERTYPE_DATA,
+                watcher,&res1));
+
+        // the responses still arrive in order
+        zkServer.respond(0,new ZooGetResponse("1",1));
+        zkServer.respond(1,new ZooStatResponse);
+        zkServer.respond(2,new ZooStatResponse);
+        res1.called_=false;
+        res3.called_=false;
+        for(int j=0;j<10 && zh->sent_requests.head;j++){
+            timeMock.millitick(5);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zookeeper_interest(zh,&fd,&interest,&tv));
+            zookeeper_process(zh,interest);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res2.rc_);
+        CPPUNIT_ASSERT(!res1.called_);
+        CPPUNIT_ASSERT(!res3.called_);
+        CPPUNIT_ASSERT(pathHasWatcher(zh,"/x/y/1",ZWATCHERTYPE_DATA,
+                watcher,&res1));
+        CPPUNIT_ASSERT_EQUAL(ZOO_CONNECTED_STATE,zoo_state(zh));
+
+        zoo_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.timeouts);
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.errors);
+        CPPUNIT_ASSERT_EQUAL(0,stats.outstanding);
+    }
+
+    // a small read issued behind a large write and more writes is sent right
+    // after the large one, and the xids still grow in the order of the wire
+    void testPriorityReads()
+    {
+        Mock_gettimeofday timeMock;
+        HoldingServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_set_priority_reads(0,1));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_priority_reads(zh,1));
+
+        // the socket takes nothing until the requests are all issued
+        zkServer.blocked=true;
+        string big(100*1024,'x');
+        AsyncStatCompletion res[5];
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_aset(zh,"/big",big.data(),
+                big.size(),-1,asyncCompletion,&res[0]));
+        for(int i=1;i<4;i++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_aset(zh,"/small","1",1,-1,
+                    asyncCompletion,&res[i]));
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                zoo_aexists(zh,"/read",0,asyncCompletion,&res[4]));
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zookeeper_interest(zh,&fd,&interest,&tv));
+        // only the large write is queued on the socket, the others wait
+        zoo_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(5,stats.send_queue);
+        CPPUNIT_ASSERT_EQUAL(1,stats.outstanding);
+
+        zkServer.blocked=false;
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL(5,(int)zkServer.xids.size());
+        CPPUNIT_ASSERT_EQUAL(ZOO_SETDATA_OP,zkServer.types[0]);
+        CPPUNIT_ASSERT_EQUAL(ZOO_EXISTS_OP,zkServer.types[1]);
+        for(int i=2;i<5;i++){
+            CPPUNIT_ASSERT_EQUAL(ZOO_SETDATA_OP,zkServer.types[i]);
+        }
+        for(int i=1;i<5;i++){
+            CPPUNIT_ASSERT_EQUAL(zkServer.xids[i-1]+1,zkServer.xids[i]);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(0,stats.send_queue);
+        CPPUNIT_ASSERT_EQUAL(5,stats.outstanding);
+
+        // the responses come back in the order of the wire
+        for(int i=0;i<5;i++){
+            zkServer.respond(i,new ZooStatResponse);
+        }
+        for(int j=0;j<10 && zh->sent_requests.head;j++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zookeeper_interest(zh,&fd,&interest,&tv));
+            zookeeper_process(zh,interest);
+        }
+        for(int i=0;i<5;i++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,res[i].rc_);
+        }
+    }
+
+    // a ping is queued right behind the packets on the socket already,
+    // ahead of the requests still waiting in their lanes
+    void testPingAheadOfLanes()
+    {
+        Mock_gettimeofday timeMock;
+        HoldingServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        zkServer.blocked=true;
+        string big(100*1024,'x');
+        AsyncStatCompletion res[3];
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_aset(zh,"/big",big.data(),
+                big.size(),-1,asyncCompletion,&res[0]));
+        for(int i=1;i<3;i++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_aset(zh,"/small","1",1,-1,
+                    asyncCompletion,&res[i]));
+        }
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zookeeper_interest(zh,&fd,&interest,&tv));
+        zoo_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(1,stats.outstanding);
+        // the way the I/O thread pings an idle connection
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,send_ping(zh));
+
+        zkServer.blocked=false;
+        zookeeper_process(zh,interest);
+        CPPUNIT_ASSERT_EQUAL(4,(int)zkServer.wire.size());
+        CPPUNIT_ASSERT_EQUAL(ZOO_SETDATA_OP,zkServer.wire[0]);
+        CPPUNIT_ASSERT_EQUAL(ZOO_PING_OP,zkServer.wire[1]);
+        CPPUNIT_ASSERT_EQUAL(ZOO_SETDATA_OP,zkServer.wire[2]);
+        CPPUNIT_ASSERT_EQUAL(ZOO_SETDATA_OP,zkServer.wire[3]);
+
+        // the responses are matched in the order of the wire
+        zkServer.respond(0,new ZooStatResponse);
+        zkServer.addRecvResponse(new PingResponse);
+        zkServer.respond(1,new ZooStatResponse);
+        zkServer.respond(2,new ZooStatResponse);
+        for(int j=0;j<10 && zh->sent_requests.head;j++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zookeeper_interest(zh,&fd,&interest,&tv));
+            zookeeper_process(zh,interest);
+        }
+        for(int i=0;i<3;i++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,res[i].rc_);
+        }
+        CPPUNIT_ASSERT_EQUAL(ZOO_CONNECTED_STATE,zoo_state(zh));
+    }
+
+    // takes at most chunk bytes per sendmsg() and keeps the data of the set
+    // and create requests it receives
+    class TrickleServer: public ZookeeperServer{
+    public:
+        size_t chunk;
+        vector<string> values;
+        TrickleServer():chunk(1000){}
+        virtual ssize_t callSendmsg(int s,const struct msghdr *msg,int flags){
+            struct iovec iov[256];
+            struct msghdr m=*msg;
+            size_t left=chunk;
+            m.msg_iovlen=0;
+            for(size_t i=0;i<msg->msg_iovlen && left>0;i++){
+                iov[i]=msg->msg_iov[i];
+                if(iov[i].iov_len>left)
+                    iov[i].iov_len=left;
+                left-=iov[i].iov_len;
+                m.msg_iovlen++;
+            }
+            m.msg_iov=iov;
+            return ZookeeperServer::callSendmsg(s,&m,flags);
+        }
+        virtual void onMessageReceived(const RequestHeader& rh, iarchive* ia){
+            if(rh.type==ZOO_SETDATA_OP){
+                SetDataRequest req;
+                deserialize_SetDataRequest(ia,"req",&req);
+                values.push_back(string(req.data.buff,req.data.len));
+                deallocate_SetDataRequest(&req);
+            }else if(rh.type==ZOO_CREATE_OP){
+                CreateRequest req;
+                deserialize_CreateRequest(ia,"req",&req);
+                values.push_back(string(req.data.buff,req.data.len));
+                deallocate_CreateRequest(&req);
+            }
+        }
+    };
+    static void releaseBuffer(const char *buffer, void *ctx){
+        ((vector<const char*>*)ctx)->push_back(buffer);
+    }
+
+    // values sent in place arrive whole, even written a bit at a time, and
+    // their buffers are released once written or when the submit fails
+    void testBufferRefs()
+    {
+        Mock_gettimeofday timeMock;
+        TrickleServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        string big(10000,'x');
+        for(size_t i=0;i<big.size();i++)
+            big[i]='a'+i%26;
+        vector<const char*> released;
+        AsyncStatCompletion res1;
+        AsyncCompletion res2;
+        AsyncStatCompletion res3;
+        zoo_aop_t ops[3];
+        zoo_aset_op_init(&ops[0],"/x/big",big.data(),big.size(),-1,
+                asyncCompletion,&res1);
+        zoo_aop_set_buffer_ref(&ops[0],releaseBuffer,&released);
+        zoo_acreate_op_init(&ops[1],"/x/new",big.data()+1,100,
+                &ZOO_OPEN_ACL_UNSAFE,0,asyncCompletion,&res2);
+        zoo_aop_set_buffer_ref(&ops[1],releaseBuffer,&released);
+        // copied
+        zoo_aset_op_init(&ops[2],"/x/copy","copy",4,-1,asyncCompletion,&res3);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_asubmit(zh,3,ops));
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        for(int j=0;j<10 && zkServer.values.size()<3;j++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zookeeper_interest(zh,&fd,&interest,&tv));
+            zookeeper_process(zh,interest);
+        }
+        CPPUNIT_ASSERT_EQUAL(3,(int)zkServer.values.size());
+        CPPUNIT_ASSERT(zkServer.values[0]==big);
+        CPPUNIT_ASSERT(zkServer.values[1]==big.substr(1,100));
+        CPPUNIT_ASSERT(zkServer.values[2]=="copy");
+        CPPUNIT_ASSERT_EQUAL(2,(int)released.size());
+        CPPUNIT_ASSERT(released[0]==big.data());
+        CPPUNIT_ASSERT(released[1]==big.data()+1);
+
+        // a failed submit releases the buffers of all the ops
+        released.clear();
+        zoo_acreate_op_init(&ops[1],"bad",big.data(),100,
+                &ZOO_OPEN_ACL_UNSAFE,0,asyncCompletion,&res2);
+        zoo_aop_set_buffer_ref(&ops[1],releaseBuffer,&released);
+        zoo_aset_op_init(&ops[2],"/x/next",big.data(),10,-1,
+                asyncCompletion,&res3);
+        zoo_aop_set_buffer_ref(&ops[2],releaseBuffer,&released);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_asubmit(zh,3,ops));
+        CPPUNIT_ASSERT_EQUAL(3,(int)released.size());
+    }
+
+    // the bytes an archive writes for a record
+    template<class T>
+    static int32_t serializedSize(int (*serialize)(struct oarchive*,
+            const char*,T*),T* record){
+        struct oarchive *oa=create_buffer_oarchive();
+        CPPUNIT_ASSERT_EQUAL(0,serialize(oa,"req",record));
+        int32_t len=get_buffer_len(oa);
+        close_buffer_oarchive(&oa,1);
+        return len;
+    }
+
+    // the sizeof_ functions add up to what the archive writes, whatever the
+    // vectors and null fields
+    void testRecordSizes()
+    {
+        struct CreateRequest create;
+        create.path=(char*)"/a/b";
+        create.data.buff=0;
+        create.data.len=-1;
+        create.acl=ZOO_OPEN_ACL_UNSAFE;
+        create.flags=ZOO_EPHEMERAL;
+        CPPUNIT_ASSERT_EQUAL(serializedSize(serialize_CreateRequest,&create),
+                sizeof_CreateRequest(&create));
+        struct ACL acls[3]={ZOO_OPEN_ACL_UNSAFE.data[0],
+            ZOO_READ_ACL_UNSAFE.data[0],ZOO_CREATOR_ALL_ACL.data[0]};
+        create.acl.count=3;
+        create.acl.data=acls;
+        CPPUNIT_ASSERT_EQUAL(serializedSize(serialize_CreateRequest,&create),
+                sizeof_CreateRequest(&create));
+
+        char *paths[]={(char*)"/x",(char*)"/x/yy",(char*)"/x/yy/zzz"};
+        struct SetWatches sw;
+        sw.relativeZxid=0x12345678;
+        sw.dataWatches.count=3;
+        sw.dataWatches.data=paths;
+        sw.existWatches.count=0;
+        sw.existWatches.data=0;
+        sw.childWatches.count=1;
+        sw.childWatches.data=paths+2;
+        CPPUNIT_ASSERT_EQUAL(serializedSize(serialize_SetWatches,&sw),
+                sizeof_SetWatches(&sw));
+    }
+
+    // the buffer of a multi is allocated once at its size, the chroot
+    // prepended to the paths included
+    void testMultiSizeUnderChroot()
+    {
+        Mock_gettimeofday timeMock;
+        HoldingServer zkServer;
+        // completed by zookeeper_close()
+        AsyncCompletion res;
+        zoo_op_result_t results[4];
+        char path[64];
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121/chroot",watcher,10000,
+                TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+        // the multi stays queued
+        zkServer.blocked=true;
+
+        zoo_op_t ops[4];
+        zoo_create_op_init(&ops[0],"/a","data",4,&ZOO_OPEN_ACL_UNSAFE,0,
+                path,sizeof(path));
+        zoo_delete_op_init(&ops[1],"/b",-1);
+        zoo_set_op_init(&ops[2],"/",0,-1,-1,0);
+        zoo_check_op_init(&ops[3],"/c/d",1);
+
+        // the size the request should have, from the records it is made of
+        struct RequestHeader h={0,ZOO_MULTI_OP};
+        struct MultiHeader mh={-1,1,-1};
+        int32_t expected=sizeof_RequestHeader(&h)+sizeof_MultiHeader(&mh)+
+            4*sizeof_MultiHeader(&mh);
+        struct CreateRequest create={(char*)"/chroot/a",{4,(char*)"data"},
+            ZOO_OPEN_ACL_UNSAFE,0};
+        struct DeleteRequest del={(char*)"/chroot/b",-1};
+        struct SetDataRequest set={(char*)"/chroot",{-1,0},-1};
+        struct CheckVersionRequest check={(char*)"/chroot/c/d",1};
+        expected+=sizeof_CreateRequest(&create)+sizeof_DeleteRequest(&del)+
+            sizeof_SetDataRequest(&set)+sizeof_CheckVersionRequest(&check);
+
+        {
+            Mock_realloc reallocMock;
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_amulti(zh,4,ops,results,
+                    asyncCompletion,&res));
+            // never grown
+            CPPUNIT_ASSERT_EQUAL(0,reallocMock.counter);
+        }
+        CPPUNIT_ASSERT(zh->to_send.head!=0);
+        CPPUNIT_ASSERT_EQUAL(expected,(int32_t)zh->to_send.head->len);
+        // let zookeeper_close() flush the queue, the clock doesn't move
+        zkServer.blocked=false;
+    }
+
+    typedef vector<pair<string,zoo_trace_t> > Traces;
+    static void trace(const char *hook, const zoo_trace_t *trace, void *ctx){
+        zoo_trace_t t=*trace;
+        t.path=0;
+        ((Traces*)ctx)->push_back(make_pair(string(hook)+" "+
+                (trace->path?trace->path:"-"),t));
+    }
+    static void traceQueued(zhandle_t*, const zoo_trace_t *t, void *ctx){
+        trace("queued",t,ctx);
+    }
+    static void traceSent(zhandle_t*, const zoo_trace_t *t, void *ctx){
+        trace("sent",t,ctx);
+    }
+    static void traceReceived(zhandle_t*, const zoo_trace_t *t, void *ctx){
+        trace("received",t,ctx);
+    }
+    static void traceCallbackStart(zhandle_t*, const zoo_trace_t *t, void *ctx){
+        trace("callback_start",t,ctx);
+    }
+    static void traceCallbackEnd(zhandle_t*, const zoo_trace_t *t, void *ctx){
+        trace("callback_end",t,ctx);
+    }
+
+    // trace a request held for 5ms before it is sent; verify the hooks see
+    // its whole timeline and the slow request log reports it
+    void testTraceHooks()
+    {
+        Mock_gettimeofday timeMock;
+        ZookeeperServer zkServer;
+        // must call zookeeper_close() while all the mocks are in scope
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // simulate connected state
+        forceConnected(zh);
+
+        Traces traces;
+        zoo_trace_hooks_t hooks={traceQueued,traceSent,traceReceived,
+            traceCallbackStart,traceCallbackEnd,&traces};
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_trace_hooks(zh,&hooks));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_slow_request_log(zh,1));
+        slowRequestLogs=0;
+        zoo_set_log_callback(zh,countSlowRequestLogs);
+
+        AsyncGetOperationCompletion res;
+        // millitick() drops the microseconds of the clock, do it up front
+        timeMock.millitick(0);
+        {
+            // hold the request in the submission queue
+            Mock_flush_send_queue noFlush;
+            zkServer.addOperationResponse(new ZooGetResponse("1",1));
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zoo_aget(zh,"/x/y/1",0,asyncCompletion,&res));
+        }
+        timeMock.millitick(5);
+
+        int fd=0;
+        int interest=0;
+        timeval tv;
+        for(int j=0;j<10 && !res.called_;j++){
+            int rc=zookeeper_interest(zh,&fd,&interest,&tv);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            zookeeper_process(zh,interest);
+            timeMock.millitick(5);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,res.rc_);
+        CPPUNIT_ASSERT_EQUAL(1,slowRequestLogs);
+
+        const char *expected[]={"queued /x/y/1","sent /x/y/1",
+            "received /x/y/1","callback_start /x/y/1","callback_end /x/y/1"};
+        CPPUNIT_ASSERT_EQUAL((size_t)5,traces.size());
+        for(size_t i=0;i<traces.size();i++){
+            zoo_trace_t &t=traces[i].second;
+            CPPUNIT_ASSERT_EQUAL(string(expected[i]),traces[i].first);
+            CPPUNIT_ASSERT_EQUAL(traces[0].second.xid,t.xid);
+            CPPUNIT_ASSERT_EQUAL(ZOO_GETDATA_OP,t.op);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,t.rc);
+            CPPUNIT_ASSERT_EQUAL(traces[0].second.submitted_us,t.submitted_us);
+            if(i>0){
+                CPPUNIT_ASSERT(t.time_us>=traces[i-1].second.time_us);
+            }
+        }
+        CPPUNIT_ASSERT(traces[0].second.xid>0);
+        CPPUNIT_ASSERT_EQUAL((int64_t)5000,
+                traces[0].second.time_us-traces[0].second.submitted_us);
+
+        // without hooks and log requests aren't tracked
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_trace_hooks(zh,0));
+        CPPUNIT_ASSERT(zh->tracing);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_slow_request_log(zh,0));
+        CPPUNIT_ASSERT(!zh->tracing);
+    }
+
     // simulate a watch arriving right before a ping is due
     // assert the ping is sent nevertheless
     void testTimeoutCausedByWatches1()
@@ -615,6 +1734,137 @@ public:
         CPPUNIT_ASSERT_EQUAL((int)ZOK,res1.rc_);
         CPPUNIT_ASSERT_EQUAL(string("1"),res1.value_);        
     }
+    // a synchronous call returns once its deadline passes
+    void testSyncDeadline()
+    {
+        ZookeeperServer zkServer;
+        Mock_poll pollMock(&zkServer,ZookeeperServer::FD);
+        // must call zookeeper_close() while all the mocks are in the scope!
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT(ensureCondition(ClientConnected(zh),1000)<1000);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_request_timeout(zh,100));
+
+        struct Stat stat;
+        timeval start, end;
+        gettimeofday(&start,0);
+        // there is no response to the request
+        CPPUNIT_ASSERT_EQUAL((int)ZOPERATIONTIMEOUT,
+                zoo_exists(zh,"/x/y/1",0,&stat));
+        gettimeofday(&end,0);
+        int elapsed=(end.tv_sec-start.tv_sec)*1000+
+                (end.tv_usec-start.tv_usec)/1000;
+        CPPUNIT_ASSERT(elapsed>=99);
+        CPPUNIT_ASSERT(elapsed<2000);
+        CPPUNIT_ASSERT_EQUAL(ZOO_CONNECTED_STATE,zoo_state(zh));
+    }
+
+    class PathOrderCompletions{
+    public:
+        static const int PATHS=4;
+        static const int REPS=50;
+        struct Request{
+            PathOrderCompletions* owner;
+            int path;
+            int seq;
+        };
+        PathOrderCompletions():done_(0),outOfOrder_(0){
+            for(int i=0;i<PATHS;i++){
+                last_[i]=-1;
+                for(int j=0;j<REPS;j++){
+                    Request r={this,i,j};
+                    requests_[i][j]=r;
+                }
+            }
+        }
+        static void completion(int rc, const char *value, int len,
+                const struct Stat *stat, const void *data){
+            const Request* r=(const Request*)data;
+            r->owner->record(r->path,r->seq);
+            // give the other workers a chance to overtake this one
+            millisleep(1);
+        }
+        void record(int path,int seq){
+            synchronized(mx_);
+            if(seq!=last_[path]+1)
+                outOfOrder_++;
+            last_[path]=seq;
+            done_++;
+        }
+        bool operator()()const{
+            synchronized(mx_);
+            return done_==PATHS*REPS;
+        }
+        mutable Mutex mx_;
+        int done_;
+        int outOfOrder_;
+        int last_[PATHS];
+        Request requests_[PATHS][REPS];
+    };
+    class CompletionsCounted{
+    public:
+        CompletionsCounted(zhandle_t* zh,int64_t expected):
+            zh_(zh),expected_(expected){}
+        bool operator()()const{
+            zoo_completion_stats_t stats[8];
+            int count=8;
+            int64_t completions=0;
+            if(zoo_get_completion_stats(zh_,stats,&count)!=ZOK)
+                return false;
+            for(int i=0;i<count;i++)
+                completions+=stats[i].completions;
+            return completions>=expected_;
+        }
+        zhandle_t* zh_;
+        int64_t expected_;
+    };
+    // completions on several workers still run in order per path
+    void testCompletionWorkers()
+    {
+        Mock_gettimeofday timeMock;
+
+        ZookeeperServer zkServer;
+        Mock_poll pollMock(&zkServer,ZookeeperServer::FD);
+        // must call zookeeper_close() while all the mocks are in the scope!
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_set_completion_workers(zh,
+                4,ZOO_COMPLETION_ORDER_KEY,0));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_completion_workers(zh,4,
+                ZOO_COMPLETION_ORDER_PATH,0));
+        CPPUNIT_ASSERT_EQUAL((int)ZINVALIDSTATE,zoo_set_completion_workers(zh,
+                2,ZOO_COMPLETION_ORDER_PATH,0));
+        CPPUNIT_ASSERT(ensureCondition(ClientConnected(zh),1000)<1000);
+
+        PathOrderCompletions res;
+        const char* paths[PathOrderCompletions::PATHS]={"/a","/b","/c","/d"};
+        for(int j=0;j<PathOrderCompletions::REPS;j++){
+            for(int i=0;i<PathOrderCompletions::PATHS;i++){
+                zkServer.addOperationResponse(new ZooGetResponse("1",1));
+                int rc=zoo_aget(zh,paths[i],0,PathOrderCompletions::completion,
+                        &res.requests_[i][j]);
+                CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+            }
+        }
+        CPPUNIT_ASSERT(ensureCondition(res,5000)<5000);
+        CPPUNIT_ASSERT_EQUAL(0,res.outOfOrder_);
+        // the workers count a completion once its callback has returned
+        CompletionsCounted counted(zh,
+                PathOrderCompletions::PATHS*PathOrderCompletions::REPS);
+        CPPUNIT_ASSERT(ensureCondition(counted,1000)<1000);
+
+        zoo_completion_stats_t stats[8];
+        int count=8;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_completion_stats(zh,stats,&count));
+        CPPUNIT_ASSERT_EQUAL(4,count);
+        for(int i=0;i<count;i++){
+            CPPUNIT_ASSERT(stats[i].busy_usec<=stats[i].elapsed_usec);
+        }
+    }
     class ChangeNodeWatcher: public WatcherAction{
     public:
         ChangeNodeWatcher():changed_(false){}
@@ -669,6 +1919,109 @@ public:
         CPPUNIT_ASSERT(ensureCondition(action.isNodeChangedTriggered(),1000)<1000);
         CPPUNIT_ASSERT_EQUAL(string("/x/y/z"),action.path_);                
     }
+    // watched reads are served from the cache until the watch fires
+    void testWatchCache(){
+        Mock_gettimeofday timeMock;
+
+        ZookeeperServer zkServer;
+        Mock_poll pollMock(&zkServer,ZookeeperServer::FD);
+        // must call zookeeper_close() while all the mocks are in the scope!
+        CloseFinally guard(&zh);
+
+        ChangeNodeWatcher action;
+        zh=zookeeper_init("localhost:2121",activeWatcher,10000,
+                TEST_CLIENT_ID,&action,0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT(ensureCondition(ClientConnected(zh),1000)<1000);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_cache(zh,1024*1024));
+
+        char buf[16];
+        int len=sizeof(buf);
+        zkServer.addOperationResponse(new ZooGetResponse("1",1));
+        int rc=zoo_get(zh,"/x/y/z",1,buf,&len,0);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        CPPUNIT_ASSERT_EQUAL(string("1"),string(buf,len));
+
+        // a server round trip would return the second value
+        zkServer.addOperationResponse(new ZooGetResponse("2",1));
+        len=sizeof(buf);
+        rc=zoo_get(zh,"/x/y/z",1,buf,&len,0);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        CPPUNIT_ASSERT_EQUAL(string("1"),string(buf,len));
+        zoo_cache_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_cache_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(1LL,(long long)stats.hits);
+        CPPUNIT_ASSERT_EQUAL(1LL,(long long)stats.misses);
+        CPPUNIT_ASSERT_EQUAL(1,stats.entries);
+
+        // the change drops the entry and the next read goes to the server
+        zkServer.addRecvResponse(new ZNodeEvent(ZOO_CHANGED_EVENT,"/x/y/z"));
+        CPPUNIT_ASSERT(ensureCondition(action.isNodeChangedTriggered(),1000)<1000);
+        len=sizeof(buf);
+        rc=zoo_get(zh,"/x/y/z",1,buf,&len,0);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,rc);
+        CPPUNIT_ASSERT_EQUAL(string("2"),string(buf,len));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_cache_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(1LL,(long long)stats.invalidations);
+        CPPUNIT_ASSERT_EQUAL(2LL,(long long)stats.misses);
+    }
+
+    // messages logged by several threads all reach the stream, in batches,
+    // or are counted as dropped
+    static void *logMessages(void *) {
+        for (int i = 0; i < 500; i++) {
+            log_message(NULL, ZOO_LOG_LEVEL_ERROR, __LINE__, "logMessages",
+                    "async log message %d", i);
+        }
+        return 0;
+    }
+
+    void testAsyncLog()
+    {
+        FILE *stream = tmpfile();
+        CPPUNIT_ASSERT(stream);
+        zoo_log_stats_t before, after;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK, zoo_get_log_stats(&before));
+        zoo_set_log_stream(stream);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS, zoo_set_log_async(1, -1));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK, zoo_set_log_async(1, 1));
+
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            CPPUNIT_ASSERT_EQUAL(0,
+                    pthread_create(&threads[i], 0, logMessages, 0));
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], 0);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK, zoo_set_log_async(0, 0));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK, zoo_get_log_stats(&after));
+        zoo_set_log_stream(logfile);
+
+        int64_t records = after.records - before.records;
+        int64_t dropped = after.dropped - before.dropped;
+        CPPUNIT_ASSERT(records > 0);
+        CPPUNIT_ASSERT(after.writes > before.writes);
+
+        // each message is either written out or counted and reported
+        int messages = 0, reported = 0;
+        char line[4096];
+        rewind(stream);
+        while (fgets(line, sizeof(line), stream)) {
+            long long n;
+            const char *text = strstr(line, "@logMessages@");
+            if (text && strstr(text, ": async log message ")) {
+                messages++;
+            } else if ((text = strstr(line, ": ")) &&
+                    sscanf(text, ": %lld log messages were dropped", &n) == 1) {
+                reported += n;
+            }
+        }
+        fclose(stream);
+        CPPUNIT_ASSERT_EQUAL(2000, (int)(records + dropped));
+        CPPUNIT_ASSERT_EQUAL((int)records, messages);
+        CPPUNIT_ASSERT_EQUAL((int)dropped, reported);
+    }
 #endif
 };
 
@@ -19,7 +19,12 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "CppAssertHelper.h"
 
+#include <algorithm>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
 #include <zookeeper.h>
@@ -31,6 +36,7 @@ class Zookeeper_readOnly : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST_SUITE(Zookeeper_readOnly);
 #ifdef THREADED
     CPPUNIT_TEST(testReadOnly);
+    CPPUNIT_TEST(testReadOnlyProbeDoesNotBlock);
 #endif
     CPPUNIT_TEST_SUITE_END();
 
@@ -105,6 +111,59 @@ public:
         CPPUNIT_ASSERT_EQUAL((int)ZNOTREADONLY, res);
         stopPeer();
     }
+
+    static int64_t millis() {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+
+    void testReadOnlyProbeDoesNotBlock() {
+        // a server that accepts connections but never answers "isro", like
+        // one cut off by a partition
+        int lsock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CPPUNIT_ASSERT(bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+        CPPUNIT_ASSERT(listen(lsock, 16) == 0);
+        CPPUNIT_ASSERT(getsockname(lsock, (struct sockaddr*)&addr, &addrlen) == 0);
+        char hosts[128];
+        sprintf(hosts, "localhost:22181,127.0.0.1:%d", ntohs(addr.sin_port));
+
+        startReadOnly();
+        watchctx_t watch;
+        zoo_deterministic_conn_order(1);
+        zhandle_t* zh = zookeeper_init(hosts, watcher, 10000, NULL, &watch,
+                                       ZOO_READONLY);
+        watch.zh = zh;
+        CPPUNIT_ASSERT(zh != 0);
+        sleep(1);
+        CPPUNIT_ASSERT_EQUAL(ZOO_READONLY_STATE, zoo_state(zh));
+
+        // probes of the silent server run for up to a second each; reads on
+        // the read-only connection must not wait for them
+        int64_t end = millis() + 3000;
+        int64_t slowest = 0;
+        while (millis() < end) {
+            int len = 1024;
+            char buf[1024];
+            int64_t start = millis();
+            int res = zoo_get(zh, "/", 0, buf, &len, 0);
+            CPPUNIT_ASSERT_EQUAL((int)ZOK, res);
+            slowest = std::max(slowest, millis() - start);
+            usleep(10000);
+        }
+        CPPUNIT_ASSERT(slowest < 500);
+
+        zookeeper_close(zh);
+        watch.zh = 0;
+        zoo_deterministic_conn_order(0);
+        close(lsock);
+        stopPeer();
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Zookeeper_readOnly);
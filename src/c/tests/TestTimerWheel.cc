@@ -0,0 +1,212 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cppunit/extensions/HelperMacros.h>
+#include "CppAssertHelper.h"
+
+#include <string.h>
+#include <vector>
+
+#include "src/zk_timer.h"
+
+// the ticks of a slot of each level and of the whole wheel
+static const int64_t LEVEL1_TICKS=(int64_t)1<<TIMER_WHEEL_BITS;
+static const int64_t LEVEL2_TICKS=(int64_t)1<<(TIMER_WHEEL_BITS*2);
+static const int64_t LEVEL3_TICKS=(int64_t)1<<(TIMER_WHEEL_BITS*3);
+static const int64_t WHEEL_SPAN=(int64_t)1<<(TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS);
+
+class Zookeeper_timerWheel : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(Zookeeper_timerWheel);
+    CPPUNIT_TEST(testCascadeFromUpperLevels);
+    CPPUNIT_TEST(testParkBeyondSpan);
+    CPPUNIT_TEST(testNextAcrossLevels);
+    CPPUNIT_TEST(testCancel);
+    CPPUNIT_TEST_SUITE_END();
+
+    zk_timer_wheel_t wheel;
+    // the mocked clock the wheel is driven with, in ms
+    int64_t now;
+
+    void arm(zk_timer_t *t, int64_t expires){
+        memset(t,0,sizeof(*t));
+        t->expires=expires;
+        zk_timer_add(&wheel,t,now);
+    }
+
+    static std::vector<zk_timer_t*> toVector(zk_timer_t *t){
+        std::vector<zk_timer_t*> v;
+        for(;t;t=t->next)
+            v.push_back(t);
+        return v;
+    }
+
+    // advances the clock to the time zk_timer_wheel_next() asks for, the
+    // way a poll loop does, until the first timer expires; the number of
+    // wake ups is returned in wakeUps
+    std::vector<zk_timer_t*> runToNextExpiry(int& wakeUps){
+        std::vector<zk_timer_t*> expired;
+        wakeUps=0;
+        while(expired.empty()){
+            int64_t next=zk_timer_wheel_next(&wheel);
+            CPPUNIT_ASSERT(next>=0);
+            CPPUNIT_ASSERT(next>=now);
+            now=next;
+            wakeUps++;
+            expired=toVector(zk_timer_wheel_expire(&wheel,now));
+        }
+        return expired;
+    }
+
+public:
+    void setUp()
+    {
+        memset(&wheel,0,sizeof(wheel));
+        now=5000;
+    }
+
+    void tearDown()
+    {
+        zk_timer_wheel_clear(&wheel);
+    }
+
+    // timers of levels 2 and 3 move down the levels as the wheel passes
+    // their slots and expire exactly at their time
+    void testCascadeFromUpperLevels()
+    {
+        zk_timer_t t2, t3;
+        arm(&t2,now+3*LEVEL2_TICKS+LEVEL1_TICKS+7);
+        arm(&t3,now+2*LEVEL3_TICKS+5*LEVEL1_TICKS+11);
+        CPPUNIT_ASSERT_EQUAL(2,wheel.count);
+
+        // nothing expires a tick early
+        CPPUNIT_ASSERT(zk_timer_wheel_expire(&wheel,t2.expires-1)==0);
+        now=t2.expires-1;
+        CPPUNIT_ASSERT_EQUAL(2,wheel.count);
+
+        int wakeUps;
+        std::vector<zk_timer_t*> expired=runToNextExpiry(wakeUps);
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&t2);
+        CPPUNIT_ASSERT_EQUAL(t2.expires,now);
+        CPPUNIT_ASSERT(t2.pprev==0);
+
+        // the wheel wakes up once per level on the way down, not per slot
+        expired=runToNextExpiry(wakeUps);
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&t3);
+        CPPUNIT_ASSERT_EQUAL(t3.expires,now);
+        CPPUNIT_ASSERT(wakeUps<=TIMER_WHEEL_LEVELS);
+        CPPUNIT_ASSERT_EQUAL(0,wheel.count);
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1,zk_timer_wheel_next(&wheel));
+    }
+
+    // a timer further ahead than the wheel spans is parked in the top level
+    // and still expires at its time
+    void testParkBeyondSpan()
+    {
+        zk_timer_t near, far;
+        arm(&far,now+2*WHEEL_SPAN+12345);
+        arm(&near,now+10);
+
+        int wakeUps;
+        std::vector<zk_timer_t*> expired=runToNextExpiry(wakeUps);
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&near);
+
+        // a clock jumping a whole span ahead at once doesn't expire it early
+        CPPUNIT_ASSERT(zk_timer_wheel_expire(&wheel,now+WHEEL_SPAN)==0);
+        now+=WHEEL_SPAN;
+        CPPUNIT_ASSERT_EQUAL(1,wheel.count);
+        CPPUNIT_ASSERT(zk_timer_wheel_next(&wheel)<=far.expires);
+
+        expired=runToNextExpiry(wakeUps);
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&far);
+        CPPUNIT_ASSERT_EQUAL(far.expires,now);
+        CPPUNIT_ASSERT_EQUAL(0,wheel.count);
+    }
+
+    // zk_timer_wheel_next() reports the earliest slot of any level, and a
+    // timer added after its time is due right away
+    void testNextAcrossLevels()
+    {
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1,zk_timer_wheel_next(&wheel));
+
+        // the next slot boundaries of levels 1 to 3 after the clock
+        now=7*LEVEL3_TICKS+3;
+        int64_t level1=(now/LEVEL1_TICKS+2)*LEVEL1_TICKS;
+        int64_t level2=(now/LEVEL2_TICKS+2)*LEVEL2_TICKS;
+        int64_t level3=(now/LEVEL3_TICKS+2)*LEVEL3_TICKS;
+        zk_timer_t t1, t2, t3, t0;
+        arm(&t3,level3+9);
+        CPPUNIT_ASSERT_EQUAL(level3,zk_timer_wheel_next(&wheel));
+        arm(&t2,level2+9);
+        CPPUNIT_ASSERT_EQUAL(level2,zk_timer_wheel_next(&wheel));
+        arm(&t1,level1+9);
+        CPPUNIT_ASSERT_EQUAL(level1,zk_timer_wheel_next(&wheel));
+        arm(&t0,now+9);
+        CPPUNIT_ASSERT_EQUAL(now+9,zk_timer_wheel_next(&wheel));
+
+        zk_timer_cancel(&wheel,&t0);
+        CPPUNIT_ASSERT_EQUAL(level1,zk_timer_wheel_next(&wheel));
+        zk_timer_cancel(&wheel,&t1);
+        CPPUNIT_ASSERT_EQUAL(level2,zk_timer_wheel_next(&wheel));
+        zk_timer_cancel(&wheel,&t2);
+        CPPUNIT_ASSERT_EQUAL(level3,zk_timer_wheel_next(&wheel));
+
+        // passing the slot of level 3 moves the timer straight to level 0
+        CPPUNIT_ASSERT(zk_timer_wheel_expire(&wheel,level3)==0);
+        now=level3;
+        CPPUNIT_ASSERT_EQUAL(t3.expires,zk_timer_wheel_next(&wheel));
+
+        zk_timer_t late;
+        arm(&late,now-100);
+        CPPUNIT_ASSERT(zk_timer_wheel_next(&wheel)<=now);
+        std::vector<zk_timer_t*> expired=
+            toVector(zk_timer_wheel_expire(&wheel,now));
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&late);
+        CPPUNIT_ASSERT_EQUAL(t3.expires,zk_timer_wheel_next(&wheel));
+    }
+
+    // cancelled timers never expire, whatever level they were in
+    void testCancel()
+    {
+        zk_timer_t t[TIMER_WHEEL_LEVELS];
+        for(int i=0;i<TIMER_WHEEL_LEVELS;i++)
+            arm(&t[i],now+((int64_t)1<<(TIMER_WHEEL_BITS*i))*3);
+        zk_timer_t keep;
+        arm(&keep,now+WHEEL_SPAN/2);
+        for(int i=0;i<TIMER_WHEEL_LEVELS;i++){
+            zk_timer_cancel(&wheel,&t[i]);
+            CPPUNIT_ASSERT(t[i].pprev==0);
+        }
+        // cancelling twice is harmless
+        zk_timer_cancel(&wheel,&t[0]);
+        CPPUNIT_ASSERT_EQUAL(1,wheel.count);
+
+        int wakeUps;
+        std::vector<zk_timer_t*> expired=runToNextExpiry(wakeUps);
+        CPPUNIT_ASSERT_EQUAL(1,(int)expired.size());
+        CPPUNIT_ASSERT(expired[0]==&keep);
+        CPPUNIT_ASSERT_EQUAL(keep.expires,now);
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(Zookeeper_timerWheel);
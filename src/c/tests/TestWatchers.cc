@@ -23,6 +23,15 @@
 #include "CollectionUtil.h"
 #include "Util.h"
 
+#include <string>
+#include <vector>
+
+// testing functions of zk_hashtable.c
+extern "C" {
+uint32_t getWatcherTableCapacity(zk_hashtable* ht);
+uint32_t getWatchedPathHome(zk_hashtable* ht,const char* path);
+}
+
 class Zookeeper_watchers : public CPPUNIT_NS::TestFixture
 {
     CPPUNIT_TEST_SUITE(Zookeeper_watchers);
@@ -33,6 +42,11 @@ class Zookeeper_watchers : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testNodeWatcher1);
     CPPUNIT_TEST(testChildWatcher1);
     CPPUNIT_TEST(testChildWatcher2);
+    CPPUNIT_TEST(testTableBackwardShift);
+    CPPUNIT_TEST(testTableShrink);
+#ifdef THREADED
+    CPPUNIT_TEST(testChunkedSetWatches);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
     static void watcher(zhandle_t *, int, int, const char *,void*){}
@@ -132,6 +146,114 @@ public:
         int counter_;
     };
 
+    // a handle whose only state is its child watch table
+    class WatchTable{
+    public:
+        WatchTable(){
+            memset(&zh_,0,sizeof(zh_));
+            zh_.active_child_watchers=create_zk_hashtable();
+        }
+        ~WatchTable(){
+            destroy_zk_hashtable(zh_.active_child_watchers);
+        }
+        void add(const std::string& path){
+            watcher_registration_t reg={watcher,0,child_result_checker,
+                    path.c_str()};
+            activateWatcher(&zh_,&reg,ZOK);
+        }
+        void remove(const std::string& path){
+            removeWatchers(&zh_,path.c_str(),ZWATCHERTYPE_CHILDREN,0,0);
+        }
+        bool contains(const std::string& path){
+            return pathHasWatcher(&zh_,path.c_str(),ZWATCHERTYPE_CHILDREN,
+                    watcher,0)!=0;
+        }
+        uint32_t capacity(){
+            return getWatcherTableCapacity(zh_.active_child_watchers);
+        }
+        uint32_t home(const std::string& path){
+            return getWatchedPathHome(zh_.active_child_watchers,path.c_str());
+        }
+        zhandle_t zh_;
+    };
+
+    static std::string nodePath(int i){
+        char path[32];
+        snprintf(path,sizeof(path),"/node-%d",i);
+        return path;
+    }
+
+    // testcase: fill a probe cluster, then remove entries from its middle
+    // verify: the entries behind a removed one are still found
+    void testTableBackwardShift(){
+        WatchTable table;
+        uint32_t home=table.home(nodePath(0));
+        uint32_t next=(home+1)%table.capacity();
+        // four paths sharing a home slot and one homed in the slot after it,
+        // which the cluster pushes further down
+        std::vector<std::string> paths;
+        std::string displaced;
+        for(int i=0;paths.size()<4 || displaced.empty();i++){
+            std::string path=nodePath(i);
+            if(table.home(path)==home && paths.size()<4)
+                paths.push_back(path);
+            else if(table.home(path)==next && displaced.empty())
+                displaced=path;
+        }
+        for(size_t i=0;i<paths.size();i++)
+            table.add(paths[i]);
+        table.add(displaced);
+
+        table.remove(paths[1]);
+        CPPUNIT_ASSERT(!table.contains(paths[1]));
+        CPPUNIT_ASSERT(table.contains(paths[0]));
+        CPPUNIT_ASSERT(table.contains(paths[2]));
+        CPPUNIT_ASSERT(table.contains(paths[3]));
+        CPPUNIT_ASSERT(table.contains(displaced));
+
+        table.remove(paths[0]);
+        CPPUNIT_ASSERT(!table.contains(paths[0]));
+        CPPUNIT_ASSERT(table.contains(paths[2]));
+        CPPUNIT_ASSERT(table.contains(paths[3]));
+        CPPUNIT_ASSERT(table.contains(displaced));
+
+        table.remove(displaced);
+        CPPUNIT_ASSERT(!table.contains(displaced));
+        CPPUNIT_ASSERT(table.contains(paths[2]));
+        CPPUNIT_ASSERT(table.contains(paths[3]));
+
+        // the removed slots are free again, the cluster can be refilled
+        table.add(paths[0]);
+        table.add(paths[1]);
+        for(size_t i=0;i<paths.size();i++)
+            CPPUNIT_ASSERT(table.contains(paths[i]));
+    }
+
+    // testcase: grow the table, then remove most of its paths
+    // verify: the table shrinks back and keeps the remaining paths
+    void testTableShrink(){
+        const int PATHS=1000;
+        const int KEPT=5;
+        WatchTable table;
+        uint32_t initial=table.capacity();
+
+        for(int i=0;i<PATHS;i++)
+            table.add(nodePath(i));
+        CPPUNIT_ASSERT(table.capacity()>=PATHS*4/3);
+        for(int i=0;i<PATHS;i++)
+            CPPUNIT_ASSERT(table.contains(nodePath(i)));
+
+        uint32_t grown=table.capacity();
+        for(int i=KEPT;i<PATHS;i++)
+            table.remove(nodePath(i));
+        CPPUNIT_ASSERT(table.capacity()<grown);
+        CPPUNIT_ASSERT_EQUAL(initial,table.capacity());
+        for(int i=0;i<KEPT;i++)
+            CPPUNIT_ASSERT(table.contains(nodePath(i)));
+        for(int i=KEPT;i<PATHS;i++)
+            CPPUNIT_ASSERT(!table.contains(nodePath(i)));
+    }
+
 #ifndef THREADED
     
     // verify: the default watcher is called once for a session event
@@ -767,6 +889,97 @@ public:
         CPPUNIT_ASSERT_EQUAL(0,defWatcher.counter_);
     }
 
+    // records the SetWatches packets sent by the client
+    class SetWatchesServer: public ZookeeperServer{
+    public:
+        SetWatchesServer():packets_(0),paths_(0),maxLen_(0){}
+        // the connection loss is a one shot so that the client reconnects
+        virtual ssize_t callRecv(int s,void *buf,size_t len,int flags){
+            bool lost=connectionLost;
+            ssize_t rc=ZookeeperServer::callRecv(s,buf,len,flags);
+            if(lost)
+                connectionLost=false;
+            return rc;
+        }
+        virtual void notifyBufferSent(const std::string& buffer){
+            if(!HandshakeRequest::isValid(buffer)){
+                iarchive *ia=create_buffer_iarchive((char*)buffer.data(),
+                        buffer.size());
+                RequestHeader rh;
+                deserialize_RequestHeader(ia,"hdr",&rh);
+                if(rh.xid==SET_WATCHES_XID){
+                    SetWatches req;
+                    deserialize_SetWatches(ia,"req",&req);
+                    synchronized(mx_);
+                    packets_++;
+                    paths_+=req.dataWatches.count+req.existWatches.count+
+                            req.childWatches.count;
+                    if((int)buffer.size()>maxLen_)
+                        maxLen_=buffer.size();
+                    deallocate_SetWatches(&req);
+                }
+                close_buffer_iarchive(&ia);
+            }
+            ZookeeperServer::notifyBufferSent(buffer);
+        }
+        mutable Mutex mx_;
+        int packets_;
+        int paths_;
+        int maxLen_;
+    };
+    class RewatchCompleted{
+    public:
+        RewatchCompleted(zhandle_t* zh):zh_(zh){}
+        bool operator()()const{
+            zoo_rewatch_stats_t stats;
+            return zoo_get_rewatch_stats(zh_,&stats)==ZOK &&
+                    stats.rewatches==1 && stats.pending==0;
+        }
+        zhandle_t* zh_;
+    };
+    // testcase: set many watches of every type, disconnect from the server
+    // verify: the watches are re-registered in several bounded packets
+    void testChunkedSetWatches(){
+        Mock_gettimeofday timeMock;
+        // zookeeper simulator
+        SetWatchesServer zkServer;
+        Mock_poll pollMock(&zkServer,ZookeeperServer::FD);
+        // must call zookeeper_close() while all the mocks are in the scope!
+        CloseFinally guard(&zh);
+
+        zh=zookeeper_init("localhost:2121",watcher,10000,TEST_CLIENT_ID,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        // make sure the client has connected
+        CPPUNIT_ASSERT(ensureCondition(ClientConnected(zh),1000)<1000);
+
+        const int PATHS=3000;
+        result_checker_fn checkers[]={data_result_checker,
+                exists_result_checker,child_result_checker};
+        int rcs[]={ZOK,ZNONODE,ZOK};
+        lock_watchers(zh);
+        for(int i=0;i<PATHS;i++){
+            char path[64];
+            snprintf(path,sizeof(path),"/a/rather/long/path/to/a/watched/node-%08d",i);
+            for(int j=0;j<3;j++){
+                watcher_registration_t reg={watcher,0,checkers[j],path};
+                activateWatcher(zh,&reg,rcs[j]);
+            }
+        }
+        unlock_watchers(zh);
+
+        zkServer.setConnectionLost();
+        CPPUNIT_ASSERT(ensureCondition(RewatchCompleted(zh),5000)<5000);
+
+        zoo_rewatch_stats_t stats;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_rewatch_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL(3LL*PATHS,(long long)stats.paths);
+        CPPUNIT_ASSERT(stats.packets>3);
+        synchronized(zkServer.mx_);
+        CPPUNIT_ASSERT_EQUAL((int)stats.packets,zkServer.packets_);
+        CPPUNIT_ASSERT_EQUAL(3*PATHS,zkServer.paths_);
+        CPPUNIT_ASSERT(zkServer.maxLen_<=128*1024);
+    }
+
 #endif //THREADED
 };
 
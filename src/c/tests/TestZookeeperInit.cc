@@ -39,6 +39,7 @@ class Zookeeper_init : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testBasic);
     CPPUNIT_TEST(testAddressResolution);
     CPPUNIT_TEST(testMultipleAddressResolution);
+    CPPUNIT_TEST(testResolveCache);
     CPPUNIT_TEST(testNullAddressString);
     CPPUNIT_TEST(testEmptyAddressString);
     CPPUNIT_TEST(testOneSpaceAddressString);
@@ -149,6 +150,51 @@ public:
             CPPUNIT_ASSERT_EQUAL(2121,(int)ntohs(addr->sin_port));
         }
     }
+    void testResolveCache()
+    {
+        zoo_resolve_stats_t stats;
+
+        zh=zookeeper_init("127.0.0.1:2121",0,10000,0,0,0);
+        CPPUNIT_ASSERT(zh!=0);
+        CPPUNIT_ASSERT_EQUAL(ZOO_DEFAULT_RESOLVE_TTL,zh->resolve_ttl);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_resolve_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.resolutions);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.address_changes);
+
+        // resolving to the same addresses must not publish a new list
+        struct sockaddr_storage *before=zh->addrs.data;
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_servers(zh,"127.0.0.1:2121"));
+        CPPUNIT_ASSERT(zh->addrs.data==before);
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_resolve_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.resolutions);
+        CPPUNIT_ASSERT_EQUAL((int64_t)1,stats.address_changes);
+
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_servers(zh,"127.0.0.2:2121"));
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_resolve_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)2,stats.address_changes);
+
+#ifndef THREADED
+        // waiting for a reconnect never resolves, even with a ttl of 0
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_resolve_ttl(zh,0));
+        gettimeofday(&zh->reconnect_at,0);
+        zh->reconnect_at.tv_sec+=60;
+        int fd;
+        int interest;
+        timeval tv;
+        for(int i=0;i<3;i++){
+            CPPUNIT_ASSERT_EQUAL((int)ZOK,
+                    zookeeper_interest(zh,&fd,&interest,&tv));
+            CPPUNIT_ASSERT_EQUAL(-1,fd);
+        }
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_get_resolve_stats(zh,&stats));
+        CPPUNIT_ASSERT_EQUAL((int64_t)3,stats.resolutions);
+#endif
+
+        CPPUNIT_ASSERT_EQUAL((int)ZOK,zoo_set_resolve_ttl(zh,-1));
+        CPPUNIT_ASSERT_EQUAL(-1,zh->resolve_ttl);
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_set_resolve_ttl(0,0));
+        CPPUNIT_ASSERT_EQUAL((int)ZBADARGUMENTS,zoo_get_resolve_stats(zh,0));
+    }
     void testMultipleAddressResolution()
     {
         const string EXPECTED_HOST("127.0.0.1:2121,127.0.0.2:3434");
@@ -151,6 +151,7 @@ public void genCCode(FileWriter h, FileWriter c) throws IOException {
                     h.write("struct " + struct_name + " {\n    int32_t count;\n" + jv.getElementType().genCDecl("*data") + "\n};\n");
                     h.write("int serialize_" + struct_name + "(struct oarchive *out, const char *tag, struct " + struct_name + " *v);\n");
                     h.write("int deserialize_" + struct_name + "(struct iarchive *in, const char *tag, struct " + struct_name + " *v);\n");
+                    h.write("int32_t sizeof_" + struct_name + "(struct " + struct_name + " *v);\n");
                     h.write("int allocate_" + struct_name + "(struct " + struct_name + " *v, int32_t len);\n");
                     h.write("int deallocate_" + struct_name + "(struct " + struct_name + " *v);\n");
                     c.write("int allocate_" + struct_name + "(struct " + struct_name + " *v, int32_t len) {\n");
@@ -198,6 +199,15 @@ public void genCCode(FileWriter h, FileWriter c) throws IOException {
                     c.write("    rc = in->end_vector(in, tag);\n");
                     c.write("    return rc;\n");
                     c.write("}\n");
+                    c.write("int32_t sizeof_" + struct_name + "(struct " + struct_name + " *v)\n");
+                    c.write("{\n");
+                    c.write("    int32_t size = sizeof(v->count);\n");
+                    c.write("    int32_t i;\n");
+                    c.write("    for(i=0;i<v->count;i++) {\n");
+                    genSizeof(c, jvType, "data[i]");
+                    c.write("    }\n");
+                    c.write("    return size;\n");
+                    c.write("}\n");
 
                 }
             }
@@ -211,6 +221,7 @@ public void genCCode(FileWriter h, FileWriter c) throws IOException {
         h.write("int serialize_" + rec_name + "(struct oarchive *out, const char *tag, struct " + rec_name + " *v);\n");
         h.write("int deserialize_" + rec_name + "(struct iarchive *in, const char *tag, struct " + rec_name + "*v);\n");
         h.write("void deallocate_" + rec_name + "(struct " + rec_name + "*);\n");
+        h.write("int32_t sizeof_" + rec_name + "(struct " + rec_name + " *v);\n");
         c.write("int serialize_" + rec_name + "(struct oarchive *out, const char *tag, struct " + rec_name + " *v)");
         c.write("{\n");
         c.write("    int rc;\n");
@@ -231,6 +242,14 @@ public void genCCode(FileWriter h, FileWriter c) throws IOException {
         c.write("    rc = rc ? rc : in->end_record(in, tag);\n");
         c.write("    return rc;\n");
         c.write("}\n");
+        c.write("int32_t sizeof_" + rec_name + "(struct " + rec_name + " *v)");
+        c.write("{\n");
+        c.write("    int32_t size = 0;\n");
+        for(JField f : mFields) {
+            genSizeof(c, f.getType(), f.getName());
+        }
+        c.write("    return size;\n");
+        c.write("}\n");
         c.write("void deallocate_" + rec_name + "(struct " + rec_name + "*v)");
         c.write("{\n");
         for(JField f : mFields) {
@@ -256,6 +275,20 @@ private void genSerialize(FileWriter c, JType type, String tag, String name) thr
         }
     }
 
+    /**
+     * Generates the addition of the encoded size of a field, as written by
+     * the C buffer oarchive.
+     */
+    private void genSizeof(FileWriter c, JType type, String name) throws IOException {
+        if (type instanceof JRecord) {
+            c.write("    size += sizeof_" + extractStructName(type) + "(&v->" + name + ");\n");
+        } else if (type instanceof JVector) {
+            c.write("    size += sizeof_" + JVector.extractVectorName(((JVector)type).getElementType()) + "(&v->" + name + ");\n");
+        } else {
+            c.write("    size += sizeof_" + extractMethodSuffix(type) + "(&v->" + name + ");\n");
+        }
+    }
+
     private void genDeserialize(FileWriter c, JType type, String tag, String name) throws IOException {
         if (type instanceof JRecord) {
             c.write("    rc = rc ? rc : deserialize_" + extractStructName(type) + "(in, \"" + tag + "\", &v->" + name + ");\n");